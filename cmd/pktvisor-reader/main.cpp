@@ -39,6 +39,7 @@ static const char USAGE[] =
       -i INPUT              Input type (pcap|dnstap|sflow|netflow). If not set, default is pcap input
       --max-deep-sample N   Never deep sample more than N% of streams (an int between 0 and 100) [default: 100]
       --periods P           Hold this many 60 second time periods of history in memory. Use 1 to summarize all data. [default: 5]
+      --threads N           Process pcap input on N worker threads, partitioned by flow [default: 1]
       -h --help             Show this screen
       --version             Show version
       -v                    Verbose log output
@@ -122,6 +123,12 @@ int main(int argc, char *argv[])
 
     long periods = args["--periods"].asLong();
 
+    long threads = args["--threads"].asLong();
+    if (threads < 1) {
+        logger->error("--threads must be at least 1");
+        return -1;
+    }
+
     visor::Config window_config;
     window_config.config_set<uint64_t>("num_periods", periods);
     window_config.config_set<uint64_t>("deep_sample_rate", sample_rate);
@@ -168,6 +175,9 @@ int main(int argc, char *argv[])
             new_input_stream->config_set("pcap_file", args["FILE"].asString());
             new_input_stream->config_set("bpf", bpf);
             new_input_stream->config_set("host_spec", host_spec);
+            if (threads > 1) {
+                new_input_stream->config_set<uint64_t>("workers", threads);
+            }
             static_cast<input::pcap::PcapInputStream *>(new_input_stream.get())->parse_host_spec();
             break;
         }
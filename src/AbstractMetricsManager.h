@@ -4,21 +4,32 @@
 
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <cassert>
 #include <chrono>
+#include <condition_variable>
 #include <deque>
 #include <exception>
+#include <functional>
+#include <iterator>
+#include <map>
 #include <nlohmann/json.hpp>
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wzero-as-null-pointer-constant"
 #include <jsf.h>
 #pragma GCC diagnostic pop
 #include "Configurable.h"
+#include "LoadShedder.h"
 #include "Metrics.h"
+#include <mutex>
 #include <shared_mutex>
 #include <sstream>
 #include <sys/time.h>
+#include <thread>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace visor {
 
@@ -42,6 +53,132 @@ public:
 
 using namespace std::chrono;
 
+/**
+ * input streams which spread capture over several worker threads assign each worker its own shard index here.
+ * metrics managers keep a separate live bucket per shard so that workers do not contend on the same bucket,
+ * and the shards are merged when the window is read or shifted. threads which never set it write to shard 0.
+ */
+inline thread_local unsigned int worker_shard_id{0};
+
+/**
+ * how the events to deep sample are chosen, see the deep_sample_mode window config
+ */
+enum class DeepSampleMode {
+    // each event is drawn on its own
+    Random,
+    // events are chosen by a hash of their flow (and transaction, where there is one), so that every event of a flow is
+    // sampled alike by every handler of a policy
+    Flow
+};
+
+/**
+ * the flow sampling decision. it depends only on the key and the rate: handlers sharing a window config agree on it
+ * without coordinating, and a flow sampled at some rate is also sampled at every higher rate
+ */
+inline bool deep_sample_flow(uint64_t flow_key, uint32_t rate)
+{
+    // murmur3 finalizer, flow keys are far from uniform in their low bits
+    flow_key ^= flow_key >> 33;
+    flow_key *= 0xff51afd7ed558ccdULL;
+    flow_key ^= flow_key >> 33;
+    flow_key *= 0xc4ceb9fe1a85ec53ULL;
+    flow_key ^= flow_key >> 33;
+    return flow_key % 100U < rate;
+}
+
+/**
+ * the generator behind random deep sampling. there is one per thread, so that capture workers don't share its state
+ */
+inline jsf32 &deep_sample_rng()
+{
+    static std::atomic<uint32_t> streams{0};
+    thread_local jsf32 rng{0xcafe5eedU + streams.fetch_add(0x9e3779b9U, std::memory_order_relaxed)};
+    return rng;
+}
+
+/**
+ * hands the live bucket of a single writer manager over to readers, see the single_writer window config.
+ *
+ * the writer marks the span of each update with enter() and leave(), which costs a fence but no lock. a reader takes
+ * the gate with lock(), which waits for the writer to leave and holds it off until unlock(). readers should only copy
+ * the bucket while they hold it, and render the copy after
+ */
+class SingleWriterGate
+{
+    // both sides store their flag and then load the other's, sequentially consistent so that at least one of them sees
+    // the other: the writer steps aside, or the reader waits
+    std::atomic<bool> _writing{false};
+    std::atomic<bool> _reading{false};
+    // serializes readers
+    std::mutex _reader_mutex;
+    // nested scopes of the writer, only touched by it
+    unsigned int _depth{0};
+
+public:
+    void enter()
+    {
+        if (_depth++) {
+            return;
+        }
+        _writing = true;
+        while (_reading) {
+            // a reader is copying the bucket, step aside until it is done
+            _writing.store(false, std::memory_order_release);
+            while (_reading.load(std::memory_order_relaxed)) {
+                std::this_thread::yield();
+            }
+            _writing = true;
+        }
+    }
+
+    void leave()
+    {
+        if (--_depth) {
+            return;
+        }
+        _writing.store(false, std::memory_order_release);
+    }
+
+    void lock()
+    {
+        _reader_mutex.lock();
+        _reading = true;
+        while (_writing) {
+            std::this_thread::yield();
+        }
+    }
+
+    void unlock()
+    {
+        _reading.store(false, std::memory_order_release);
+        _reader_mutex.unlock();
+    }
+};
+
+/**
+ * the lock a bucket takes for an update, which is a no-op for the buckets of a single writer manager
+ */
+class BucketWriteLock
+{
+    std::unique_lock<std::shared_mutex> _lock;
+
+public:
+    BucketWriteLock(std::shared_mutex &mutex, bool single_writer)
+        : _lock(mutex, std::defer_lock)
+    {
+        if (!single_writer) {
+            _lock.lock();
+        }
+    }
+
+    void unlock()
+    {
+        if (_lock.owns_lock()) {
+            _lock.unlock();
+        }
+    }
+};
+
 /**
  * This class should be specialized to contain metrics and sketches specific to this handler
  * It *MUST* be thread safe, and should expect mostly writes.
@@ -60,10 +197,23 @@ private:
     unsigned int _period_length = 0;
     bool _read_only = false;
     bool _recorded_stream = false;
+    bool _single_writer = false;
+
+    // all rates of the bucket in the order they were built, if it was built by BucketPool::build()
+    std::vector<Rate *> _rates;
 
 protected:
     const std::bitset<GROUP_SIZE> *_groups;
 
+    /**
+     * lock mutex for an update of the bucket. buckets should take their update locks through here, so that they are
+     * skipped when the bucket has a single writer
+     */
+    BucketWriteLock write_lock(std::shared_mutex &mutex) const
+    {
+        return BucketWriteLock(mutex, _single_writer);
+    }
+
     // merge the metrics of the specialized metric bucket
     virtual void specialized_merge(const AbstractMetricsBucket &other) = 0;
 
@@ -143,17 +293,53 @@ public:
         _recorded_stream = true;
     }
 
-    void set_event_rate_info(std::string schema_key, std::initializer_list<std::string> names, const std::string &desc)
+    /**
+     * updates come from a single thread, which holds the SingleWriterGate of the manager while it updates. must be set
+     * before the first update
+     */
+    void set_single_writer()
+    {
+        _single_writer = true;
+    }
+
+    void set_rates(std::vector<Rate *> rates)
+    {
+        _rates = std::move(rates);
+    }
+
+    /**
+     * start the rates of a bucket which was built ahead of time, once it goes live
+     */
+    void start_rates()
+    {
+        for (auto rate : _rates) {
+            rate->start();
+        }
+    }
+
+    /**
+     * count the events of this bucket into the rates of another bucket of the same type, see Rate::count_into. both must
+     * have been built by BucketPool::build(), this one must not have been started
+     */
+    void count_rates_into(AbstractMetricsBucket &other)
+    {
+        assert(_rates.size() == other._rates.size());
+        for (size_t i = 0; i < _rates.size(); ++i) {
+            _rates[i]->count_into(*other._rates[i]);
+        }
+    }
+
+    void set_event_rate_info(std::string_view schema_key, std::initializer_list<std::string_view> names, std::string_view desc)
     {
         _rate_events.set_info(schema_key, names, desc);
     }
 
-    void set_num_sample_info(std::string schema_key, std::initializer_list<std::string> names, const std::string &desc)
+    void set_num_sample_info(std::string_view schema_key, std::initializer_list<std::string_view> names, std::string_view desc)
     {
         _num_samples.set_info(schema_key, names, desc);
     }
 
-    void set_num_events_info(std::string schema_key, std::initializer_list<std::string> names, const std::string &desc)
+    void set_num_events_info(std::string_view schema_key, std::initializer_list<std::string_view> names, std::string_view desc)
     {
         _num_events.set_info(schema_key, names, desc);
     }
@@ -190,17 +376,28 @@ public:
         specialized_merge(other);
     }
 
-    void new_event(bool deep)
+    /**
+     * @param weight the number of events this one stands for, see LoadShedder::admit
+     */
+    void new_event(bool deep, uint64_t weight = 1)
     {
         // note, currently not enforcing _read_only
-        ++_rate_events;
-        std::unique_lock lock(_base_mutex);
-        ++_num_events;
+        _rate_events += weight;
+        auto lock = write_lock(_base_mutex);
+        _num_events += weight;
         if (deep) {
             ++_num_samples;
         }
     }
 
+    void new_events(uint64_t events, uint64_t samples)
+    {
+        _rate_events += events;
+        auto lock = write_lock(_base_mutex);
+        _num_events += events;
+        _num_samples += samples;
+    }
+
     void configure_groups(const std::bitset<GROUP_SIZE> *groups)
     {
         std::unique_lock lock(_base_mutex);
@@ -216,6 +413,159 @@ public:
     virtual void to_prometheus(std::stringstream &out, Metric::LabelMap add_labels = {}) const = 0;
 };
 
+/**
+ * a thread shared by all metrics managers, for bucket work which is kept off the packet path
+ */
+class BucketPoolThread
+{
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<std::function<void()>> _jobs;
+    bool _stop{false};
+    std::thread _thread;
+
+    BucketPoolThread()
+        : _thread([this] { _run(); })
+    {
+    }
+
+    void _run()
+    {
+        std::unique_lock lock(_mutex);
+        while (true) {
+            _cv.wait(lock, [this] { return _stop || !_jobs.empty(); });
+            if (_stop) {
+                return;
+            }
+            auto job = std::move(_jobs.front());
+            _jobs.pop_front();
+            lock.unlock();
+            job();
+            // whatever the job holds is released here too, on this thread
+            job = nullptr;
+            lock.lock();
+        }
+    }
+
+public:
+    static BucketPoolThread &instance()
+    {
+        static BucketPoolThread pool_thread;
+        return pool_thread;
+    }
+
+    ~BucketPoolThread()
+    {
+        {
+            std::unique_lock lock(_mutex);
+            _stop = true;
+        }
+        _cv.notify_one();
+        _thread.join();
+    }
+
+    void post(std::function<void()> job)
+    {
+        {
+            std::unique_lock lock(_mutex);
+            _jobs.push_back(std::move(job));
+        }
+        _cv.notify_one();
+    }
+};
+
+/**
+ * the buckets of a metrics manager are built and destroyed on the BucketPoolThread, so that a period shift only swaps
+ * in the bucket which was built ahead of it. building one means constructing all of its sketches, its metric names
+ * are only checked by the first bucket of its class, and its rates are only started when it goes live
+ */
+template <typename MetricsBucketClass>
+class BucketPool
+{
+    struct Spare {
+        std::mutex mutex;
+        std::unique_ptr<MetricsBucketClass> bucket;
+        bool building{false};
+    };
+    // shared with the jobs on the pool thread, which may outlive the pool
+    std::shared_ptr<Spare> _spare{std::make_shared<Spare>()};
+
+public:
+    /**
+     * a new bucket whose rates are not started yet, see AbstractMetricsBucket::start_rates()
+     */
+    static std::unique_ptr<MetricsBucketClass> build()
+    {
+        // resolved by the first bucket built, see MetricDescriptor::Table
+        static MetricDescriptor::Table descriptors;
+        std::vector<Rate *> rates;
+        std::unique_ptr<MetricsBucketClass> bucket;
+        {
+            Rate::DeferStart defer(rates);
+            MetricDescriptor::Table::Scope scope(descriptors);
+            bucket = std::make_unique<MetricsBucketClass>();
+        }
+        bucket->set_rates(std::move(rates));
+        return bucket;
+    }
+
+    /**
+     * build the next bucket in the background, unless there is one already
+     */
+    void prepare()
+    {
+        {
+            std::unique_lock lock(_spare->mutex);
+            if (_spare->bucket || _spare->building) {
+                return;
+            }
+            _spare->building = true;
+        }
+        BucketPoolThread::instance().post([spare = _spare] {
+            auto bucket = build();
+            std::unique_lock lock(spare->mutex);
+            spare->bucket = std::move(bucket);
+            spare->building = false;
+        });
+    }
+
+    bool ready() const
+    {
+        std::unique_lock lock(_spare->mutex);
+        return static_cast<bool>(_spare->bucket);
+    }
+
+    /**
+     * the bucket built by prepare(), or a new one if it is not ready yet. either way its rates are running
+     */
+    std::unique_ptr<MetricsBucketClass> acquire()
+    {
+        std::unique_ptr<MetricsBucketClass> bucket;
+        {
+            std::unique_lock lock(_spare->mutex);
+            bucket = std::move(_spare->bucket);
+        }
+        if (!bucket) {
+            bucket = build();
+        }
+        bucket->start_rates();
+        return bucket;
+    }
+
+    /**
+     * destroy a bucket in the background
+     */
+    void release(std::unique_ptr<MetricsBucketClass> bucket)
+    {
+        if (!bucket) {
+            return;
+        }
+        BucketPoolThread::instance().post([expired = std::shared_ptr<MetricsBucketClass>(std::move(bucket))]() mutable {
+            expired.reset();
+        });
+    }
+};
+
 template <typename MetricsBucketClass>
 class AbstractMetricsManager
 {
@@ -226,6 +576,18 @@ private:
     mutable std::shared_mutex _bucket_mutex;
     std::deque<std::unique_ptr<MetricsBucketClass>> _metric_buckets;
 
+    /**
+     * live buckets for worker shards 1..N, shard 0 is always _metric_buckets[0]. these are merged into the live bucket
+     * at period shift. workers only write to them through a LiveBucket, so none is in use by then
+     */
+    std::vector<std::unique_ptr<MetricsBucketClass>> _live_shards;
+
+    // the next live bucket, built ahead of the period shift
+    BucketPool<MetricsBucketClass> _pool;
+
+    // serializes period shifts, which may be triggered from multiple worker threads at once
+    std::mutex _shift_mutex;
+
     mutable std::shared_mutex _base_mutex;
 
     /**
@@ -236,8 +598,22 @@ private:
     /**
      * sampling
      */
-    jsf32 _rng;
     uint32_t _deep_sample_rate{100};
+    DeepSampleMode _deep_sample_mode{DeepSampleMode::Random};
+    // may lower the deep sample rate to keep the policy within its cpu budget
+    const LoadShedder *_shedder{nullptr};
+
+    /**
+     * single writer mode, see the single_writer window config. the live bucket is updated without locks by the one
+     * thread which processes events, readers copy it through the gate
+     */
+    bool _single_writer{false};
+    mutable SingleWriterGate _gate;
+
+    uint32_t _effective_deep_sample_rate() const
+    {
+        return _shedder ? std::min(_deep_sample_rate, _shedder->deep_sample_rate()) : _deep_sample_rate;
+    }
 
 protected:
     std::atomic_bool _deep_sampling_now; // atomic so we can reference without mutex
@@ -257,9 +633,28 @@ private:
     timespec _next_shift_tstamp;
 
     /**
-     * simple cache for json results
+     * counts period shifts, so that results derived from the closed periods can tell when they are stale.
+     * protected by _bucket_mutex
+     */
+    uint64_t _shift_generation{0};
+
+    /**
+     * _closed_aggregates[k] is the merge of closed periods 1..k+1, built on demand once per shift. a merged window is
+     * then the live bucket merged with one of these
      */
+    mutable std::mutex _aggregate_mutex;
+    mutable uint64_t _aggregate_generation{0};
+    mutable std::vector<std::shared_ptr<const MetricsBucketClass>> _closed_aggregates;
+
+    /**
+     * rendered results. closed periods are immutable until the next shift, merged windows are kept for
+     * MERGE_CACHE_TTL_MS since they include the live period
+     */
+    mutable std::mutex _render_cache_mutex;
+    mutable uint64_t _render_cache_generation{0};
     mutable std::unordered_map<unsigned int, std::pair<std::chrono::high_resolution_clock::time_point, json>> _mergeResultCache;
+    mutable std::unordered_map<uint64_t, json> _closedJsonCache;
+    mutable std::map<std::pair<uint64_t, Metric::LabelMap>, std::string> _closedPrometheusCache;
 
     /**
      * manage the time window
@@ -267,18 +662,32 @@ private:
      */
     void _period_shift(timespec stamp)
     {
+        std::unique_lock sl(_shift_mutex);
+        std::shared_lock rlb(_base_mutex);
+        if (stamp.tv_sec < _next_shift_tstamp.tv_sec) {
+            // another worker shifted while we waited
+            return;
+        }
+        rlb.unlock();
+        auto live = _pool.acquire();
         // ensure access to the buckets is locked while we period shift
         std::unique_lock wl(_bucket_mutex);
         std::unique_ptr<MetricsBucketClass> expiring_bucket;
         // this changes the live bucket
-        _metric_buckets.emplace_front(std::make_unique<MetricsBucketClass>());
+        _metric_buckets.emplace_front(std::move(live));
         _metric_buckets[0]->configure_groups(_groups);
         _metric_buckets[0]->set_start_tstamp(stamp);
         if (_recorded_stream) {
             _metric_buckets[0]->set_recorded_stream();
         }
+        if (_single_writer) {
+            _metric_buckets[0]->set_single_writer();
+        }
+        // fold the worker shards of the previous period into its bucket
+        auto merged_shards = _merge_live_shards(*_metric_buckets[1], stamp);
         // notify second most recent bucket that it is now read only, save end time
         _metric_buckets[1]->set_read_only(stamp);
+        ++_shift_generation;
         // if we're at our period history length max, pop the oldest
         if (_metric_buckets.size() > _num_periods) {
             // before popping, take ownership of the bucket we are expiring so that it can be examined by the period shift callback handler
@@ -291,8 +700,124 @@ private:
         _last_shift_tstamp.tv_sec = stamp.tv_sec;
         _next_shift_tstamp.tv_sec = stamp.tv_sec + AbstractMetricsManager::PERIOD_SEC;
         wlb.unlock();
+        _pool.prepare();
         on_period_shift(stamp, (expiring_bucket) ? expiring_bucket.get() : nullptr);
-        // expiring bucket will destruct here if it exists
+        // expiring bucket and merged shards will destruct on the pool thread
+        _pool.release(std::move(expiring_bucket));
+        for (auto &shard : merged_shards) {
+            _pool.release(std::move(shard));
+        }
+    }
+
+    /**
+     * merge the live worker shards into the given bucket and take them out of the window, workers start new ones on
+     * their next event. caller must hold _bucket_mutex for write
+     *
+     * @return the merged shards, for the caller to dispose of
+     */
+    std::vector<std::unique_ptr<MetricsBucketClass>> _merge_live_shards(MetricsBucketClass &into, timespec stamp)
+    {
+        for (auto &shard : _live_shards) {
+            if (shard) {
+                shard->set_read_only(stamp);
+                into.merge(*shard);
+            }
+        }
+        return std::exchange(_live_shards, {});
+    }
+
+    /**
+     * merge the live bucket and all live worker shards into the given bucket. caller must hold _bucket_mutex for read
+     */
+    void _merge_live_bucket(MetricsBucketClass &into) const
+    {
+        into.merge(*_metric_buckets[0]);
+        for (const auto &shard : _live_shards) {
+            if (shard) {
+                into.merge(*shard);
+            }
+        }
+    }
+
+    /**
+     * the merge of the most recent closed periods, up to the given number of them, or nullptr if there are none.
+     * caller must hold _bucket_mutex for read
+     */
+    std::shared_ptr<const MetricsBucketClass> _closed_aggregate(size_t periods) const
+    {
+        std::unique_lock al(_aggregate_mutex);
+        if (_aggregate_generation != _shift_generation) {
+            _closed_aggregates.clear();
+            _aggregate_generation = _shift_generation;
+        }
+        periods = std::min(periods, _metric_buckets.size() - 1);
+        while (_closed_aggregates.size() < periods) {
+            auto aggregate = std::make_shared<MetricsBucketClass>();
+            if (_recorded_stream) {
+                aggregate->set_recorded_stream();
+            }
+            // it lives until the next shift, so its rates must not tick. read only from its start, the period length
+            // is then the sum of the merged ones
+            aggregate->set_read_only(aggregate->start_tstamp());
+            if (!_closed_aggregates.empty()) {
+                aggregate->merge(*_closed_aggregates.back());
+            }
+            aggregate->merge(*_metric_buckets[_closed_aggregates.size() + 1]);
+            _closed_aggregates.push_back(std::move(aggregate));
+        }
+        return periods ? _closed_aggregates[periods - 1] : nullptr;
+    }
+
+    /**
+     * lock the rendered results, dropping them if the window has shifted since they were made. caller must hold
+     * _bucket_mutex for read
+     */
+    std::unique_lock<std::mutex> _lock_render_cache() const
+    {
+        std::unique_lock cl(_render_cache_mutex);
+        if (_render_cache_generation != _shift_generation) {
+            _mergeResultCache.clear();
+            _closedJsonCache.clear();
+            _closedPrometheusCache.clear();
+            _render_cache_generation = _shift_generation;
+        }
+        return cl;
+    }
+
+    void _add_live_shard(unsigned int shard_id)
+    {
+        std::unique_lock wl(_bucket_mutex);
+        if (_live_shards.size() < shard_id) {
+            _live_shards.resize(shard_id);
+        }
+        auto &shard = _live_shards[shard_id - 1];
+        if (!shard) {
+            // the events of all workers make up the rates of the live bucket
+            shard = BucketPool<MetricsBucketClass>::build();
+            shard->count_rates_into(*_metric_buckets[0]);
+            shard->configure_groups(_groups);
+            shard->set_start_tstamp(_metric_buckets[0]->start_tstamp());
+            if (_recorded_stream) {
+                shard->set_recorded_stream();
+            }
+        }
+    }
+
+    time_t _next_shift_sec() const
+    {
+        if (_single_writer) {
+            // only changed by a period shift, which the writer either takes itself or is held off from by the gate
+            return _next_shift_tstamp.tv_sec;
+        }
+        std::shared_lock rlb(_base_mutex);
+        return _next_shift_tstamp.tv_sec;
+    }
+
+    void _check_period_shift(timespec stamp)
+    {
+        if (_num_periods > 1 && stamp.tv_sec >= _next_shift_sec()) {
+            _period_shift(stamp);
+        }
     }
 
 public:
@@ -305,22 +830,106 @@ protected:
      * (optionally) chosen, and the time window will be maintained
      *
      * @param stamp time stamp of the event
+     * @param sample false to keep the previous sampling decision, e.g. for events which are not inspected
+     * @param weight the number of events this one stands for, see LoadShedder::admit
+     * @return true if the event should be deep sampled
      */
-    void new_event(timespec stamp, bool sample = true)
+    bool new_event(timespec stamp, bool sample = true, uint64_t weight = 1)
     {
         // CRITICAL EVENT PATH
-        if (sample && _deep_sample_rate != 100) {
-            _deep_sampling_now.store((_rng() % 100U < _deep_sample_rate), std::memory_order_relaxed);
+        bool deep = _deep_sampling_now.load(std::memory_order_relaxed);
+        auto rate = _effective_deep_sample_rate();
+        if (sample && rate != 100) {
+            deep = deep_sample_rng()() % 100U < rate;
+            _deep_sampling_now.store(deep, std::memory_order_relaxed);
         }
-        std::shared_lock rlb(_base_mutex);
-        bool will_shift = _num_periods > 1 && stamp.tv_sec >= _next_shift_tstamp.tv_sec;
-        rlb.unlock();
-        if (will_shift) {
-            _period_shift(stamp);
+        _check_period_shift(stamp);
+        // bucket base event
+        live_bucket()->new_event(deep, weight);
+        return deep;
+    }
+
+    /**
+     * new_event for an event which belongs to a flow. with the flow sampling mode the decision is taken from flow_key,
+     * which should also identify the transaction where the protocol has them, so that a query and its response are
+     * always sampled alike. otherwise this is new_event(stamp)
+     *
+     * @return true if the event should be deep sampled
+     */
+    bool new_flow_event(timespec stamp, uint64_t flow_key, uint64_t weight = 1)
+    {
+        // CRITICAL EVENT PATH
+        if (_deep_sample_mode != DeepSampleMode::Flow) {
+            return new_event(stamp, true, weight);
         }
-        std::shared_lock rl(_bucket_mutex);
+        auto rate = _effective_deep_sample_rate();
+        bool deep = rate == 100 || deep_sample_flow(flow_key, rate);
+        _deep_sampling_now.store(deep, std::memory_order_relaxed);
+        _check_period_shift(stamp);
         // bucket base event
-        _metric_buckets[0]->new_event(_deep_sampling_now);
+        live_bucket()->new_event(deep, weight);
+        return deep;
+    }
+
+    /**
+     * the batch version of new_event. the time window is shifted as needed, and each run of events which lands in the
+     * same live bucket is handed to process in a single call, so that the bucket can take its locks once per run
+     * instead of once per event
+     *
+     * @param batch container of events, each with a timespec stamp member
+     * @param process called as process(MetricsBucketClass *bucket, first, last, const std::vector<bool> &deep) for
+     *  each run [first, last), where deep[i] is the deep sampling decision for event first + i
+     */
+    template <typename Batch, typename Process>
+    void new_event_batch(const Batch &batch, Process &&process)
+    {
+        new_event_batch(batch, nullptr, 1, std::forward<Process>(process));
+    }
+
+    /**
+     * new_event_batch for events which belong to flows, see new_flow_event
+     *
+     * @param flow_key called as flow_key(event) for the flow key of each event, or nullptr for random sampling
+     * @param weight the number of events each one stands for, see LoadShedder::admit
+     */
+    template <typename Batch, typename FlowKey, typename Process>
+    void new_event_batch(const Batch &batch, FlowKey &&flow_key, uint64_t weight, Process &&process)
+    {
+        // CRITICAL EVENT PATH
+        static thread_local std::vector<bool> deep;
+        auto first = batch.begin();
+        bool windowed = _num_periods > 1;
+        while (first != batch.end()) {
+            auto next_shift = _next_shift_sec();
+            if (windowed && first->stamp.tv_sec >= next_shift) {
+                _period_shift(first->stamp);
+                next_shift = _next_shift_sec();
+            }
+            // the run ends before the next event which would shift the window
+            auto last = std::next(first);
+            while (last != batch.end() && !(windowed && last->stamp.tv_sec >= next_shift)) {
+                ++last;
+            }
+            deep.clear();
+            uint64_t samples{0};
+            auto rate = _effective_deep_sample_rate();
+            for (auto it = first; it != last; ++it) {
+                bool sample = rate == 100;
+                if constexpr (std::is_same_v<std::decay_t<FlowKey>, std::nullptr_t>) {
+                    sample = sample || deep_sample_rng()() % 100U < rate;
+                } else if (!sample && _deep_sample_mode == DeepSampleMode::Flow) {
+                    sample = deep_sample_flow(flow_key(*it), rate);
+                } else if (!sample) {
+                    sample = deep_sample_rng()() % 100U < rate;
+                }
+                deep.push_back(sample);
+                samples += sample;
+            }
+            auto bucket = live_bucket();
+            bucket->new_events(deep.size() * weight, samples);
+            process(bucket.get(), first, last, deep);
+            first = last;
+        }
     }
 
     inline bool group_enabled(MetricGroupIntType g) const
@@ -328,6 +937,56 @@ protected:
         return (*_groups)[g];
     }
 
+    /**
+     * the span of an update by the single writer, see SingleWriterGate. does nothing in the default mode
+     */
+    class WriteScope
+    {
+        SingleWriterGate *_gate;
+
+    public:
+        explicit WriteScope(SingleWriterGate *gate)
+            : _gate(gate)
+        {
+            if (_gate) {
+                _gate->enter();
+            }
+        }
+
+        ~WriteScope()
+        {
+            if (_gate) {
+                _gate->leave();
+            }
+        }
+
+        WriteScope(const WriteScope &) = delete;
+        WriteScope &operator=(const WriteScope &) = delete;
+    };
+
+    /**
+     * entry points which process events should hold this from before new_event until they are done with the live bucket
+     */
+    WriteScope write_scope()
+    {
+        return WriteScope(_single_writer ? &_gate : nullptr);
+    }
+
+    /**
+     * honour the single_writer window config. managers call this from their constructor once all of their entry points
+     * hold a write_scope() and their buckets take their update locks through write_lock(). the input must then call
+     * into the handler from a single thread
+     */
+    void enable_single_writer(const Configurable *window_config)
+    {
+        if (!window_config->config_exists("single_writer") || !window_config->config_get<bool>("single_writer")) {
+            return;
+        }
+        std::unique_lock wl(_bucket_mutex);
+        _single_writer = true;
+        _metric_buckets.front()->set_single_writer();
+    }
+
     /**
      * call back when the time window period shift
      *
@@ -355,6 +1014,15 @@ public:
             _deep_sample_rate = 1;
         }
 
+        if (window_config->config_exists("deep_sample_mode")) {
+            auto mode = window_config->config_get<std::string>("deep_sample_mode");
+            if (mode == "flow") {
+                _deep_sample_mode = DeepSampleMode::Flow;
+            } else if (mode != "random") {
+                throw ConfigException(fmt::format("invalid deep_sample_mode: {}, use random or flow", mode));
+            }
+        }
+
         if (window_config->config_exists("num_periods")) {
             _num_periods = window_config->config_get<uint64_t>("num_periods");
         }
@@ -364,7 +1032,11 @@ public:
         _next_shift_tstamp = _last_shift_tstamp;
         _next_shift_tstamp.tv_sec += AbstractMetricsManager::PERIOD_SEC;
 
-        _metric_buckets.emplace_front(std::make_unique<MetricsBucketClass>());
+        _metric_buckets.emplace_front(BucketPool<MetricsBucketClass>::build());
+        _metric_buckets.front()->start_rates();
+        if (_num_periods > 1) {
+            _pool.prepare();
+        }
     }
 
     virtual ~AbstractMetricsManager() = default;
@@ -387,6 +1059,32 @@ public:
         return _deep_sample_rate;
     }
 
+    DeepSampleMode deep_sample_mode() const
+    {
+        return _deep_sample_mode;
+    }
+
+    bool single_writer() const
+    {
+        return _single_writer;
+    }
+
+    /**
+     * the deep sample rate in use, which the load shedder may have lowered from the configured one
+     */
+    unsigned int effective_deep_sample_rate() const
+    {
+        return _effective_deep_sample_rate();
+    }
+
+    /**
+     * follow the deep sample rate of a policy load shedder. must be set before events are processed
+     */
+    void set_load_shedder(const LoadShedder *shedder)
+    {
+        _shedder = shedder;
+    }
+
     auto start_tstamp() const
     {
         std::shared_lock rl(_bucket_mutex);
@@ -401,6 +1099,10 @@ public:
 
     void set_start_tstamp(timespec stamp)
     {
+        std::unique_lock<SingleWriterGate> gate(_gate, std::defer_lock);
+        if (_single_writer) {
+            gate.lock();
+        }
         std::unique_lock wl(_base_mutex);
         _last_shift_tstamp = stamp;
         _next_shift_tstamp.tv_sec = stamp.tv_sec + AbstractMetricsManager::PERIOD_SEC;
@@ -411,7 +1113,12 @@ public:
 
     void set_end_tstamp(timespec stamp)
     {
-        std::shared_lock rl(_bucket_mutex);
+        std::unique_lock<SingleWriterGate> gate(_gate, std::defer_lock);
+        if (_single_writer) {
+            gate.lock();
+        }
+        std::unique_lock wl(_bucket_mutex);
+        _merge_live_shards(*_metric_buckets.front(), stamp);
         _metric_buckets.front()->set_read_only(stamp);
     }
 
@@ -440,26 +1147,96 @@ public:
         }
     }
 
+    /**
+     * shift the window if it is due, for callers other than the event path, e.g. input heartbeats
+     */
     void check_period_shift(timespec stamp)
     {
-        std::shared_lock rlb(_base_mutex);
-        bool will_shift = _num_periods > 1 && stamp.tv_sec >= _next_shift_tstamp.tv_sec;
-        rlb.unlock();
-        if (will_shift) {
-            _period_shift(stamp);
+        // a single writer is held off while another thread shifts
+        std::unique_lock<SingleWriterGate> gate(_gate, std::defer_lock);
+        if (_single_writer) {
+            gate.lock();
         }
+        _check_period_shift(stamp);
     }
 
-    MetricsBucketClass *live_bucket()
+    /**
+     * the live bucket of the calling worker. it holds the bucket container for read while it lives, so a period shift
+     * waits for the update in progress instead of merging the bucket from under it. keep it for a single update, or
+     * one run of a batch, and never across a period shift
+     */
+    class LiveBucket
+    {
+        std::shared_lock<std::shared_mutex> _lock;
+        MetricsBucketClass *_bucket;
+
+    public:
+        LiveBucket(std::shared_lock<std::shared_mutex> lock, MetricsBucketClass *bucket)
+            : _lock(std::move(lock))
+            , _bucket(bucket)
+        {
+        }
+
+        MetricsBucketClass *operator->() const
+        {
+            return _bucket;
+        }
+
+        MetricsBucketClass *get() const
+        {
+            return _bucket;
+        }
+    };
+
+    LiveBucket live_bucket()
     {
         // CRITICAL PATH
+        if (_single_writer) {
+            // the writer is the only one to change the bucket container while it holds its write scope
+            assert(worker_shard_id == 0);
+            return LiveBucket({}, _metric_buckets[0].get());
+        }
         std::shared_lock rl(_bucket_mutex);
-        // NOT bounds checked
-        return _metric_buckets[0].get();
+        if (worker_shard_id == 0) {
+            // NOT bounds checked
+            return LiveBucket(std::move(rl), _metric_buckets[0].get());
+        }
+        while (worker_shard_id > _live_shards.size() || !_live_shards[worker_shard_id - 1]) {
+            // first event from this worker in the current period. a shift may retire the new shard before we get it
+            rl.unlock();
+            _add_live_shard(worker_shard_id);
+            rl.lock();
+        }
+        return LiveBucket(std::move(rl), _live_shards[worker_shard_id - 1].get());
+    }
+
+    /**
+     * a copy of the live bucket merged with its worker shards, which can be rendered while updates carry on. with a
+     * single writer this is the only consistent way to read the live period
+     */
+    std::unique_ptr<MetricsBucketClass> live_bucket_snapshot() const
+    {
+        // the gate is always taken before the manager locks, which the writer may wait on in its write scope
+        std::unique_lock<SingleWriterGate> gate(_gate, std::defer_lock);
+        if (_single_writer) {
+            gate.lock();
+        }
+        std::shared_lock rbl(_bucket_mutex);
+        auto snapshot = std::make_unique<MetricsBucketClass>();
+        if (_recorded_stream) {
+            snapshot->set_recorded_stream();
+        }
+        _merge_live_bucket(*snapshot);
+        return snapshot;
     }
 
     void window_single_json(json &j, const std::string &key, uint64_t period = 0) const
     {
+        std::unique_ptr<MetricsBucketClass> snapshot;
+        if (period == 0 && _single_writer) {
+            snapshot = live_bucket_snapshot();
+        }
+
         std::shared_lock rl(_base_mutex);
         std::shared_lock rbl(_bucket_mutex);
 
@@ -474,14 +1251,51 @@ public:
             throw PeriodException(err.str());
         }
 
+        if (snapshot) {
+            j[key]["period"]["start_ts"] = snapshot->start_tstamp().tv_sec;
+            j[key]["period"]["length"] = snapshot->period_length();
+            snapshot->to_json(j[key]);
+            return;
+        }
+
+        if (period > 0) {
+            // closed periods don't change until the next shift
+            auto cl = _lock_render_cache();
+            auto cached = _closedJsonCache.find(period);
+            if (cached == _closedJsonCache.end()) {
+                json rendered;
+                rendered["period"]["start_ts"] = _metric_buckets.at(period)->start_tstamp().tv_sec;
+                rendered["period"]["length"] = _metric_buckets.at(period)->period_length();
+                _metric_buckets.at(period)->to_json(rendered);
+                cached = _closedJsonCache.emplace(period, std::move(rendered)).first;
+            }
+            j[key] = cached->second;
+            return;
+        }
+
         j[key]["period"]["start_ts"] = _metric_buckets.at(period)->start_tstamp().tv_sec;
         j[key]["period"]["length"] = _metric_buckets.at(period)->period_length();
 
+        if (!_live_shards.empty()) {
+            auto merged = std::make_unique<MetricsBucketClass>();
+            if (_recorded_stream) {
+                merged->set_recorded_stream();
+            }
+            _merge_live_bucket(*merged);
+            merged->to_json(j[key]);
+            return;
+        }
+
         _metric_buckets.at(period)->to_json(j[key]);
     }
 
     void window_single_prometheus(std::stringstream &out, uint64_t period = 0, Metric::LabelMap add_labels = {}) const
     {
+        std::unique_ptr<MetricsBucketClass> snapshot;
+        if (period == 0 && _single_writer) {
+            snapshot = live_bucket_snapshot();
+        }
+
         std::shared_lock rl(_base_mutex);
         std::shared_lock rbl(_bucket_mutex);
 
@@ -496,53 +1310,102 @@ public:
             throw PeriodException(err.str());
         }
 
+        if (snapshot) {
+            snapshot->to_prometheus(out, add_labels);
+            return;
+        }
+
+        if (period > 0) {
+            auto cl = _lock_render_cache();
+            auto cached = _closedPrometheusCache.find({period, add_labels});
+            if (cached == _closedPrometheusCache.end()) {
+                std::stringstream rendered;
+                _metric_buckets.at(period)->to_prometheus(rendered, add_labels);
+                cached = _closedPrometheusCache.emplace(std::make_pair(period, add_labels), rendered.str()).first;
+            }
+            out << cached->second;
+            return;
+        }
+
+        if (!_live_shards.empty()) {
+            auto merged = std::make_unique<MetricsBucketClass>();
+            if (_recorded_stream) {
+                merged->set_recorded_stream();
+            }
+            _merge_live_bucket(*merged);
+            merged->to_prometheus(out, add_labels);
+            return;
+        }
+
         _metric_buckets.at(period)->to_prometheus(out, add_labels);
     }
 
     void window_merged_json(json &j, const std::string &key, uint64_t period) const
     {
-        std::shared_lock rl(_base_mutex);
-        std::shared_lock rbl(_bucket_mutex);
-
-        if (period <= 1 || period > _num_periods) {
+        if (period <= 1 || period > num_periods()) {
             std::stringstream err;
-            err << "invalid metrics period, specify [2, " << _num_periods << "]";
+            err << "invalid metrics period, specify [2, " << num_periods() << "]";
             throw PeriodException(err.str());
         }
 
-        auto cached = _mergeResultCache.find(period);
-        if (cached != _mergeResultCache.end()) {
-            // cached results, make sure still valid
-            auto t_diff = std::chrono::high_resolution_clock::now() - cached->second.first;
-            if (std::chrono::duration_cast<std::chrono::milliseconds>(t_diff).count() < MERGE_CACHE_TTL_MS) {
-                j = cached->second.second;
-            } else {
+        std::shared_ptr<const MetricsBucketClass> closed;
+        uint64_t generation;
+        {
+            std::shared_lock rbl(_bucket_mutex);
+            generation = _shift_generation;
+            auto cl = _lock_render_cache();
+            auto cached = _mergeResultCache.find(period);
+            if (cached != _mergeResultCache.end()) {
+                // cached results, make sure still valid
+                auto t_diff = std::chrono::high_resolution_clock::now() - cached->second.first;
+                if (std::chrono::duration_cast<std::chrono::milliseconds>(t_diff).count() < MERGE_CACHE_TTL_MS) {
+                    j[key] = cached->second.second;
+                    return;
+                }
                 // expire
-                _mergeResultCache.erase(period);
+                _mergeResultCache.erase(cached);
             }
+            cl.unlock();
+            // built at most once per shift, and before taking the gate so that a single writer is not held off for it
+            closed = _closed_aggregate(period - 1);
         }
 
-        MetricsBucketClass merged;
-        if (_recorded_stream) {
-            merged.set_recorded_stream();
+        // the live period always takes part in a merged window, it is copied through the gate
+        std::unique_lock<SingleWriterGate> gate(_gate, std::defer_lock);
+        if (_single_writer) {
+            gate.lock();
         }
-
-        auto p = period;
-        for (auto &m : _metric_buckets) {
-            if (p-- == 0) {
-                break;
-            }
-            merged.merge(*m);
+        std::shared_lock rbl(_bucket_mutex);
+        if (generation != _shift_generation) {
+            // shifted meanwhile
+            generation = _shift_generation;
+            closed = _closed_aggregate(period - 1);
         }
 
-        std::string period_str = std::to_string(period) + "m";
-
-        j[key]["period"]["start_ts"] = merged.start_tstamp().tv_sec;
-        j[key]["period"]["length"] = merged.period_length();
+        auto merged = std::make_unique<MetricsBucketClass>();
+        if (_recorded_stream) {
+            merged->set_recorded_stream();
+        }
+        if (closed) {
+            merged->merge(*closed);
+        }
+        _merge_live_bucket(*merged);
+        rbl.unlock();
+        if (gate.owns_lock()) {
+            gate.unlock();
+        }
 
-        merged.to_json(j[key]);
+        json rendered;
+        rendered["period"]["start_ts"] = merged->start_tstamp().tv_sec;
+        rendered["period"]["length"] = merged->period_length();
+        merged->to_json(rendered);
+        j[key] = rendered;
 
-        _mergeResultCache[period] = std::pair<std::chrono::high_resolution_clock::time_point, json>(std::chrono::high_resolution_clock::now(), j);
+        std::shared_lock rbl_cache(_bucket_mutex);
+        auto cl = _lock_render_cache();
+        if (generation == _shift_generation) {
+            _mergeResultCache[period] = std::make_pair(std::chrono::high_resolution_clock::now(), std::move(rendered));
+        }
     }
 };
 
@@ -51,6 +51,23 @@ public:
         return _policies.size();
     }
 
+    /**
+     * the occupancy of the capture ring in percent, for inputs which have one. the policy load shedder backs off
+     * when it fills up
+     */
+    virtual uint32_t backlog() const
+    {
+        return 0;
+    }
+
+    /**
+     * the number of threads which may deliver events to the handlers of this input at the same time
+     */
+    virtual uint64_t capture_threads() const
+    {
+        return 1;
+    }
+
     virtual size_t consumer_count() const
     {
         return policy_signal.slot_count() + heartbeat_signal.slot_count();
@@ -0,0 +1,110 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "LoadShedder.h"
+#include <algorithm>
+#include <fmt/format.h>
+
+namespace visor {
+
+LoadShedder::LoadShedder(const Configurable *window_config, std::function<uint32_t()> backlog)
+    : _backlog(std::move(backlog))
+{
+    auto budget = window_config->config_get<uint64_t>("cpu_budget");
+    if (budget < 1 || budget > UINT32_MAX) {
+        throw ConfigException(fmt::format("invalid cpu_budget: {}, expecting a percentage of one cpu above 0", budget));
+    }
+    _cpu_budget = static_cast<uint32_t>(budget);
+
+    // clamped the same way the metrics managers do it
+    if (window_config->config_exists("deep_sample_rate")) {
+        _max_deep_sample_rate = static_cast<uint32_t>(std::clamp<uint64_t>(window_config->config_get<uint64_t>("deep_sample_rate"), 1, 100));
+    }
+    _deep_sample_rate = _max_deep_sample_rate;
+}
+
+LoadShedder::Probe *LoadShedder::add_probe(const std::string &name)
+{
+    std::unique_lock lock(_control_mutex);
+    _probes.push_back(std::make_unique<Probe>(this, name));
+    return _probes.back().get();
+}
+
+void LoadShedder::_control(int64_t now_ns)
+{
+    _next_control_ns.store(now_ns + CONTROL_INTERVAL_NS, std::memory_order_relaxed);
+    if (!_last_control_ns) {
+        // the first step only takes the baseline
+        for (auto &probe : _probes) {
+            probe->_last_busy_ns = probe->_busy_ns.load(std::memory_order_relaxed);
+        }
+        _last_control_ns = now_ns;
+        return;
+    }
+    auto elapsed = now_ns - _last_control_ns;
+    if (elapsed <= 0) {
+        return;
+    }
+    _last_control_ns = now_ns;
+
+    double usage{0};
+    for (auto &probe : _probes) {
+        auto busy = probe->_busy_ns.load(std::memory_order_relaxed);
+        auto probe_usage = static_cast<double>(busy - probe->_last_busy_ns) * 100.0 / static_cast<double>(elapsed);
+        probe->_last_busy_ns = busy;
+        probe->_cpu_usage.store(probe_usage, std::memory_order_relaxed);
+        usage += probe_usage;
+    }
+    _cpu_usage.store(usage, std::memory_order_relaxed);
+    auto backlog = _backlog ? _backlog() : 0;
+    _input_backlog.store(backlog, std::memory_order_relaxed);
+
+    auto shift = _shed_shift.load(std::memory_order_relaxed);
+    auto deep = _deep_sample_rate.load(std::memory_order_relaxed);
+    if (usage > _cpu_budget || backlog >= BACKLOG_HIGH) {
+        // deep parsing is the costlier part, so it goes first
+        if (deep > 1) {
+            _deep_sample_rate.store(deep / 2, std::memory_order_relaxed);
+        } else if (shift < MAX_SHED_SHIFT) {
+            _shed_shift.store(shift + 1, std::memory_order_relaxed);
+        }
+    } else if (usage * 2 < _cpu_budget && backlog < BACKLOG_LOW) {
+        // a step back at most doubles the work
+        if (shift) {
+            _shed_shift.store(shift - 1, std::memory_order_relaxed);
+        } else if (deep < _max_deep_sample_rate) {
+            _deep_sample_rate.store(std::min(deep * 2, _max_deep_sample_rate), std::memory_order_relaxed);
+        }
+    }
+}
+
+void LoadShedder::to_json(json &j) const
+{
+    j["cpu_budget"] = _cpu_budget;
+    j["cpu_usage"] = cpu_usage();
+    j["input_backlog"] = input_backlog();
+    j["sample_ratio"] = sample_ratio();
+    j["deep_sample_rate"] = deep_sample_rate();
+    std::unique_lock lock(_control_mutex);
+    for (const auto &probe : _probes) {
+        j["handlers"][probe->name()]["cpu_usage"] = probe->cpu_usage();
+    }
+}
+
+void LoadShedder::to_prometheus(std::stringstream &out, const std::string &schema_key, Metric::LabelMap add_labels) const
+{
+    Gauge sample_ratio_gauge(schema_key, {"load_shed", "sample_ratio"}, "Share of events processed by the policy, the rest are shed to stay within its cpu budget");
+    sample_ratio_gauge.set(sample_ratio());
+    sample_ratio_gauge.to_prometheus(out, add_labels);
+
+    Gauge deep_rate_gauge(schema_key, {"load_shed", "deep_sample_rate"}, "Highest deep sample rate the policy may use within its cpu budget");
+    deep_rate_gauge.set(deep_sample_rate());
+    deep_rate_gauge.to_prometheus(out, add_labels);
+
+    Gauge cpu_usage_gauge(schema_key, {"load_shed", "cpu_usage"}, "Percent of one cpu used by the handlers of the policy over the last second");
+    cpu_usage_gauge.set(cpu_usage());
+    cpu_usage_gauge.to_prometheus(out, add_labels);
+}
+
+}
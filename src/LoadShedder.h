@@ -0,0 +1,232 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "Configurable.h"
+#include "Metrics.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace visor {
+
+/**
+ * Keeps the stream handlers of a policy within a cpu budget by shedding work on purpose, rather than letting the input
+ * fall behind until the kernel drops packets indiscriminately.
+ *
+ * handlers time their processing through a Probe. about once a second, the time spent by all of them is compared with
+ * the budget, and the backlog of the input ring with its water marks. while over, the deep sample rate of the policy
+ * is halved first, down to 1, and then events are sampled before they are parsed, halving the share kept at each step
+ * down to 1 in 2^MAX_SHED_SHIFT. steps are undone in the reverse order once doubling the work would still fit.
+ *
+ * events are kept by a hash of their sample key, so that every handler of the policy keeps the same ones and a query and
+ * its reply are kept alike. a kept event stands for all the events shed in its place, its counters are scaled by the
+ * weight admit() returns
+ */
+class LoadShedder
+{
+public:
+    static constexpr uint32_t MAX_SHED_SHIFT = 10;
+    static constexpr int64_t CONTROL_INTERVAL_NS = 1'000'000'000;
+    // input ring occupancy in percent: over the high mark the input is falling behind whatever the measured usage
+    static constexpr uint32_t BACKLOG_HIGH = 50;
+    static constexpr uint32_t BACKLOG_LOW = 10;
+
+    /**
+     * the processing time of a single handler
+     */
+    class Probe
+    {
+        friend class LoadShedder;
+
+        LoadShedder *_shedder;
+        std::string _name;
+        std::atomic<uint64_t> _busy_ns{0};
+        // controller state
+        uint64_t _last_busy_ns{0};
+        std::atomic<double> _cpu_usage{0};
+
+    public:
+        Probe(LoadShedder *shedder, std::string name)
+            : _shedder(shedder)
+            , _name(std::move(name))
+        {
+        }
+
+        LoadShedder *shedder() const
+        {
+            return _shedder;
+        }
+
+        const std::string &name() const
+        {
+            return _name;
+        }
+
+        // percent of one cpu over the last control interval
+        double cpu_usage() const
+        {
+            return _cpu_usage.load(std::memory_order_relaxed);
+        }
+
+        void add(int64_t start_ns, int64_t end_ns)
+        {
+            _busy_ns.fetch_add(static_cast<uint64_t>(end_ns - start_ns), std::memory_order_relaxed);
+            _shedder->_maybe_control(end_ns);
+        }
+    };
+
+    /**
+     * times a call into a handler while in scope. a null probe is not timed
+     */
+    class Timer
+    {
+        Probe *_probe;
+        int64_t _start_ns{0};
+
+    public:
+        explicit Timer(Probe *probe)
+            : _probe(probe)
+        {
+            if (_probe) {
+                _start_ns = now_ns();
+            }
+        }
+
+        ~Timer()
+        {
+            if (_probe) {
+                _probe->add(_start_ns, now_ns());
+            }
+        }
+
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+    };
+
+    static int64_t now_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /**
+     * whether an event is kept when 1 in 2^shift are. a key kept at some shift is also kept at every lower one
+     */
+    static bool keep(uint64_t sample_key, uint32_t shift)
+    {
+        if (!shift) {
+            return true;
+        }
+        // murmur3 finalizer of the salted key, so that this choice is independent from the flow deep sampling one
+        sample_key ^= 0x9e3779b97f4a7c15ULL;
+        sample_key ^= sample_key >> 33;
+        sample_key *= 0xff51afd7ed558ccdULL;
+        sample_key ^= sample_key >> 33;
+        sample_key *= 0xc4ceb9fe1a85ec53ULL;
+        sample_key ^= sample_key >> 33;
+        return sample_key >> (64 - shift) == 0;
+    }
+
+private:
+    uint32_t _cpu_budget;
+    uint32_t _max_deep_sample_rate{100};
+    std::function<uint32_t()> _backlog;
+
+    std::atomic<uint32_t> _shed_shift{0};
+    std::atomic<uint32_t> _deep_sample_rate;
+    std::atomic<double> _cpu_usage{0};
+    std::atomic<uint32_t> _input_backlog{0};
+
+    // serializes control steps, and guards the probe list
+    mutable std::mutex _control_mutex;
+    std::vector<std::unique_ptr<Probe>> _probes;
+    std::atomic<int64_t> _next_control_ns{0};
+    int64_t _last_control_ns{0};
+
+    void _control(int64_t now_ns);
+
+    void _maybe_control(int64_t now_ns)
+    {
+        if (now_ns < _next_control_ns.load(std::memory_order_relaxed)) {
+            return;
+        }
+        // whoever gets here first takes the step, the others carry on
+        std::unique_lock lock(_control_mutex, std::try_to_lock);
+        if (lock && now_ns >= _next_control_ns.load(std::memory_order_relaxed)) {
+            _control(now_ns);
+        }
+    }
+
+public:
+    /**
+     * @param window_config the policy window config: cpu_budget, in percent of one cpu, and deep_sample_rate
+     * @param backlog returns the occupancy of the input ring in percent, or nullptr for inputs without one
+     */
+    LoadShedder(const Configurable *window_config, std::function<uint32_t()> backlog = nullptr);
+
+    Probe *add_probe(const std::string &name);
+
+    /**
+     * take a control step now. steps are otherwise taken from the event path, once per CONTROL_INTERVAL_NS
+     */
+    void control(int64_t now_ns)
+    {
+        std::unique_lock lock(_control_mutex);
+        _control(now_ns);
+    }
+
+    uint32_t cpu_budget() const
+    {
+        return _cpu_budget;
+    }
+
+    // percent of one cpu used by all probes over the last control interval
+    double cpu_usage() const
+    {
+        return _cpu_usage.load(std::memory_order_relaxed);
+    }
+
+    uint32_t input_backlog() const
+    {
+        return _input_backlog.load(std::memory_order_relaxed);
+    }
+
+    uint32_t shed_shift() const
+    {
+        return _shed_shift.load(std::memory_order_relaxed);
+    }
+
+    // the share of events kept, 1 while nothing is shed
+    double sample_ratio() const
+    {
+        return 1.0 / static_cast<double>(1U << shed_shift());
+    }
+
+    // the highest deep sample rate handlers of the policy may use
+    uint32_t deep_sample_rate() const
+    {
+        return _deep_sample_rate.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * the pre parse sampling decision for an event
+     *
+     * @return 0 if the event is shed, otherwise the number of events it stands for
+     */
+    uint32_t admit(uint64_t sample_key) const
+    {
+        auto shift = shed_shift();
+        return keep(sample_key, shift) ? 1U << shift : 0;
+    }
+
+    void to_json(json &j) const;
+    void to_prometheus(std::stringstream &out, const std::string &schema_key, Metric::LabelMap add_labels = {}) const;
+};
+
+}
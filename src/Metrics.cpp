@@ -4,6 +4,9 @@
 
 #include "Metrics.h"
 #include <cpc_union.hpp>
+#include <regex>
+#include <thread>
+#include <unordered_map>
 
 namespace visor {
 
@@ -14,11 +17,104 @@ void Counter::to_json(json &j) const
 
 void Counter::to_prometheus(std::stringstream &out, Metric::LabelMap add_labels) const
 {
-    out << "# HELP " << base_name_snake() << ' ' << _desc << std::endl;
+    out << "# HELP " << base_name_snake() << ' ' << _info->desc << std::endl;
     out << "# TYPE " << base_name_snake() << " gauge" << std::endl;
     out << name_snake({}, add_labels) << ' ' << _value << std::endl;
 }
 
+void Gauge::to_json(json &j) const
+{
+    name_json_assign(j, _value);
+}
+
+void Gauge::to_prometheus(std::stringstream &out, Metric::LabelMap add_labels) const
+{
+    out << "# HELP " << base_name_snake() << ' ' << _info->desc << std::endl;
+    out << "# TYPE " << base_name_snake() << " gauge" << std::endl;
+    out << name_snake({}, add_labels) << ' ' << _value << std::endl;
+}
+
+RateEngine::RateEngine()
+{
+    std::thread([this] {
+        auto next = std::chrono::steady_clock::now();
+        while (true) {
+            next += 1s;
+            std::this_thread::sleep_until(next);
+            tick();
+        }
+    }).detach();
+}
+
+RateEngine &RateEngine::instance()
+{
+    // never destroyed, rates may still be cancelled during static destruction
+    static auto *engine = new RateEngine();
+    return *engine;
+}
+
+void RateEngine::add(Rate *rate)
+{
+    std::unique_lock lock(_mutex);
+    if (rate->_slot != Rate::NO_SLOT) {
+        return;
+    }
+    if (_free_slots.empty()) {
+        rate->_slot = _slots.size();
+        _slots.push_back(rate);
+    } else {
+        rate->_slot = _free_slots.back();
+        _free_slots.pop_back();
+        _slots[rate->_slot] = rate;
+    }
+}
+
+void RateEngine::remove(Rate *rate)
+{
+    // once this returns, a tick will not touch the rate anymore
+    std::unique_lock lock(_mutex);
+    if (rate->_slot == Rate::NO_SLOT) {
+        return;
+    }
+    _slots[rate->_slot] = nullptr;
+    if (rate->_slot < _ticked.size()) {
+        _ticked[rate->_slot] = nullptr;
+    }
+    _free_slots.push_back(rate->_slot);
+    rate->_slot = Rate::NO_SLOT;
+}
+
+bool RateEngine::running(const Rate *rate)
+{
+    std::unique_lock lock(_mutex);
+    return rate->_slot != Rate::NO_SLOT;
+}
+
+void RateEngine::tick()
+{
+    std::unique_lock tick_lock(_tick_mutex);
+    std::unique_lock lock(_mutex);
+    // take all the counters first, so that they cover the same second
+    _ticked = _slots;
+    _snapshot.resize(_slots.size());
+    for (size_t i = 0; i < _slots.size(); ++i) {
+        _snapshot[i] = _slots[i] ? _slots[i]->_counter.exchange(0, std::memory_order_relaxed) : 0;
+    }
+    lock.unlock();
+
+    // then the quantiles, locking per rate so that adding and removing rates never waits for the whole pass. a rate
+    // removed in between is skipped, its slot may already belong to another one
+    for (size_t i = 0; i < _ticked.size(); ++i) {
+        lock.lock();
+        if (auto rate = _ticked[i]) {
+            rate->_rate.store(_snapshot[i], std::memory_order_relaxed);
+            std::unique_lock sketch_lock(rate->_sketch_mutex);
+            rate->_quantile.update(_snapshot[i]);
+        }
+        lock.unlock();
+    }
+}
+
 void Rate::to_json(json &j, bool include_live) const
 {
     to_json(j);
@@ -59,7 +155,7 @@ void Rate::to_prometheus(std::stringstream &out, Metric::LabelMap add_labels) co
     l99["quantile"] = "0.99";
 
     if (quantiles.size()) {
-        out << "# HELP " << base_name_snake() << ' ' << _desc << std::endl;
+        out << "# HELP " << base_name_snake() << ' ' << _info->desc << std::endl;
         out << "# TYPE " << base_name_snake() << " summary" << std::endl;
         out << name_snake({}, l5) << ' ' << quantiles[0] << std::endl;
         out << name_snake({}, l9) << ' ' << quantiles[1] << std::endl;
@@ -83,7 +179,7 @@ void Cardinality::to_json(json &j) const
 }
 void Cardinality::to_prometheus(std::stringstream &out, Metric::LabelMap add_labels) const
 {
-    out << "# HELP " << base_name_snake() << ' ' << _desc << std::endl;
+    out << "# HELP " << base_name_snake() << ' ' << _info->desc << std::endl;
     out << "# TYPE " << base_name_snake() << " gauge" << std::endl;
     out << name_snake({}, add_labels) << ' ' << lround(_set.get_estimate()) << std::endl;
 }
@@ -91,10 +187,54 @@ void Cardinality::to_prometheus(std::stringstream &out, Metric::LabelMap add_lab
 // static storage for base labels
 Metric::LabelMap Metric::_static_labels;
 
+const MetricDescriptor *MetricDescriptor::get(std::string_view schema_key, std::initializer_list<std::string_view> names, std::string_view desc)
+{
+    static std::shared_mutex registry_mutex;
+    static std::unordered_map<std::string, std::unique_ptr<MetricDescriptor>> registry;
+
+    std::string key{schema_key};
+    for (const auto &name : names) {
+        key.append(1, '\0').append(name);
+    }
+    key.append(1, '\0').append(desc);
+
+    {
+        std::shared_lock r_lock(registry_mutex);
+        auto found = registry.find(key);
+        if (found != registry.end()) {
+            return found->second.get();
+        }
+    }
+
+    static const std::regex label_regex(Metric::LABEL_REGEX);
+    for (const auto &name : names) {
+        if (!std::regex_match(name.begin(), name.end(), label_regex)) {
+            throw std::runtime_error("invalid metric name: " + std::string(name));
+        }
+    }
+    if (!std::regex_match(schema_key.begin(), schema_key.end(), label_regex)) {
+        throw std::runtime_error("invalid schema name: " + std::string(schema_key));
+    }
+
+    auto descriptor = std::make_unique<MetricDescriptor>();
+    descriptor->schema_key = schema_key;
+    descriptor->names.assign(names.begin(), names.end());
+    descriptor->desc = desc;
+    descriptor->base_name_snake = schema_key;
+    for (const auto &name : names) {
+        descriptor->base_name_snake.append(1, '_').append(name);
+    }
+
+    std::unique_lock w_lock(registry_mutex);
+    // another thread may have added it meanwhile, either one will do
+    auto [inserted, added] = registry.emplace(std::move(key), std::move(descriptor));
+    return inserted->second.get();
+}
+
 void Metric::name_json_assign(json &j, const json &val) const
 {
     json *j_part = &j;
-    for (const auto &s_part : _name) {
+    for (const auto &s_part : _info->names) {
         j_part = &(*j_part)[s_part];
     }
     (*j_part) = val;
@@ -102,7 +242,7 @@ void Metric::name_json_assign(json &j, const json &val) const
 void Metric::name_json_assign(json &j, std::initializer_list<std::string> add_names, const json &val) const
 {
     json *j_part = &j;
-    for (const auto &s_part : _name) {
+    for (const auto &s_part : _info->names) {
         j_part = &(*j_part)[s_part];
     }
     for (const auto &s_part : add_names) {
@@ -110,14 +250,6 @@ void Metric::name_json_assign(json &j, std::initializer_list<std::string> add_na
     }
     (*j_part) = val;
 }
-std::string Metric::base_name_snake() const
-{
-    auto snake = [](const std::string &ss, const std::string &s) {
-        return ss.empty() ? s : ss + "_" + s;
-    };
-    std::string name_text = _schema_key + "_" + std::accumulate(std::begin(_name), std::end(_name), std::string(), snake);
-    return name_text;
-}
 
 std::string Metric::name_snake(std::initializer_list<std::string> add_names, Metric::LabelMap add_labels) const
 {
@@ -136,15 +268,15 @@ std::string Metric::name_snake(std::initializer_list<std::string> add_names, Met
         label_text.pop_back();
     }
     label_text.push_back('}');
-    auto snake = [](const std::string &ss, const std::string &s) {
-        return ss.empty() ? s : ss + "_" + s;
-    };
-    std::string name_text = _schema_key + "_" + std::accumulate(std::begin(_name), std::end(_name), std::string(), snake);
+    std::string name_text = _info->base_name_snake;
     if (add_names.size()) {
+        auto snake = [](const std::string &ss, const std::string &s) {
+            return ss.empty() ? s : ss + "_" + s;
+        };
         name_text.push_back('_');
         name_text.append(std::accumulate(std::begin(add_names), std::end(add_names), std::string(), snake));
     }
     return name_text + label_text;
 }
 
-}
\ No newline at end of file
+}
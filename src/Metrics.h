@@ -5,7 +5,6 @@
 #pragma once
 #include <nlohmann/json.hpp>
 #include <sstream>
-#include <timer.hpp>
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wold-style-cast"
 #pragma GCC diagnostic ignored "-Wunused-function"
@@ -15,9 +14,18 @@
 #include <frequent_items_sketch.hpp>
 #include <kll_sketch.hpp>
 #pragma GCC diagnostic pop
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
 #include <chrono>
-#include <regex>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <shared_mutex>
+#include <string_view>
 #include <vector>
 
 namespace visor {
@@ -25,6 +33,105 @@ namespace visor {
 using json = nlohmann::json;
 using namespace std::chrono;
 
+/**
+ * the names, help text and prometheus name of a metric. these are the same in every bucket of every policy, so each
+ * distinct one is kept once and metrics only point to it
+ */
+struct MetricDescriptor {
+    std::string schema_key;
+    std::vector<std::string> names;
+    std::string desc;
+    // schema_key and names in snake case
+    std::string base_name_snake;
+
+    /**
+     * the descriptor with this info, which is validated and added on first use. descriptors are never freed
+     */
+    static const MetricDescriptor *get(std::string_view schema_key, std::initializer_list<std::string_view> names, std::string_view desc);
+
+    class Table;
+};
+
+/**
+ * the descriptors of all metrics of one bucket class, in the order a bucket constructs them. the first bucket built
+ * under a Scope on the table resolves them through MetricDescriptor::get(), the metrics of every later one take theirs
+ * by index, without building a key or taking a lock. bucket constructors must build the same metrics in the same order
+ */
+class MetricDescriptor::Table
+{
+    std::mutex _mutex;
+    std::vector<const MetricDescriptor *> _entries;
+    std::atomic<bool> _complete{false};
+
+public:
+    class Scope
+    {
+        Table &_table;
+        bool _replay;
+        size_t _next{0};
+        std::vector<const MetricDescriptor *> _resolved;
+        int _uncaught;
+        Scope *_previous;
+
+        inline static thread_local Scope *_current{nullptr};
+
+    public:
+        explicit Scope(Table &table)
+            : _table(table)
+            , _replay(table._complete.load(std::memory_order_acquire))
+            , _uncaught(std::uncaught_exceptions())
+            , _previous(_current)
+        {
+            _current = this;
+        }
+
+        ~Scope()
+        {
+            _current = _previous;
+            if (_replay || std::uncaught_exceptions() != _uncaught) {
+                return;
+            }
+            // concurrent first builds resolve the same entries, either one will do
+            std::unique_lock lock(_table._mutex);
+            if (!_table._complete.load(std::memory_order_relaxed)) {
+                _table._entries = std::move(_resolved);
+                _table._complete.store(true, std::memory_order_release);
+            }
+        }
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+        /**
+         * the descriptor for the next metric constructed on this thread: from the table of the innermost scope, or
+         * MetricDescriptor::get() when there is none
+         */
+        static const MetricDescriptor *resolve(std::string_view schema_key, std::initializer_list<std::string_view> names, std::string_view desc)
+        {
+            auto scope = _current;
+            if (!scope) {
+                return MetricDescriptor::get(schema_key, names, desc);
+            }
+            if (scope->_replay && scope->_next < scope->_table._entries.size()) {
+                auto descriptor = scope->_table._entries[scope->_next++];
+                assert(descriptor->desc == desc);
+                return descriptor;
+            }
+            auto descriptor = MetricDescriptor::get(schema_key, names, desc);
+            if (!scope->_replay) {
+                scope->_resolved.push_back(descriptor);
+            }
+            return descriptor;
+        }
+    };
+
+    // the number of entries, 0 until a first bucket has been built
+    size_t size() const
+    {
+        return _complete.load(std::memory_order_acquire) ? _entries.size() : 0;
+    }
+};
+
 class Metric
 {
 public:
@@ -37,40 +144,24 @@ private:
     static LabelMap _static_labels;
 
 protected:
-    std::vector<std::string> _name;
-    std::string _desc;
-    std::string _schema_key;
-
-    void _check_names()
-    {
-        for (const auto &name : _name) {
-            if (!std::regex_match(name, std::regex(LABEL_REGEX))) {
-                throw std::runtime_error("invalid metric name: " + name);
-            }
-        }
-        if (!std::regex_match(_schema_key, std::regex(LABEL_REGEX))) {
-            throw std::runtime_error("invalid schema name: " + _schema_key);
-        }
-    }
+    const MetricDescriptor *_info;
 
 public:
     inline static const std::string LABEL_REGEX = "[a-zA-Z_][a-zA-Z0-9_]*";
 
-    Metric(std::string schema_key, std::initializer_list<std::string> names, std::string desc)
-        : _name(names)
-        , _desc(std::move(desc))
-        , _schema_key(schema_key)
+    Metric(std::string_view schema_key, std::initializer_list<std::string_view> names, std::string_view desc)
+        : _info(MetricDescriptor::Table::Scope::resolve(schema_key, names, desc))
     {
-        _check_names();
     }
 
-    void set_info(std::string schema_key, std::initializer_list<std::string> names, const std::string &desc)
+    void set_info(std::string_view schema_key, std::initializer_list<std::string_view> names, std::string_view desc)
     {
-        _name.clear();
-        _name = names;
-        _desc = desc;
-        _schema_key = schema_key;
-        _check_names();
+        _info = MetricDescriptor::Table::Scope::resolve(schema_key, names, desc);
+    }
+
+    const MetricDescriptor &info() const
+    {
+        return *_info;
     }
 
     static void add_static_label(const std::string &label, const std::string &value)
@@ -81,7 +172,10 @@ public:
     void name_json_assign(json &j, const json &val) const;
     void name_json_assign(json &j, std::initializer_list<std::string> add_names, const json &val) const;
 
-    [[nodiscard]] std::string base_name_snake() const;
+    [[nodiscard]] const std::string &base_name_snake() const
+    {
+        return _info->base_name_snake;
+    }
     [[nodiscard]] std::string name_snake(std::initializer_list<std::string> add_names = {}, LabelMap add_labels = {}) const;
 
     virtual void to_json(json &j) const = 0;
@@ -97,8 +191,8 @@ class Counter final : public Metric
     uint64_t _value = 0;
 
 public:
-    Counter(std::string schema_key, std::initializer_list<std::string> names, std::string desc)
-        : Metric(schema_key, names, std::move(desc))
+    Counter(std::string_view schema_key, std::initializer_list<std::string_view> names, std::string_view desc)
+        : Metric(schema_key, names, desc)
     {
     }
 
@@ -128,6 +222,35 @@ public:
     void to_prometheus(std::stringstream &out, Metric::LabelMap add_labels = {}) const override;
 };
 
+/**
+ * A Gauge metric class for a value which is set rather than counted, and which may be fractional
+ * NOTE: intentionally _not_ thread safe; it should be protected by a mutex
+ */
+class Gauge final : public Metric
+{
+    double _value = 0;
+
+public:
+    Gauge(std::string_view schema_key, std::initializer_list<std::string_view> names, std::string_view desc)
+        : Metric(schema_key, names, desc)
+    {
+    }
+
+    void set(double value)
+    {
+        _value = value;
+    }
+
+    [[nodiscard]] double value() const
+    {
+        return _value;
+    }
+
+    // Metric
+    void to_json(json &j) const override;
+    void to_prometheus(std::stringstream &out, Metric::LabelMap add_labels = {}) const override;
+};
+
 /**
  * A Quantile metric class which knows how to render its output into p50, p90, p95, p99
  *
@@ -139,8 +262,8 @@ class Quantile final : public Metric
     datasketches::kll_sketch<T> _quantile;
 
 public:
-    Quantile(std::string schema_key, std::initializer_list<std::string> names, std::string desc)
-        : Metric(schema_key, names, std::move(desc))
+    Quantile(std::string_view schema_key, std::initializer_list<std::string_view> names, std::string_view desc)
+        : Metric(schema_key, names, desc)
     {
     }
 
@@ -199,7 +322,7 @@ public:
         l99["quantile"] = "0.99";
 
         if (quantiles.size()) {
-            out << "# HELP " << base_name_snake() << ' ' << _desc << std::endl;
+            out << "# HELP " << base_name_snake() << ' ' << _info->desc << std::endl;
             out << "# TYPE " << base_name_snake() << " summary" << std::endl;
             out << name_snake({}, l5) << ' ' << quantiles[0] << std::endl;
             out << name_snake({}, l9) << ' ' << quantiles[1] << std::endl;
@@ -237,8 +360,8 @@ private:
     std::string _item_key;
 
 public:
-    TopN(std::string schema_key, std::string item_key, std::initializer_list<std::string> names, std::string desc)
-        : Metric(schema_key, names, std::move(desc))
+    TopN(std::string_view schema_key, std::string item_key, std::initializer_list<std::string_view> names, std::string_view desc)
+        : Metric(schema_key, names, desc)
         , _fi(MAX_FI_MAP_SIZE, START_FI_MAP_SIZE)
         , _item_key(item_key)
     {
@@ -259,6 +382,17 @@ public:
         _fi.merge(other._fi);
     }
 
+    /**
+     * call f with every item the sketch currently tracks, not only the top N
+     */
+    template <typename F>
+    void for_each_item(F &&f) const
+    {
+        for (const auto &row : _fi.get_frequent_items(datasketches::frequent_items_error_type::NO_FALSE_NEGATIVES, 0)) {
+            f(row.get_item());
+        }
+    }
+
     /**
      * to_json which takes a formater to format the "name"
      * @param j json object
@@ -279,7 +413,7 @@ public:
     {
         LabelMap l(add_labels);
         auto items = _fi.get_frequent_items(datasketches::frequent_items_error_type::NO_FALSE_NEGATIVES);
-        out << "# HELP " << base_name_snake() << ' ' << _desc << std::endl;
+        out << "# HELP " << base_name_snake() << ' ' << _info->desc << std::endl;
         out << "# TYPE " << base_name_snake() << " gauge" << std::endl;
         for (uint64_t i = 0; i < std::min(_top_count, items.size()); i++) {
             l[_item_key] = formatter(items[i].get_item());
@@ -303,7 +437,7 @@ public:
     {
         LabelMap l(add_labels);
         auto items = _fi.get_frequent_items(datasketches::frequent_items_error_type::NO_FALSE_NEGATIVES);
-        out << "# HELP " << base_name_snake() << ' ' << _desc << std::endl;
+        out << "# HELP " << base_name_snake() << ' ' << _info->desc << std::endl;
         out << "# TYPE " << base_name_snake() << " gauge" << std::endl;
         for (uint64_t i = 0; i < std::min(_top_count, items.size()); i++) {
             std::stringstream name_text;
@@ -314,6 +448,150 @@ public:
     }
 };
 
+/**
+ * A TopN metric class for small integer domains, such as ports, qtypes and rcodes, which keeps an exact count for every
+ * possible value instead of a sketch. the counts are allocated on the first update, after which updates and merges do not
+ * allocate. the top items are only picked when rendering
+ *
+ * NOTE: intentionally _not_ thread safe; it should be protected by a mutex
+ */
+template <typename T, size_t N = (size_t{1} << (8 * sizeof(T)))>
+class DenseTopN final : public Metric
+{
+    static_assert(std::is_integral_v<T> && std::is_unsigned_v<T>, "DenseTopN needs an unsigned integer type");
+    static_assert(N > 0 && N <= 65536, "DenseTopN domain size must be within 1 and 65536");
+
+    // on the heap and only once counted, it is 512KB for a 16 bit domain
+    std::unique_ptr<std::array<uint64_t, N>> _counts;
+    size_t _top_count = 10;
+
+    std::array<uint64_t, N> &_alloc_counts()
+    {
+        if (!_counts) {
+            _counts = std::make_unique<std::array<uint64_t, N>>();
+        }
+        return *_counts;
+    }
+    std::string _item_key;
+
+    /**
+     * the top items by count, ties by value
+     */
+    std::vector<std::pair<T, uint64_t>> _top_items() const
+    {
+        std::vector<std::pair<T, uint64_t>> items;
+        for_each_item([this, &items](T value) {
+            items.emplace_back(value, (*_counts)[value]);
+        });
+        auto top = items.begin() + std::min(_top_count, items.size());
+        std::partial_sort(items.begin(), top, items.end(), [](const auto &a, const auto &b) {
+            return a.second > b.second || (a.second == b.second && a.first < b.first);
+        });
+        items.erase(top, items.end());
+        return items;
+    }
+
+public:
+    DenseTopN(std::string_view schema_key, std::string item_key, std::initializer_list<std::string_view> names, std::string_view desc)
+        : Metric(schema_key, names, desc)
+        , _item_key(item_key)
+    {
+    }
+
+    /**
+     * @param value must be below N
+     */
+    void update(T value, uint64_t weight = 1)
+    {
+        assert(value < N);
+        _alloc_counts()[value] += weight;
+    }
+
+    void merge(const DenseTopN &other)
+    {
+        if (!other._counts) {
+            return;
+        }
+        auto &counts = _alloc_counts();
+        for (size_t i = 0; i < N; ++i) {
+            counts[i] += (*other._counts)[i];
+        }
+    }
+
+    uint64_t count(T value) const
+    {
+        return _counts ? (*_counts)[value] : 0;
+    }
+
+    /**
+     * call f with every item counted, not only the top N
+     */
+    template <typename F>
+    void for_each_item(F &&f) const
+    {
+        if (!_counts) {
+            return;
+        }
+        for (size_t i = 0; i < N; ++i) {
+            if ((*_counts)[i]) {
+                f(static_cast<T>(i));
+            }
+        }
+    }
+
+    /**
+     * to_json which takes a formater to format the "name"
+     * @param j json object
+     * @param formatter std::function which takes a T as input (the type store it in top table) it needs to return a std::string
+     */
+    void to_json(json &j, std::function<std::string(const T &)> formatter) const
+    {
+        auto section = json::array();
+        auto items = _top_items();
+        for (uint64_t i = 0; i < items.size(); i++) {
+            section[i]["name"] = formatter(items[i].first);
+            section[i]["estimate"] = items[i].second;
+        }
+        name_json_assign(j, section);
+    }
+
+    void to_prometheus(std::stringstream &out, Metric::LabelMap add_labels, std::function<std::string(const T &)> formatter) const
+    {
+        LabelMap l(add_labels);
+        auto items = _top_items();
+        out << "# HELP " << base_name_snake() << ' ' << _info->desc << std::endl;
+        out << "# TYPE " << base_name_snake() << " gauge" << std::endl;
+        for (const auto &item : items) {
+            l[_item_key] = formatter(item.first);
+            out << name_snake({}, l) << ' ' << item.second << std::endl;
+        }
+    }
+
+    // Metric
+    void to_json(json &j) const override
+    {
+        auto section = json::array();
+        auto items = _top_items();
+        for (uint64_t i = 0; i < items.size(); i++) {
+            section[i]["name"] = items[i].first;
+            section[i]["estimate"] = items[i].second;
+        }
+        name_json_assign(j, section);
+    }
+
+    void to_prometheus(std::stringstream &out, Metric::LabelMap add_labels = {}) const override
+    {
+        LabelMap l(add_labels);
+        auto items = _top_items();
+        out << "# HELP " << base_name_snake() << ' ' << _info->desc << std::endl;
+        out << "# TYPE " << base_name_snake() << " gauge" << std::endl;
+        for (const auto &item : items) {
+            l[_item_key] = std::to_string(item.first);
+            out << name_snake({}, l) << ' ' << item.second << std::endl;
+        }
+    }
+};
+
 /**
  * A Cardinality metric class which knows how to render its output
  *
@@ -324,8 +602,8 @@ class Cardinality final : public Metric
     datasketches::cpc_sketch _set;
 
 public:
-    Cardinality(std::string schema_key, std::initializer_list<std::string> names, std::string desc)
-        : Metric(schema_key, names, std::move(desc))
+    Cardinality(std::string_view schema_key, std::initializer_list<std::string_view> names, std::string_view desc)
+        : Metric(schema_key, names, desc)
     {
     }
 
@@ -359,41 +637,119 @@ public:
  *
  * NOTE: this class _is_ thread safe, it _does not_ need an additional mutex
  */
+class Rate;
+
+/**
+ * drives all rates from a single thread. once a second it takes the counters of every live rate in one pass, then adds
+ * them to their quantiles one rate at a time. a rate holds a slot here while it is live, and cancelling it frees the slot
+ */
+class RateEngine
+{
+    // serializes ticks. adding and removing rates only takes _mutex, which a tick holds for one rate at a time
+    std::mutex _tick_mutex;
+    std::mutex _mutex;
+    std::vector<Rate *> _slots;
+    std::vector<size_t> _free_slots;
+    // the rates and counters taken by the last tick. removing a rate clears it from here
+    std::vector<Rate *> _ticked;
+    std::vector<uint64_t> _snapshot;
+
+    RateEngine();
+
+public:
+    static RateEngine &instance();
+
+    void add(Rate *rate);
+    void remove(Rate *rate);
+    bool running(const Rate *rate);
+
+    // one pass over all the rates, normally called by the engine thread
+    void tick();
+};
+
 class Rate final : public Metric
 {
+    friend class RateEngine;
+
     std::atomic_uint64_t _counter;
     std::atomic_uint64_t _rate;
     mutable std::shared_mutex _sketch_mutex;
     datasketches::kll_sketch<int_fast32_t> _quantile;
 
-    std::shared_ptr<timer::interval_handle> _timer_handle;
+    // the rate which counts the updates of this one, see count_into()
+    Rate *_sink{this};
+
+    static constexpr size_t NO_SLOT = SIZE_MAX;
+    // protected by the RateEngine mutex
+    size_t _slot{NO_SLOT};
+    // only touched by the thread which builds the rate, before it goes live
+    bool _started{false};
+
+    // see DeferStart
+    inline static thread_local std::vector<Rate *> *_deferred{nullptr};
 
-    void _start_timer()
+    void _start()
     {
-        // all rates use a single static timer object which holds its own thread
-        // the tick argument determines the granularity of job running and canceling
-        static timer timer_thread{100ms};
-        _timer_handle = timer_thread.set_interval(1s, [this] {
-            _rate.store(_counter.exchange(0));
-            // lock mutex for write
-            std::unique_lock lock(_sketch_mutex);
-            _quantile.update(_rate);
-        });
+        _started = true;
+        RateEngine::instance().add(this);
     }
 
 public:
-    Rate(std::string schema_key, std::initializer_list<std::string> names, std::string desc)
-        : Metric(schema_key, names, std::move(desc))
+    /**
+     * rates constructed on this thread while one of these is alive do not start, they are added to the given list to be
+     * start()ed later instead. used to build metrics ahead of the time they go live
+     */
+    class DeferStart
+    {
+        std::vector<Rate *> *_previous;
+
+    public:
+        explicit DeferStart(std::vector<Rate *> &rates)
+            : _previous(_deferred)
+        {
+            _deferred = &rates;
+        }
+
+        ~DeferStart()
+        {
+            _deferred = _previous;
+        }
+
+        DeferStart(const DeferStart &) = delete;
+        DeferStart &operator=(const DeferStart &) = delete;
+    };
+
+    Rate(std::string_view schema_key, std::initializer_list<std::string_view> names, std::string_view desc)
+        : Metric(schema_key, names, desc)
         , _counter(0)
         , _rate(0)
         , _quantile()
     {
-        _start_timer();
+        if (_deferred) {
+            _deferred->push_back(this);
+        } else {
+            _start();
+        }
     }
 
     ~Rate()
     {
-        _timer_handle->cancel();
+        RateEngine::instance().remove(this);
+    }
+
+    /**
+     * start a rate whose start was deferred, see DeferStart
+     */
+    void start()
+    {
+        if (!_started) {
+            _start();
+        }
+    }
+
+    bool running() const
+    {
+        return RateEngine::instance().running(this);
     }
 
     /**
@@ -403,20 +759,32 @@ public:
      */
     void cancel()
     {
-        _timer_handle->cancel();
+        RateEngine::instance().remove(this);
         _rate.store(0, std::memory_order_relaxed);
         _counter.store(0, std::memory_order_relaxed);
     }
 
+    /**
+     * count the updates of this rate into another one, so that several writers make up a single rate. this one never
+     * starts, its quantiles stay empty and its live rate zero. must be called before the first update, and the other
+     * rate must outlive the updates
+     */
+    void count_into(Rate &other)
+    {
+        RateEngine::instance().remove(this);
+        _started = true;
+        _sink = &other;
+    }
+
     Rate &operator++()
     {
-        _counter.fetch_add(1, std::memory_order_relaxed);
+        _sink->_counter.fetch_add(1, std::memory_order_relaxed);
         return *this;
     }
 
     void operator+=(uint64_t i)
     {
-        _counter.fetch_add(i, std::memory_order_relaxed);
+        _sink->_counter.fetch_add(i, std::memory_order_relaxed);
     }
 
     uint64_t rate() const
@@ -177,6 +177,15 @@ std::vector<Policy *> PolicyManager::load(const YAML::Node &policy_yaml)
             window_config.config_set<uint64_t>("deep_sample_rate", _default_deep_sample_rate);
         }
 
+        // Load Shedding
+        if (window_config.config_exists("cpu_budget")) {
+            try {
+                policy->set_load_shedder(std::make_unique<LoadShedder>(&window_config, [input_ptr] { return input_ptr->backlog(); }));
+            } catch (ConfigException &e) {
+                throw PolicyException(fmt::format("invalid stream handler window config: {}", e.what()));
+            }
+        }
+
         std::unique_ptr<Policy> input_resources_policy;
         Policy *input_res_policy_ptr{nullptr};
         std::unique_ptr<StreamHandler> resources_module;
@@ -273,6 +282,11 @@ std::vector<Policy *> PolicyManager::load(const YAML::Node &policy_yaml)
             handler_config.config_merge(handler_filter);
             handler_config.config_merge(window_config);
 
+            // the live bucket of a single writer handler is updated without locks, so only one capture thread may feed it
+            if (handler_config.config_exists("single_writer") && handler_config.config_get<bool>("single_writer") && input_ptr->capture_threads() > 1) {
+                throw PolicyException(fmt::format("single_writer on handler '{}' requires an input with one capture thread, not {}", handler_module_name, input_ptr->capture_threads()));
+            }
+
             std::unique_ptr<StreamHandler> handler_module;
             if (!handler_sequence || handler_modules.empty()) {
                 handler_module = handler_plugin->second->instantiate(policy_name + "-" + handler_module_name, input_ptr, &handler_config);
@@ -280,6 +294,9 @@ std::vector<Policy *> PolicyManager::load(const YAML::Node &policy_yaml)
                 // for sequence, use only previous handler
                 handler_module = handler_plugin->second->instantiate(policy_name + "-" + handler_module_name, nullptr, &handler_config, handler_modules.back().get());
             }
+            if (policy_ptr->load_shedder()) {
+                handler_module->set_load_shedder(policy_ptr->load_shedder());
+            }
             policy_ptr->add_module(handler_module.get());
             handler_modules.emplace_back(std::move(handler_module));
         }
@@ -395,6 +412,9 @@ void PolicyManager::remove_policy(const std::string &name)
 void Policy::info_json(json &j) const
 {
     _input_stream->info_json(j["input"][_input_stream->name()]);
+    if (_shedder) {
+        _shedder->to_json(j["load_shedding"]);
+    }
     for (auto &mod : _modules) {
         mod->info_json(j["modules"][mod->name()]);
     }
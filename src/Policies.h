@@ -9,6 +9,7 @@
 #include "Configurable.h"
 #include "HandlerModulePlugin.h"
 #include "InputModulePlugin.h"
+#include "LoadShedder.h"
 #include "Taps.h"
 #include <vector>
 #include <yaml-cpp/yaml.h>
@@ -34,6 +35,8 @@ class Policy : public AbstractRunnableModule
     bool _modules_sequence;
     InputStream *_input_stream;
     std::vector<AbstractRunnableModule *> _modules;
+    // only with a cpu_budget in the window config
+    std::unique_ptr<LoadShedder> _shedder;
 
 public:
     Policy(const std::string &name, Tap *tap, bool modules_sequence)
@@ -69,6 +72,16 @@ public:
         return _modules;
     }
 
+    void set_load_shedder(std::unique_ptr<LoadShedder> shedder)
+    {
+        _shedder = std::move(shedder);
+    }
+
+    LoadShedder *load_shedder() const
+    {
+        return _shedder.get();
+    }
+
     size_t get_handlers_list_size() const
     {
         if (_modules_sequence) {
@@ -6,6 +6,7 @@
 
 #include "AbstractMetricsManager.h"
 #include "AbstractModule.h"
+#include "LoadShedder.h"
 #include <fmt/ostream.h>
 #include <nlohmann/json.hpp>
 #include <sstream>
@@ -37,6 +38,11 @@ public:
     virtual size_t consumer_count() const = 0;
     virtual void window_json(json &j, uint64_t period, bool merged) = 0;
     virtual void window_prometheus(std::stringstream &out, Metric::LabelMap add_labels = {}) = 0;
+
+    /**
+     * follow the load shedding of the policy, see LoadShedder. the shedder outlives the handler
+     */
+    virtual void set_load_shedder(LoadShedder *shedder) = 0;
 };
 
 template <class MetricsManagerClass>
@@ -63,6 +69,10 @@ protected:
     std::unique_ptr<MetricsManagerClass> _metrics;
     std::bitset<GROUP_SIZE> _groups;
 
+    // set when the policy has a cpu budget. only handlers which time themselves have a probe
+    const LoadShedder *_shedder{nullptr};
+    LoadShedder::Probe *_shed_probe{nullptr};
+
     void process_groups(const GroupDefType &group_defs)
     {
 
@@ -86,28 +96,40 @@ protected:
         AbstractRunnableModule::common_info_json(j);
 
         j["metrics"]["deep_sample_rate"] = _metrics->deep_sample_rate();
+        j["metrics"]["deep_sample_mode"] = _metrics->deep_sample_mode() == DeepSampleMode::Flow ? "flow" : "random";
         j["metrics"]["periods_configured"] = _metrics->num_periods();
+        if (_shedder) {
+            j["metrics"]["load_shedding"]["cpu_budget"] = _shedder->cpu_budget();
+            j["metrics"]["load_shedding"]["sample_ratio"] = _shedder->sample_ratio();
+            j["metrics"]["load_shedding"]["deep_sample_rate"] = _metrics->effective_deep_sample_rate();
+            if (_shed_probe) {
+                j["metrics"]["load_shedding"]["cpu_usage"] = _shed_probe->cpu_usage();
+            }
+        }
 
         j["metrics"]["periods"] = json::array();
         for (auto i = 0UL; i < _metrics->current_periods(); ++i) {
+            // a single writer updates the live bucket without locks, so it is only read through a copy
+            auto snapshot = (i == 0 && _metrics->single_writer()) ? _metrics->live_bucket_snapshot() : nullptr;
+            auto bucket = snapshot ? snapshot.get() : _metrics->bucket(i);
             {
                 std::stringstream ssts;
-                time_t b_time_t = _metrics->bucket(i)->start_tstamp().tv_sec;
+                time_t b_time_t = bucket->start_tstamp().tv_sec;
                 ssts << std::put_time(std::gmtime(&b_time_t), "%Y-%m-%d %X");
                 j["metrics"]["periods"][i]["start_tstamp"] = ssts.str();
             }
-            if (_metrics->bucket(i)->read_only()) {
+            if (bucket->read_only()) {
                 std::stringstream ssts;
-                time_t b_time_t = _metrics->bucket(i)->end_tstamp().tv_sec;
+                time_t b_time_t = bucket->end_tstamp().tv_sec;
                 ssts << std::put_time(std::gmtime(&b_time_t), "%Y-%m-%d %X");
                 j["metrics"]["periods"][i]["end_tstamp"] = ssts.str();
             }
-            j["metrics"]["periods"][i]["read_only"] = _metrics->bucket(i)->read_only();
-            j["metrics"]["periods"][i]["length"] = _metrics->bucket(i)->period_length();
-            auto [num_events, num_samples, event_rate, event_lock] = _metrics->bucket(i)->event_data_locked();
+            j["metrics"]["periods"][i]["read_only"] = bucket->read_only();
+            j["metrics"]["periods"][i]["length"] = bucket->period_length();
+            auto [num_events, num_samples, event_rate, event_lock] = bucket->event_data_locked();
             num_events->to_json(j["metrics"]["periods"][i]["events"]);
             num_samples->to_json(j["metrics"]["periods"][i]["events"]);
-            event_rate->to_json(j["metrics"]["periods"][i]["events"]["rates"], !_metrics->bucket(i)->read_only());
+            event_rate->to_json(j["metrics"]["periods"][i]["events"]["rates"], !bucket->read_only());
         }
     }
 
@@ -139,6 +161,15 @@ public:
         } else {
             _metrics->window_single_prometheus(out, 0, add_labels);
         }
+        if (_shedder) {
+            _shedder->to_prometheus(out, schema_key(), add_labels);
+        }
+    }
+
+    void set_load_shedder(LoadShedder *shedder) override
+    {
+        _shedder = shedder;
+        _metrics->set_load_shedder(shedder);
     }
 
     void check_period_shift(timespec stamp)
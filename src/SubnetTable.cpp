@@ -0,0 +1,101 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "SubnetTable.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <iterator>
+#include <limits>
+
+namespace visor {
+
+static SubnetTable::Ipv6Int to_ipv6_int(const uint8_t *bytes)
+{
+    SubnetTable::Ipv6Int v{0, 0};
+    for (int i = 0; i < 8; ++i) {
+        v.hi = (v.hi << 8) | bytes[i];
+        v.lo = (v.lo << 8) | bytes[i + 8];
+    }
+    return v;
+}
+
+// sort the ranges and merge any which overlap or touch
+template <typename T, typename Next>
+static void normalize(std::vector<std::pair<T, T>> &ranges, Next is_next)
+{
+    std::sort(ranges.begin(), ranges.end());
+    size_t out{0};
+    for (size_t i = 1; i < ranges.size(); ++i) {
+        auto &cur = ranges[out];
+        if (ranges[i].first <= cur.second || is_next(cur.second, ranges[i].first)) {
+            if (cur.second < ranges[i].second) {
+                cur.second = ranges[i].second;
+            }
+        } else {
+            ranges[++out] = ranges[i];
+        }
+    }
+    if (!ranges.empty()) {
+        ranges.resize(out + 1);
+    }
+}
+
+template <typename T>
+static bool lookup(const std::vector<std::pair<T, T>> &ranges, const T &addr)
+{
+    // the last range starting at or before addr is the only one which may contain it
+    auto it = std::upper_bound(ranges.begin(), ranges.end(), addr, [](const T &a, const std::pair<T, T> &r) { return a < r.first; });
+    if (it == ranges.begin()) {
+        return false;
+    }
+    return addr <= std::prev(it)->second;
+}
+
+void SubnetTable::add(const in_addr &network, uint8_t prefix_len)
+{
+    if (prefix_len > 32) {
+        prefix_len = 32;
+    }
+    uint32_t mask = prefix_len ? std::numeric_limits<uint32_t>::max() << (32 - prefix_len) : 0;
+    uint32_t first = ntohl(network.s_addr) & mask;
+    _ipv4.emplace_back(first, first | ~mask);
+    normalize(_ipv4, [](uint32_t last, uint32_t next) { return last != std::numeric_limits<uint32_t>::max() && next == last + 1; });
+}
+
+void SubnetTable::add(const in6_addr &network, uint8_t prefix_len)
+{
+    if (prefix_len > 128) {
+        prefix_len = 128;
+    }
+    auto addr = to_ipv6_int(network.s6_addr);
+    constexpr auto ones = std::numeric_limits<uint64_t>::max();
+    Ipv6Int mask{0, 0};
+    if (prefix_len >= 64) {
+        mask.hi = ones;
+        mask.lo = (prefix_len == 64) ? 0 : ones << (128 - prefix_len);
+    } else if (prefix_len > 0) {
+        mask.hi = ones << (64 - prefix_len);
+    }
+    Ipv6Int first{addr.hi & mask.hi, addr.lo & mask.lo};
+    Ipv6Int last{first.hi | ~mask.hi, first.lo | ~mask.lo};
+    _ipv6.emplace_back(first, last);
+    normalize(_ipv6, [](const Ipv6Int &last, const Ipv6Int &next) {
+        if (last.lo != ones) {
+            return next.hi == last.hi && next.lo == last.lo + 1;
+        }
+        return last.hi != ones && next.hi == last.hi + 1 && next.lo == 0;
+    });
+}
+
+bool SubnetTable::match(uint32_t ipv4) const
+{
+    return lookup(_ipv4, ntohl(ipv4));
+}
+
+bool SubnetTable::match(const uint8_t *ipv6) const
+{
+    return lookup(_ipv6, to_ipv6_int(ipv6));
+}
+
+}
@@ -0,0 +1,75 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <cstdint>
+#include <netinet/in.h>
+#include <utility>
+#include <vector>
+
+namespace visor {
+
+/**
+ * A compiled set of IPv4 and IPv6 subnets, used to decide whether an address belongs to any of them (host_spec,
+ * only_hosts). prefixes are folded into sorted, non overlapping address ranges when added, so a lookup is a binary
+ * search over a contiguous array regardless of how many (possibly overlapping) prefixes were configured.
+ *
+ * adding is not thread safe, lookups are safe from any number of threads once the table is built.
+ */
+class SubnetTable
+{
+public:
+    // a 128 bit address in host byte order, compared as an unsigned integer
+    struct Ipv6Int {
+        uint64_t hi;
+        uint64_t lo;
+
+        bool operator<(const Ipv6Int &o) const
+        {
+            return hi < o.hi || (hi == o.hi && lo < o.lo);
+        }
+        bool operator<=(const Ipv6Int &o) const
+        {
+            return !(o < *this);
+        }
+    };
+
+private:
+    // inclusive [first, last] ranges, in host byte order, sorted and non overlapping
+    std::vector<std::pair<uint32_t, uint32_t>> _ipv4;
+    std::vector<std::pair<Ipv6Int, Ipv6Int>> _ipv6;
+
+public:
+    void add(const in_addr &network, uint8_t prefix_len);
+    void add(const in6_addr &network, uint8_t prefix_len);
+
+    /**
+     * @param ipv4 address in network byte order, as in in_addr::s_addr
+     */
+    bool match(uint32_t ipv4) const;
+
+    /**
+     * @param ipv6 16 byte address in network byte order, as in in6_addr::s6_addr
+     */
+    bool match(const uint8_t *ipv6) const;
+
+    bool ipv4_empty() const
+    {
+        return _ipv4.empty();
+    }
+
+    bool ipv6_empty() const
+    {
+        return _ipv6.empty();
+    }
+
+    void clear()
+    {
+        _ipv4.clear();
+        _ipv6.clear();
+    }
+};
+
+}
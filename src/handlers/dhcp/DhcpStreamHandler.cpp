@@ -179,9 +179,9 @@ void DhcpMetricsBucket::process_dhcp_layer(bool deep, pcpp::DhcpLayer *payload,
 void DhcpMetricsManager::process_dhcp_layer(pcpp::DhcpLayer *payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, uint32_t flowkey, uint16_t src_port, uint16_t dst_port, timespec stamp)
 {
     // base event
-    new_event(stamp);
+    auto deep = new_flow_event(stamp, flowkey);
     // process in the "live" bucket. this will parse the resources if we are deep sampling
-    live_bucket()->process_dhcp_layer(_deep_sampling_now, payload, l3, l4, src_port, dst_port);
+    live_bucket()->process_dhcp_layer(deep, payload, l3, l4, src_port, dst_port);
 }
 
 void DhcpMetricsManager::process_filtered(timespec stamp)
@@ -0,0 +1,208 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "DnsMessageView.h"
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VISOR_DNS_X86 1
+#endif
+
+namespace visor::handler::dns {
+
+static inline char ascii_lower(uint8_t c)
+{
+    return static_cast<char>((static_cast<uint8_t>(c - 'A') < 26) ? (c | 0x20) : c);
+}
+
+static void ascii_lower_copy_scalar(char *dst, const uint8_t *src, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] = ascii_lower(src[i]);
+    }
+}
+
+#ifdef VISOR_DNS_X86
+// bytes are compared signed, so shift 'A'..'Z' down to the bottom of the signed range and compare once
+static void ascii_lower_copy_sse2(char *dst, const uint8_t *src, size_t n)
+{
+    const auto shift = _mm_set1_epi8(static_cast<char>(0x80 - 'A'));
+    const auto limit = _mm_set1_epi8(static_cast<char>(0x80 + 26));
+    const auto bit = _mm_set1_epi8(0x20);
+    size_t i{0};
+    for (; i + 16 <= n; i += 16) {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        auto upper = _mm_cmplt_epi8(_mm_add_epi8(v, shift), limit);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_or_si128(v, _mm_and_si128(upper, bit)));
+    }
+    ascii_lower_copy_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void ascii_lower_copy_avx2(char *dst, const uint8_t *src, size_t n)
+{
+    const auto shift = _mm256_set1_epi8(static_cast<char>(0x80 - 'A'));
+    const auto limit = _mm256_set1_epi8(static_cast<char>(0x80 + 26));
+    const auto bit = _mm256_set1_epi8(0x20);
+    size_t i{0};
+    for (; i + 32 <= n; i += 32) {
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        // there is no signed less than, swap the operands of greater than
+        auto upper = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(v, shift));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_or_si256(v, _mm256_and_si256(upper, bit)));
+    }
+    ascii_lower_copy_sse2(dst + i, src + i, n - i);
+}
+#endif
+
+void ascii_lower_copy(char *dst, const uint8_t *src, size_t n)
+{
+#ifdef VISOR_DNS_X86
+    static const auto impl = __builtin_cpu_supports("avx2") ? ascii_lower_copy_avx2 : ascii_lower_copy_sse2;
+    impl(dst, src, n);
+#else
+    ascii_lower_copy_scalar(dst, src, n);
+#endif
+}
+
+bool DnsNameView::_read_labels(size_t pos, size_t &end)
+{
+    for (;;) {
+        if (pos >= _msg_len) {
+            return false;
+        }
+        size_t len = _msg[pos];
+        if (len == 0) {
+            ++_wire_size;
+            end = pos + 1;
+            return true;
+        }
+        if ((len & 0xc0) == 0xc0) {
+            if (pos + 1 >= _msg_len) {
+                return false;
+            }
+            _pointer = static_cast<uint16_t>(pos);
+            end = pos + 2;
+            return true;
+        }
+        if (len & 0xc0) {
+            // extended and reserved label types
+            return false;
+        }
+        // leave room for the root label
+        if (_wire_size + 1 + len + 1 > MAX_WIRE_SIZE || _count == MAX_LABELS) {
+            return false;
+        }
+        _wire_size = static_cast<uint16_t>(_wire_size + 1 + len);
+        _labels[_count++] = static_cast<uint16_t>(pos);
+        pos += 1 + len;
+    }
+}
+
+size_t DnsNameView::scan(const uint8_t *msg, size_t msg_len, size_t offset)
+{
+    _msg = msg;
+    _msg_len = msg_len;
+    _pointer = 0;
+    _lowest_jump = static_cast<uint16_t>(offset);
+    _wire_size = 0;
+    _count = 0;
+
+    size_t end{0};
+    _valid = _read_labels(offset, end);
+    if (!_valid) {
+        _pointer = 0;
+        return 0;
+    }
+    return end - offset;
+}
+
+void DnsNameView::_resolve()
+{
+    while (_pointer) {
+        size_t target = (_msg[_pointer] & 0x3f) << 8 | _msg[_pointer + 1];
+        _pointer = 0;
+        size_t end{0};
+        if (target < DnsMessageView::HEADER_SIZE || target >= _lowest_jump || !_read_labels(target, end)) {
+            _valid = false;
+            return;
+        }
+        _lowest_jump = static_cast<uint16_t>(target);
+    }
+}
+
+void DnsNameView::decode(DnsNameText &out, bool lower)
+{
+    _resolve();
+    out._size = 0;
+    out._count = 0;
+    if (!_valid) {
+        return;
+    }
+
+    // labels are contiguous on the wire up to a compression pointer. each run is copied in one go, after which the
+    // length bytes in it become the dots and give the label index
+    size_t pos{0};
+    for (size_t i = 0; i < _count;) {
+        size_t run_start = _labels[i];
+        size_t j = i;
+        size_t run_end = run_start + 1 + _msg[run_start];
+        while (j + 1 < _count && _labels[j + 1] == run_end) {
+            ++j;
+            run_end = _labels[j] + 1 + _msg[_labels[j]];
+        }
+
+        auto n = run_end - run_start - 1;
+        if (lower) {
+            ascii_lower_copy(out._text.data() + pos, _msg + run_start + 1, n);
+        } else {
+            std::memcpy(out._text.data() + pos, _msg + run_start + 1, n);
+        }
+        for (size_t k = i; k <= j; ++k) {
+            auto start = pos + _labels[k] - run_start;
+            out._label_start[k] = static_cast<uint8_t>(start);
+            if (k > i) {
+                out._text[start - 1] = '.';
+            }
+        }
+        pos += n;
+        i = j + 1;
+        if (i < _count) {
+            out._text[pos++] = '.';
+        }
+    }
+    out._size = static_cast<uint8_t>(pos);
+    out._count = _count;
+}
+
+bool DnsMessageView::parse(const uint8_t *data, size_t len)
+{
+    _data = data;
+    _len = len;
+    _well_formed = false;
+    _has_question = false;
+    _qname_decoded = false;
+    if (len < HEADER_SIZE) {
+        return false;
+    }
+
+    uint32_t records = question_count() + answer_count() + authority_count() + additional_count();
+    if (records > MAX_RECORDS) {
+        return true;
+    }
+    if (!question_count()) {
+        _well_formed = true;
+        return true;
+    }
+
+    auto name_size = _qname.scan(data, len, HEADER_SIZE);
+    if (!name_size || HEADER_SIZE + name_size + 2 * sizeof(uint16_t) > len) {
+        return true;
+    }
+    _qtype = _read16(HEADER_SIZE + name_size);
+    _qclass = _read16(HEADER_SIZE + name_size + sizeof(uint16_t));
+    _well_formed = _has_question = true;
+    return true;
+}
+
+}
@@ -0,0 +1,246 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace visor::handler::dns {
+
+/**
+ * copy n bytes from src to dst, lower casing ascii letters. vectorized with SSE2, or AVX2 where the cpu supports it
+ */
+void ascii_lower_copy(char *dst, const uint8_t *src, size_t n);
+
+/**
+ * The text of a domain name, with the position of each of its labels in it. fixed size, it is meant to live on the
+ * stack
+ */
+class DnsNameText
+{
+public:
+    // a name is at most 255 bytes on the wire, which leaves room for at most 127 labels and 253 bytes of text
+    static constexpr size_t MAX_WIRE_SIZE = 255;
+    static constexpr size_t MAX_LABELS = 127;
+
+private:
+    friend class DnsNameView;
+
+    std::array<char, MAX_WIRE_SIZE> _text;
+    std::array<uint8_t, MAX_LABELS> _label_start;
+    uint8_t _size{0};
+    uint8_t _count{0};
+
+public:
+    // dot separated labels without the trailing dot, the root being empty
+    std::string_view str() const
+    {
+        return std::string_view(_text.data(), _size);
+    }
+
+    size_t label_count() const
+    {
+        return _count;
+    }
+
+    // offset of label i in str(). the dot separating it from the label before is right in front of it
+    size_t label_start(size_t i) const
+    {
+        return _label_start[i];
+    }
+
+    // the last n labels, or the whole name if it has no more than n
+    std::string_view suffix(size_t labels) const
+    {
+        if (labels >= _count) {
+            return str();
+        }
+        return str().substr(_label_start[_count - labels]);
+    }
+};
+
+/**
+ * A domain name inside a DNS message in wire format, kept as the offsets of its labels in the message. labels reached
+ * through compression pointers are only looked up when the name is first read. nothing is allocated or copied, the
+ * message must outlive the view
+ */
+class DnsNameView
+{
+public:
+    static constexpr size_t MAX_WIRE_SIZE = DnsNameText::MAX_WIRE_SIZE;
+    static constexpr size_t MAX_LABELS = DnsNameText::MAX_LABELS;
+
+private:
+    const uint8_t *_msg{nullptr};
+    size_t _msg_len{0};
+    // offset of the compression pointer still to be followed, 0 if there is none
+    uint16_t _pointer{0};
+    // the lowest offset jumped to so far. pointers must go strictly backwards from there, which rules out loops
+    uint16_t _lowest_jump{0};
+    uint16_t _wire_size{0};
+    uint8_t _count{0};
+    bool _valid{false};
+    std::array<uint16_t, MAX_LABELS> _labels;
+
+    bool _read_labels(size_t pos, size_t &end);
+    void _resolve();
+
+public:
+    /**
+     * read the labels of the name starting at offset in msg, up to its end or its first compression pointer
+     * @return the size of the name at offset, as it appears there on the wire, or 0 if it is malformed
+     */
+    size_t scan(const uint8_t *msg, size_t msg_len, size_t offset);
+
+    // false if the name is malformed, including through its compression pointers. malformed names decode as empty
+    bool valid()
+    {
+        _resolve();
+        return _valid;
+    }
+
+    size_t label_count()
+    {
+        _resolve();
+        return _count;
+    }
+
+    std::string_view label(size_t i)
+    {
+        _resolve();
+        return std::string_view(reinterpret_cast<const char *>(_msg) + _labels[i] + 1, _msg[_labels[i]]);
+    }
+
+    /**
+     * write the text of the name and its label index to out, lower casing ascii letters if lower is set
+     */
+    void decode(DnsNameText &out, bool lower = false);
+};
+
+/**
+ * A read only view of a DNS message in wire format. parsing validates the header and the first question in a single
+ * pass without allocating, the rest of the message is not looked at. the message must outlive the view
+ */
+class DnsMessageView
+{
+public:
+    static constexpr size_t HEADER_SIZE = 12;
+    // a message claiming more records than this is considered malformed
+    static constexpr uint32_t MAX_RECORDS = 100;
+
+private:
+    const uint8_t *_data{nullptr};
+    size_t _len{0};
+    bool _well_formed{false};
+    bool _has_question{false};
+    uint16_t _qtype{0};
+    uint16_t _qclass{0};
+    DnsNameView _qname;
+    bool _qname_decoded{false};
+    DnsNameText _qname_lower;
+
+    uint16_t _read16(size_t offset) const
+    {
+        return static_cast<uint16_t>(_data[offset] << 8 | _data[offset + 1]);
+    }
+
+public:
+    /**
+     * @return false if len is too short for a DNS header, in which case the view must not be used
+     */
+    bool parse(const uint8_t *data, size_t len);
+
+    const uint8_t *data() const
+    {
+        return _data;
+    }
+
+    size_t size() const
+    {
+        return _len;
+    }
+
+    uint16_t id() const
+    {
+        return _read16(0);
+    }
+
+    bool is_response() const
+    {
+        return _data[2] & 0x80;
+    }
+
+    uint8_t opcode() const
+    {
+        return static_cast<uint8_t>((_data[2] >> 3) & 0x0f);
+    }
+
+    uint8_t rcode() const
+    {
+        return static_cast<uint8_t>(_data[3] & 0x0f);
+    }
+
+    uint16_t question_count() const
+    {
+        return _read16(4);
+    }
+
+    uint16_t answer_count() const
+    {
+        return _read16(6);
+    }
+
+    uint16_t authority_count() const
+    {
+        return _read16(8);
+    }
+
+    uint16_t additional_count() const
+    {
+        return _read16(10);
+    }
+
+    // false if the record counts are implausible or the first question runs past the end of the message
+    bool well_formed() const
+    {
+        return _well_formed;
+    }
+
+    // a first question is present and well formed, up to its name's compression pointers which are followed lazily.
+    // only then may the accessors below be used
+    bool has_question() const
+    {
+        return _has_question;
+    }
+
+    DnsNameView &qname()
+    {
+        return _qname;
+    }
+
+    // the lower cased question name, decoded on first use and shared by everything looking at this message
+    const DnsNameText &qname_lower()
+    {
+        if (!_qname_decoded) {
+            _qname.decode(_qname_lower, true);
+            _qname_decoded = true;
+        }
+        return _qname_lower;
+    }
+
+    uint16_t qtype() const
+    {
+        return _qtype;
+    }
+
+    uint16_t qclass() const
+    {
+        return _qclass;
+    }
+};
+
+}
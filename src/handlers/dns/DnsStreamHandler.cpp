@@ -20,7 +20,6 @@
 
 namespace visor::handler::dns {
 
-thread_local DnsStreamHandler::DnsCacheData DnsStreamHandler::_cached_dns_layer;
 
 DnsStreamHandler::DnsStreamHandler(const std::string &name, InputStream *stream, const Configurable *window_config, StreamHandler *handler)
     : visor::StreamMetricsHandler<DnsMetricsManager>(name, window_config)
@@ -72,16 +71,16 @@ void DnsStreamHandler::start()
     }
     if (config_exists("only_qname_suffix")) {
         _f_enabled.set(Filters::OnlyQNameSuffix);
+        _f_qnames.clear();
         for (const auto &qname : config_get<StringList>("only_qname_suffix")) {
-            // note, this currently copies the strings, meaning there could be a big list that is duplicated
-            // we can work on trying to make this a string_view instead
-            // we copy it out so that we don't have to hit the config mutex
-            std::string qname_ci{qname};
-            std::transform(qname_ci.begin(), qname_ci.end(), qname_ci.begin(),
-                [](unsigned char c) { return std::tolower(c); });
-            _f_qnames.emplace_back(std::move(qname_ci));
+            // compiled into a suffix table once, so matching does not depend on the size of the list
+            _f_qnames.add(qname);
         }
     }
+    if (config_exists("xact_max_open")) {
+        // 0 means no limit
+        _metrics->set_max_open_transactions(config_get<uint64_t>("xact_max_open"));
+    }
     if (config_exists("dnstap_msg_type")) {
         auto type = config_get<std::string>("dnstap_msg_type");
         try {
@@ -103,7 +102,8 @@ void DnsStreamHandler::start()
     }
 
     if (_pcap_stream) {
-        _pkt_udp_connection = _pcap_stream->udp_signal.connect(&DnsStreamHandler::process_udp_packet_cb, this);
+        _tcp_connections.resize(_pcap_stream->capture_threads());
+        _pkt_udp_connection = _pcap_stream->packet_batch_signal.connect(&DnsStreamHandler::process_batch_cb, this);
         _start_tstamp_connection = _pcap_stream->start_tstamp_signal.connect(&DnsStreamHandler::set_start_tstamp, this);
         _end_tstamp_connection = _pcap_stream->end_tstamp_signal.connect(&DnsStreamHandler::set_end_tstamp, this);
         _tcp_start_connection = _pcap_stream->tcp_connection_start_signal.connect(&DnsStreamHandler::tcp_connection_start_cb, this);
@@ -142,92 +142,71 @@ void DnsStreamHandler::stop()
 // callback from input module
 void DnsStreamHandler::process_dnstap_cb(const dnstap::Dnstap &d, [[maybe_unused]] size_t size)
 {
+    LoadShedder::Timer timer(_shed_probe);
+    uint32_t weight{1};
+    if (_shedder && !(weight = _shedder->admit(dnstap_sample_key(d)))) {
+        return;
+    }
     if (_f_enabled[Filters::DnstapMsgType] && !_f_dnstap_types[d.message().type()]) {
-        _metrics->process_dnstap(d, true);
+        _metrics->process_dnstap(d, true, weight);
     } else {
-        _metrics->process_dnstap(d, false);
+        _metrics->process_dnstap(d, false, weight);
     }
 }
 
 // callback from input module
-void DnsStreamHandler::process_udp_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, uint32_t flowkey, timespec stamp)
+void DnsStreamHandler::process_batch_cb(const PacketBatch &batch)
 {
-    pcpp::UdpLayer *udpLayer = payload.getLayerOfType<pcpp::UdpLayer>();
-    assert(udpLayer);
-
-    uint16_t metric_port{0};
-    auto dst_port = ntohs(udpLayer->getUdpHeader()->portDst);
-    auto src_port = ntohs(udpLayer->getUdpHeader()->portSrc);
-    // note we want to capture metrics only when one of the ports is dns,
-    // but metrics on the port which is _not_ the dns port
-    if (DnsLayer::isDnsPort(dst_port)) {
-        metric_port = src_port;
-    } else if (DnsLayer::isDnsPort(src_port)) {
-        metric_port = dst_port;
-    }
-    if (metric_port) {
-        if (flowkey != _cached_dns_layer.flowKey || stamp.tv_sec != _cached_dns_layer.timestamp.tv_sec || stamp.tv_nsec != _cached_dns_layer.timestamp.tv_nsec) {
-            _cached_dns_layer.flowKey = flowkey;
-            _cached_dns_layer.timestamp = stamp;
-            _cached_dns_layer.dnsLayer = std::make_unique<DnsLayer>(udpLayer, &payload);
-        }
-        auto dnsLayer = _cached_dns_layer.dnsLayer.get();
-        if (!_filtering(*dnsLayer, dir, l3, pcpp::UDP, metric_port, stamp)) {
-            _metrics->process_dns_layer(*dnsLayer, dir, l3, pcpp::UDP, flowkey, metric_port, _static_suffix_size, stamp);
-            _static_suffix_size = 0;
-            // signal for chained stream handlers, if we have any
-            udp_signal(payload, dir, l3, flowkey, stamp);
+    LoadShedder::Timer timer(_shed_probe);
+    for (const auto &packet : batch) {
+        if (packet.view.l4 == pcpp::UDP) {
+            process_udp_packet_cb(packet.view, packet.dir, packet.stamp);
         }
     }
 }
 
-void TcpSessionData::receive_dns_wire_data(const uint8_t *data, size_t len)
+void DnsStreamHandler::process_udp_packet_cb(const PacketView &payload, PacketDirection dir, timespec stamp)
 {
-    if (_invalid_data) {
-        return;
+    uint16_t metric_port{0};
+    // note we want to capture metrics only when one of the ports is dns,
+    // but metrics on the port which is _not_ the dns port
+    if (DnsLayer::isDnsPort(payload.dst_port)) {
+        metric_port = payload.src_port;
+    } else if (DnsLayer::isDnsPort(payload.src_port)) {
+        metric_port = payload.dst_port;
     }
-
-    _buffer.append(reinterpret_cast<const char *>(data), len);
-
-    for (;;) {
-        std::uint16_t size;
-
-        // if buffer size < min DNS size, we know we need more data
-        if (_buffer.size() < MIN_DNS_QUERY_SIZE + sizeof(size)) {
-            break;
+    if (metric_port) {
+        uint32_t weight{1};
+        if (_shedder && !(weight = _shedder->admit(payload.sample_key))) {
+            // shed before parsing, a packet which is kept stands for it
+            return;
         }
-
-        // dns packet size is in network byte order.
-        size = static_cast<unsigned char>(_buffer[1]) | static_cast<unsigned char>(_buffer[0]) << 8;
-
-        // if size is less than MIN_DNS_QUERY_SIZE, it is not a dns packet
-        if (size < MIN_DNS_QUERY_SIZE) {
-            _buffer.clear();
-            _invalid_data = true;
-            break;
+        DnsMessageView dns;
+        if (!dns.parse(payload.payload(), payload.payload_len)) {
+            // too short to be dns
+            return;
         }
-
-        if (_buffer.size() >= sizeof(size) + size) {
-            auto data = std::make_unique<uint8_t[]>(size);
-            std::memcpy(data.get(), _buffer.data() + sizeof(size), size);
-            _buffer.erase(0, sizeof(size) + size);
-            _got_dns_msg(std::move(data), size);
-        } else {
-            // Nope, we need more data.
-            break;
+        size_t suffix_size{0};
+        if (!_filtering(dns, dir, payload.l3, pcpp::UDP, metric_port, stamp, suffix_size, weight)) {
+            _metrics->process_dns_layer(dns, dir, payload.l3, pcpp::UDP, payload.flow_key, payload.sample_key, metric_port, suffix_size, stamp, weight);
+            // signal for chained stream handlers, if we have any
+            udp_signal(payload, dir, stamp);
         }
     }
 }
 
-void DnsStreamHandler::tcp_message_ready_cb(int8_t side, const pcpp::TcpStreamData &tcpData)
+void DnsStreamHandler::tcp_message_ready_cb(int8_t side, const pcpp::TcpStreamData &tcpData, uint32_t flow_key)
 {
+    LoadShedder::Timer timer(_shed_probe);
     auto flowKey = tcpData.getConnectionData().flowKey;
+    // NOT bounds checked, workers are numbered [0, capture_threads())
+    auto &connections = _tcp_connections[worker_shard_id];
 
     // check if this flow already appears in the connection manager. If not add it
-    auto iter = _tcp_connections.find(flowKey);
+    auto iter = connections.find(flowKey);
 
     // if not tracking connection, and it's DNS, then start tracking.
-    if (iter == _tcp_connections.end()) {
+    if (iter == connections.end()) {
         // note we want to capture metrics only when one of the ports is dns,
         // but metrics on the port which is _not_ the dns port
         uint16_t metric_port{0};
@@ -237,44 +216,45 @@ void DnsStreamHandler::tcp_message_ready_cb(int8_t side, const pcpp::TcpStreamDa
             metric_port = tcpData.getConnectionData().dstPort;
         }
         if (metric_port) {
-            _tcp_connections.emplace(flowKey, TcpFlowData(tcpData.getConnectionData().srcIP.getType() == pcpp::IPAddress::IPv4AddressType, metric_port));
-            iter = _tcp_connections.find(tcpData.getConnectionData().flowKey);
+            iter = connections.emplace(flowKey, TcpFlowData(tcpData.getConnectionData().srcIP.getType() == pcpp::IPAddress::IPv4AddressType, metric_port)).first;
         } else {
             // not tracking
             return;
         }
     }
 
-    pcpp::ProtocolType l3Type{iter->second.l3Type};
-    auto port{iter->second.port};
+    auto &flow = iter->second;
+    pcpp::ProtocolType l3Type{flow.l3Type};
+    auto port{flow.port};
     timespec stamp{0, 0};
     // for tcp, endTime is updated by pcpp to represent the time stamp from the latest packet in the stream
     TIMEVAL_TO_TIMESPEC(&tcpData.getConnectionData().endTime, &stamp);
     auto dir = (side == 0) ? PacketDirection::fromHost : PacketDirection::toHost;
-
-    auto got_dns_message = [this, port, dir, l3Type, flowKey, stamp](std::unique_ptr<uint8_t[]> data, size_t size) {
-        // this dummy packet prevents DnsLayer from owning and trying to free the data. it is otherwise unused by the DNS layer,
-        // instead using the packet meta data we pass in
-        pcpp::Packet dummy_packet;
-        DnsLayer dnsLayer(data.get(), size, nullptr, &dummy_packet);
-        if (!_filtering(dnsLayer, dir, l3Type, pcpp::UDP, port, stamp)) {
-            _metrics->process_dns_layer(dnsLayer, dir, l3Type, pcpp::TCP, flowKey, port, _static_suffix_size, stamp);
-            _static_suffix_size = 0;
+    // messages are sampled and shed by their connection, as the net handler does with its packets
+    auto sample_key = tcp_sample_key(flow_key);
+
+    flow.sessionData[side].receive_dns_wire_data(tcpData.getData(), tcpData.getDataLength(), [&](const uint8_t *data, size_t size) {
+        // the framing guarantees at least a dns header
+        DnsMessageView dns;
+        dns.parse(data, size);
+        uint32_t weight{1};
+        if (_shedder && !(weight = _shedder->admit(sample_key))) {
+            return;
         }
-        // data is freed upon return
-    };
-
-    if (!iter->second.sessionData[side]) {
-        iter->second.sessionData[side] = std::make_unique<TcpSessionData>(got_dns_message);
-    }
-
-    iter->second.sessionData[side]->receive_dns_wire_data(tcpData.getData(), tcpData.getDataLength());
+        size_t suffix_size{0};
+        if (!_filtering(dns, dir, l3Type, pcpp::UDP, port, stamp, suffix_size, weight)) {
+            _metrics->process_dns_layer(dns, dir, l3Type, pcpp::TCP, flow_key, sample_key, port, suffix_size, stamp, weight);
+        }
+    });
 }
 
 void DnsStreamHandler::tcp_connection_start_cb(const pcpp::ConnectionData &connectionData)
 {
+    // NOT bounds checked, workers are numbered [0, capture_threads())
+    auto &connections = _tcp_connections[worker_shard_id];
+
     // look for the connection
-    auto iter = _tcp_connections.find(connectionData.flowKey);
+    auto iter = connections.find(connectionData.flowKey);
 
     // note we want to capture metrics only when one of the ports is dns,
     // but metrics on the port which is _not_ the dns port
@@ -284,24 +264,27 @@ void DnsStreamHandler::tcp_connection_start_cb(const pcpp::ConnectionData &conne
     } else if (DnsLayer::isDnsPort(connectionData.srcPort)) {
         metric_port = connectionData.dstPort;
     }
-    if (iter == _tcp_connections.end() && metric_port) {
+    if (iter == connections.end() && metric_port) {
         // add it to the connections
-        _tcp_connections.emplace(connectionData.flowKey, TcpFlowData(connectionData.srcIP.getType() == pcpp::IPAddress::IPv4AddressType, metric_port));
+        connections.emplace(connectionData.flowKey, TcpFlowData(connectionData.srcIP.getType() == pcpp::IPAddress::IPv4AddressType, metric_port));
     }
 }
 
 void DnsStreamHandler::tcp_connection_end_cb(const pcpp::ConnectionData &connectionData, [[maybe_unused]] pcpp::TcpReassembly::ConnectionEndReason reason)
 {
+    // NOT bounds checked, workers are numbered [0, capture_threads())
+    auto &connections = _tcp_connections[worker_shard_id];
+
     // find the connection in the connections by the flow key
-    auto iter = _tcp_connections.find(connectionData.flowKey);
+    auto iter = connections.find(connectionData.flowKey);
 
     // connection wasn't found, we didn't track
-    if (iter == _tcp_connections.end()) {
+    if (iter == connections.end()) {
         return;
     }
 
     // remove the connection from the connection manager
-    _tcp_connections.erase(iter);
+    connections.erase(iter);
 }
 void DnsStreamHandler::set_start_tstamp(timespec stamp)
 {
@@ -316,36 +299,26 @@ void DnsStreamHandler::info_json(json &j) const
     common_info_json(j);
     j[schema_key()]["xact"]["open"] = _metrics->num_open_transactions();
 }
-static inline bool endsWith(std::string_view str, std::string_view suffix)
-{
-    return str.size() >= suffix.size() && 0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
-}
-bool DnsStreamHandler::_filtering(DnsLayer &payload, [[maybe_unused]] PacketDirection dir, [[maybe_unused]] pcpp::ProtocolType l3, [[maybe_unused]] pcpp::ProtocolType l4, [[maybe_unused]] uint16_t port, timespec stamp)
+bool DnsStreamHandler::_filtering(DnsMessageView &payload, [[maybe_unused]] PacketDirection dir, [[maybe_unused]] pcpp::ProtocolType l3, [[maybe_unused]] pcpp::ProtocolType l4, [[maybe_unused]] uint16_t port, timespec stamp, size_t &suffix_size, uint32_t weight)
 {
-    if (_f_enabled[Filters::ExcludingRCode] && payload.getDnsHeader()->responseCode == _f_rcode) {
+    if (_f_enabled[Filters::ExcludingRCode] && payload.rcode() == _f_rcode) {
         goto will_filter;
-    } else if (_f_enabled[Filters::OnlyRCode] && payload.getDnsHeader()->responseCode != _f_rcode) {
+    } else if (_f_enabled[Filters::OnlyRCode] && payload.rcode() != _f_rcode) {
         goto will_filter;
     }
     if (_f_enabled[Filters::OnlyQNameSuffix]) {
-        if (!payload.parseResources(true) || payload.getFirstQuery() == nullptr) {
+        if (!payload.has_question()) {
             goto will_filter;
         }
-        std::string_view qname_ci = payload.getFirstQuery()->getNameLower();
-        for (const auto &fqn : _f_qnames) {
-            // if it matched, we know we are not filtering
-            if (endsWith(qname_ci, fqn)) {
-                _static_suffix_size = fqn.size();
-                goto will_not_filter;
-            }
+        auto match = _f_qnames.match(payload.qname_lower());
+        if (!match) {
+            goto will_filter;
         }
-        // checked the whole list and none of them matched: filter
-        goto will_filter;
+        suffix_size = match->suffix_size;
     }
-will_not_filter:
     return false;
 will_filter:
-    _metrics->process_filtered(stamp);
+    _metrics->process_filtered(stamp, weight);
     return true;
 }
 
@@ -377,6 +350,7 @@ void DnsMetricsBucket::specialized_merge(const AbstractMetricsBucket &o)
         _counters.xacts_in += other._counters.xacts_in;
         _counters.xacts_out += other._counters.xacts_out;
         _counters.xacts_timed_out += other._counters.xacts_timed_out;
+        _counters.xacts_evicted += other._counters.xacts_evicted;
 
         _dnsXactFromTimeUs.merge(other._dnsXactFromTimeUs);
         _dnsXactToTimeUs.merge(other._dnsXactToTimeUs);
@@ -399,6 +373,26 @@ void DnsMetricsBucket::specialized_merge(const AbstractMetricsBucket &o)
     _dns_topUDPPort.merge(other._dns_topUDPPort);
     _dns_topQType.merge(other._dns_topQType);
     _dns_topRCode.merge(other._dns_topRCode);
+
+    // hold on to the names of the ids merged in, the other bucket may prune or go away before this one is rendered
+    if (other._qname_refs.table()) {
+        _qname_refs.set_table(other._qname_refs.table());
+        other._for_each_qname_id([this](const uint64_t &id) { _qname_refs.retain(id); });
+    }
+}
+
+void DnsMetricsBucket::_prune_qnames()
+{
+    robin_hood::unordered_flat_set<uint64_t> in_use;
+    _for_each_qname_id([&in_use](const uint64_t &id) { in_use.insert(id); });
+    _qname_refs.prune([&in_use](uint64_t id) { return in_use.count(id) > 0; });
+}
+
+void DnsMetricsBucket::on_set_read_only()
+{
+    // nothing is added to a read only bucket anymore, only keep the names it can render
+    std::unique_lock lock(_mutex);
+    _prune_qnames();
 }
 
 void DnsMetricsBucket::to_json(json &j) const
@@ -416,6 +410,8 @@ void DnsMetricsBucket::to_json(json &j) const
 
     std::shared_lock r_lock(_mutex);
 
+    auto qname = [this](const uint64_t &id) { return _qname_refs.name(id); };
+
     if (group_enabled(group::DnsMetrics::Counters)) {
         _counters.queries.to_json(j);
         _counters.replies.to_json(j);
@@ -438,25 +434,26 @@ void DnsMetricsBucket::to_json(json &j) const
     if (group_enabled(group::DnsMetrics::DnsTransactions)) {
         _counters.xacts_total.to_json(j);
         _counters.xacts_timed_out.to_json(j);
+        _counters.xacts_evicted.to_json(j);
 
         _counters.xacts_in.to_json(j);
-        _dns_slowXactIn.to_json(j);
+        _dns_slowXactIn.to_json(j, qname);
 
         _dnsXactFromTimeUs.to_json(j);
         _dnsXactToTimeUs.to_json(j);
 
         _counters.xacts_out.to_json(j);
-        _dns_slowXactOut.to_json(j);
+        _dns_slowXactOut.to_json(j, qname);
     }
 
     _dns_topUDPPort.to_json(j, [](const uint16_t &val) { return std::to_string(val); });
 
     if (group_enabled(group::DnsMetrics::TopQnames)) {
-        _dns_topQname2.to_json(j);
-        _dns_topQname3.to_json(j);
-        _dns_topNX.to_json(j);
-        _dns_topREFUSED.to_json(j);
-        _dns_topSRVFAIL.to_json(j);
+        _dns_topQname2.to_json(j, qname);
+        _dns_topQname3.to_json(j, qname);
+        _dns_topNX.to_json(j, qname);
+        _dns_topREFUSED.to_json(j, qname);
+        _dns_topSRVFAIL.to_json(j, qname);
     }
     _dns_topRCode.to_json(j, [](const uint16_t &val) {
         if (RCodeNames.find(val) != RCodeNames.end()) {
@@ -475,9 +472,9 @@ void DnsMetricsBucket::to_json(json &j) const
 }
 
 // the main bucket analysis
-void DnsMetricsBucket::process_dnstap(bool deep, const dnstap::Dnstap &payload)
+void DnsMetricsBucket::process_dnstap(bool deep, const dnstap::Dnstap &payload, const std::shared_ptr<QnameTable> &qnames, uint32_t weight)
 {
-    std::unique_lock lock(_mutex);
+    auto lock = write_lock(_mutex);
 
     pcpp::ProtocolType l3;
     if (payload.message().has_socket_family()) {
@@ -519,7 +516,7 @@ void DnsMetricsBucket::process_dnstap(bool deep, const dnstap::Dnstap &payload)
     }
 
     if (!deep || (!payload.message().has_query_message() && !payload.message().has_response_message())) {
-        process_dns_layer(l3, l4, side, 0);
+        process_dns_layer(l3, l4, side, 0, weight);
         return;
     }
 
@@ -528,70 +525,69 @@ void DnsMetricsBucket::process_dnstap(bool deep, const dnstap::Dnstap &payload)
         port = payload.message().query_port();
     }
 
+    const std::string *wire{nullptr};
     if (side == QR::query && payload.message().has_query_message()) {
-        auto query = payload.message().query_message();
-        uint8_t *buf = new uint8_t[query.size()];
-        std::memcpy(buf, query.c_str(), query.size());
-        // DnsLayer takes ownership of buf
-        DnsLayer dpayload(buf, query.size(), nullptr, nullptr);
-        lock.unlock();
-        process_dns_layer(deep, dpayload, l3, l4, port);
+        wire = &payload.message().query_message();
     } else if (side == QR::response && payload.message().has_response_message()) {
-        auto query = payload.message().response_message();
-        uint8_t *buf = new uint8_t[query.size()];
-        std::memcpy(buf, query.c_str(), query.size());
-        // DnsLayer takes ownership of buf
-        DnsLayer dpayload(buf, query.size(), nullptr, nullptr);
+        wire = &payload.message().response_message();
+    }
+    if (wire) {
+        // the view points into the protobuf message, which outlives this call
+        DnsMessageView dpayload;
         lock.unlock();
-        process_dns_layer(deep, dpayload, l3, l4, port);
+        if (dpayload.parse(reinterpret_cast<const uint8_t *>(wire->data()), wire->size())) {
+            process_dns_layer(deep, dpayload, l3, l4, port, qnames, 0, weight);
+        } else {
+            process_dns_layer(l3, l4, side, port, weight);
+        }
     }
 }
-void DnsMetricsBucket::process_dns_layer(bool deep, DnsLayer &payload, pcpp::ProtocolType l3, Protocol l4, uint16_t port, size_t suffix_size)
+void DnsMetricsBucket::process_dns_layer(bool deep, DnsMessageView &payload, pcpp::ProtocolType l3, Protocol l4, uint16_t port, const std::shared_ptr<QnameTable> &qnames, size_t suffix_size, uint32_t weight)
 {
-    std::unique_lock lock(_mutex);
+    auto lock = write_lock(_mutex);
 
     if (group_enabled(group::DnsMetrics::Counters)) {
         if (l3 == pcpp::IPv6) {
-            ++_counters.IPv6;
+            _counters.IPv6 += weight;
         } else if (l3 == pcpp::IPv4) {
-            ++_counters.IPv4;
+            _counters.IPv4 += weight;
         }
 
         switch (l4) {
         case DNSTAP_UDP:
         case PCPP_UDP:
-            ++_counters.UDP;
+            _counters.UDP += weight;
             break;
         case DNSTAP_TCP:
         case PCPP_TCP:
-            ++_counters.TCP;
+            _counters.TCP += weight;
             break;
         case DNSTAP_DOT:
-            ++_counters.DOT;
+            _counters.DOT += weight;
             break;
         case DNSTAP_DOH:
-            ++_counters.DOH;
+            _counters.DOH += weight;
             break;
         }
 
-        if (payload.getDnsHeader()->queryOrResponse == QR::response) {
-            ++_counters.replies;
-            switch (payload.getDnsHeader()->responseCode) {
+        if (payload.is_response()) {
+            _counters.replies += weight;
+            switch (payload.rcode()) {
             case NoError:
-                ++_counters.NOERROR;
+                _counters.NOERROR += weight;
                 break;
             case SrvFail:
-                ++_counters.SRVFAIL;
+                _counters.SRVFAIL += weight;
                 break;
             case NXDomain:
-                ++_counters.NX;
+                _counters.NX += weight;
                 break;
             case Refused:
-                ++_counters.REFUSED;
+                _counters.REFUSED += weight;
                 break;
             }
         } else {
-            ++_counters.queries;
+            _counters.queries += weight;
         }
     }
 
@@ -603,82 +599,86 @@ void DnsMetricsBucket::process_dns_layer(bool deep, DnsLayer &payload, pcpp::Pro
         _dns_topUDPPort.update(port);
     }
 
-    auto success = payload.parseResources(true);
-    if (!success) {
+    if (!payload.well_formed()) {
         return;
     }
 
-    if (payload.getDnsHeader()->queryOrResponse == response) {
-        _dns_topRCode.update(payload.getDnsHeader()->responseCode);
+    if (payload.is_response()) {
+        _dns_topRCode.update(payload.rcode());
     }
 
-    auto query = payload.getFirstQuery();
-    if (query) {
+    if (payload.has_question()) {
 
-        auto name = query->getNameLower();
+        _qname_refs.set_table(qnames);
+        const auto &qname = payload.qname_lower();
+        auto name = qname.str();
 
         if (group_enabled(group::DnsMetrics::Cardinality)) {
-            _dns_qnameCard.update(name);
+            _dns_qnameCard.update(name.data(), static_cast<int>(name.size()));
         }
 
-        _dns_topQType.update(query->getDnsType());
+        _dns_topQType.update(payload.qtype());
 
         if (group_enabled(group::DnsMetrics::TopQnames)) {
-            if (payload.getDnsHeader()->queryOrResponse == response) {
-                switch (payload.getDnsHeader()->responseCode) {
+            if (payload.is_response()) {
+                switch (payload.rcode()) {
                 case SrvFail:
-                    _dns_topSRVFAIL.update(name);
+                    _dns_topSRVFAIL.update(_qname_refs.intern(name));
                     break;
                 case NXDomain:
-                    _dns_topNX.update(name);
+                    _dns_topNX.update(_qname_refs.intern(name));
                     break;
                 case Refused:
-                    _dns_topREFUSED.update(name);
+                    _dns_topREFUSED.update(_qname_refs.intern(name));
                     break;
                 }
             }
 
-            auto aggDomain = aggregateDomain(name, suffix_size);
-            _dns_topQname2.update(std::string(aggDomain.first));
-            if (aggDomain.second.size()) {
-                _dns_topQname3.update(std::string(aggDomain.second));
+            auto aggDomain = _qname_refs.aggregate(qname, suffix_size);
+            _dns_topQname2.update(aggDomain.qname2);
+            if (aggDomain.qname3) {
+                _dns_topQname3.update(aggDomain.qname3);
             }
         }
+
+        if (_qname_refs.size() > QnameRefs::PRUNE_SIZE) {
+            _prune_qnames();
+        }
     }
 }
 
-void DnsMetricsBucket::process_dns_layer(pcpp::ProtocolType l3, Protocol l4, QR side, uint16_t port)
+void DnsMetricsBucket::process_dns_layer(pcpp::ProtocolType l3, Protocol l4, QR side, uint16_t port, uint32_t weight)
 {
-    std::unique_lock lock(_mutex);
+    auto lock = write_lock(_mutex);
 
     if (group_enabled(group::DnsMetrics::Counters)) {
         if (l3 == pcpp::IPv6) {
-            ++_counters.IPv6;
+            _counters.IPv6 += weight;
         } else if (l3 == pcpp::IPv4) {
-            ++_counters.IPv4;
+            _counters.IPv4 += weight;
         }
 
         switch (l4) {
         case DNSTAP_UDP:
         case PCPP_UDP:
-            ++_counters.UDP;
+            _counters.UDP += weight;
             break;
         case DNSTAP_TCP:
         case PCPP_TCP:
-            ++_counters.TCP;
+            _counters.TCP += weight;
             break;
         case DNSTAP_DOT:
-            ++_counters.DOT;
+            _counters.DOT += weight;
             break;
         case DNSTAP_DOH:
-            ++_counters.DOH;
+            _counters.DOH += weight;
             break;
         }
 
         if (side == QR::query) {
-            ++_counters.queries;
+            _counters.queries += weight;
         } else if (side == QR::response) {
-            ++_counters.replies;
+            _counters.replies += weight;
         }
     }
 
@@ -687,39 +687,41 @@ void DnsMetricsBucket::process_dns_layer(pcpp::ProtocolType l3, Protocol l4, QR
     }
 }
 
-void DnsMetricsBucket::new_dns_transaction(bool deep, float to90th, float from90th, DnsLayer &dns, PacketDirection dir, DnsTransaction xact)
+void DnsMetricsBucket::new_dns_transaction(bool deep, float to90th, float from90th, DnsMessageView &dns, PacketDirection dir, DnsTransaction xact, const std::shared_ptr<QnameTable> &qnames, uint32_t weight)
 {
 
     uint64_t xactTime = ((xact.totalTS.tv_sec * 1'000'000'000L) + xact.totalTS.tv_nsec) / 1'000; // nanoseconds to microseconds
 
     // lock for write
-    std::unique_lock lock(_mutex);
+    auto lock = write_lock(_mutex);
 
-    ++_counters.xacts_total;
+    _counters.xacts_total += weight;
 
     if (dir == PacketDirection::toHost) {
-        ++_counters.xacts_out;
+        _counters.xacts_out += weight;
         if (deep) {
             _dnsXactFromTimeUs.update(xactTime);
         }
     } else if (dir == PacketDirection::fromHost) {
-        ++_counters.xacts_in;
+        _counters.xacts_in += weight;
         if (deep) {
             _dnsXactToTimeUs.update(xactTime);
         }
     }
 
-    if (deep) {
-        auto query = dns.getFirstQuery();
-        if (query) {
-            auto name = query->getName();
-            // dir is the direction of the last packet, meaning the reply so from a transaction perspective
-            // we look at it from the direction of the query, so the opposite side than we have here
-            if (dir == PacketDirection::toHost && from90th > 0 && xactTime >= from90th) {
-                _dns_slowXactOut.update(name);
-            } else if (dir == PacketDirection::fromHost && to90th > 0 && xactTime >= to90th) {
-                _dns_slowXactIn.update(name);
-            }
+    if (deep && dns.has_question()) {
+        // dir is the direction of the last packet, meaning the reply so from a transaction perspective
+        // we look at it from the direction of the query, so the opposite side than we have here
+        if (dir == PacketDirection::toHost && from90th > 0 && xactTime >= from90th) {
+            DnsNameText name;
+            dns.qname().decode(name);
+            _qname_refs.set_table(qnames);
+            _dns_slowXactOut.update(_qname_refs.intern(name.str()));
+        } else if (dir == PacketDirection::fromHost && to90th > 0 && xactTime >= to90th) {
+            DnsNameText name;
+            dns.qname().decode(name);
+            _qname_refs.set_table(qnames);
+            _dns_slowXactIn.update(_qname_refs.intern(name.str()));
         }
     }
 }
@@ -735,6 +737,9 @@ void DnsMetricsBucket::to_prometheus(std::stringstream &out, Metric::LabelMap ad
     }
 
     std::shared_lock r_lock(_mutex);
+
+    auto qname = [this](const uint64_t &id) { return _qname_refs.name(id); };
+
     if (group_enabled(group::DnsMetrics::Counters)) {
         _counters.queries.to_prometheus(out, add_labels);
         _counters.replies.to_prometheus(out, add_labels);
@@ -757,25 +762,26 @@ void DnsMetricsBucket::to_prometheus(std::stringstream &out, Metric::LabelMap ad
     if (group_enabled(group::DnsMetrics::DnsTransactions)) {
         _counters.xacts_total.to_prometheus(out, add_labels);
         _counters.xacts_timed_out.to_prometheus(out, add_labels);
+        _counters.xacts_evicted.to_prometheus(out, add_labels);
 
         _counters.xacts_in.to_prometheus(out, add_labels);
-        _dns_slowXactIn.to_prometheus(out, add_labels);
+        _dns_slowXactIn.to_prometheus(out, add_labels, qname);
 
         _dnsXactFromTimeUs.to_prometheus(out, add_labels);
         _dnsXactToTimeUs.to_prometheus(out, add_labels);
 
         _counters.xacts_out.to_prometheus(out, add_labels);
-        _dns_slowXactOut.to_prometheus(out, add_labels);
+        _dns_slowXactOut.to_prometheus(out, add_labels, qname);
     }
 
     _dns_topUDPPort.to_prometheus(out, add_labels, [](const uint16_t &val) { return std::to_string(val); });
 
     if (group_enabled(group::DnsMetrics::TopQnames)) {
-        _dns_topQname2.to_prometheus(out, add_labels);
-        _dns_topQname3.to_prometheus(out, add_labels);
-        _dns_topNX.to_prometheus(out, add_labels);
-        _dns_topREFUSED.to_prometheus(out, add_labels);
-        _dns_topSRVFAIL.to_prometheus(out, add_labels);
+        _dns_topQname2.to_prometheus(out, add_labels, qname);
+        _dns_topQname3.to_prometheus(out, add_labels, qname);
+        _dns_topNX.to_prometheus(out, add_labels, qname);
+        _dns_topREFUSED.to_prometheus(out, add_labels, qname);
+        _dns_topSRVFAIL.to_prometheus(out, add_labels, qname);
     }
     _dns_topRCode.to_prometheus(out, add_labels, [](const uint16_t &val) {
         if (RCodeNames.find(val) != RCodeNames.end()) {
@@ -793,40 +799,44 @@ void DnsMetricsBucket::to_prometheus(std::stringstream &out, Metric::LabelMap ad
         }
     });
 }
-void DnsMetricsBucket::process_filtered()
+void DnsMetricsBucket::process_filtered(uint32_t weight)
 {
-    std::unique_lock lock(_mutex);
-    ++_counters.filtered;
+    auto lock = write_lock(_mutex);
+    _counters.filtered += weight;
 }
 
 // the general metrics manager entry point (both UDP and TCP)
-void DnsMetricsManager::process_dns_layer(DnsLayer &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, uint32_t flowkey, uint16_t port, size_t suffix_size, timespec stamp)
+void DnsMetricsManager::process_dns_layer(DnsMessageView &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, uint32_t flowkey, uint64_t sample_key, uint16_t port, size_t suffix_size, timespec stamp, uint32_t weight)
 {
-    // base event
-    new_event(stamp);
+    auto scope = write_scope();
+    // base event, a query and its response are sampled alike in flow sampling mode
+    auto deep = new_flow_event(stamp, sample_key, weight);
     // process in the "live" bucket. this will parse the resources if we are deep sampling
-    live_bucket()->process_dns_layer(_deep_sampling_now, payload, l3, static_cast<Protocol>(l4), port, suffix_size);
+    live_bucket()->process_dns_layer(deep, payload, l3, static_cast<Protocol>(l4), port, _qnames, suffix_size, weight);
 
     if (group_enabled(group::DnsMetrics::DnsTransactions)) {
         // handle dns transactions (query/response pairs)
-        if (payload.getDnsHeader()->queryOrResponse == QR::response) {
-            auto xact = _qr_pair_manager.maybe_end_transaction(flowkey, payload.getDnsHeader()->transactionID, stamp);
+        if (payload.is_response()) {
+            auto xact = _qr_pair_manager.maybe_end_transaction(flowkey, payload.id(), stamp);
             if (xact.first) {
-                live_bucket()->new_dns_transaction(_deep_sampling_now, _to90th, _from90th, payload, dir, xact.second);
+                live_bucket()->new_dns_transaction(deep, _to90th, _from90th, payload, dir, xact.second, _qnames, weight);
             }
         } else {
-            _qr_pair_manager.start_transaction(flowkey, payload.getDnsHeader()->transactionID, stamp);
+            _qr_pair_manager.start_transaction(flowkey, payload.id(), stamp);
         }
+        _report_expired_transactions();
     }
 }
-void DnsMetricsManager::process_filtered(timespec stamp)
+void DnsMetricsManager::process_filtered(timespec stamp, uint32_t weight)
 {
+    auto scope = write_scope();
     // base event, no sample
-    new_event(stamp, false);
-    live_bucket()->process_filtered();
+    new_event(stamp, false, weight);
+    live_bucket()->process_filtered(weight);
 }
-void DnsMetricsManager::process_dnstap(const dnstap::Dnstap &payload, bool filtered)
+void DnsMetricsManager::process_dnstap(const dnstap::Dnstap &payload, bool filtered, uint32_t weight)
 {
+    auto scope = write_scope();
     // dnstap message type
     auto mtype = payload.message().type();
     // set proper timestamp. use dnstap version if available, otherwise "now"
@@ -854,11 +864,11 @@ void DnsMetricsManager::process_dnstap(const dnstap::Dnstap &payload, bool filte
     }
 
     if (filtered) {
-        return process_filtered(stamp);
+        return process_filtered(stamp, weight);
     }
     // base event
-    new_event(stamp);
+    auto deep = new_flow_event(stamp, dnstap_sample_key(payload), weight);
     // process in the "live" bucket. this will parse the resources if we are deep sampling
-    live_bucket()->process_dnstap(_deep_sampling_now, payload);
+    live_bucket()->process_dnstap(deep, payload, _qnames, weight);
 }
 }
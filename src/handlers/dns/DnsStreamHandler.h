@@ -5,16 +5,21 @@
 #pragma once
 
 #include "AbstractMetricsManager.h"
+#include "DnsMessageView.h"
 #include "MockInputStream.h"
 #include "PcapInputStream.h"
+#include "QnameSuffixTable.h"
+#include "QnameTable.h"
 #include "StreamHandler.h"
 #include "dns.h"
 #include "dnstap.pb.h"
 #include "querypairmgr.h"
 #include <Corrade/Utility/Debug.h>
+#include <algorithm>
 #include <bitset>
 #include <limits>
 #include <string>
+#include <vector>
 
 namespace visor::input::dnstap {
 class DnstapInputStream;
@@ -55,22 +60,28 @@ protected:
 
     Cardinality _dns_qnameCard;
 
-    TopN<std::string> _dns_topQname2;
-    TopN<std::string> _dns_topQname3;
-    TopN<std::string> _dns_topNX;
-    TopN<std::string> _dns_topREFUSED;
-    TopN<std::string> _dns_topSRVFAIL;
-    TopN<uint16_t> _dns_topUDPPort;
-    TopN<uint16_t> _dns_topQType;
-    TopN<uint16_t> _dns_topRCode;
-    TopN<std::string> _dns_slowXactIn;
-    TopN<std::string> _dns_slowXactOut;
+    // the qname sketches count ids interned in the handler's QnameTable, names are only looked up when rendering
+    TopN<uint64_t> _dns_topQname2;
+    TopN<uint64_t> _dns_topQname3;
+    TopN<uint64_t> _dns_topNX;
+    TopN<uint64_t> _dns_topREFUSED;
+    TopN<uint64_t> _dns_topSRVFAIL;
+    DenseTopN<uint16_t> _dns_topUDPPort;
+    DenseTopN<uint16_t> _dns_topQType;
+    // the header rcode, 4 bits
+    DenseTopN<uint16_t, 16> _dns_topRCode;
+    TopN<uint64_t> _dns_slowXactIn;
+    TopN<uint64_t> _dns_slowXactOut;
+
+    // keeps every name the qname sketches may hold interned for as long as this bucket lives
+    QnameRefs _qname_refs;
 
     struct counters {
         Counter xacts_total;
         Counter xacts_in;
         Counter xacts_out;
         Counter xacts_timed_out;
+        Counter xacts_evicted;
         Counter queries;
         Counter replies;
         Counter UDP;
@@ -89,6 +100,7 @@ protected:
             , xacts_in("dns", {"xact", "in", "total"}, "Total ingress DNS transactions (host is server)")
             , xacts_out("dns", {"xact", "out", "total"}, "Total egress DNS transactions (host is client)")
             , xacts_timed_out("dns", {"xact", "counts", "timed_out"}, "Total number of DNS transactions that timed out")
+            , xacts_evicted("dns", {"xact", "counts", "evicted"}, "Total number of open DNS transactions dropped because xact_max_open was reached")
             , queries("dns", {"wire_packets", "queries"}, "Total DNS wire packets flagged as query (ingress and egress)")
             , replies("dns", {"wire_packets", "replies"}, "Total DNS wire packets flagged as reply (ingress and egress)")
             , UDP("dns", {"wire_packets", "udp"}, "Total DNS wire packets received over UDP (ingress and egress)")
@@ -107,6 +119,19 @@ protected:
     };
     counters _counters;
 
+    template <typename F>
+    void _for_each_qname_id(F &&f) const
+    {
+        for (auto sketch : {&_dns_topQname2, &_dns_topQname3, &_dns_topNX, &_dns_topREFUSED, &_dns_topSRVFAIL, &_dns_slowXactIn, &_dns_slowXactOut}) {
+            sketch->for_each_item(f);
+        }
+    }
+
+    // drop the references to names which the sketches no longer track. caller must hold _mutex for write
+    void _prune_qnames();
+
+    void on_set_read_only() override;
+
 public:
     DnsMetricsBucket()
         : _dnsXactFromTimeUs("dns", {"xact", "out", "quantiles_us"}, "Quantiles of transaction timing (query/reply pairs) when host is client, in microseconds")
@@ -139,10 +164,11 @@ public:
         return retVals{_dnsXactToTimeUs, _dnsXactFromTimeUs, std::move(lock)};
     }
 
-    void inc_xact_timed_out(uint64_t c)
+    void inc_xact_expired(uint64_t timed_out, uint64_t evicted)
     {
-        std::unique_lock lock(_mutex);
-        _counters.xacts_timed_out += c;
+        auto lock = write_lock(_mutex);
+        _counters.xacts_timed_out += timed_out;
+        _counters.xacts_evicted += evicted;
     }
 
     // get a copy of the counters
@@ -157,33 +183,43 @@ public:
     void to_json(json &j) const override;
     void to_prometheus(std::stringstream &out, Metric::LabelMap add_labels = {}) const override;
 
-    void process_filtered();
-    void process_dns_layer(bool deep, DnsLayer &payload, pcpp::ProtocolType l3, Protocol l4, uint16_t port, size_t suffix_size = 0);
-    void process_dns_layer(pcpp::ProtocolType l3, Protocol l4, QR side, uint16_t port);
-    void process_dnstap(bool deep, const dnstap::Dnstap &payload);
+    // weight is the number of events one stands for, see LoadShedder::admit
+    void process_filtered(uint32_t weight = 1);
+    void process_dns_layer(bool deep, DnsMessageView &payload, pcpp::ProtocolType l3, Protocol l4, uint16_t port, const std::shared_ptr<QnameTable> &qnames, size_t suffix_size = 0, uint32_t weight = 1);
+    void process_dns_layer(pcpp::ProtocolType l3, Protocol l4, QR side, uint16_t port, uint32_t weight = 1);
+    void process_dnstap(bool deep, const dnstap::Dnstap &payload, const std::shared_ptr<QnameTable> &qnames, uint32_t weight = 1);
 
-    void new_dns_transaction(bool deep, float to90th, float from90th, DnsLayer &dns, PacketDirection dir, DnsTransaction xact);
+    void new_dns_transaction(bool deep, float to90th, float from90th, DnsMessageView &dns, PacketDirection dir, DnsTransaction xact, const std::shared_ptr<QnameTable> &qnames, uint32_t weight = 1);
 };
 
 class DnsMetricsManager final : public visor::AbstractMetricsManager<DnsMetricsBucket>
 {
     QueryResponsePairMgr _qr_pair_manager;
+    // shared with the buckets, which may outlive the manager's members
+    std::shared_ptr<QnameTable> _qnames{std::make_shared<QnameTable>()};
     float _to90th{0.0};
     float _from90th{0.0};
 
+    void _report_expired_transactions()
+    {
+        auto expired = _qr_pair_manager.take_expired();
+        if (expired.timed_out || expired.evicted) {
+            live_bucket()->inc_xact_expired(expired.timed_out, expired.evicted);
+        }
+    }
+
 public:
     DnsMetricsManager(const Configurable *window_config)
         : visor::AbstractMetricsManager<DnsMetricsBucket>(window_config)
     {
+        enable_single_writer(window_config);
     }
 
     void on_period_shift(timespec stamp, [[maybe_unused]] const DnsMetricsBucket *maybe_expiring_bucket) override
     {
-        // DNS transaction support
-        auto timed_out = _qr_pair_manager.purge_old_transactions(stamp);
-        if (timed_out) {
-            live_bucket()->inc_xact_timed_out(timed_out);
-        }
+        // DNS transaction support. transactions are expired as packets arrive, this covers quiet periods
+        _qr_pair_manager.purge_old_transactions(stamp);
+        _report_expired_transactions();
         // collect to/from 90th percentile every period shift to judge slow xacts
         auto [xact_to, xact_from, lock] = bucket(1)->get_xact_data_locked();
         if (xact_from.get_n()) {
@@ -199,37 +235,118 @@ public:
         return _qr_pair_manager.open_transaction_count();
     }
 
-    void process_filtered(timespec stamp);
-    void process_dns_layer(DnsLayer &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, uint32_t flowkey, uint16_t port, size_t suffix_size, timespec stamp);
-    void process_dnstap(const dnstap::Dnstap &payload, bool filtered);
+    void set_max_open_transactions(size_t max_open)
+    {
+        _qr_pair_manager.set_max_open(max_open);
+    }
+
+    // the number of names interned for the buckets of this manager
+    size_t num_interned_qnames() const
+    {
+        return _qnames->size();
+    }
+
+    void process_filtered(timespec stamp, uint32_t weight = 1);
+    void process_dns_layer(DnsMessageView &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, uint32_t flowkey, uint64_t sample_key, uint16_t port, size_t suffix_size, timespec stamp, uint32_t weight = 1);
+    void process_dnstap(const dnstap::Dnstap &payload, bool filtered, uint32_t weight = 1);
 };
 
+/**
+ * DNS over TCP message framing for one side of a flow. complete length prefixed messages are handed to the callback
+ * straight from the segment they arrived in, only a message split across segments is copied, into a buffer which never
+ * holds more than one message
+ */
 class TcpSessionData final
 {
 public:
     static constexpr size_t MIN_DNS_QUERY_SIZE = 17;
-    using got_msg_cb = std::function<void(std::unique_ptr<uint8_t[]> data, size_t size)>;
+    // a length prefix and the largest message it can describe
+    static constexpr size_t MAX_BUFFER_SIZE = sizeof(uint16_t) + std::numeric_limits<uint16_t>::max();
 
 private:
-    std::string _buffer;
-    got_msg_cb _got_dns_msg;
-    bool _invalid_data;
+    // the start of a message which continues in a following segment
+    std::vector<uint8_t> _pending;
+    bool _invalid_data{false};
 
-public:
-    TcpSessionData(
-        got_msg_cb got_data_handler)
-        : _got_dns_msg{std::move(got_data_handler)}
-        , _invalid_data(false)
+    static size_t _message_size(const uint8_t *prefix)
     {
+        // dns message size is in network byte order
+        return static_cast<size_t>(prefix[0] << 8 | prefix[1]);
     }
 
-    // called from pcpp::TcpReassembly callback, matches types
-    void receive_dns_wire_data(const uint8_t *data, size_t len);
+    void _invalidate()
+    {
+        _pending.clear();
+        _pending.shrink_to_fit();
+        _invalid_data = true;
+    }
+
+public:
+    /**
+     * called from the pcpp::TcpReassembly callback with the data of each segment
+     * @param got_dns_msg called as got_dns_msg(const uint8_t *data, size_t size) for every complete message. the data
+     * is only valid for the duration of the call
+     */
+    template <typename Callback>
+    void receive_dns_wire_data(const uint8_t *data, size_t len, Callback &&got_dns_msg)
+    {
+        if (_invalid_data) {
+            return;
+        }
+
+        // finish the message left over from previous segments first
+        if (!_pending.empty()) {
+            if (_pending.size() < sizeof(uint16_t)) {
+                auto take = std::min(len, sizeof(uint16_t) - _pending.size());
+                _pending.insert(_pending.end(), data, data + take);
+                data += take;
+                len -= take;
+                if (_pending.size() < sizeof(uint16_t)) {
+                    return;
+                }
+            }
+            auto size = _message_size(_pending.data());
+            // if size is less than MIN_DNS_QUERY_SIZE, it is not a dns packet
+            if (size < MIN_DNS_QUERY_SIZE) {
+                _invalidate();
+                return;
+            }
+            _pending.reserve(sizeof(uint16_t) + size);
+            auto take = std::min(len, sizeof(uint16_t) + size - _pending.size());
+            _pending.insert(_pending.end(), data, data + take);
+            data += take;
+            len -= take;
+            if (_pending.size() < sizeof(uint16_t) + size) {
+                // nope, we need more data
+                return;
+            }
+            got_dns_msg(_pending.data() + sizeof(uint16_t), size);
+            _pending.clear();
+        }
+
+        // everything else is framed in place
+        while (len >= sizeof(uint16_t)) {
+            auto size = _message_size(data);
+            if (size < MIN_DNS_QUERY_SIZE) {
+                _invalidate();
+                return;
+            }
+            if (len < sizeof(uint16_t) + size) {
+                break;
+            }
+            got_dns_msg(data + sizeof(uint16_t), size);
+            data += sizeof(uint16_t) + size;
+            len -= sizeof(uint16_t) + size;
+        }
+        if (len) {
+            _pending.assign(data, data + len);
+        }
+    }
 };
 
 struct TcpFlowData {
 
-    std::unique_ptr<TcpSessionData> sessionData[2];
+    TcpSessionData sessionData[2];
     pcpp::ProtocolType l3Type;
     uint16_t port;
 
@@ -244,20 +361,15 @@ class DnsStreamHandler final : public visor::StreamMetricsHandler<DnsMetricsMana
 {
     static constexpr size_t DNSTAP_TYPE_SIZE = 15;
 
-    struct DnsCacheData {
-        uint32_t flowKey = 0;
-        timespec timestamp = timespec();
-        std::unique_ptr<DnsLayer> dnsLayer;
-    };
-    static thread_local DnsCacheData _cached_dns_layer;
-
     // the input stream sources we support (only one will be in use at a time)
     PcapInputStream *_pcap_stream{nullptr};
     MockInputStream *_mock_stream{nullptr};
     DnstapInputStream *_dnstap_stream{nullptr};
 
     typedef uint32_t flowKey;
-    std::unordered_map<flowKey, TcpFlowData> _tcp_connections;
+    // tcp callbacks may arrive from several capture workers, each tracks its own connections, indexed by
+    // worker_shard_id. flow keys are only unique within the reassembly of one worker
+    std::vector<std::unordered_map<flowKey, TcpFlowData>> _tcp_connections;
 
     sigslot::connection _dnstap_connection;
 
@@ -271,9 +383,10 @@ class DnsStreamHandler final : public visor::StreamMetricsHandler<DnsMetricsMana
 
     sigslot::connection _heartbeat_connection;
 
-    void process_udp_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, uint32_t flowkey, timespec stamp);
+    void process_batch_cb(const PacketBatch &batch);
+    void process_udp_packet_cb(const PacketView &payload, PacketDirection dir, timespec stamp);
     void process_dnstap_cb(const dnstap::Dnstap &, size_t);
-    void tcp_message_ready_cb(int8_t side, const pcpp::TcpStreamData &tcpData);
+    void tcp_message_ready_cb(int8_t side, const pcpp::TcpStreamData &tcpData, uint32_t flow_key);
     void tcp_connection_start_cb(const pcpp::ConnectionData &connectionData);
     void tcp_connection_end_cb(const pcpp::ConnectionData &connectionData, pcpp::TcpReassembly::ConnectionEndReason reason);
     void set_start_tstamp(timespec stamp);
@@ -298,8 +411,7 @@ class DnsStreamHandler final : public visor::StreamMetricsHandler<DnsMetricsMana
     };
     std::bitset<Filters::FiltersMAX> _f_enabled;
     uint16_t _f_rcode{0};
-    std::vector<std::string> _f_qnames;
-    size_t _static_suffix_size{0};
+    QnameSuffixTable _f_qnames;
     std::bitset<DNSTAP_TYPE_SIZE> _f_dnstap_types;
 
     static const inline StreamMetricsHandler::GroupDefType _group_defs = {
@@ -308,7 +420,7 @@ class DnsStreamHandler final : public visor::StreamMetricsHandler<DnsMetricsMana
         {"dns_transaction", group::DnsMetrics::DnsTransactions},
         {"top_qnames", group::DnsMetrics::TopQnames}};
 
-    bool _filtering(DnsLayer &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, uint16_t port, timespec stamp);
+    bool _filtering(DnsMessageView &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, uint16_t port, timespec stamp, size_t &suffix_size, uint32_t weight = 1);
 
 public:
     DnsStreamHandler(const std::string &name, InputStream *stream, const Configurable *window_config, StreamHandler *handler = nullptr);
@@ -329,7 +441,13 @@ public:
     void stop() override;
     void info_json(json &j) const override;
 
-    mutable sigslot::signal<pcpp::Packet &, PacketDirection, pcpp::ProtocolType, uint32_t, timespec> udp_signal;
+    void set_load_shedder(LoadShedder *shedder) override
+    {
+        StreamMetricsHandler::set_load_shedder(shedder);
+        _shed_probe = shedder->add_probe(name());
+    }
+
+    mutable sigslot::signal<const PacketView &, PacketDirection, timespec> udp_signal;
 };
 
 }
@@ -0,0 +1,103 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "QnameSuffixTable.h"
+#include <algorithm>
+#include <cctype>
+
+namespace visor::handler::dns {
+
+QnameSuffixTable::QnameSuffixTable()
+{
+    _nodes.emplace_back();
+}
+
+uint32_t QnameSuffixTable::add(std::string_view suffix)
+{
+    std::string suffix_ci{suffix};
+    std::transform(suffix_ci.begin(), suffix_ci.end(), suffix_ci.begin(),
+        [](unsigned char c) { return std::tolower(c); });
+
+    std::string_view name{suffix_ci};
+    if (!name.empty() && name.back() == '.') {
+        name.remove_suffix(1);
+    }
+    bool sub_only{false};
+    if (!name.empty() && name.front() == '.') {
+        sub_only = true;
+        name.remove_prefix(1);
+    }
+
+    // walk down from the root, starting with the last label
+    uint32_t node{0};
+    while (!name.empty()) {
+        std::string_view label;
+        auto dot = name.rfind('.');
+        if (dot == std::string_view::npos) {
+            label = name;
+            name = std::string_view{};
+        } else {
+            label = name.substr(dot + 1);
+            name = name.substr(0, dot);
+        }
+        auto iter = _edges.find(Edge{node, label});
+        if (iter != _edges.end()) {
+            node = iter->second;
+            continue;
+        }
+        auto child = static_cast<uint32_t>(_nodes.size());
+        _nodes.emplace_back();
+        _labels.emplace_back(label);
+        _edges.emplace(Edge{node, _labels.back()}, child);
+        node = child;
+    }
+
+    auto &zone = sub_only ? _nodes[node].sub_zone : _nodes[node].zone;
+    if (zone == NO_ZONE) {
+        zone = _zones++;
+    }
+    return zone;
+}
+
+std::optional<QnameSuffixTable::Match> QnameSuffixTable::match(const DnsNameText &name) const
+{
+    auto text = name.str();
+    std::optional<Match> result;
+
+    uint32_t node{0};
+    if (_nodes[node].zone != NO_ZONE) {
+        result = Match{0, _nodes[node].zone};
+    }
+    // start of the labels matched so far in text
+    size_t matched = text.size();
+    for (size_t i = name.label_count(); i-- > 0;) {
+        if (_nodes[node].sub_zone != NO_ZONE) {
+            // there is at least one more label, so the suffix matches along with the dot in front of it
+            result = Match{text.size() - matched + 1, _nodes[node].sub_zone};
+        }
+        auto start = name.label_start(i);
+        auto end = (matched == text.size()) ? matched : matched - 1;
+        auto iter = _edges.find(Edge{node, text.substr(start, end - start)});
+        if (iter == _edges.end()) {
+            break;
+        }
+        node = iter->second;
+        matched = start;
+        if (_nodes[node].zone != NO_ZONE) {
+            result = Match{text.size() - matched, _nodes[node].zone};
+        }
+    }
+    return result;
+}
+
+void QnameSuffixTable::clear()
+{
+    _edges.clear();
+    _labels.clear();
+    _nodes.clear();
+    _nodes.emplace_back();
+    _zones = 0;
+}
+
+}
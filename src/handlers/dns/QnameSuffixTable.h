@@ -0,0 +1,97 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "DnsMessageView.h"
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <robin_hood.h>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace visor::handler::dns {
+
+/**
+ * A set of domain name suffixes (zones), matched against names label by label from the right. every node of the tree
+ * is a suffix, reached from its parent through the hash of (parent, label), so a lookup costs one hash probe per label
+ * of the name no matter how many suffixes there are.
+ *
+ * suffixes are case insensitive and only match on label boundaries: "google.com" matches "google.com" and
+ * "www.google.com", but not "notgoogle.com". a suffix with a leading dot, e.g. ".google.com", only matches names below
+ * it. an empty suffix matches every name. when several suffixes match, the longest one wins.
+ *
+ * names are expected to be lower cased already, e.g. DnsMessageView::qname_lower(). not thread safe to modify, lookups
+ * are const and may run concurrently.
+ */
+class QnameSuffixTable
+{
+public:
+    struct Match {
+        // the size of the matched suffix in the name text, counting the leading dot for suffixes written with one
+        size_t suffix_size;
+        // the id returned by add() for the matched suffix
+        uint32_t zone_id;
+    };
+
+private:
+    static constexpr uint32_t NO_ZONE = UINT32_MAX;
+
+    struct Node {
+        // suffix ending at this node, matching the name itself and every name below it
+        uint32_t zone{NO_ZONE};
+        // suffix ending at this node which was written with a leading dot, matching names below it only
+        uint32_t sub_zone{NO_ZONE};
+    };
+
+    using Edge = std::pair<uint32_t, std::string_view>;
+
+    struct EdgeHash {
+        size_t operator()(const Edge &e) const
+        {
+            return std::hash<std::string_view>{}(e.second) ^ (e.first * 0x9e3779b97f4a7c15ULL);
+        }
+    };
+
+    // the label text of every edge. a deque never moves its elements, so the views in _edges stay valid
+    std::deque<std::string> _labels;
+    // node 0 is the root
+    std::vector<Node> _nodes;
+    robin_hood::unordered_flat_map<Edge, uint32_t, EdgeHash> _edges;
+    uint32_t _zones{0};
+
+public:
+    QnameSuffixTable();
+
+    /**
+     * add a suffix. a trailing dot is ignored
+     * @return the zone id of the suffix: the number of distinct suffixes added before it, or the id it was first
+     * given if it was already added
+     */
+    uint32_t add(std::string_view suffix);
+
+    /**
+     * @return the longest suffix matching name, if any
+     */
+    std::optional<Match> match(const DnsNameText &name) const;
+
+    // the number of distinct suffixes
+    size_t size() const
+    {
+        return _zones;
+    }
+
+    bool empty() const
+    {
+        return _zones == 0;
+    }
+
+    void clear();
+};
+
+}
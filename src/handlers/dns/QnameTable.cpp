@@ -0,0 +1,123 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "QnameTable.h"
+#include "dns.h"
+
+namespace visor::handler::dns {
+
+uint64_t QnameTable::id(std::string_view name)
+{
+    uint64_t id = robin_hood::hash_bytes(name.data(), name.size());
+    // 0 is kept free to mean "no name"
+    return id ? id : 1;
+}
+
+uint64_t QnameTable::acquire(std::string_view name)
+{
+    auto name_id = id(name);
+    auto &shard = _shard(name_id);
+    std::unique_lock lock(shard.mutex);
+    auto &entry = shard.entries[name_id];
+    if (!entry.refs) {
+        entry.name = name;
+    }
+    ++entry.refs;
+    return name_id;
+}
+
+bool QnameTable::acquire(uint64_t id)
+{
+    auto &shard = _shard(id);
+    std::unique_lock lock(shard.mutex);
+    auto iter = shard.entries.find(id);
+    if (iter == shard.entries.end()) {
+        return false;
+    }
+    ++iter->second.refs;
+    return true;
+}
+
+void QnameTable::release(uint64_t id)
+{
+    auto &shard = _shard(id);
+    std::unique_lock lock(shard.mutex);
+    auto iter = shard.entries.find(id);
+    if (iter != shard.entries.end() && --iter->second.refs == 0) {
+        shard.entries.erase(iter);
+    }
+}
+
+std::string QnameTable::name(uint64_t id) const
+{
+    auto &shard = _shard(id);
+    std::unique_lock lock(shard.mutex);
+    auto iter = shard.entries.find(id);
+    if (iter == shard.entries.end()) {
+        return std::string();
+    }
+    return iter->second.name;
+}
+
+size_t QnameTable::size() const
+{
+    size_t size{0};
+    for (const auto &shard : _shards) {
+        std::unique_lock lock(shard.mutex);
+        size += shard.entries.size();
+    }
+    return size;
+}
+
+uint64_t QnameRefs::intern(std::string_view name)
+{
+    auto id = QnameTable::id(name);
+    if (_refs.count(id)) {
+        return id;
+    }
+    _table->acquire(name);
+    _refs.insert(id);
+    return id;
+}
+
+QnameRefs::Aggregate QnameRefs::aggregate(const DnsNameText &name, size_t suffix_size)
+{
+    auto id = QnameTable::id(name.str());
+    auto cached = _aggregates.find(id);
+    if (cached != _aggregates.end() && cached->second.suffix_size == suffix_size) {
+        return cached->second.ids;
+    }
+
+    auto [qname2, qname3] = aggregateDomain(name, suffix_size);
+    Aggregate ids{intern(qname2), qname3.size() ? intern(qname3) : 0};
+    if (_aggregates.size() >= PRUNE_SIZE) {
+        // random names never repeat, don't let them grow the cache without bound
+        _aggregates.clear();
+    }
+    _aggregates[id] = CachedAggregate{ids, suffix_size};
+    return ids;
+}
+
+void QnameRefs::retain(uint64_t id)
+{
+    if (_refs.count(id)) {
+        return;
+    }
+    if (_table->acquire(id)) {
+        _refs.insert(id);
+    }
+}
+
+void QnameRefs::clear()
+{
+    if (_table) {
+        for (auto id : _refs) {
+            _table->release(id);
+        }
+    }
+    _refs.clear();
+    _aggregates.clear();
+}
+
+}
@@ -0,0 +1,191 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "DnsMessageView.h"
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <robin_hood.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace visor::handler::dns {
+
+/**
+ * Domain names interned under a 64 bit id, so that the TopN sketches can count ids instead of allocating and hashing a
+ * string for every sample. the id is a hash of the name and is computed without looking at the table, which is only
+ * needed to add a name and to turn an id back into its name when rendering.
+ *
+ * names are reference counted, each metrics bucket holding one reference to every name it may render (see QnameRefs),
+ * and are dropped once no bucket references them. sharded by id, safe to use from several threads.
+ */
+class QnameTable
+{
+    static constexpr size_t SHARD_BITS = 4;
+
+    struct Entry {
+        std::string name;
+        uint64_t refs{0};
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        robin_hood::unordered_flat_map<uint64_t, Entry> entries;
+    };
+
+    std::array<Shard, 1 << SHARD_BITS> _shards;
+
+    // the top bits pick the shard, the maps hash the whole id again
+    Shard &_shard(uint64_t id)
+    {
+        return _shards[id >> (64 - SHARD_BITS)];
+    }
+
+    const Shard &_shard(uint64_t id) const
+    {
+        return _shards[id >> (64 - SHARD_BITS)];
+    }
+
+public:
+    /**
+     * @return the id of name, never 0. two names sharing an id are not told apart, which at 64 bits is not expected to
+     * happen before billions of distinct names are live at once
+     */
+    static uint64_t id(std::string_view name);
+
+    /**
+     * add a reference to name, interning it if it is not in the table yet
+     * @return the id of name
+     */
+    uint64_t acquire(std::string_view name);
+
+    /**
+     * add a reference to a name which is already in the table
+     * @return false if there is no name with this id
+     */
+    bool acquire(uint64_t id);
+
+    void release(uint64_t id);
+
+    /**
+     * @return the name with this id, or an empty string if there is none
+     */
+    std::string name(uint64_t id) const;
+
+    // the number of names in the table
+    size_t size() const;
+};
+
+/**
+ * The references one metrics bucket holds in a QnameTable, released along with the bucket. it also caches the ids of
+ * the aggregateDomain() results of the names the bucket has seen.
+ *
+ * not thread safe, it is protected by the mutex of the bucket owning it
+ */
+class QnameRefs
+{
+public:
+    // past this many references the bucket should prune the ones its sketches no longer track
+    static constexpr size_t PRUNE_SIZE = 1 << 16;
+
+    struct Aggregate {
+        uint64_t qname2;
+        // 0 if the name has less than three labels
+        uint64_t qname3;
+    };
+
+private:
+    struct CachedAggregate {
+        Aggregate ids;
+        size_t suffix_size;
+    };
+
+    std::shared_ptr<QnameTable> _table;
+    robin_hood::unordered_flat_set<uint64_t> _refs;
+    // keyed by the id of the full name, which is not referenced itself
+    robin_hood::unordered_flat_map<uint64_t, CachedAggregate> _aggregates;
+
+public:
+    QnameRefs() = default;
+
+    ~QnameRefs()
+    {
+        clear();
+    }
+
+    QnameRefs(const QnameRefs &) = delete;
+    QnameRefs &operator=(const QnameRefs &) = delete;
+
+    const std::shared_ptr<QnameTable> &table() const
+    {
+        return _table;
+    }
+
+    /**
+     * use table for all references. only the first call has an effect, a bucket never changes tables
+     */
+    void set_table(const std::shared_ptr<QnameTable> &table)
+    {
+        if (!_table) {
+            _table = table;
+        }
+    }
+
+    /**
+     * intern name, keeping a reference to it
+     * @return the id of name
+     */
+    uint64_t intern(std::string_view name);
+
+    /**
+     * intern both aggregateDomain() results of name, computed only the first time name is seen
+     */
+    Aggregate aggregate(const DnsNameText &name, size_t suffix_size);
+
+    /**
+     * keep a reference to a name interned by another bucket, e.g. when merging it. ids unknown to the table are ignored
+     */
+    void retain(uint64_t id);
+
+    /**
+     * release the references to every id for which in_use returns false, and forget the cached aggregates
+     */
+    template <typename InUse>
+    void prune(InUse &&in_use)
+    {
+        std::vector<uint64_t> unused;
+        for (auto id : _refs) {
+            if (!in_use(id)) {
+                unused.push_back(id);
+            }
+        }
+        for (auto id : unused) {
+            _refs.erase(id);
+            _table->release(id);
+        }
+        _aggregates.clear();
+    }
+
+    /**
+     * @return the name with this id, or an empty string if it is not known
+     */
+    std::string name(uint64_t id) const
+    {
+        return _table ? _table->name(id) : std::string();
+    }
+
+    // the number of names referenced
+    size_t size() const
+    {
+        return _refs.size();
+    }
+
+    void clear();
+};
+
+}
@@ -6,7 +6,7 @@
 
 namespace visor::handler::dns {
 
-AggDomainResult aggregateDomain(const std::string &domain, size_t suffix_size)
+AggDomainResult aggregateDomain(std::string_view domain, size_t suffix_size)
 {
 
     std::string_view qname2(domain);
@@ -42,4 +42,51 @@ AggDomainResult aggregateDomain(const std::string &domain, size_t suffix_size)
     return AggDomainResult(qname2, qname3);
 }
 
-}
\ No newline at end of file
+// the offset of the last dot at or before pos, as std::string_view::rfind('.', pos) would find it
+static size_t last_dot(const DnsNameText &name, size_t pos)
+{
+    for (auto i = name.label_count(); i-- > 1;) {
+        auto dot = name.label_start(i) - 1;
+        if (dot <= pos) {
+            return dot;
+        }
+    }
+    return std::string_view::npos;
+}
+
+AggDomainResult aggregateDomain(const DnsNameText &name, size_t suffix_size)
+{
+    auto domain = name.str();
+    std::string_view qname2(domain);
+    std::string_view qname3(domain);
+
+    // smallest we ever agg is a.b.c which returns a.b.c and b.c
+    if (domain.size() < 5) {
+        qname3.remove_prefix(domain.size());
+        return AggDomainResult(qname2, qname3);
+    }
+    // decoded names never end in a dot
+    std::size_t endDot = std::string_view::npos;
+    if (suffix_size > 0 && domain.size() > suffix_size) {
+        endDot = domain.size() - suffix_size;
+    }
+    auto first_dot = last_dot(name, endDot);
+    if (first_dot != std::string_view::npos && first_dot > 0) {
+        auto second_dot = last_dot(name, first_dot - 1);
+        if (second_dot != std::string_view::npos) {
+            qname2.remove_prefix(second_dot);
+            if (second_dot > 0) {
+                auto third_dot = last_dot(name, second_dot - 1);
+                if (third_dot != std::string_view::npos) {
+                    qname3.remove_prefix(third_dot);
+                }
+            }
+        } else {
+            // didn't find two dots, so this is empty
+            qname3.remove_prefix(domain.size());
+        }
+    }
+    return AggDomainResult(qname2, qname3);
+}
+
+}
@@ -5,15 +5,19 @@
 #pragma once
 
 #include "DnsLayer.h"
+#include "DnsMessageView.h"
 #include "DnsResource.h"
 #include "DnsResourceData.h"
 #include <string>
+#include <string_view>
 #include <unordered_map>
 
 namespace visor::handler::dns {
 
 typedef std::pair<std::string_view, std::string_view> AggDomainResult;
-AggDomainResult aggregateDomain(const std::string &domain, size_t suffix_size = 0);
+AggDomainResult aggregateDomain(std::string_view domain, size_t suffix_size = 0);
+// the same, reading the dots from the label index of name instead of searching for them
+AggDomainResult aggregateDomain(const DnsNameText &name, size_t suffix_size = 0);
 
 enum QR {
     query = 0,
@@ -3,8 +3,8 @@
  * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
 
 #include "querypairmgr.h"
+#include <algorithm>
 #include <sys/time.h>
-#include <vector>
 
 static inline void timespec_diff(struct timespec *a, struct timespec *b,
     struct timespec *result)
@@ -19,37 +19,215 @@ static inline void timespec_diff(struct timespec *a, struct timespec *b,
 
 namespace visor::handler::dns {
 
-void QueryResponsePairMgr::start_transaction(uint32_t flowKey, uint16_t queryID, timespec stamp)
+QueryResponsePairMgr::QueryResponsePairMgr(unsigned int ttl_secs, size_t max_open)
+    : _ttl_secs(std::max(ttl_secs, 1U))
+    , _max_open(max_open)
 {
-    _dns_transactions[DnsXactID(flowKey, queryID)] = {stamp, {0, 0}};
+    _index.resize(MIN_INDEX_SIZE);
+    _index_mask = MIN_INDEX_SIZE - 1;
+
+    // one slot per second of the ttl, with room for stamps running a little ahead
+    size_t slots{8};
+    while (slots <= _ttl_secs * 2) {
+        slots <<= 1;
+    }
+    _wheel.assign(slots, NIL);
+    _wheel_mask = slots - 1;
 }
 
-std::pair<bool, DnsTransaction> QueryResponsePairMgr::maybe_end_transaction(uint32_t flowKey, uint16_t queryID, timespec stamp)
+size_t QueryResponsePairMgr::_find_slot(uint64_t key) const
+{
+    auto slot = _hash(key) & _index_mask;
+    while (_index[slot].entry != NIL && _index[slot].key != key) {
+        slot = (slot + 1) & _index_mask;
+    }
+    return slot;
+}
+
+void QueryResponsePairMgr::_index_insert(uint64_t key, uint32_t entry)
+{
+    if ((_open + 1) * 2 > _index.size()) {
+        _grow_index();
+    }
+    auto slot = _find_slot(key);
+    _index[slot].key = key;
+    _index[slot].entry = entry;
+}
+
+void QueryResponsePairMgr::_index_erase(size_t slot)
+{
+    // backward shift deletion: move up every following entry which would no longer be reachable through the hole
+    auto hole = slot;
+    auto next = (hole + 1) & _index_mask;
+    while (_index[next].entry != NIL) {
+        auto home = _hash(_index[next].key) & _index_mask;
+        // the entry may move into the hole unless its home lies cyclically in (hole, next]
+        if (((next - home) & _index_mask) >= ((next - hole) & _index_mask)) {
+            _index[hole] = _index[next];
+            hole = next;
+        }
+        next = (next + 1) & _index_mask;
+    }
+    _index[hole].entry = NIL;
+}
+
+void QueryResponsePairMgr::_grow_index()
+{
+    std::vector<Slot> old(_index.size() * 2);
+    old.swap(_index);
+    _index_mask = _index.size() - 1;
+    for (const auto &slot : old) {
+        if (slot.entry != NIL) {
+            auto to = _find_slot(slot.key);
+            _index[to] = slot;
+        }
+    }
+}
+
+void QueryResponsePairMgr::_link(uint32_t entry)
 {
-    auto key = DnsXactID(flowKey, queryID);
-    if (_dns_transactions.find(key) != _dns_transactions.end()) {
-        auto result = _dns_transactions[key];
-        timespec_diff(&stamp, &result.queryTS, &result.totalTS);
-        _dns_transactions.erase(key);
-        return std::pair<bool, DnsTransaction>(true, result);
+    auto &e = _entries[entry];
+    auto &head = _wheel[static_cast<uint64_t>(e.query_ts.tv_sec) & _wheel_mask];
+    e.prev = NIL;
+    e.next = head;
+    if (head != NIL) {
+        _entries[head].prev = entry;
+    }
+    head = entry;
+}
+
+void QueryResponsePairMgr::_unlink(uint32_t entry)
+{
+    auto &e = _entries[entry];
+    if (e.prev != NIL) {
+        _entries[e.prev].next = e.next;
     } else {
-        return std::pair<bool, DnsTransaction>(false, DnsTransaction{{0, 0}, {0, 0}});
+        _wheel[static_cast<uint64_t>(e.query_ts.tv_sec) & _wheel_mask] = e.next;
+    }
+    if (e.next != NIL) {
+        _entries[e.next].prev = e.prev;
+    }
+}
+
+void QueryResponsePairMgr::_remove(uint32_t entry)
+{
+    _unlink(entry);
+    _index_erase(_find_slot(_entries[entry].key));
+    _entries[entry].next = _free;
+    _free = entry;
+    --_open;
+}
+
+void QueryResponsePairMgr::_expire(timespec now)
+{
+    int64_t limit = now.tv_sec - _ttl_secs;
+    if (!_started) {
+        _expired_through = limit;
+        _started = true;
+        return;
+    }
+    if (limit <= _expired_through) {
+        return;
+    }
+    // after a jump of a full turn or more every slot is visited once
+    auto seconds = std::min<uint64_t>(static_cast<uint64_t>(limit - _expired_through), _wheel.size());
+    uint64_t timed_out{0};
+    for (uint64_t i = 0; i < seconds; ++i) {
+        auto second = static_cast<uint64_t>(limit) - i;
+        auto entry = _wheel[second & _wheel_mask];
+        while (entry != NIL) {
+            auto next = _entries[entry].next;
+            // the slot may also hold transactions started a turn later
+            if (_entries[entry].query_ts.tv_sec <= limit) {
+                _remove(entry);
+                ++timed_out;
+            }
+            entry = next;
+        }
+    }
+    _expired_through = limit;
+    if (timed_out) {
+        _pending_timed_out.fetch_add(timed_out, std::memory_order_relaxed);
     }
 }
 
-size_t QueryResponsePairMgr::purge_old_transactions(timespec now)
+void QueryResponsePairMgr::_evict_oldest()
 {
-    // TODO this is a simple linear search, can optimize with some better data structures
-    std::vector<DnsXactID> timed_out;
-    for (auto i : _dns_transactions) {
-        if (now.tv_sec - i.second.queryTS.tv_sec >= _ttl_secs) {
-            timed_out.push_back(i.first);
+    // everything up to _expired_through is gone, so the oldest transaction is in the first non empty slot after it
+    for (uint64_t i = 1; i <= _wheel.size(); ++i) {
+        auto entry = _wheel[static_cast<uint64_t>(_expired_through + static_cast<int64_t>(i)) & _wheel_mask];
+        if (entry == NIL) {
+            continue;
+        }
+        auto oldest = entry;
+        for (; entry != NIL; entry = _entries[entry].next) {
+            if (_entries[entry].query_ts.tv_sec < _entries[oldest].query_ts.tv_sec) {
+                oldest = entry;
+            }
         }
+        _remove(oldest);
+        ++_evictions;
+        _pending_evicted.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+}
+
+void QueryResponsePairMgr::start_transaction(uint32_t flowKey, uint16_t queryID, timespec stamp)
+{
+    auto key = _make_key(flowKey, queryID);
+    std::unique_lock lock(_mutex);
+    _expire(stamp);
+
+    auto slot = _find_slot(key);
+    if (_index[slot].entry != NIL) {
+        // the same query again, e.g. a retransmission: it starts over
+        auto entry = _index[slot].entry;
+        _unlink(entry);
+        _entries[entry].query_ts = stamp;
+        _link(entry);
+        return;
+    }
+
+    while (_max_open && _open >= _max_open) {
+        _evict_oldest();
     }
-    for (auto i : timed_out) {
-        _dns_transactions.erase(i);
+
+    uint32_t entry;
+    if (_free != NIL) {
+        entry = _free;
+        _free = _entries[entry].next;
+    } else {
+        entry = static_cast<uint32_t>(_entries.size());
+        _entries.emplace_back();
     }
-    return timed_out.size();
+    _entries[entry].key = key;
+    _entries[entry].query_ts = stamp;
+    _link(entry);
+    _index_insert(key, entry);
+    ++_open;
+}
+
+std::pair<bool, DnsTransaction> QueryResponsePairMgr::maybe_end_transaction(uint32_t flowKey, uint16_t queryID, timespec stamp)
+{
+    auto key = _make_key(flowKey, queryID);
+    std::unique_lock lock(_mutex);
+    _expire(stamp);
+
+    auto slot = _find_slot(key);
+    if (_index[slot].entry == NIL) {
+        return std::pair<bool, DnsTransaction>(false, DnsTransaction{{0, 0}, {0, 0}});
+    }
+    auto entry = _index[slot].entry;
+    DnsTransaction result{_entries[entry].query_ts, {0, 0}};
+    timespec_diff(&stamp, &result.queryTS, &result.totalTS);
+    _remove(entry);
+    return std::pair<bool, DnsTransaction>(true, result);
+}
+
+void QueryResponsePairMgr::purge_old_transactions(timespec now)
+{
+    std::unique_lock lock(_mutex);
+    _expire(now);
 }
 
 }
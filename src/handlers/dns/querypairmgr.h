@@ -4,56 +4,161 @@
 
 #pragma once
 
+#include <atomic>
 #include <chrono>
-#include <memory>
-#include <robin_hood.h>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <utility>
+#include <vector>
 
 namespace visor::handler::dns {
 
 using hr_clock = std::chrono::high_resolution_clock;
 
-// A hash function used to hash a pair of any kind
-struct hash_pair {
-    template <class T1, class T2>
-    size_t operator()(const std::pair<T1, T2> &p) const
-    {
-        auto hash1 = std::hash<T1>{}(p.first);
-        auto hash2 = std::hash<T2>{}(p.second);
-        return hash1 ^ hash2;
-    }
-};
-
 struct DnsTransaction {
     timespec queryTS;
     timespec totalTS;
 };
 
+/**
+ * The open DNS transactions, i.e. queries still waiting for their reply, keyed by flow and query id.
+ *
+ * transactions live in a fixed pool indexed by an open addressing table, and are linked into a hashed timing wheel
+ * with one slot per second of their start time, so that starting, ending and expiring a transaction are all O(1) and
+ * nothing is allocated once the pool has grown. past the maximum number of open transactions, the oldest one is
+ * evicted to make room for a new one.
+ *
+ * time moves forward with the stamps of the packets. transactions open for longer than the ttl are expired as soon as
+ * a later packet is seen, and reported through take_expired()
+ */
 class QueryResponsePairMgr
 {
-
-    using DnsXactID = std::pair<uint32_t, uint16_t>;
-    typedef robin_hood::unordered_map<DnsXactID, DnsTransaction, hash_pair> DnsXactMap;
+public:
+    static constexpr size_t DEFAULT_MAX_OPEN = 1'000'000;
+
+    struct Expired {
+        uint64_t timed_out;
+        uint64_t evicted;
+    };
+
+private:
+    static constexpr uint32_t NIL = UINT32_MAX;
+    static constexpr size_t MIN_INDEX_SIZE = 1024;
+
+    struct Entry {
+        uint64_t key;
+        timespec query_ts;
+        // neighbours in the wheel slot, or the next free entry
+        uint32_t prev;
+        uint32_t next;
+    };
+
+    struct Slot {
+        uint64_t key;
+        uint32_t entry{NIL};
+    };
 
     unsigned int _ttl_secs;
-    DnsXactMap _dns_transactions;
+    size_t _max_open;
+
+    // transactions may be started and ended from several capture workers, and purged from the period shift
+    mutable std::mutex _mutex;
+
+    std::vector<Entry> _entries;
+    uint32_t _free{NIL};
+    size_t _open{0};
+
+    // linear probing, twice as large as the number of open transactions at least
+    std::vector<Slot> _index;
+    size_t _index_mask{0};
+
+    std::vector<uint32_t> _wheel;
+    uint64_t _wheel_mask{0};
+    // every second up to this one has been expired
+    int64_t _expired_through{0};
+    bool _started{false};
+
+    uint64_t _evictions{0};
+    std::atomic<uint64_t> _pending_timed_out{0};
+    std::atomic<uint64_t> _pending_evicted{0};
+
+    static uint64_t _make_key(uint32_t flowKey, uint16_t queryID)
+    {
+        return static_cast<uint64_t>(flowKey) << 16 | queryID;
+    }
+
+    static uint64_t _hash(uint64_t key)
+    {
+        // murmur3 finalizer, every bit of the key affects the slot
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return key;
+    }
+
+    size_t _find_slot(uint64_t key) const;
+    void _index_insert(uint64_t key, uint32_t entry);
+    void _index_erase(size_t slot);
+    void _grow_index();
+
+    void _link(uint32_t entry);
+    void _unlink(uint32_t entry);
+    void _remove(uint32_t entry);
+    void _expire(timespec now);
+    void _evict_oldest();
 
 public:
-    QueryResponsePairMgr(unsigned int ttl_secs = 5)
-        : _ttl_secs(ttl_secs)
+    QueryResponsePairMgr(unsigned int ttl_secs = 5, size_t max_open = DEFAULT_MAX_OPEN);
+
+    /**
+     * set the maximum number of open transactions, 0 for no limit. a lower limit is applied as new transactions start
+     */
+    void set_max_open(size_t max_open)
     {
+        std::unique_lock lock(_mutex);
+        _max_open = max_open;
     }
 
     void start_transaction(uint32_t flowKey, uint16_t queryID, timespec stamp);
 
     std::pair<bool, DnsTransaction> maybe_end_transaction(uint32_t flowKey, uint16_t queryID, timespec stamp);
 
-    size_t purge_old_transactions(timespec now);
+    /**
+     * expire the transactions open for longer than the ttl at time now, without starting or ending one
+     */
+    void purge_old_transactions(timespec now);
 
-    DnsXactMap::size_type open_transaction_count() const
+    /**
+     * @return the number of transactions which timed out and which were evicted since the last call
+     */
+    Expired take_expired()
     {
-        return _dns_transactions.size();
+        // checked first so that the event path doesn't write to shared cache lines for nothing
+        Expired expired{0, 0};
+        if (_pending_timed_out.load(std::memory_order_relaxed)) {
+            expired.timed_out = _pending_timed_out.exchange(0, std::memory_order_relaxed);
+        }
+        if (_pending_evicted.load(std::memory_order_relaxed)) {
+            expired.evicted = _pending_evicted.exchange(0, std::memory_order_relaxed);
+        }
+        return expired;
+    }
+
+    size_t open_transaction_count() const
+    {
+        std::unique_lock lock(_mutex);
+        return _open;
+    }
+
+    // total number of transactions evicted because of the maximum
+    uint64_t evictions() const
+    {
+        std::unique_lock lock(_mutex);
+        return _evictions;
     }
 };
 
 }
-
@@ -2,8 +2,13 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
 
+#include "../DnsMessageView.h"
+#include "../QnameSuffixTable.h"
+#include "../QnameTable.h"
 #include "../dns.h"
+#include "Metrics.h"
 #include <benchmark/benchmark.h>
+#include <random>
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wold-style-cast"
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -37,6 +42,196 @@ static void BM_aggregateDomainLong(benchmark::State &state)
 
 BENCHMARK(BM_aggregateDomainLong);
 
+// a query for each name, type A
+static std::vector<std::vector<uint8_t>> make_queries(const std::vector<std::string> &names)
+{
+    std::vector<std::vector<uint8_t>> queries;
+    for (const auto &name : names) {
+        std::vector<uint8_t> wire{0x12, 0x34, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0};
+        size_t start{0};
+        while (start < name.size()) {
+            auto dot = std::min(name.find('.', start), name.size());
+            wire.push_back(static_cast<uint8_t>(dot - start));
+            wire.insert(wire.end(), name.begin() + start, name.begin() + dot);
+            start = dot + 1;
+        }
+        wire.insert(wire.end(), {0, 0, 1, 0, 1});
+        queries.push_back(std::move(wire));
+    }
+    return queries;
+}
+
+static const auto short_queries = make_queries({"www.Example.com"});
+static const auto long_queries = make_queries({"Long1.long2.LONG3.long4.long5.long6.long7.long8.biz.foo.bar.com"});
+// a random subdomain flood: a fresh mixed case label under the same zone every time
+static const auto random_queries = [] {
+    std::mt19937 rng(1);
+    const std::string chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    std::vector<std::string> names;
+    for (int i = 0; i < 1024; ++i) {
+        std::string label(8 + rng() % 40, ' ');
+        for (auto &c : label) {
+            c = chars[rng() % chars.size()];
+        }
+        names.push_back(label + ".Victim-Zone.example.com");
+    }
+    return make_queries(names);
+}();
+
+static const std::vector<std::vector<uint8_t>> &queries(int64_t arg)
+{
+    switch (arg) {
+    case 1:
+        return long_queries;
+    case 2:
+        return random_queries;
+    default:
+        return short_queries;
+    }
+}
+
+// qname lower casing and aggregation as done before DnsMessageView
+static void BM_dnsLayerQname(benchmark::State &state)
+{
+    const auto &wires = queries(state.range(0));
+    // keeps DnsLayer from owning the data
+    pcpp::Packet dummy_packet;
+    size_t i{0};
+    for (auto _ : state) {
+        auto &wire = wires[i++ % wires.size()];
+        DnsLayer dns(const_cast<uint8_t *>(wire.data()), wire.size(), nullptr, &dummy_packet);
+        dns.parseResources(true);
+        auto name = dns.getFirstQuery()->getNameLower();
+        benchmark::DoNotOptimize(aggregateDomain(name));
+    }
+}
+BENCHMARK(BM_dnsLayerQname)->Arg(0)->Arg(1)->Arg(2);
+
+static void BM_dnsMessageViewQname(benchmark::State &state)
+{
+    const auto &wires = queries(state.range(0));
+    size_t i{0};
+    for (auto _ : state) {
+        auto &wire = wires[i++ % wires.size()];
+        DnsMessageView dns;
+        dns.parse(wire.data(), wire.size());
+        benchmark::DoNotOptimize(aggregateDomain(dns.qname_lower()));
+    }
+}
+BENCHMARK(BM_dnsMessageViewQname)->Arg(0)->Arg(1)->Arg(2);
+
+// the top_qname2/top_qname3 updates of a bucket as done before QnameTable: a string per sketch and sample
+static void BM_topQnameStrings(benchmark::State &state)
+{
+    const auto &wires = queries(state.range(0));
+    visor::TopN<std::string> qname2("dns", "qname", {"top_qname2"}, "");
+    visor::TopN<std::string> qname3("dns", "qname", {"top_qname3"}, "");
+    size_t i{0};
+    for (auto _ : state) {
+        auto &wire = wires[i++ % wires.size()];
+        DnsMessageView dns;
+        dns.parse(wire.data(), wire.size());
+        auto aggDomain = aggregateDomain(dns.qname_lower());
+        qname2.update(std::string(aggDomain.first));
+        if (aggDomain.second.size()) {
+            qname3.update(std::string(aggDomain.second));
+        }
+    }
+}
+BENCHMARK(BM_topQnameStrings)->Arg(0)->Arg(1)->Arg(2);
+
+static void BM_topQnameIds(benchmark::State &state)
+{
+    const auto &wires = queries(state.range(0));
+    visor::TopN<uint64_t> qname2("dns", "qname", {"top_qname2"}, "");
+    visor::TopN<uint64_t> qname3("dns", "qname", {"top_qname3"}, "");
+    QnameRefs refs;
+    refs.set_table(std::make_shared<QnameTable>());
+    size_t i{0};
+    for (auto _ : state) {
+        auto &wire = wires[i++ % wires.size()];
+        DnsMessageView dns;
+        dns.parse(wire.data(), wire.size());
+        auto aggDomain = refs.aggregate(dns.qname_lower(), 0);
+        qname2.update(aggDomain.qname2);
+        if (aggDomain.qname3) {
+            qname3.update(aggDomain.qname3);
+        }
+    }
+}
+BENCHMARK(BM_topQnameIds)->Arg(0)->Arg(1)->Arg(2);
+
+// only_qname_suffix lists of random zones, with queries of which half fall under one of them
+struct SuffixFilterData {
+    std::vector<std::string> suffixes;
+    std::vector<std::vector<uint8_t>> queries;
+};
+
+static SuffixFilterData make_suffix_filter(size_t count)
+{
+    std::mt19937 rng(2);
+    auto random_label = [&rng] {
+        std::string label(3 + rng() % 10, ' ');
+        for (auto &c : label) {
+            c = static_cast<char>('a' + rng() % 26);
+        }
+        return label;
+    };
+    SuffixFilterData data;
+    for (size_t i = 0; i < count; ++i) {
+        data.suffixes.push_back(random_label() + (i % 2 ? ".com" : ".net"));
+    }
+    std::vector<std::string> names;
+    for (size_t i = 0; i < 1024; ++i) {
+        if (i % 2) {
+            names.push_back("www." + data.suffixes[rng() % count]);
+        } else {
+            names.push_back("www." + random_label() + ".com");
+        }
+    }
+    data.queries = make_queries(names);
+    return data;
+}
+
+// matching as done before QnameSuffixTable: the raw text against every entry of the list
+static void BM_qnameSuffixList(benchmark::State &state)
+{
+    auto data = make_suffix_filter(static_cast<size_t>(state.range(0)));
+    size_t i{0};
+    for (auto _ : state) {
+        auto &wire = data.queries[i++ % data.queries.size()];
+        DnsMessageView dns;
+        dns.parse(wire.data(), wire.size());
+        auto qname = dns.qname_lower().str();
+        size_t suffix_size{0};
+        for (const auto &fqn : data.suffixes) {
+            if (qname.size() >= fqn.size() && 0 == qname.compare(qname.size() - fqn.size(), fqn.size(), fqn)) {
+                suffix_size = fqn.size();
+                break;
+            }
+        }
+        benchmark::DoNotOptimize(suffix_size);
+    }
+}
+BENCHMARK(BM_qnameSuffixList)->Arg(10)->Arg(1000)->Arg(100000);
+
+static void BM_qnameSuffixTable(benchmark::State &state)
+{
+    auto data = make_suffix_filter(static_cast<size_t>(state.range(0)));
+    QnameSuffixTable table;
+    for (const auto &suffix : data.suffixes) {
+        table.add(suffix);
+    }
+    size_t i{0};
+    for (auto _ : state) {
+        auto &wire = data.queries[i++ % data.queries.size()];
+        DnsMessageView dns;
+        dns.parse(wire.data(), wire.size());
+        benchmark::DoNotOptimize(table.match(dns.qname_lower()));
+    }
+}
+BENCHMARK(BM_qnameSuffixTable)->Arg(10)->Arg(1000)->Arg(100000);
+
 static void BM_pcapReadNoParse(benchmark::State &state)
 {
 
@@ -1,6 +1,10 @@
 #include <catch2/catch.hpp>
 
+#include "QnameSuffixTable.h"
+#include "QnameTable.h"
 #include "dns.h"
+#include "querypairmgr.h"
+#include <vector>
 
 using namespace visor::handler::dns;
 
@@ -116,3 +120,328 @@ TEST_CASE("DNS Utilities", "[dns]")
         CHECK(result.second == "");
     }
 }
+
+// a query for name, without the question type and class which are not needed here
+static std::vector<uint8_t> wire_name(const std::string &name)
+{
+    std::vector<uint8_t> wire(DnsMessageView::HEADER_SIZE, 0);
+    size_t start{0};
+    while (start < name.size()) {
+        auto dot = name.find('.', start);
+        if (dot == std::string::npos) {
+            dot = name.size();
+        }
+        wire.push_back(static_cast<uint8_t>(dot - start));
+        wire.insert(wire.end(), name.begin() + start, name.begin() + dot);
+        start = dot + 1;
+    }
+    wire.push_back(0);
+    return wire;
+}
+
+TEST_CASE("aggregateDomain from the label index", "[dns]")
+{
+    for (std::string domain : {"biz.foo.bar.com", "foo.bar.com", "a.com", "a.b.c", "abcdefg", "abcdefg.com", "www.google.co.uk", "long1.long2.long3.long4.biz.foo.bar.com"}) {
+        auto wire = wire_name(domain);
+        DnsNameView view;
+        REQUIRE(view.scan(wire.data(), wire.size(), DnsMessageView::HEADER_SIZE));
+        DnsNameText name;
+        view.decode(name);
+        REQUIRE(name.str() == domain);
+        for (size_t suffix_size : {0, 3, 6, 7, 8, 11, 12, 15, 40}) {
+            CHECK(aggregateDomain(name, suffix_size) == aggregateDomain(domain, suffix_size));
+        }
+    }
+}
+
+TEST_CASE("ascii_lower_copy", "[dns]")
+{
+    std::vector<uint8_t> src;
+    for (int i = 0; i < 256; ++i) {
+        src.push_back(static_cast<uint8_t>(i));
+    }
+    // every length, so that every mix of vector and scalar tail is covered
+    for (size_t offset : {0, 1, 65, 200}) {
+        for (size_t n = 0; n <= src.size() - offset; ++n) {
+            std::vector<char> dst(n + 1, 'x');
+            ascii_lower_copy(dst.data(), src.data() + offset, n);
+            for (size_t i = 0; i < n; ++i) {
+                auto c = src[offset + i];
+                auto expected = (c >= 'A' && c <= 'Z') ? c + 32 : c;
+                REQUIRE(static_cast<uint8_t>(dst[i]) == expected);
+            }
+            CHECK(dst[n] == 'x');
+        }
+    }
+}
+
+static DnsNameText name_text(const std::string &name)
+{
+    auto wire = wire_name(name);
+    DnsNameView view;
+    REQUIRE(view.scan(wire.data(), wire.size(), DnsMessageView::HEADER_SIZE));
+    DnsNameText text;
+    view.decode(text, true);
+    return text;
+}
+
+TEST_CASE("QnameSuffixTable", "[dns]")
+{
+    QnameSuffixTable table;
+    CHECK(table.empty());
+    CHECK(!table.match(name_text("www.google.com")));
+
+    CHECK(table.add("GooGle.com") == 0);
+    CHECK(table.add(".example.com") == 1);
+    CHECK(table.add("mail.google.com.") == 2);
+    CHECK(table.add("co.uk") == 3);
+    // duplicates keep their first id
+    CHECK(table.add("google.COM") == 0);
+    CHECK(table.size() == 4);
+
+    SECTION("exact names and names below a suffix match")
+    {
+        auto m = table.match(name_text("google.com"));
+        REQUIRE(m);
+        CHECK(m->zone_id == 0);
+        CHECK(m->suffix_size == 10);
+
+        m = table.match(name_text("WWW.google.com"));
+        REQUIRE(m);
+        CHECK(m->zone_id == 0);
+        CHECK(m->suffix_size == 10);
+
+        m = table.match(name_text("a.b.c.bbc.co.uk"));
+        REQUIRE(m);
+        CHECK(m->zone_id == 3);
+        CHECK(m->suffix_size == 5);
+    }
+
+    SECTION("the longest suffix wins")
+    {
+        auto m = table.match(name_text("imap.mail.google.com"));
+        REQUIRE(m);
+        CHECK(m->zone_id == 2);
+        CHECK(m->suffix_size == 15);
+
+        m = table.match(name_text("mail.google.com"));
+        REQUIRE(m);
+        CHECK(m->zone_id == 2);
+
+        m = table.match(name_text("ail.google.com"));
+        REQUIRE(m);
+        CHECK(m->zone_id == 0);
+    }
+
+    SECTION("suffixes with a leading dot only match names below them")
+    {
+        CHECK(!table.match(name_text("example.com")));
+        auto m = table.match(name_text("www.example.com"));
+        REQUIRE(m);
+        CHECK(m->zone_id == 1);
+        // the leading dot counts, as it did when matching on the raw text
+        CHECK(m->suffix_size == 12);
+    }
+
+    SECTION("only whole labels match")
+    {
+        CHECK(!table.match(name_text("notgoogle.com")));
+        CHECK(!table.match(name_text("com")));
+        CHECK(!table.match(name_text("uk")));
+        CHECK(!table.match(name_text("")));
+    }
+
+    SECTION("an empty suffix matches everything")
+    {
+        CHECK(table.add("") == 4);
+        auto m = table.match(name_text("foo.bar"));
+        REQUIRE(m);
+        CHECK(m->zone_id == 4);
+        CHECK(m->suffix_size == 0);
+        m = table.match(name_text("www.google.com"));
+        REQUIRE(m);
+        CHECK(m->zone_id == 0);
+    }
+
+    SECTION("clear")
+    {
+        table.clear();
+        CHECK(table.empty());
+        CHECK(!table.match(name_text("google.com")));
+        CHECK(table.add("google.com") == 0);
+        CHECK(table.match(name_text("google.com")));
+    }
+}
+
+TEST_CASE("QnameTable reference counting", "[dns]")
+{
+    auto table = std::make_shared<QnameTable>();
+    auto id = QnameTable::id("www.google.com");
+    CHECK(id != 0);
+    CHECK(id != QnameTable::id("www.google.co"));
+
+    CHECK(table->acquire("www.google.com") == id);
+    CHECK(table->acquire(id));
+    CHECK(!table->acquire(QnameTable::id("unknown.com")));
+    CHECK(table->name(id) == "www.google.com");
+    CHECK(table->size() == 1);
+
+    table->release(id);
+    CHECK(table->name(id) == "www.google.com");
+    table->release(id);
+    CHECK(table->name(id).empty());
+    CHECK(table->size() == 0);
+}
+
+TEST_CASE("QnameRefs", "[dns]")
+{
+    auto table = std::make_shared<QnameTable>();
+
+    SECTION("references are released with their owner")
+    {
+        {
+            QnameRefs refs;
+            refs.set_table(table);
+            auto id = refs.intern("a.example.com");
+            // a bucket holds a single reference per name
+            CHECK(refs.intern("a.example.com") == id);
+            CHECK(refs.size() == 1);
+            CHECK(refs.name(id) == "a.example.com");
+
+            QnameRefs merged;
+            merged.set_table(table);
+            merged.retain(id);
+            merged.retain(QnameTable::id("unknown.com"));
+            CHECK(merged.size() == 1);
+            CHECK(table->size() == 1);
+        }
+        CHECK(table->size() == 0);
+    }
+
+    SECTION("aggregates are interned and cached")
+    {
+        QnameRefs refs;
+        refs.set_table(table);
+        auto name = name_text("biz.foo.bar.com");
+        auto agg = refs.aggregate(name, 0);
+        CHECK(refs.name(agg.qname2) == ".bar.com");
+        CHECK(refs.name(agg.qname3) == ".foo.bar.com");
+        // the full name is only a cache key
+        CHECK(refs.size() == 2);
+
+        auto again = refs.aggregate(name, 0);
+        CHECK(again.qname2 == agg.qname2);
+        CHECK(again.qname3 == agg.qname3);
+
+        // a different suffix size is not served from the cache
+        auto suffixed = refs.aggregate(name, 8);
+        CHECK(refs.name(suffixed.qname2) == ".foo.bar.com");
+        CHECK(refs.name(suffixed.qname3) == "biz.foo.bar.com");
+
+        auto short_name = refs.aggregate(name_text("com"), 0);
+        CHECK(refs.name(short_name.qname2) == "com");
+        CHECK(short_name.qname3 == 0);
+    }
+
+    SECTION("pruning keeps the names still in use")
+    {
+        QnameRefs refs;
+        refs.set_table(table);
+        auto keep = refs.intern("keep.com");
+        auto drop = refs.intern("drop.com");
+        refs.aggregate(name_text("www.keep.com"), 0);
+        refs.prune([keep](uint64_t id) { return id == keep; });
+        CHECK(refs.size() == 1);
+        CHECK(table->name(keep) == "keep.com");
+        CHECK(table->name(drop).empty());
+        // the cached aggregate referenced a pruned name, it must be interned again
+        auto agg = refs.aggregate(name_text("www.keep.com"), 0);
+        CHECK(refs.name(agg.qname3) == "www.keep.com");
+    }
+}
+
+TEST_CASE("DNS transaction table", "[dns][xact]")
+{
+    QueryResponsePairMgr xacts(5, 0);
+
+    SECTION("queries are matched with their reply")
+    {
+        xacts.start_transaction(1, 100, {1000, 0});
+        xacts.start_transaction(2, 100, {1000, 500});
+        CHECK(xacts.open_transaction_count() == 2);
+
+        auto xact = xacts.maybe_end_transaction(1, 100, {1000, 250'000'000});
+        CHECK(xact.first);
+        CHECK(xact.second.totalTS.tv_sec == 0);
+        CHECK(xact.second.totalTS.tv_nsec == 250'000'000);
+        CHECK(!xacts.maybe_end_transaction(1, 100, {1000, 300'000'000}).first);
+        CHECK(!xacts.maybe_end_transaction(2, 101, {1000, 300'000'000}).first);
+        CHECK(xacts.open_transaction_count() == 1);
+    }
+
+    SECTION("a retransmitted query starts over")
+    {
+        xacts.start_transaction(1, 100, {1000, 0});
+        xacts.start_transaction(1, 100, {1003, 0});
+        CHECK(xacts.open_transaction_count() == 1);
+        xacts.purge_old_transactions({1006, 0});
+        auto xact = xacts.maybe_end_transaction(1, 100, {1007, 0});
+        CHECK(xact.first);
+        CHECK(xact.second.totalTS.tv_sec == 4);
+    }
+
+    SECTION("transactions time out as time moves on")
+    {
+        xacts.start_transaction(1, 1, {1000, 0});
+        xacts.start_transaction(1, 2, {1002, 0});
+        xacts.purge_old_transactions({1004, 999'999'999});
+        CHECK(xacts.take_expired().timed_out == 0);
+
+        xacts.start_transaction(1, 3, {1005, 0});
+        CHECK(xacts.open_transaction_count() == 2);
+        auto expired = xacts.take_expired();
+        CHECK(expired.timed_out == 1);
+        CHECK(expired.evicted == 0);
+        // reported once
+        CHECK(xacts.take_expired().timed_out == 0);
+
+        // a jump of more than a turn of the wheel
+        xacts.purge_old_transactions({5000, 0});
+        CHECK(xacts.open_transaction_count() == 0);
+        CHECK(xacts.take_expired().timed_out == 2);
+    }
+
+    SECTION("the oldest transactions are evicted past the maximum")
+    {
+        xacts.set_max_open(3);
+        xacts.start_transaction(1, 1, {1000, 0});
+        xacts.start_transaction(1, 2, {1001, 0});
+        xacts.start_transaction(1, 3, {1002, 0});
+        xacts.start_transaction(1, 4, {1003, 0});
+        CHECK(xacts.open_transaction_count() == 3);
+        CHECK(!xacts.maybe_end_transaction(1, 1, {1003, 0}).first);
+        CHECK(xacts.maybe_end_transaction(1, 2, {1003, 0}).first);
+        CHECK(xacts.evictions() == 1);
+        auto expired = xacts.take_expired();
+        CHECK(expired.evicted == 1);
+        CHECK(expired.timed_out == 0);
+    }
+
+    SECTION("many open transactions")
+    {
+        // enough to grow the index several times, and to exercise removal from long probe chains
+        for (uint32_t i = 0; i < 20000; ++i) {
+            xacts.start_transaction(i / 7, static_cast<uint16_t>(i % 7), {1000 + (i / 5000), 0});
+        }
+        CHECK(xacts.open_transaction_count() == 20000);
+        for (uint32_t i = 0; i < 20000; i += 2) {
+            REQUIRE(xacts.maybe_end_transaction(i / 7, static_cast<uint16_t>(i % 7), {1004, 0}).first);
+        }
+        CHECK(xacts.open_transaction_count() == 10000);
+        for (uint32_t i = 1; i < 20000; i += 2) {
+            REQUIRE(xacts.maybe_end_transaction(i / 7, static_cast<uint16_t>(i % 7), {1004, 0}).first);
+        }
+        CHECK(xacts.open_transaction_count() == 0);
+        CHECK(xacts.take_expired().timed_out == 0);
+    }
+}
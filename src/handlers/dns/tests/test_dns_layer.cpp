@@ -15,6 +15,8 @@
 #include <TcpLayer.h>
 #include <UdpLayer.h>
 #include <arpa/inet.h>
+#include <cstring>
+#include <fstream>
 #pragma GCC diagnostic pop
 #pragma GCC diagnostic ignored "-Wold-style-cast"
 
@@ -120,6 +122,268 @@ TEST_CASE("Parse DNS TCP IPv4 tests", "[pcap][ipv4][tcp][dns]")
     CHECK(j["top_qname2"][0]["estimate"] == 420);
 }
 
+TEST_CASE("Parse DNS TCP IPv4 tests with pcap file workers", "[pcap][ipv4][tcp][dns]")
+{
+    PcapInputStream stream{"pcap-test"};
+    stream.config_set("pcap_file", "tests/fixtures/dns_ipv4_tcp.pcap");
+    stream.config_set("bpf", "");
+    stream.config_set<uint64_t>("workers", 4);
+
+    visor::Config c;
+    c.config_set<uint64_t>("num_periods", 1);
+    DnsStreamHandler dns_handler{"dns-test", &stream, &c};
+
+    dns_handler.start();
+    stream.start();
+    dns_handler.stop();
+    stream.stop();
+
+    auto counters = dns_handler.metrics()->bucket(0)->counters();
+    auto event_data = dns_handler.metrics()->bucket(0)->event_data_locked();
+
+    // same as a single worker, each flow is reassembled and matched on one worker
+    CHECK(event_data.num_events->value() == 420);
+    CHECK(counters.TCP.value() == 420);
+    CHECK(counters.queries.value() == 210);
+    CHECK(counters.replies.value() == 210);
+    CHECK(dns_handler.metrics()->num_open_transactions() == 0);
+}
+
+// a copy of a capture with its timeline stretched by factor, so that it spans more than one metrics period
+static std::string stretched_capture(const char *file, int64_t factor, const char *copy)
+{
+    std::ifstream in(file, std::ios::binary);
+    std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    REQUIRE(data.size() > 24);
+    uint32_t magic;
+    std::memcpy(&magic, data.data(), sizeof(magic));
+    REQUIRE(magic == 0xa1b2c3d4);
+    int64_t first{-1};
+    for (size_t offset = 24; offset + 16 <= data.size();) {
+        uint32_t ts_sec, cap_len;
+        std::memcpy(&ts_sec, &data[offset], sizeof(ts_sec));
+        std::memcpy(&cap_len, &data[offset + 8], sizeof(cap_len));
+        if (first < 0) {
+            first = ts_sec;
+        }
+        ts_sec = static_cast<uint32_t>(first + (ts_sec - first) * factor);
+        std::memcpy(&data[offset], &ts_sec, sizeof(ts_sec));
+        offset += 16 + cap_len;
+    }
+    std::ofstream out(copy, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size());
+    return copy;
+}
+
+static std::vector<json> dns_periods(const std::string &file, uint64_t workers)
+{
+    PcapInputStream stream{"pcap-test"};
+    stream.config_set("pcap_file", file);
+    stream.config_set("bpf", "");
+    stream.config_set<uint64_t>("workers", workers);
+
+    visor::Config c;
+    c.config_set<uint64_t>("num_periods", 5);
+    DnsStreamHandler dns_handler{"dns-test", &stream, &c};
+
+    dns_handler.start();
+    stream.start();
+    dns_handler.stop();
+    stream.stop();
+
+    std::vector<json> periods;
+    for (uint64_t period = 0; period < dns_handler.metrics()->current_periods(); ++period) {
+        json j;
+        dns_handler.metrics()->window_single_json(j, "dns", period);
+        // sketches depend on the order in which the worker shards are merged, counters do not
+        periods.push_back({{"period", j["dns"]["period"]}, {"wire_packets", j["dns"]["wire_packets"]}});
+    }
+    return periods;
+}
+
+TEST_CASE("DNS periods with pcap file workers", "[pcap][dns][workers]")
+{
+    // 31 seconds of traffic stretched over two periods
+    auto file = stretched_capture("tests/fixtures/dns_udp_tcp_random.pcap", 3, "/tmp/pktvisor-test-periods.pcap");
+
+    auto single = dns_periods(file, 1);
+    REQUIRE(single.size() == 2);
+    CHECK(single[0]["wire_packets"]["total"] > 0);
+    CHECK(single[1]["wire_packets"]["total"] > 0);
+    for (int run = 0; run < 3; ++run) {
+        CHECK(dns_periods(file, 4) == single);
+    }
+}
+
+TEST_CASE("DNS TCP message framing", "[dns][tcp]")
+{
+    // three pipelined messages of different sizes, each filled with its index
+    std::vector<uint8_t> stream;
+    for (uint8_t i = 0; i < 3; ++i) {
+        size_t size = 20 + i * 100;
+        stream.push_back(static_cast<uint8_t>(size >> 8));
+        stream.push_back(static_cast<uint8_t>(size & 0xff));
+        stream.insert(stream.end(), size, i);
+    }
+
+    for (size_t segment : {size_t(1), size_t(2), size_t(7), size_t(64), stream.size()}) {
+        TcpSessionData session;
+        std::vector<std::pair<size_t, uint8_t>> messages;
+        for (size_t offset = 0; offset < stream.size(); offset += segment) {
+            auto len = std::min(segment, stream.size() - offset);
+            session.receive_dns_wire_data(stream.data() + offset, len, [&messages](const uint8_t *data, size_t size) {
+                CHECK(std::all_of(data, data + size, [data](uint8_t b) { return b == data[0]; }));
+                messages.emplace_back(size, data[0]);
+            });
+        }
+        CHECK(messages == std::vector<std::pair<size_t, uint8_t>>{{20, 0}, {120, 1}, {220, 2}});
+    }
+
+    // too short to be dns, nothing after it is parsed
+    TcpSessionData session;
+    std::vector<uint8_t> invalid{0x00, 0x05, 1, 2, 3, 4, 5, 0x00, 0x14};
+    invalid.insert(invalid.end(), 20, 0);
+    size_t count{0};
+    session.receive_dns_wire_data(invalid.data(), invalid.size(), [&count](const uint8_t *, size_t) { ++count; });
+    CHECK(count == 0);
+}
+
+TEST_CASE("DnsMessageView matches DnsLayer", "[pcap][dns]")
+{
+    auto reader = pcpp::IFileReaderDevice::getReader("tests/fixtures/dns_udp_tcp_random.pcap");
+    CHECK(reader->open());
+
+    pcpp::RawPacket rawPacket;
+    size_t count{0};
+    while (reader->getNextPacket(rawPacket)) {
+        pcpp::Packet packet(&rawPacket, pcpp::UDP);
+        auto udp = packet.getLayerOfType<pcpp::UdpLayer>();
+        if (!udp || udp->getLayerPayloadSize() < DnsMessageView::HEADER_SIZE) {
+            continue;
+        }
+        DnsMessageView view;
+        REQUIRE(view.parse(udp->getLayerPayload(), udp->getLayerPayloadSize()));
+
+        // DnsLayer takes ownership of buf
+        auto buf = new uint8_t[udp->getLayerPayloadSize()];
+        std::memcpy(buf, udp->getLayerPayload(), udp->getLayerPayloadSize());
+        DnsLayer layer(buf, udp->getLayerPayloadSize(), nullptr, nullptr);
+
+        CHECK(view.is_response() == (layer.getDnsHeader()->queryOrResponse == QR::response));
+        CHECK(view.rcode() == layer.getDnsHeader()->responseCode);
+        CHECK(view.id() == ntohs(layer.getDnsHeader()->transactionID));
+        CHECK(view.well_formed() == layer.parseResources(true));
+        auto query = layer.getFirstQuery();
+        REQUIRE(view.has_question() == (query != nullptr));
+        if (query) {
+            DnsNameText name;
+            view.qname().decode(name);
+            CHECK(name.str() == query->getName());
+            CHECK(view.qname_lower().str() == query->getNameLower());
+            CHECK(aggregateDomain(view.qname_lower()) == aggregateDomain(query->getNameLower()));
+            CHECK(view.qtype() == query->getDnsType());
+        }
+        ++count;
+    }
+    CHECK(count > 1000);
+
+    reader->close();
+    delete reader;
+}
+
+TEST_CASE("DnsMessageView names", "[dns]")
+{
+    // header with one question, then "WWW.Example.com" IN A
+    std::vector<uint8_t> msg{0x12, 0x34, 0x81, 0x83, 0, 1, 0, 1, 0, 0, 0, 0,
+        3, 'W', 'W', 'W', 7, 'E', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0, 0, 1, 0, 1};
+    DnsNameText text;
+
+    DnsMessageView view;
+    REQUIRE(view.parse(msg.data(), msg.size()));
+    CHECK(view.id() == 0x1234);
+    CHECK(view.is_response());
+    CHECK(view.rcode() == NXDomain);
+    CHECK(view.answer_count() == 1);
+    REQUIRE(view.has_question());
+    CHECK(view.qtype() == 1);
+    CHECK(view.qclass() == 1);
+    CHECK(view.qname().label_count() == 3);
+    CHECK(view.qname().label(1) == "Example");
+    view.qname().decode(text);
+    CHECK(text.str() == "WWW.Example.com");
+    CHECK(view.qname_lower().str() == "www.example.com");
+    CHECK(view.qname_lower().label_count() == 3);
+    CHECK(view.qname_lower().label_start(2) == 12);
+    CHECK(view.qname_lower().suffix(2) == "example.com");
+    CHECK(view.qname_lower().suffix(5) == "www.example.com");
+
+    // a compressed name in the answer: "mail" then a pointer back to "Example.com"
+    std::vector<uint8_t> answer(msg);
+    answer.insert(answer.end(), {4, 'm', 'a', 'i', 'l', 0xc0, 16});
+    DnsNameView name;
+    CHECK(name.scan(answer.data(), answer.size(), msg.size()) == 7);
+    name.decode(text, true);
+    CHECK(text.str() == "mail.example.com");
+    CHECK(text.label_count() == 3);
+    CHECK(text.suffix(2) == "example.com");
+
+    // pointers which go forwards or loop are malformed, and read as empty
+    answer.back() = static_cast<uint8_t>(msg.size());
+    CHECK(name.scan(answer.data(), answer.size(), msg.size()) == 7);
+    CHECK(!name.valid());
+    name.decode(text);
+    CHECK(text.str().empty());
+
+    // root
+    std::vector<uint8_t> root{0, 1, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 1};
+    REQUIRE(view.parse(root.data(), root.size()));
+    REQUIRE(view.has_question());
+    CHECK(view.qname().label_count() == 0);
+    CHECK(view.qname_lower().str().empty());
+    CHECK(view.qtype() == 2);
+}
+
+TEST_CASE("DnsMessageView malformed messages", "[dns]")
+{
+    std::vector<uint8_t> msg{0x12, 0x34, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0,
+        3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0, 0, 1, 0, 1};
+    DnsMessageView view;
+
+    CHECK(!view.parse(msg.data(), DnsMessageView::HEADER_SIZE - 1));
+
+    // the question is cut short anywhere
+    for (size_t len = DnsMessageView::HEADER_SIZE; len < msg.size(); ++len) {
+        REQUIRE(view.parse(msg.data(), len));
+        CHECK(!view.well_formed());
+        CHECK(!view.has_question());
+    }
+    REQUIRE(view.parse(msg.data(), msg.size()));
+    CHECK(view.has_question());
+
+    // implausible record counts
+    auto many(msg);
+    many[6] = 1;
+    REQUIRE(view.parse(many.data(), many.size()));
+    CHECK(!view.well_formed());
+
+    // no question at all is fine
+    auto none(msg);
+    none[5] = 0;
+    REQUIRE(view.parse(none.data(), none.size()));
+    CHECK(view.well_formed());
+    CHECK(!view.has_question());
+
+    // a name longer than 255 bytes
+    std::vector<uint8_t> longname(msg.begin(), msg.begin() + DnsMessageView::HEADER_SIZE);
+    for (int i = 0; i < 5; ++i) {
+        longname.push_back(63);
+        longname.insert(longname.end(), 63, 'a');
+    }
+    longname.insert(longname.end(), {0, 0, 1, 0, 1});
+    REQUIRE(view.parse(longname.data(), longname.size()));
+    CHECK(!view.has_question());
+}
+
 TEST_CASE("Parse DNS UDP IPv6 tests", "[pcap][ipv6][udp][dns]")
 {
 
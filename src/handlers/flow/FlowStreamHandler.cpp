@@ -215,11 +215,10 @@ void FlowStreamHandler::process_netflow_cb(const NFSample &payload)
 bool FlowStreamHandler::_filtering(const FlowData &flow)
 {
     if (_f_enabled[Filters::OnlyHosts]) {
-        if (flow.is_ipv6 && !_match_subnet(0, flow.ipv6_in.toBytes()) && !_match_subnet(0, flow.ipv6_out.toBytes())) {
-            return true;
-        } else if (!_match_subnet(flow.ipv4_in.toInt()) && !_match_subnet(flow.ipv4_out.toInt())) {
-            return true;
+        if (flow.is_ipv6) {
+            return !_host_table.match(flow.ipv6_in.toBytes()) && !_host_table.match(flow.ipv6_out.toBytes());
         }
+        return !_host_table.match(flow.ipv4_in.toInt()) && !_host_table.match(flow.ipv4_out.toInt());
     }
     return false;
 }
@@ -248,7 +247,7 @@ void FlowStreamHandler::_parse_host_specs(const std::vector<std::string> &host_l
             if (inet_pton(AF_INET6, ip.c_str(), &ipv6) != 1) {
                 throw StreamHandlerException(fmt::format("invalid IPv6 address: {}", ip));
             }
-            _IPv6_host_list.emplace_back(ipv6, cidr_number);
+            _host_table.add(ipv6, static_cast<uint8_t>(cidr_number));
         } else {
             if (cidr_number < 0 || cidr_number > 32) {
                 throw StreamHandlerException(fmt::format("invalid CIDR: {}", host));
@@ -257,52 +256,11 @@ void FlowStreamHandler::_parse_host_specs(const std::vector<std::string> &host_l
             if (inet_pton(AF_INET, ip.c_str(), &ipv4) != 1) {
                 throw StreamHandlerException(fmt::format("invalid IPv4 address: {}", ip));
             }
-            _IPv4_host_list.emplace_back(ipv4, cidr_number);
+            _host_table.add(ipv4, static_cast<uint8_t>(cidr_number));
         }
     }
 }
 
-bool FlowStreamHandler::_match_subnet(uint32_t ipv4_val, const uint8_t *ipv6_val)
-{
-    if (ipv4_val && _IPv4_host_list.size() > 0) {
-        in_addr ipv4;
-        std::memcpy(&ipv4, &ipv4_val, sizeof(in_addr));
-        for (const auto &net : _IPv4_host_list) {
-            uint8_t cidr = net.second;
-            if (cidr == 0) {
-                return true;
-            }
-            uint32_t mask = htonl((0xFFFFFFFFu) << (32 - cidr));
-            if (!((ipv4.s_addr ^ net.first.s_addr) & mask)) {
-                return true;
-            }
-        }
-    } else if (ipv6_val && _IPv6_host_list.size() > 0) {
-        in6_addr ipv6;
-        std::memcpy(&ipv6, ipv6_val, sizeof(in6_addr));
-        for (const auto &net : _IPv6_host_list) {
-            uint8_t prefixLength = net.second;
-            auto network = net.first;
-            uint8_t compareByteCount = prefixLength / 8;
-            uint8_t compareBitCount = prefixLength % 8;
-            bool result = false;
-            if (compareByteCount > 0) {
-                result = std::memcmp(&network.s6_addr, &ipv6.s6_addr, compareByteCount) == 0;
-            }
-            if ((result || prefixLength < 8) && compareBitCount > 0) {
-                uint8_t subSubnetByte = network.s6_addr[compareByteCount] >> (8 - compareBitCount);
-                uint8_t subThisByte = ipv6.s6_addr[compareByteCount] >> (8 - compareBitCount);
-                result = subSubnetByte == subThisByte;
-            }
-            if (result) {
-                return true;
-            }
-        }
-    }
-
-    return false;
-}
-
 void FlowMetricsBucket::specialized_merge(const AbstractMetricsBucket &o)
 {
     // static because caller guarantees only our own bucket type
@@ -480,7 +438,7 @@ void FlowMetricsBucket::to_json(json &j) const
 
 void FlowMetricsBucket::process_flow(bool deep, const FlowPacket &payload)
 {
-    std::unique_lock lock(_mutex);
+    auto lock = write_lock(_mutex);
 
     if (group_enabled(group::FlowMetrics::Counters)) {
         _counters.filtered += payload.filtered;
@@ -604,8 +562,9 @@ void FlowMetricsBucket::process_flow(bool deep, const FlowPacket &payload)
 
 void FlowMetricsManager::process_flow(const FlowPacket &payload)
 {
-    new_event(payload.stamp);
+    auto scope = write_scope();
+    auto deep = new_event(payload.stamp);
     // process in the "live" bucket
-    live_bucket()->process_flow(_deep_sampling_now, payload);
+    live_bucket()->process_flow(deep, payload);
 }
 }
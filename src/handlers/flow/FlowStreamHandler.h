@@ -8,6 +8,7 @@
 #include "FlowInputStream.h"
 #include "MockInputStream.h"
 #include "StreamHandler.h"
+#include "SubnetTable.h"
 #include <Corrade/Utility/Debug.h>
 #include <IPv4Layer.h>
 #include <IPv6Layer.h>
@@ -18,9 +19,6 @@ namespace visor::handler::flow {
 using namespace visor::input::mock;
 using namespace visor::input::flow;
 
-typedef std::pair<in_addr, uint8_t> Ipv4Subnet;
-typedef std::pair<in6_addr, uint8_t> Ipv6Subnet;
-
 static constexpr const char *FLOW_SCHEMA{"flow"};
 
 namespace group {
@@ -77,8 +75,8 @@ protected:
     struct topns {
         TopN<std::string> topSrcIP;
         TopN<std::string> topDstIP;
-        TopN<uint16_t> topSrcPort;
-        TopN<uint16_t> topDstPort;
+        DenseTopN<uint16_t> topSrcPort;
+        DenseTopN<uint16_t> topDstPort;
         TopN<uint32_t> topInIfIndex;
         TopN<uint32_t> topOutIfIndex;
         topns(std::string metric)
@@ -166,6 +164,7 @@ public:
     FlowMetricsManager(const Configurable *window_config)
         : visor::AbstractMetricsManager<FlowMetricsBucket>(window_config)
     {
+        enable_single_writer(window_config);
     }
 
     void process_flow(const FlowPacket &payload);
@@ -181,8 +180,7 @@ class FlowStreamHandler final : public visor::StreamMetricsHandler<FlowMetricsMa
     sigslot::connection _sflow_connection;
     sigslot::connection _netflow_connection;
 
-    std::vector<Ipv4Subnet> _IPv4_host_list;
-    std::vector<Ipv6Subnet> _IPv6_host_list;
+    SubnetTable _host_table;
 
     enum Filters {
         OnlyHosts,
@@ -203,7 +201,6 @@ class FlowStreamHandler final : public visor::StreamMetricsHandler<FlowMetricsMa
     void set_end_tstamp(timespec stamp);
 
     void _parse_host_specs(const std::vector<std::string> &host_list);
-    bool _match_subnet(uint32_t ipv4 = 0, const uint8_t *ipv6 = nullptr);
     bool _filtering(const FlowData &flow);
 
 public:
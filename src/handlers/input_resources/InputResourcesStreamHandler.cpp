@@ -40,7 +40,7 @@ void InputResourcesStreamHandler::start()
     }
 
     if (_pcap_stream) {
-        _pkt_connection = _pcap_stream->packet_signal.connect(&InputResourcesStreamHandler::process_packet_cb, this);
+        _pkt_connection = _pcap_stream->packet_batch_signal.connect(&InputResourcesStreamHandler::process_batch_cb, this);
         _policies_connection = _pcap_stream->policy_signal.connect(&InputResourcesStreamHandler::process_policies_cb, this);
         _heartbeat_connection = _pcap_stream->heartbeat_signal.connect(&InputResourcesStreamHandler::check_period_shift, this);
     } else if (_dnstap_stream) {
@@ -120,8 +120,10 @@ void InputResourcesStreamHandler::process_dnstap_cb([[maybe_unused]] const dnsta
     }
 }
 
-void InputResourcesStreamHandler::process_packet_cb([[maybe_unused]] pcpp::Packet &payload, [[maybe_unused]] PacketDirection dir, [[maybe_unused]] pcpp::ProtocolType l3, [[maybe_unused]] pcpp::ProtocolType l4, [[maybe_unused]] timespec stamp)
+void InputResourcesStreamHandler::process_batch_cb(const PacketBatch &batch)
 {
+    // batches are never empty
+    auto stamp = batch.back().stamp;
     if (stamp.tv_sec >= _timestamp.tv_sec + MEASURE_INTERVAL) {
         _timestamp = stamp;
         _metrics->process_resources(_monitor.cpu_percentage(), _monitor.memory_usage());
@@ -6,15 +6,6 @@
 #include "GeoDB.h"
 #include "utils.h"
 #include <Corrade/Utility/Debug.h>
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wold-style-cast"
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-#pragma clang diagnostic ignored "-Wc99-extensions"
-#pragma GCC diagnostic ignored "-Wpedantic"
-#include "TcpLayer.h"
-#include <IPv4Layer.h>
-#include <IPv6Layer.h>
-#pragma GCC diagnostic pop
 #include <arpa/inet.h>
 #include <cpc_union.hpp>
 #include <fmt/format.h>
@@ -61,7 +52,7 @@ void NetStreamHandler::start()
     }
 
     if (_pcap_stream) {
-        _pkt_connection = _pcap_stream->packet_signal.connect(&NetStreamHandler::process_packet_cb, this);
+        _pkt_connection = _pcap_stream->packet_batch_signal.connect(&NetStreamHandler::process_batch_cb, this);
         _start_tstamp_connection = _pcap_stream->start_tstamp_signal.connect(&NetStreamHandler::set_start_tstamp, this);
         _end_tstamp_connection = _pcap_stream->end_tstamp_signal.connect(&NetStreamHandler::set_end_tstamp, this);
         _heartbeat_connection = _pcap_stream->heartbeat_signal.connect(&NetStreamHandler::check_period_shift, this);
@@ -69,7 +60,7 @@ void NetStreamHandler::start()
         _dnstap_connection = _dnstap_stream->dnstap_signal.connect(&NetStreamHandler::process_dnstap_cb, this);
         _heartbeat_connection = _dnstap_stream->heartbeat_signal.connect(&NetStreamHandler::check_period_shift, this);
     } else if (_dns_handler) {
-        _pkt_udp_connection = _dns_handler->udp_signal.connect(&NetStreamHandler::process_udp_packet_cb, this);
+        _pkt_udp_connection = _dns_handler->udp_signal.connect(&NetStreamHandler::process_packet_cb, this);
     }
 
     _running = true;
@@ -100,9 +91,35 @@ NetStreamHandler::~NetStreamHandler()
 }
 
 // callback from input module
-void NetStreamHandler::process_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, timespec stamp)
+void NetStreamHandler::process_batch_cb(const PacketBatch &batch)
 {
-    _metrics->process_packet(payload, dir, l3, l4, stamp);
+    LoadShedder::Timer timer(_shed_probe);
+    auto shift = _shedder ? _shedder->shed_shift() : 0;
+    if (!shift) {
+        _metrics->process_batch(batch);
+        return;
+    }
+    // shed before parsing, the packets which are kept stand for the others
+    static thread_local PacketBatch kept;
+    kept.clear();
+    for (const auto &packet : batch) {
+        if (LoadShedder::keep(packet.view.sample_key, shift)) {
+            kept.push_back(packet);
+        }
+    }
+    if (!kept.empty()) {
+        _metrics->process_batch(kept, 1U << shift);
+    }
+}
+
+void NetStreamHandler::process_packet_cb(const PacketView &payload, PacketDirection dir, timespec stamp)
+{
+    // chained behind the dns handler, which keeps the same packets since the policy shares the shedder
+    uint32_t weight{1};
+    if (_shedder && !(weight = _shedder->admit(payload.sample_key))) {
+        return;
+    }
+    _metrics->process_packet(payload, dir, stamp, weight);
 }
 
 void NetStreamHandler::set_start_tstamp(timespec stamp)
@@ -117,12 +134,12 @@ void NetStreamHandler::set_end_tstamp(timespec stamp)
 
 void NetStreamHandler::process_dnstap_cb(const dnstap::Dnstap &payload, size_t size)
 {
-    _metrics->process_dnstap(payload, size);
-}
-
-void NetStreamHandler::process_udp_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, [[maybe_unused]] uint32_t flowkey, timespec stamp)
-{
-    _metrics->process_packet(payload, dir, l3, pcpp::UDP, stamp);
+    LoadShedder::Timer timer(_shed_probe);
+    uint32_t weight{1};
+    if (_shedder && !(weight = _shedder->admit(dnstap_sample_key(payload)))) {
+        return;
+    }
+    _metrics->process_dnstap(payload, size, weight);
 }
 
 void NetworkMetricsBucket::specialized_merge(const AbstractMetricsBucket &o)
@@ -263,46 +280,80 @@ void NetworkMetricsBucket::to_json(json &j) const
     _payload_size.to_json(j);
 }
 
-// the main bucket analysis
-void NetworkMetricsBucket::process_packet(bool deep, pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4)
+static NetworkPacket view_to_packet(const PacketView &payload, PacketDirection dir)
 {
-    if (!deep) {
-        process_net_layer(dir, l3, l4, payload.getRawPacket()->getRawDataLen());
-        return;
-    }
-
-    bool syn_flag = false;
-    if (l4 == pcpp::TCP) {
-        pcpp::TcpLayer *tcpLayer = payload.getLayerOfType<pcpp::TcpLayer>();
-        if (tcpLayer) {
-            syn_flag = tcpLayer->getTcpHeader()->synFlag;
-        }
-    }
-
-    NetworkPacket packet(dir, l3, l4, payload.getRawPacket()->getRawDataLen(), syn_flag, false);
+    bool syn_flag = (payload.l4 == pcpp::TCP) && (payload.tcp_flags & PacketView::TCP_SYN);
 
-    auto IP4layer = payload.getLayerOfType<pcpp::IPv4Layer>();
-    auto IP6layer = payload.getLayerOfType<pcpp::IPv6Layer>();
+    NetworkPacket packet(dir, payload.l3, payload.l4, payload.len, syn_flag, false);
 
-    if (IP4layer) {
+    if (payload.l3 == pcpp::IPv4) {
         packet.is_ipv6 = false;
         if (dir == PacketDirection::toHost) {
-            packet.ipv4_in = IP4layer->getSrcIPv4Address();
+            packet.ipv4_in = pcpp::IPv4Address(payload.ipv4_src);
         } else if (dir == PacketDirection::fromHost) {
-            packet.ipv4_out = IP4layer->getDstIPv4Address();
+            packet.ipv4_out = pcpp::IPv4Address(payload.ipv4_dst);
         }
-    } else if (IP6layer) {
+    } else if (payload.l3 == pcpp::IPv6) {
         packet.is_ipv6 = true;
         if (dir == PacketDirection::toHost) {
-            packet.ipv6_in = IP6layer->getSrcIPv6Address();
+            packet.ipv6_in = pcpp::IPv6Address(payload.ipv6_src);
         } else if (dir == PacketDirection::fromHost) {
-            packet.ipv6_out = IP6layer->getDstIPv6Address();
+            packet.ipv6_out = pcpp::IPv6Address(payload.ipv6_dst);
         }
     }
 
-    process_net_layer(packet);
+    return packet;
 }
-void NetworkMetricsBucket::process_dnstap(bool deep, const dnstap::Dnstap &payload, size_t size)
+
+// the main bucket analysis
+void NetworkMetricsBucket::process_packet(bool deep, const PacketView &payload, PacketDirection dir, uint32_t weight)
+{
+    if (!deep) {
+        process_net_layer(dir, payload.l3, payload.l4, payload.len, weight);
+        return;
+    }
+
+    auto packet = view_to_packet(payload, dir);
+    process_net_layer(packet, weight);
+}
+
+void NetworkMetricsBucket::process_batch(PacketBatch::const_iterator first, PacketBatch::const_iterator last, const std::vector<bool> &deep, uint32_t weight)
+{
+    uint64_t packets_in{0}, packets_out{0}, bytes_in{0}, bytes_out{0};
+
+    auto lock = write_lock(_mutex);
+    for (auto sampled = deep.begin(); first != last; ++first, ++sampled) {
+        const auto &payload = first->view;
+        switch (first->dir) {
+        case PacketDirection::fromHost:
+            packets_out += weight;
+            bytes_out += payload.len * weight;
+            break;
+        case PacketDirection::toHost:
+            packets_in += weight;
+            bytes_in += payload.len * weight;
+            break;
+        case PacketDirection::unknown:
+            break;
+        }
+        if (!*sampled) {
+            _process_counters(first->dir, payload.l3, payload.l4, payload.len, false, weight);
+            continue;
+        }
+        auto packet = view_to_packet(payload, first->dir);
+        _process_counters(packet.dir, packet.l3, packet.l4, packet.payload_size, packet.syn_flag, weight);
+        _process_addresses(packet);
+    }
+    lock.unlock();
+
+    // rates maintain their own thread safety
+    _rate_in += packets_in;
+    _rate_out += packets_out;
+    _throughput_in += bytes_in;
+    _throughput_out += bytes_out;
+}
+
+void NetworkMetricsBucket::process_dnstap(bool deep, const dnstap::Dnstap &payload, size_t size, uint32_t weight)
 {
     pcpp::ProtocolType l3;
     bool is_ipv6{false};
@@ -350,7 +401,7 @@ void NetworkMetricsBucket::process_dnstap(bool deep, const dnstap::Dnstap &paylo
     }
 
     if (!deep) {
-        process_net_layer(dir, l3, l4, size);
+        process_net_layer(dir, l3, l4, size, weight);
         return;
     }
     NetworkPacket packet(dir, l3, l4, size, false, is_ipv6);
@@ -367,123 +418,96 @@ void NetworkMetricsBucket::process_dnstap(bool deep, const dnstap::Dnstap &paylo
         packet.ipv6_out = pcpp::IPv6Address(reinterpret_cast<const uint8_t *>(payload.message().response_address().data()));
     }
 
-    process_net_layer(packet);
+    process_net_layer(packet, weight);
 }
 
-void NetworkMetricsBucket::process_net_layer(PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, size_t payload_size)
+void NetworkMetricsBucket::process_net_layer(PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, size_t payload_size, uint32_t weight)
 {
-    std::unique_lock lock(_mutex);
+    auto lock = write_lock(_mutex);
 
     switch (dir) {
     case PacketDirection::fromHost:
-        ++_rate_out;
-        _throughput_out += payload_size;
+        _rate_out += weight;
+        _throughput_out += payload_size * weight;
         break;
     case PacketDirection::toHost:
-        ++_rate_in;
-        _throughput_in += payload_size;
+        _rate_in += weight;
+        _throughput_in += payload_size * weight;
         break;
     case PacketDirection::unknown:
         break;
     }
 
-    if (group_enabled(group::NetMetrics::Counters)) {
-        switch (dir) {
-        case PacketDirection::fromHost:
-            ++_counters.total_out;
-            break;
-        case PacketDirection::toHost:
-            ++_counters.total_in;
-            break;
-        case PacketDirection::unknown:
-            break;
-        }
-
-        switch (l3) {
-        case pcpp::IPv6:
-            ++_counters.IPv6;
-            break;
-        case pcpp::IPv4:
-            ++_counters.IPv4;
-            break;
-        default:
-            break;
-        }
-
-        switch (l4) {
-        case pcpp::UDP:
-            ++_counters.UDP;
-            break;
-        case pcpp::TCP:
-            ++_counters.TCP;
-            break;
-        default:
-            ++_counters.OtherL4;
-            break;
-        }
-    }
-
-    _payload_size.update(payload_size);
+    _process_counters(dir, l3, l4, payload_size, false, weight);
 }
 
-void NetworkMetricsBucket::process_net_layer(NetworkPacket &packet)
+void NetworkMetricsBucket::process_net_layer(NetworkPacket &packet, uint32_t weight)
 {
-    std::unique_lock lock(_mutex);
+    auto lock = write_lock(_mutex);
 
     switch (packet.dir) {
     case PacketDirection::fromHost:
-        ++_rate_out;
-        _throughput_out += packet.payload_size;
+        _rate_out += weight;
+        _throughput_out += packet.payload_size * weight;
         break;
     case PacketDirection::toHost:
-        ++_rate_in;
-        _throughput_in += packet.payload_size;
+        _rate_in += weight;
+        _throughput_in += packet.payload_size * weight;
         break;
     case PacketDirection::unknown:
         break;
     }
 
+    _process_counters(packet.dir, packet.l3, packet.l4, packet.payload_size, packet.syn_flag, weight);
+    _process_addresses(packet);
+}
+
+void NetworkMetricsBucket::_process_counters(PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, size_t payload_size, bool syn_flag, uint32_t weight)
+{
     if (group_enabled(group::NetMetrics::Counters)) {
-        switch (packet.dir) {
+        switch (dir) {
         case PacketDirection::fromHost:
-            ++_counters.total_out;
+            _counters.total_out += weight;
             break;
         case PacketDirection::toHost:
-            ++_counters.total_in;
+            _counters.total_in += weight;
             break;
         case PacketDirection::unknown:
             break;
         }
 
-        switch (packet.l3) {
+        switch (l3) {
         case pcpp::IPv6:
-            ++_counters.IPv6;
+            _counters.IPv6 += weight;
             break;
         case pcpp::IPv4:
-            ++_counters.IPv4;
+            _counters.IPv4 += weight;
             break;
         default:
             break;
         }
 
-        switch (packet.l4) {
+        switch (l4) {
         case pcpp::UDP:
-            ++_counters.UDP;
+            _counters.UDP += weight;
             break;
         case pcpp::TCP:
-            ++_counters.TCP;
-            if (packet.syn_flag) {
-                ++_counters.TCP_SYN;
+            _counters.TCP += weight;
+            if (syn_flag) {
+                _counters.TCP_SYN += weight;
             }
             break;
         default:
-            ++_counters.OtherL4;
+            _counters.OtherL4 += weight;
             break;
         }
     }
 
-    _payload_size.update(packet.payload_size);
+    _payload_size.update(payload_size);
+}
 
+void NetworkMetricsBucket::_process_addresses(const NetworkPacket &packet)
+{
     struct sockaddr_in sa4;
     struct sockaddr_in6 sa6;
 
@@ -545,16 +569,27 @@ void NetworkMetricsBucket::process_net_layer(NetworkPacket &packet)
 }
 
 // the general metrics manager entry point
-void NetworkMetricsManager::process_packet(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, timespec stamp)
+void NetworkMetricsManager::process_packet(const PacketView &payload, PacketDirection dir, timespec stamp, uint32_t weight)
 {
+    auto scope = write_scope();
     // base event
-    new_event(stamp);
+    auto deep = new_flow_event(stamp, payload.sample_key, weight);
     // process in the "live" bucket
-    live_bucket()->process_packet(_deep_sampling_now, payload, dir, l3, l4);
+    live_bucket()->process_packet(deep, payload, dir, weight);
+}
+
+void NetworkMetricsManager::process_batch(const PacketBatch &batch, uint32_t weight)
+{
+    auto scope = write_scope();
+    auto sample_key = [](const auto &packet) { return packet.view.sample_key; };
+    new_event_batch(batch, sample_key, weight, [weight](NetworkMetricsBucket *bucket, auto first, auto last, const std::vector<bool> &deep) {
+        bucket->process_batch(first, last, deep, weight);
+    });
 }
 
-void NetworkMetricsManager::process_dnstap(const dnstap::Dnstap &payload, size_t size)
+void NetworkMetricsManager::process_dnstap(const dnstap::Dnstap &payload, size_t size, uint32_t weight)
 {
+    auto scope = write_scope();
     // dnstap message type
     auto mtype = payload.message().type();
     // set proper timestamp. use dnstap version if available, otherwise "now"
@@ -581,9 +616,9 @@ void NetworkMetricsManager::process_dnstap(const dnstap::Dnstap &payload, size_t
         std::timespec_get(&stamp, TIME_UTC);
     }
     // base event
-    new_event(stamp);
+    auto deep = new_flow_event(stamp, dnstap_sample_key(payload), weight);
     // process in the "live" bucket. this will parse the resources if we are deep sampling
-    live_bucket()->process_dnstap(_deep_sampling_now, payload, size);
+    live_bucket()->process_dnstap(deep, payload, size, weight);
 }
 
 }
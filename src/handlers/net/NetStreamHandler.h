@@ -97,6 +97,10 @@ protected:
     Rate _throughput_in;
     Rate _throughput_out;
 
+    // caller must hold _mutex
+    void _process_counters(PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, size_t payload_size, bool syn_flag, uint32_t weight);
+    void _process_addresses(const NetworkPacket &packet);
+
 public:
     NetworkMetricsBucket()
         : _srcIPCard("packets", {"cardinality", "src_ips_in"}, "Source IP cardinality")
@@ -138,10 +142,12 @@ public:
         _throughput_out.cancel();
     }
 
-    void process_packet(bool deep, pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4);
-    void process_dnstap(bool deep, const dnstap::Dnstap &payload, size_t size);
-    void process_net_layer(PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, size_t payload_size);
-    void process_net_layer(NetworkPacket &packet);
+    // weight is the number of packets one stands for, see LoadShedder::admit
+    void process_packet(bool deep, const PacketView &payload, PacketDirection dir, uint32_t weight = 1);
+    void process_batch(PacketBatch::const_iterator first, PacketBatch::const_iterator last, const std::vector<bool> &deep, uint32_t weight = 1);
+    void process_dnstap(bool deep, const dnstap::Dnstap &payload, size_t size, uint32_t weight = 1);
+    void process_net_layer(PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, size_t payload_size, uint32_t weight = 1);
+    void process_net_layer(NetworkPacket &packet, uint32_t weight = 1);
 };
 
 class NetworkMetricsManager final : public visor::AbstractMetricsManager<NetworkMetricsBucket>
@@ -150,10 +156,12 @@ public:
     NetworkMetricsManager(const Configurable *window_config)
         : visor::AbstractMetricsManager<NetworkMetricsBucket>(window_config)
     {
+        enable_single_writer(window_config);
     }
 
-    void process_packet(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, timespec stamp);
-    void process_dnstap(const dnstap::Dnstap &payload, size_t size);
+    void process_packet(const PacketView &payload, PacketDirection dir, timespec stamp, uint32_t weight = 1);
+    void process_batch(const PacketBatch &batch, uint32_t weight = 1);
+    void process_dnstap(const dnstap::Dnstap &payload, size_t size, uint32_t weight = 1);
 };
 
 class NetStreamHandler final : public visor::StreamMetricsHandler<NetworkMetricsManager>
@@ -184,8 +192,8 @@ class NetStreamHandler final : public visor::StreamMetricsHandler<NetworkMetrics
         {"top_ips", group::NetMetrics::TopIps}};
 
     void process_dnstap_cb(const dnstap::Dnstap &, size_t);
-    void process_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, pcpp::ProtocolType l4, timespec stamp);
-    void process_udp_packet_cb(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, uint32_t flowkey, timespec stamp);
+    void process_batch_cb(const PacketBatch &batch);
+    void process_packet_cb(const PacketView &payload, PacketDirection dir, timespec stamp);
     void set_start_tstamp(timespec stamp);
     void set_end_tstamp(timespec stamp);
 
@@ -206,6 +214,15 @@ public:
 
     void start() override;
     void stop() override;
+
+    void set_load_shedder(LoadShedder *shedder) override
+    {
+        StreamMetricsHandler::set_load_shedder(shedder);
+        // chained handlers run within the time of the upstream handler
+        if (!_dns_handler) {
+            _shed_probe = shedder->add_probe(name());
+        }
+    }
 };
 
 }
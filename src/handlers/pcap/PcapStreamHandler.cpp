@@ -36,7 +36,9 @@ void PcapStreamHandler::start()
         _end_tstamp_connection = _pcap_stream->end_tstamp_signal.connect(&PcapStreamHandler::set_end_tstamp, this);
 
         _pcap_tcp_reassembly_errors_connection = _pcap_stream->tcp_reassembly_error_signal.connect(&PcapStreamHandler::process_pcap_tcp_reassembly_error, this);
+        _pcap_tcp_evictions_connection = _pcap_stream->tcp_connection_evicted_signal.connect(&PcapStreamHandler::process_pcap_tcp_eviction, this);
         _pcap_stats_connection = _pcap_stream->pcap_stats_signal.connect(&PcapStreamHandler::process_pcap_stats, this);
+        _af_packet_stats_connection = _pcap_stream->af_packet_stats_signal.connect(&PcapStreamHandler::process_af_packet_stats, this);
         _heartbeat_connection = _pcap_stream->heartbeat_signal.connect(&PcapStreamHandler::check_period_shift, this);
     }
 
@@ -53,7 +55,9 @@ void PcapStreamHandler::stop()
         _start_tstamp_connection.disconnect();
         _end_tstamp_connection.disconnect();
         _pcap_tcp_reassembly_errors_connection.disconnect();
+        _pcap_tcp_evictions_connection.disconnect();
         _pcap_stats_connection.disconnect();
+        _af_packet_stats_connection.disconnect();
     }
     _heartbeat_connection.disconnect();
 
@@ -65,10 +69,18 @@ void PcapStreamHandler::process_pcap_tcp_reassembly_error(pcpp::Packet &payload,
 {
     _metrics->process_pcap_tcp_reassembly_error(payload, dir, l3, stamp);
 }
+void PcapStreamHandler::process_pcap_tcp_eviction()
+{
+    _metrics->process_pcap_tcp_eviction();
+}
 void PcapStreamHandler::process_pcap_stats(const pcpp::IPcapDevice::PcapStats &stats)
 {
     _metrics->process_pcap_stats(stats);
 }
+void PcapStreamHandler::process_af_packet_stats(const AFPacketStats &stats)
+{
+    _metrics->process_af_packet_stats(stats);
+}
 void PcapStreamHandler::set_start_tstamp(timespec stamp)
 {
     _metrics->set_start_tstamp(stamp);
@@ -87,8 +99,12 @@ void PcapMetricsBucket::specialized_merge(const AbstractMetricsBucket &o)
     std::unique_lock w_lock(_mutex);
 
     _counters.pcap_TCP_reassembly_errors += other._counters.pcap_TCP_reassembly_errors;
+    _counters.pcap_TCP_evictions += other._counters.pcap_TCP_evictions;
     _counters.pcap_os_drop += other._counters.pcap_os_drop;
     _counters.pcap_if_drop += other._counters.pcap_if_drop;
+    _counters.af_packet_freeze += other._counters.af_packet_freeze;
+
+    _af_packet_ring_usage.merge(other._af_packet_ring_usage);
 }
 
 void PcapMetricsBucket::to_prometheus(std::stringstream &out, Metric::LabelMap add_labels) const
@@ -96,8 +112,12 @@ void PcapMetricsBucket::to_prometheus(std::stringstream &out, Metric::LabelMap a
     std::shared_lock r_lock(_mutex);
 
     _counters.pcap_TCP_reassembly_errors.to_prometheus(out, add_labels);
+    _counters.pcap_TCP_evictions.to_prometheus(out, add_labels);
     _counters.pcap_os_drop.to_prometheus(out, add_labels);
     _counters.pcap_if_drop.to_prometheus(out, add_labels);
+    _counters.af_packet_freeze.to_prometheus(out, add_labels);
+
+    _af_packet_ring_usage.to_prometheus(out, add_labels);
 }
 
 void PcapMetricsBucket::to_json(json &j) const
@@ -105,8 +125,12 @@ void PcapMetricsBucket::to_json(json &j) const
     std::shared_lock r_lock(_mutex);
 
     _counters.pcap_TCP_reassembly_errors.to_json(j);
+    _counters.pcap_TCP_evictions.to_json(j);
     _counters.pcap_os_drop.to_json(j);
     _counters.pcap_if_drop.to_json(j);
+    _counters.af_packet_freeze.to_json(j);
+
+    _af_packet_ring_usage.to_json(j);
 }
 
 void PcapMetricsBucket::process_pcap_tcp_reassembly_error([[maybe_unused]] bool deep, [[maybe_unused]] pcpp::Packet &payload, [[maybe_unused]] PacketDirection dir, [[maybe_unused]] pcpp::ProtocolType l3)
@@ -114,6 +138,11 @@ void PcapMetricsBucket::process_pcap_tcp_reassembly_error([[maybe_unused]] bool
     std::unique_lock lock(_mutex);
     ++_counters.pcap_TCP_reassembly_errors;
 }
+void PcapMetricsBucket::process_pcap_tcp_eviction()
+{
+    std::unique_lock lock(_mutex);
+    ++_counters.pcap_TCP_evictions;
+}
 void PcapMetricsBucket::process_pcap_stats(const pcpp::IPcapDevice::PcapStats &stats)
 {
     std::unique_lock lock(_mutex);
@@ -134,13 +163,34 @@ void PcapMetricsBucket::process_pcap_stats(const pcpp::IPcapDevice::PcapStats &s
         _counters.pcap_last_if_drop = stats.packetsDropByInterface;
     }
 }
+void PcapMetricsBucket::process_af_packet_stats(const AFPacketStats &stats)
+{
+    std::unique_lock lock(_mutex);
+
+    // same as pcap drops, these are monotonic
+    if (_counters.af_packet_last_freeze == std::numeric_limits<uint64_t>::max()) {
+        _counters.af_packet_last_freeze = stats.freeze_q_cnt;
+    } else if (stats.freeze_q_cnt > _counters.af_packet_last_freeze) {
+        _counters.af_packet_freeze += stats.freeze_q_cnt - _counters.af_packet_last_freeze;
+        _counters.af_packet_last_freeze = stats.freeze_q_cnt;
+    }
+
+    if (stats.num_blocks) {
+        _af_packet_ring_usage.update(stats.blocks_in_use * 100 / stats.num_blocks);
+    }
+}
 
 // the general metrics manager entry point
 void PcapMetricsManager::process_pcap_tcp_reassembly_error(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, timespec stamp)
 {
-    new_event(stamp);
+    auto deep = new_event(stamp);
     // process in the "live" bucket
-    live_bucket()->process_pcap_tcp_reassembly_error(_deep_sampling_now, payload, dir, l3);
+    live_bucket()->process_pcap_tcp_reassembly_error(deep, payload, dir, l3);
+}
+void PcapMetricsManager::process_pcap_tcp_eviction()
+{
+    // not an event, only counted in the live bucket
+    live_bucket()->process_pcap_tcp_eviction();
 }
 void PcapMetricsManager::process_pcap_stats(const pcpp::IPcapDevice::PcapStats &stats)
 {
@@ -152,5 +202,10 @@ void PcapMetricsManager::process_pcap_stats(const pcpp::IPcapDevice::PcapStats &
     // process in the "live" bucket
     live_bucket()->process_pcap_stats(stats);
 }
+void PcapMetricsManager::process_af_packet_stats(const AFPacketStats &stats)
+{
+    // not an event, only sampled into the live bucket
+    live_bucket()->process_af_packet_stats(stats);
+}
 
-}
\ No newline at end of file
+}
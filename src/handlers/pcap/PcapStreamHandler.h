@@ -25,6 +25,7 @@ protected:
     struct counters {
 
         Counter pcap_TCP_reassembly_errors;
+        Counter pcap_TCP_evictions;
 
         Counter pcap_os_drop;
         uint64_t pcap_last_os_drop{std::numeric_limits<uint64_t>::max()};
@@ -32,17 +33,25 @@ protected:
         Counter pcap_if_drop;
         uint64_t pcap_last_if_drop{std::numeric_limits<uint64_t>::max()};
 
+        Counter af_packet_freeze;
+        uint64_t af_packet_last_freeze{std::numeric_limits<uint64_t>::max()};
+
         counters()
             : pcap_TCP_reassembly_errors("pcap", {"tcp_reassembly_errors"}, "Count of TCP reassembly errors")
+            , pcap_TCP_evictions("pcap", {"tcp_connection_evictions"}, "Count of TCP connections closed before going idle because tcp_max_connections was reached")
             , pcap_os_drop("pcap", {"os_drops"}, "Count of packets dropped by the operating system (if supported)")
             , pcap_if_drop("pcap", {"if_drops"}, "Count of packets dropped by the interface (if supported)")
+            , af_packet_freeze("pcap", {"af_packet", "queue_freezes"}, "Count of times the AF_PACKET ring was frozen because it was full (af_packet only)")
         {
         }
     };
     counters _counters;
 
+    Quantile<uint64_t> _af_packet_ring_usage;
+
 public:
     PcapMetricsBucket()
+        : _af_packet_ring_usage("pcap", {"af_packet", "ring_usage_pct"}, "Quantiles of the percentage of AF_PACKET ring blocks waiting to be processed, sampled every second (af_packet only)")
     {
     }
 
@@ -59,7 +68,9 @@ public:
     void to_prometheus(std::stringstream &out, Metric::LabelMap add_labels = {}) const override;
 
     void process_pcap_tcp_reassembly_error(bool deep, pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3);
+    void process_pcap_tcp_eviction();
     void process_pcap_stats(const pcpp::IPcapDevice::PcapStats &stats);
+    void process_af_packet_stats(const AFPacketStats &stats);
 };
 
 class PcapMetricsManager final : public visor::AbstractMetricsManager<PcapMetricsBucket>
@@ -71,7 +82,9 @@ public:
     }
 
     void process_pcap_tcp_reassembly_error(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, timespec stamp);
+    void process_pcap_tcp_eviction();
     void process_pcap_stats(const pcpp::IPcapDevice::PcapStats &stats);
+    void process_af_packet_stats(const AFPacketStats &stats);
 };
 
 class PcapStreamHandler final : public visor::StreamMetricsHandler<PcapMetricsManager>
@@ -83,12 +96,16 @@ class PcapStreamHandler final : public visor::StreamMetricsHandler<PcapMetricsMa
     sigslot::connection _end_tstamp_connection;
 
     sigslot::connection _pcap_tcp_reassembly_errors_connection;
+    sigslot::connection _pcap_tcp_evictions_connection;
     sigslot::connection _pcap_stats_connection;
+    sigslot::connection _af_packet_stats_connection;
 
     sigslot::connection _heartbeat_connection;
 
     void process_pcap_tcp_reassembly_error(pcpp::Packet &payload, PacketDirection dir, pcpp::ProtocolType l3, timespec stamp);
+    void process_pcap_tcp_eviction();
     void process_pcap_stats(const pcpp::IPcapDevice::PcapStats &stats);
+    void process_af_packet_stats(const AFPacketStats &stats);
 
     void set_start_tstamp(timespec stamp);
     void set_end_tstamp(timespec stamp);
@@ -0,0 +1,126 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "DnstapFrameView.h"
+
+namespace visor::input::dnstap {
+
+namespace {
+
+enum WireType : uint8_t {
+    VARINT = 0,
+    FIXED64 = 1,
+    LENGTH_DELIMITED = 2,
+    FIXED32 = 5
+};
+
+bool read_varint(const uint8_t *&data, const uint8_t *end, uint64_t &value)
+{
+    value = 0;
+    for (unsigned int shift = 0; shift < 64 && data < end; shift += 7) {
+        uint8_t byte = *data++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * read the next field key and, for length delimited fields, the bounds of its payload. other payloads are skipped
+ */
+bool read_field(const uint8_t *&data, const uint8_t *end, uint32_t &field, WireType &wire_type, uint64_t &value, std::string_view &bytes)
+{
+    uint64_t key;
+    if (!read_varint(data, end, key) || key >> 3 == 0 || key >> 3 > UINT32_MAX) {
+        return false;
+    }
+    field = static_cast<uint32_t>(key >> 3);
+    wire_type = static_cast<WireType>(key & 0x07);
+    switch (wire_type) {
+    case VARINT:
+        return read_varint(data, end, value);
+    case FIXED64:
+        if (end - data < 8) {
+            return false;
+        }
+        data += 8;
+        return true;
+    case FIXED32:
+        if (end - data < 4) {
+            return false;
+        }
+        data += 4;
+        return true;
+    case LENGTH_DELIMITED: {
+        uint64_t len;
+        if (!read_varint(data, end, len) || len > static_cast<uint64_t>(end - data)) {
+            return false;
+        }
+        bytes = std::string_view(reinterpret_cast<const char *>(data), len);
+        data += len;
+        return true;
+    }
+    default:
+        // groups are deprecated and not used by dnstap
+        return false;
+    }
+}
+
+}
+
+bool DnstapFrameView::_parse_message(const uint8_t *data, const uint8_t *end)
+{
+    while (data < end) {
+        uint32_t field;
+        WireType wire_type;
+        uint64_t value{0};
+        std::string_view bytes;
+        if (!read_field(data, end, field, wire_type, value, bytes)) {
+            return false;
+        }
+        if (field == MESSAGE_TYPE && wire_type == VARINT) {
+            _has_message_type = true;
+            _message_type = value;
+        } else if (field == MESSAGE_QUERY_ADDRESS && wire_type == LENGTH_DELIMITED) {
+            _has_query_address = true;
+            _query_address = bytes;
+        } else if (field == MESSAGE_RESPONSE_ADDRESS && wire_type == LENGTH_DELIMITED) {
+            _has_response_address = true;
+            _response_address = bytes;
+        }
+    }
+    return true;
+}
+
+bool DnstapFrameView::parse(const void *data, size_t len)
+{
+    *this = DnstapFrameView();
+    auto pos = static_cast<const uint8_t *>(data);
+    auto end = pos + len;
+    while (pos < end) {
+        uint32_t field;
+        WireType wire_type;
+        uint64_t value{0};
+        std::string_view bytes;
+        if (!read_field(pos, end, field, wire_type, value, bytes)) {
+            return false;
+        }
+        if (field == DNSTAP_TYPE && wire_type == VARINT) {
+            _has_type = true;
+            _type = value;
+        } else if (field == DNSTAP_MESSAGE && wire_type == LENGTH_DELIMITED) {
+            // a repeated embedded message is merged into the previous one, i.e. its fields win
+            _has_message = true;
+            auto message = reinterpret_cast<const uint8_t *>(bytes.data());
+            if (!_parse_message(message, message + bytes.size())) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,90 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace visor::input::dnstap {
+
+/**
+ * A lazy view of the few fields of an encoded dnstap frame which decide whether it is handled at all: the frame type,
+ * the message type and the query and response addresses. Addresses point into the frame, nothing is copied or
+ * allocated, and every other field is skipped over on the wire.
+ *
+ * this lets frames of the wrong type, or from filtered hosts, be dropped without decoding the whole protobuf message
+ */
+class DnstapFrameView
+{
+    // field numbers from pb/dnstap.proto
+    static constexpr uint32_t DNSTAP_MESSAGE = 14;
+    static constexpr uint32_t DNSTAP_TYPE = 15;
+    static constexpr uint32_t MESSAGE_TYPE = 1;
+    static constexpr uint32_t MESSAGE_QUERY_ADDRESS = 4;
+    static constexpr uint32_t MESSAGE_RESPONSE_ADDRESS = 5;
+
+    bool _has_type{false};
+    uint64_t _type{0};
+    bool _has_message{false};
+    bool _has_message_type{false};
+    uint64_t _message_type{0};
+    bool _has_query_address{false};
+    std::string_view _query_address;
+    bool _has_response_address{false};
+    std::string_view _response_address;
+
+    bool _parse_message(const uint8_t *data, const uint8_t *end);
+
+public:
+    /**
+     * scan an encoded Dnstap message. on success the view refers into data, which must outlive it
+     *
+     * @return false if the frame is not well formed protobuf wire format
+     */
+    bool parse(const void *data, size_t len);
+
+    bool has_type() const
+    {
+        return _has_type;
+    }
+    uint64_t type() const
+    {
+        return _type;
+    }
+
+    bool has_message() const
+    {
+        return _has_message;
+    }
+    bool has_message_type() const
+    {
+        return _has_message_type;
+    }
+    uint64_t message_type() const
+    {
+        return _message_type;
+    }
+
+    bool has_query_address() const
+    {
+        return _has_query_address;
+    }
+    std::string_view query_address() const
+    {
+        return _query_address;
+    }
+
+    bool has_response_address() const
+    {
+        return _has_response_address;
+    }
+    std::string_view response_address() const
+    {
+        return _response_address;
+    }
+};
+
+}
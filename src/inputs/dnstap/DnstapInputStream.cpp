@@ -3,9 +3,15 @@
  * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
 
 #include "DnstapInputStream.h"
+#include "AbstractMetricsManager.h"
 #include "DnstapException.h"
 #include "FrameSession.h"
+#include <cerrno>
+#include <cstring>
 #include <filesystem>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
 #include <uvw/async.h>
 #include <uvw/loop.h>
 #include <uvw/pipe.h>
@@ -15,6 +21,56 @@
 
 namespace visor::input::dnstap {
 
+static std::string client_name(uvw::TCPHandle &client)
+{
+    return client.peer().ip;
+}
+
+static std::string client_name(uvw::PipeHandle &client)
+{
+    return std::to_string(client.fd());
+}
+
+/**
+ * a listening socket bound with SO_REUSEPORT, so that every worker may bind its own to the same address and the kernel
+ * spreads new connections over them
+ */
+static int reuseport_socket(const std::string &host, unsigned int port)
+{
+    sockaddr_storage addr{};
+    socklen_t addr_len;
+    auto v4 = reinterpret_cast<sockaddr_in *>(&addr);
+    auto v6 = reinterpret_cast<sockaddr_in6 *>(&addr);
+    if (inet_pton(AF_INET, host.c_str(), &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(static_cast<uint16_t>(port));
+        addr_len = sizeof(sockaddr_in);
+    } else if (inet_pton(AF_INET6, host.c_str(), &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons(static_cast<uint16_t>(port));
+        addr_len = sizeof(sockaddr_in6);
+    } else {
+        throw DnstapException(fmt::format("invalid tcp address: {}", host));
+    }
+
+    int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw DnstapException(fmt::format("unable to create tcp socket: {}", std::strerror(errno)));
+    }
+    int on{1};
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        auto err = errno;
+        close(fd);
+        throw DnstapException(fmt::format("unable to set SO_REUSEPORT on tcp socket: {}", std::strerror(err)));
+    }
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), addr_len) < 0) {
+        auto err = errno;
+        close(fd);
+        throw DnstapException(fmt::format("unable to bind tcp socket to {}:{}: {}", host, port, std::strerror(err)));
+    }
+    return fd;
+}
+
 DnstapInputStream::DnstapInputStream(const std::string &name)
     : visor::InputStream(name)
 {
@@ -23,6 +79,32 @@ DnstapInputStream::DnstapInputStream(const std::string &name)
     assert(_logger);
 }
 
+void DnstapInputStream::_process_frame(::dnstap::Dnstap &d, const void *data, size_t len_data)
+{
+    // look at the few fields deciding whether the frame is handled before decoding all of it
+    DnstapFrameView frame;
+    if (!frame.parse(data, len_data)) {
+        _logger->warn("dnstap frame is malformed, skipping frame of size {}", len_data);
+        return;
+    }
+    if (!frame.has_type() || frame.type() != ::dnstap::Dnstap_Type_MESSAGE || !frame.has_message()) {
+        _logger->warn("dnstap data is wrong type or has no message, skipping frame of size {}", len_data);
+        return;
+    }
+    if (_filtering(frame)) {
+        return;
+    }
+
+    // Data frame ready, parse protobuf
+    if (!d.ParseFromArray(data, len_data)) {
+        _logger->warn("Dnstap::ParseFromArray fail, skipping frame of size {}", len_data);
+        return;
+    }
+
+    // Emit signal to handlers
+    dnstap_signal(d, len_data);
+}
+
 void DnstapInputStream::_read_frame_stream_file()
 {
     assert(config_exists("dnstap_file"));
@@ -44,6 +126,9 @@ void DnstapInputStream::_read_frame_stream_file()
     // Cleanup
     fstrm_file_options_destroy(&fileOptions);
 
+    // frames are decoded into the same message, see Worker::dnstap
+    ::dnstap::Dnstap d;
+
     // Loop over data frames
     for (;;) {
         const uint8_t *data;
@@ -51,21 +136,7 @@ void DnstapInputStream::_read_frame_stream_file()
 
         result = fstrm_reader_read(reader, &data, &len_data);
         if (result == fstrm_res_success) {
-            // Data frame ready, parse protobuf
-            ::dnstap::Dnstap d;
-            if (!d.ParseFromArray(data, len_data)) {
-                _logger->warn("Dnstap::ParseFromArray fail, skipping frame of size {}", len_data);
-                continue;
-            }
-            if (!d.has_type() || d.type() != ::dnstap::Dnstap_Type_MESSAGE || !d.has_message()) {
-                _logger->warn("dnstap data is wrong type or has no message, skipping frame of size {}", len_data);
-                continue;
-            }
-
-            // Emit signal to handlers
-            if (!_filtering(d)) {
-                dnstap_signal(d, len_data);
-            }
+            _process_frame(d, data, len_data);
         } else if (result == fstrm_res_stop) {
             // Normal end of data stream
             break;
@@ -107,50 +178,62 @@ void DnstapInputStream::start()
     _running = true;
 }
 
-void DnstapInputStream::_create_frame_stream_tcp_socket()
+uint64_t DnstapInputStream::_parse_workers() const
 {
-    assert(config_exists("tcp"));
-
-    // split address and port
-    auto tcp_config = config_get<std::string>("tcp");
-    if (tcp_config.find(':') == std::string::npos) {
-        throw DnstapException("invalid tcp address specification, use HOST:PORT");
-    }
-
-    std::string host;
-    unsigned int port;
-    try {
-        host = tcp_config.substr(0, tcp_config.find(':'));
-        port = std::stoul(tcp_config.substr(tcp_config.find(':') + 1, std::string::npos));
-    } catch (std::exception &err) {
-        throw DnstapException("unable to parse tcp address specification, use HOST:PORT");
+    uint64_t workers{1};
+    if (config_exists("workers")) {
+        workers = config_get<uint64_t>("workers");
+        if (workers < 1 || workers > MAX_DNSTAP_WORKERS) {
+            throw DnstapException(fmt::format("workers must be between 1 and {}", MAX_DNSTAP_WORKERS));
+        }
     }
+    return workers;
+}
 
-    // main io loop, run in its own thread
-    _io_loop = uvw::Loop::create();
-    if (!_io_loop) {
-        throw DnstapException("unable to create io loop");
-    }
-    // AsyncHandle lets us stop the loop from its own thread
-    _async_h = _io_loop->resource<uvw::AsyncHandle>();
-    if (!_async_h) {
-        throw DnstapException("unable to initialize AsyncHandle");
+void DnstapInputStream::_create_workers(uint64_t workers)
+{
+    for (uint64_t i = 0; i < workers; ++i) {
+        auto worker = std::make_unique<Worker>();
+        worker->id = static_cast<unsigned int>(i);
+
+        // io loop of this worker, run in its own thread
+        worker->loop = uvw::Loop::create();
+        if (!worker->loop) {
+            throw DnstapException("unable to create io loop");
+        }
+        worker->async_h = worker->loop->resource<uvw::AsyncHandle>();
+        if (!worker->async_h) {
+            throw DnstapException("unable to initialize AsyncHandle");
+        }
+        worker->async_h->on<uvw::AsyncEvent>([this, w = worker.get()](const auto &, auto &handle) {
+            _drain_pending_clients(*w);
+            if (!w->stopping) {
+                return;
+            }
+            if (w->id == 0) {
+                _timer->stop();
+                _timer->close();
+                if (_unix_server_h) {
+                    _unix_server_h->stop();
+                    _unix_server_h->close();
+                }
+            }
+            if (w->tcp_server_h) {
+                w->tcp_server_h->stop();
+                w->tcp_server_h->close();
+            }
+            w->loop->stop();
+            w->loop->close();
+            handle.close();
+        });
+        worker->async_h->on<uvw::ErrorEvent>([this](const auto &err, auto &handle) {
+            _logger->error("[{}] AsyncEvent error: {}", _name, err.what());
+            handle.close();
+        });
+        _workers.push_back(std::move(worker));
     }
-    _async_h->once<uvw::AsyncEvent>([this](const auto &, auto &handle) {
-        _timer->stop();
-        _timer->close();
-        _tcp_server_h->stop();
-        _tcp_server_h->close();
-        _io_loop->stop();
-        _io_loop->close();
-        handle.close();
-    });
-    _async_h->on<uvw::ErrorEvent>([this](const auto &err, auto &handle) {
-        _logger->error("[{}] AsyncEvent error: {}", _name, err.what());
-        handle.close();
-    });
 
-    _timer = _io_loop->resource<uvw::TimerHandle>();
+    _timer = _workers[0]->loop->resource<uvw::TimerHandle>();
     if (!_timer) {
         throw DnstapException("unable to initialize TimerHandle");
     }
@@ -164,133 +247,152 @@ void DnstapInputStream::_create_frame_stream_tcp_socket()
         _logger->error("[{}] TimerEvent error: {}", _name, err.what());
         handle.close();
     });
+}
 
-    // setup server socket
-    _tcp_server_h = _io_loop->resource<uvw::TCPHandle>();
-    if (!_tcp_server_h) {
-        throw DnstapException("unable to initialize server PipeHandle");
+void DnstapInputStream::_start_workers()
+{
+    // spawn the loops
+    for (auto &worker : _workers) {
+        worker->thread = std::make_unique<std::thread>([this, w = worker.get()] {
+            // each worker feeds its own shard of the handler metrics
+            worker_shard_id = w->id;
+            if (w->id == 0) {
+                _timer->start(uvw::TimerHandle::Time{1000}, uvw::TimerHandle::Time{HEARTBEAT_INTERVAL * 1000});
+            }
+            w->loop->run();
+        });
     }
+}
 
-    _tcp_server_h->on<uvw::ErrorEvent>([this](const auto &err, auto &) {
-        _logger->error("[{}] socket error: {}", _name, err.what());
-        throw DnstapException(err.what());
-    });
-
-    // ListenEvent happens on client connection
-    _tcp_server_h->on<uvw::ListenEvent>([this](const uvw::ListenEvent &, uvw::TCPHandle &) {
-        auto client = _io_loop->resource<uvw::TCPHandle>();
+void DnstapInputStream::_drain_pending_clients(Worker &worker)
+{
+    std::vector<uv_os_fd_t> pending;
+    {
+        std::unique_lock lock(worker.pending_mutex);
+        pending.swap(worker.pending_clients);
+    }
+    for (auto fd : pending) {
+        if (worker.stopping) {
+            close(fd);
+            continue;
+        }
+        auto client = worker.loop->resource<uvw::PipeHandle>();
         if (!client) {
-            throw DnstapException("unable to initialize connected client TCPHandle");
+            close(fd);
+            _logger->error("[{}]: unable to initialize handed over client PipeHandle", _name);
+            continue;
         }
+        client->open(fd);
+        _serve_client(worker, client, worker.unix_sessions);
+    }
+}
 
-        auto on_data_frame = [this](const void *data, std::size_t len_data) {
-            // Data frame ready, parse protobuf
-            ::dnstap::Dnstap d;
-            if (!d.ParseFromArray(data, len_data)) {
-                _logger->warn("Dnstap::ParseFromArray fail, skipping frame of size {}", len_data);
-                return;
-            }
-            if (!d.has_type() || d.type() != ::dnstap::Dnstap_Type_MESSAGE || !d.has_message()) {
-                _logger->warn("dnstap data is wrong type or has no message, skipping frame of size {}", len_data);
-                return;
-            }
-
-            // Emit signal to handlers
-            if (!_filtering(d)) {
-                dnstap_signal(d, len_data);
-            }
-        };
+template <typename C>
+void DnstapInputStream::_serve_client(Worker &worker, std::shared_ptr<C> client, std::unordered_map<uv_os_fd_t, std::unique_ptr<FrameSessionData<C>>> &sessions)
+{
+    auto on_data_frame = [this, &worker](const void *data, std::size_t len_data) {
+        _process_frame(worker.dnstap, data, len_data);
+    };
+
+    client->template on<uvw::ErrorEvent>([this](const uvw::ErrorEvent &err, C &c_sock) {
+        _logger->error("[{}]: dnstap client socket error: {}", _name, err.what());
+        c_sock.stop();
+        c_sock.close();
+    });
 
-        client->on<uvw::ErrorEvent>([this](const uvw::ErrorEvent &err, uvw::TCPHandle &c_sock) {
-            _logger->error("[{}]: dnstap client socket error: {}", _name, err.what());
+    // client sent data
+    client->template on<uvw::DataEvent>([this, &sessions](const uvw::DataEvent &data, C &c_sock) {
+        assert(sessions[c_sock.fd()]);
+        try {
+            sessions[c_sock.fd()]->receive_socket_data(reinterpret_cast<uint8_t *>(data.data.get()), data.length);
+        } catch (DnstapException &err) {
+            _logger->error("[{}] dnstap client read error: {}", _name, err.what());
             c_sock.stop();
             c_sock.close();
+        }
+    });
+    // client was closed
+    client->template on<uvw::CloseEvent>([this, &sessions](const uvw::CloseEvent &, C &c_sock) {
+        _logger->info("[{}]: dnstap client disconnected", _name);
+        sessions.erase(c_sock.fd());
+    });
+    // client read EOF
+    client->template on<uvw::EndEvent>([this](const uvw::EndEvent &, C &c_sock) {
+        _logger->info("[{}]: dnstap client EOF {}", _name, client_name(c_sock));
+        c_sock.stop();
+        c_sock.close();
+    });
+
+    _logger->info("[{}]: dnstap client connected {} on worker {}", _name, client_name(*client), worker.id);
+    sessions[client->fd()] = std::make_unique<FrameSessionData<C>>(client, CONTENT_TYPE, on_data_frame);
+    client->read();
+}
+
+void DnstapInputStream::_create_frame_stream_tcp_socket()
+{
+    assert(config_exists("tcp"));
+
+    // split address and port
+    auto tcp_config = config_get<std::string>("tcp");
+    if (tcp_config.find(':') == std::string::npos) {
+        throw DnstapException("invalid tcp address specification, use HOST:PORT");
+    }
+
+    std::string host;
+    unsigned int port;
+    try {
+        host = tcp_config.substr(0, tcp_config.find(':'));
+        port = std::stoul(tcp_config.substr(tcp_config.find(':') + 1, std::string::npos));
+    } catch (std::exception &err) {
+        throw DnstapException("unable to parse tcp address specification, use HOST:PORT");
+    }
+
+    auto workers = _parse_workers();
+    _create_workers(workers);
+
+    // setup server sockets, one per worker
+    for (auto &worker : _workers) {
+        worker->tcp_server_h = worker->loop->resource<uvw::TCPHandle>();
+        if (!worker->tcp_server_h) {
+            throw DnstapException("unable to initialize server PipeHandle");
+        }
+
+        worker->tcp_server_h->on<uvw::ErrorEvent>([this](const auto &err, auto &) {
+            _logger->error("[{}] socket error: {}", _name, err.what());
+            throw DnstapException(err.what());
         });
 
-        // client sent data
-        client->on<uvw::DataEvent>([this](const uvw::DataEvent &data, uvw::TCPHandle &c_sock) {
-            assert(_tcp_sessions[c_sock.fd()]);
-            try {
-                _tcp_sessions[c_sock.fd()]->receive_socket_data(reinterpret_cast<uint8_t *>(data.data.get()), data.length);
-            } catch (DnstapException &err) {
-                _logger->error("[{}] dnstap client read error: {}", _name, err.what());
-                c_sock.stop();
-                c_sock.close();
+        // ListenEvent happens on client connection
+        worker->tcp_server_h->on<uvw::ListenEvent>([this, w = worker.get()](const uvw::ListenEvent &, uvw::TCPHandle &server) {
+            auto client = w->loop->resource<uvw::TCPHandle>();
+            if (!client) {
+                throw DnstapException("unable to initialize connected client TCPHandle");
             }
+            server.accept(*client);
+            _serve_client(*w, client, w->tcp_sessions);
         });
-        // client was closed
-        client->on<uvw::CloseEvent>([this](const uvw::CloseEvent &, uvw::TCPHandle &c_sock) {
-            _logger->info("[{}]: dnstap client disconnected", _name);
-            _tcp_sessions.erase(c_sock.fd());
-        });
-        // client read EOF
-        client->on<uvw::EndEvent>([this](const uvw::EndEvent &, uvw::TCPHandle &c_sock) {
-            _logger->info("[{}]: dnstap client EOF {}", _name, c_sock.peer().ip);
-            c_sock.stop();
-            c_sock.close();
-        });
-
-        _tcp_server_h->accept(*client);
-        _logger->info("[{}]: dnstap client connected {}", _name, client->peer().ip);
-        _tcp_sessions[client->fd()] = std::make_unique<FrameSessionData<uvw::TCPHandle>>(client, CONTENT_TYPE, on_data_frame);
-        client->read();
-    });
 
-    _logger->info("[{}]: opening dnstap server on {}", _name, config_get<std::string>("tcp"));
-    _tcp_server_h->bind(host, port);
-    _tcp_server_h->listen();
+        if (workers > 1) {
+            worker->tcp_server_h->open(reuseport_socket(host, port));
+        } else {
+            worker->tcp_server_h->bind(host, port);
+        }
+        worker->tcp_server_h->listen();
+    }
+    _logger->info("[{}]: opening dnstap server on {} with {} workers", _name, config_get<std::string>("tcp"), workers);
 
-    // spawn the loop
-    _io_thread = std::make_unique<std::thread>([this] {
-        _timer->start(uvw::TimerHandle::Time{1000}, uvw::TimerHandle::Time{HEARTBEAT_INTERVAL * 1000});
-        _io_loop->run();
-    });
+    _start_workers();
 }
+
 void DnstapInputStream::_create_frame_stream_unix_socket()
 {
     assert(config_exists("socket"));
 
-    // main io loop, run in its own thread
-    _io_loop = uvw::Loop::create();
-    if (!_io_loop) {
-        throw DnstapException("unable to create io loop");
-    }
-    // AsyncHandle lets us stop the loop from its own thread
-    _async_h = _io_loop->resource<uvw::AsyncHandle>();
-    if (!_async_h) {
-        throw DnstapException("unable to initialize AsyncHandle");
-    }
-    _async_h->once<uvw::AsyncEvent>([this](const auto &, auto &handle) {
-        _timer->stop();
-        _timer->close();
-        _unix_server_h->stop();
-        _unix_server_h->close();
-        _io_loop->stop();
-        _io_loop->close();
-        handle.close();
-    });
-    _async_h->on<uvw::ErrorEvent>([this](const auto &err, auto &handle) {
-        _logger->error("[{}] AsyncEvent error: {}", _name, err.what());
-        handle.close();
-    });
-
-    _timer = _io_loop->resource<uvw::TimerHandle>();
-    if (!_timer) {
-        throw DnstapException("unable to initialize TimerHandle");
-    }
-    _timer->on<uvw::TimerEvent>([this](const auto &, auto &handle) {
-        timespec stamp;
-        // use now()
-        std::timespec_get(&stamp, TIME_UTC);
-        heartbeat_signal(stamp);
-    });
-    _timer->on<uvw::ErrorEvent>([this](const auto &err, auto &handle) {
-        _logger->error("[{}] TimerEvent error: {}", _name, err.what());
-        handle.close();
-    });
+    _create_workers(_parse_workers());
+    auto &acceptor = *_workers[0];
 
     // setup server socket
-    _unix_server_h = _io_loop->resource<uvw::PipeHandle>();
+    _unix_server_h = acceptor.loop->resource<uvw::PipeHandle>();
     if (!_unix_server_h) {
         throw DnstapException("unable to initialize server PipeHandle");
     }
@@ -301,76 +403,40 @@ void DnstapInputStream::_create_frame_stream_unix_socket()
     });
 
     // ListenEvent happens on client connection
-    _unix_server_h->on<uvw::ListenEvent>([this](const uvw::ListenEvent &, uvw::PipeHandle &) {
-        auto client = _io_loop->resource<uvw::PipeHandle>();
+    _unix_server_h->on<uvw::ListenEvent>([this, &acceptor](const uvw::ListenEvent &, uvw::PipeHandle &server) {
+        auto client = acceptor.loop->resource<uvw::PipeHandle>();
         if (!client) {
             throw DnstapException("unable to initialize connected client PipeHandle");
         }
+        server.accept(*client);
 
-        auto on_data_frame = [this](const void *data, std::size_t len_data) {
-            // Data frame ready, parse protobuf
-            ::dnstap::Dnstap d;
-            if (!d.ParseFromArray(data, len_data)) {
-                _logger->warn("Dnstap::ParseFromArray fail, skipping frame of size {}", len_data);
-                return;
-            }
-            if (!d.has_type() || d.type() != ::dnstap::Dnstap_Type_MESSAGE || !d.has_message()) {
-                _logger->warn("dnstap data is wrong type or has no message, skipping frame of size {}", len_data);
-                return;
-            }
-            // Emit signal to handlers
-            if (!_filtering(d)) {
-                dnstap_signal(d, len_data);
-            }
-        };
-
-        client->on<uvw::ErrorEvent>([this](const uvw::ErrorEvent &err, uvw::PipeHandle &c_sock) {
-            _logger->error("[{}]: dnstap client socket error: {}", _name, err.what());
-            c_sock.stop();
-            c_sock.close();
-        });
-
-        // client sent data
-        client->on<uvw::DataEvent>([this](const uvw::DataEvent &data, uvw::PipeHandle &c_sock) {
-            assert(_unix_sessions[c_sock.fd()]);
-            try {
-                _unix_sessions[c_sock.fd()]->receive_socket_data(reinterpret_cast<uint8_t *>(data.data.get()), data.length);
-            } catch (DnstapException &err) {
-                _logger->error("[{}] dnstap client read error: {}", _name, err.what());
-                c_sock.stop();
-                c_sock.close();
-            }
-        });
-        // client was closed
-        client->on<uvw::CloseEvent>([this](const uvw::CloseEvent &, uvw::PipeHandle &c_sock) {
-            _logger->info("[{}]: dnstap client disconnected", _name);
-            _unix_sessions.erase(c_sock.fd());
-        });
-        // client read EOF
-        client->on<uvw::EndEvent>([this](const uvw::EndEvent &, uvw::PipeHandle &c_sock) {
-            _logger->info("[{}]: dnstap client EOF {}", _name, c_sock.fd());
-            c_sock.stop();
-            c_sock.close();
-        });
-
-        _unix_server_h->accept(*client);
-        _logger->info("[{}]: dnstap client connected {}", _name, client->fd());
-        _unix_sessions[client->fd()] = std::make_unique<FrameSessionData<uvw::PipeHandle>>(client, CONTENT_TYPE, on_data_frame);
-        client->read();
+        auto &worker = *_workers[_next_unix_worker++ % _workers.size()];
+        if (&worker == &acceptor) {
+            _serve_client(worker, client, worker.unix_sessions);
+            return;
+        }
+        // a handle belongs to the loop which created it: hand a copy of the descriptor over to the worker loop
+        auto fd = dup(client->fd());
+        client->close();
+        if (fd < 0) {
+            _logger->error("[{}]: unable to hand dnstap client over to worker {}: {}", _name, worker.id, std::strerror(errno));
+            return;
+        }
+        {
+            std::unique_lock lock(worker.pending_mutex);
+            worker.pending_clients.push_back(fd);
+        }
+        worker.async_h->send();
     });
 
     // attempt to remove socket if it exists, ignore errors
     std::filesystem::remove(config_get<std::string>("socket"));
 
-    _logger->info("[{}]: opening dnstap server on {}", _name, config_get<std::string>("socket"));
+    _logger->info("[{}]: opening dnstap server on {} with {} workers", _name, config_get<std::string>("socket"), _workers.size());
     _unix_server_h->bind(config_get<std::string>("socket"));
     _unix_server_h->listen();
 
-    // spawn the loop
-    _io_thread = std::make_unique<std::thread>([this] {
-        _timer->start(uvw::TimerHandle::Time{1000}, uvw::TimerHandle::Time{HEARTBEAT_INTERVAL * 1000});
-        _io_loop->run();
-    });
+    _start_workers();
 }
 
 void DnstapInputStream::_parse_host_specs(const std::vector<std::string> &host_list)
@@ -397,7 +463,7 @@ void DnstapInputStream::_parse_host_specs(const std::vector<std::string> &host_l
             if (inet_pton(AF_INET6, ip.c_str(), &ipv6) != 1) {
                 throw DnstapException(fmt::format("invalid IPv6 address: {}", ip));
             }
-            _IPv6_host_list.emplace_back(ipv6, cidr_number);
+            _host_table.add(ipv6, static_cast<uint8_t>(cidr_number));
         } else {
             if (cidr_number < 0 || cidr_number > 32) {
                 throw DnstapException(fmt::format("invalid CIDR: {}", host));
@@ -406,47 +472,19 @@ void DnstapInputStream::_parse_host_specs(const std::vector<std::string> &host_l
             if (inet_pton(AF_INET, ip.c_str(), &ipv4) != 1) {
                 throw DnstapException(fmt::format("invalid IPv4 address: {}", ip));
             }
-            _IPv4_host_list.emplace_back(ipv4, cidr_number);
+            _host_table.add(ipv4, static_cast<uint8_t>(cidr_number));
         }
     }
 }
 
-bool DnstapInputStream::_match_subnet(const std::string &dnstap_ip)
+bool DnstapInputStream::_match_subnet(std::string_view dnstap_ip)
 {
-    if (dnstap_ip.size() == 16 && _IPv6_host_list.size() > 0) {
-        in6_addr ipv6;
-        std::memcpy(&ipv6, dnstap_ip.c_str(), sizeof(in6_addr));
-        for (const auto &net : _IPv6_host_list) {
-            uint8_t prefixLength = net.second;
-            auto network = net.first;
-            uint8_t compareByteCount = prefixLength / 8;
-            uint8_t compareBitCount = prefixLength % 8;
-            bool result = false;
-            if (compareByteCount > 0) {
-                result = std::memcmp(&network.s6_addr, &ipv6.s6_addr, compareByteCount) == 0;
-            }
-            if ((result || prefixLength < 8) && compareBitCount > 0) {
-                uint8_t subSubnetByte = network.s6_addr[compareByteCount] >> (8 - compareBitCount);
-                uint8_t subThisByte = ipv6.s6_addr[compareByteCount] >> (8 - compareBitCount);
-                result = subSubnetByte == subThisByte;
-            }
-            if (result) {
-                return true;
-            }
-        }
-    } else if (dnstap_ip.size() == 4 && _IPv4_host_list.size() > 0) {
-        in_addr ipv4;
-        std::memcpy(&ipv4, dnstap_ip.c_str(), sizeof(in_addr));
-        for (const auto &net : _IPv4_host_list) {
-            uint8_t cidr = net.second;
-            if (cidr == 0) {
-                return true;
-            }
-            uint32_t mask = htonl((0xFFFFFFFFu) << (32 - cidr));
-            if (!((ipv4.s_addr ^ net.first.s_addr) & mask)) {
-                return true;
-            }
-        }
+    if (dnstap_ip.size() == 16) {
+        return _host_table.match(reinterpret_cast<const uint8_t *>(dnstap_ip.data()));
+    } else if (dnstap_ip.size() == 4) {
+        uint32_t ipv4;
+        std::memcpy(&ipv4, dnstap_ip.data(), sizeof(ipv4));
+        return _host_table.match(ipv4);
     }
 
     return false;
@@ -458,12 +496,15 @@ void DnstapInputStream::stop()
         return;
     }
 
-    if (_async_h && _io_thread) {
-        // we have to use AsyncHandle to stop the loop from the same thread the loop is running in
-        _async_h->send();
-        // waits for _io_loop->run() to return
-        if (_io_thread->joinable()) {
-            _io_thread->join();
+    // we have to use AsyncHandle to stop each loop from the same thread the loop is running in
+    for (auto &worker : _workers) {
+        worker->stopping = true;
+        worker->async_h->send();
+    }
+    // waits for each loop run() to return
+    for (auto &worker : _workers) {
+        if (worker->thread && worker->thread->joinable()) {
+            worker->thread->join();
         }
     }
 
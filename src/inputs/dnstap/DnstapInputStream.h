@@ -4,13 +4,19 @@
 
 #pragma once
 
+#include "DnstapFrameView.h"
 #include "FrameSession.h"
 #include "InputStream.h"
+#include "SubnetTable.h"
 #include "dnstap.pb.h"
 #include <DnsLayer.h>
+#include <atomic>
+#include <mutex>
 #include <spdlog/spdlog.h>
+#include <thread>
 #include <unordered_map>
 #include <uv.h>
+#include <vector>
 
 namespace uvw {
 class Loop;
@@ -24,28 +30,76 @@ struct fstrm_reader;
 
 namespace visor::input::dnstap {
 
-typedef std::pair<in_addr, uint8_t> Ipv4Subnet;
-typedef std::pair<in6_addr, uint8_t> Ipv6Subnet;
-
 const static std::string CONTENT_TYPE = "protobuf:dnstap.Dnstap";
 
+/**
+ * the key deciding whether a dnstap message is deep sampled in flow sampling mode: the query address and port and the
+ * DNS message id, so that a query and its response are sampled alike by every handler
+ */
+inline uint64_t dnstap_sample_key(const ::dnstap::Dnstap &d)
+{
+    const auto &message = d.message();
+    uint32_t flow = 2166136261u;
+    auto fnv1a = [&flow](const uint8_t *p, size_t len) {
+        for (size_t i = 0; i < len; ++i) {
+            flow ^= p[i];
+            flow *= 16777619u;
+        }
+    };
+    fnv1a(reinterpret_cast<const uint8_t *>(message.query_address().data()), message.query_address().size());
+    uint32_t port = message.query_port();
+    fnv1a(reinterpret_cast<const uint8_t *>(&port), sizeof(port));
+
+    const auto &wire = message.has_response_message() ? message.response_message() : message.query_message();
+    uint16_t id{0};
+    if (wire.size() >= 2) {
+        id = static_cast<uint16_t>(static_cast<uint8_t>(wire[0]) << 8 | static_cast<uint8_t>(wire[1]));
+    }
+    return static_cast<uint64_t>(flow) << 16 | id;
+}
+
 class DnstapInputStream : public visor::InputStream
 {
+public:
+    static constexpr uint64_t MAX_DNSTAP_WORKERS = 64;
+
+private:
+    /**
+     * each worker runs its own io loop on its own thread, and serves a share of the client connections. frames are
+     * decoded and handed to the handlers on the thread of their worker, which writes to its own shard of the handler
+     * metrics
+     */
+    struct Worker {
+        unsigned int id{0};
+        std::shared_ptr<uvw::Loop> loop;
+        // AsyncHandle lets us stop the loop, or hand it new clients, from another thread
+        std::shared_ptr<uvw::AsyncHandle> async_h;
+        std::unique_ptr<std::thread> thread;
+        std::atomic_bool stopping{false};
+
+        // tcp: every worker listens on the port, new connections are spread over them with SO_REUSEPORT
+        std::shared_ptr<uvw::TCPHandle> tcp_server_h;
+        std::unordered_map<uv_os_fd_t, std::unique_ptr<FrameSessionData<uvw::TCPHandle>>> tcp_sessions;
+
+        // unix: connections are accepted by worker 0 and handed round robin to the workers
+        std::mutex pending_mutex;
+        std::vector<uv_os_fd_t> pending_clients;
+        std::unordered_map<uv_os_fd_t, std::unique_ptr<FrameSessionData<uvw::PipeHandle>>> unix_sessions;
+
+        // every frame of this worker is decoded into this message: clearing it keeps the memory of its fields, so
+        // decoding doesn't allocate once it has seen frames of the usual size
+        ::dnstap::Dnstap dnstap;
+    };
+
     std::shared_ptr<spdlog::logger> _logger;
 
-    std::unique_ptr<std::thread> _io_thread;
-    std::shared_ptr<uvw::Loop> _io_loop;
-    std::shared_ptr<uvw::AsyncHandle> _async_h;
+    std::vector<std::unique_ptr<Worker>> _workers;
+    // these run on the loop of worker 0
     std::shared_ptr<uvw::TimerHandle> _timer;
-
     std::shared_ptr<uvw::PipeHandle> _unix_server_h;
-    std::unordered_map<uv_os_fd_t, std::unique_ptr<FrameSessionData<uvw::PipeHandle>>> _unix_sessions;
-
-    std::shared_ptr<uvw::TCPHandle> _tcp_server_h;
-    std::unordered_map<uv_os_fd_t, std::unique_ptr<FrameSessionData<uvw::TCPHandle>>> _tcp_sessions;
+    size_t _next_unix_worker{0};
 
-    std::vector<Ipv4Subnet> _IPv4_host_list;
-    std::vector<Ipv6Subnet> _IPv6_host_list;
+    SubnetTable _host_table;
 
     enum Filters {
         OnlyHosts,
@@ -53,25 +107,33 @@ class DnstapInputStream : public visor::InputStream
     };
     std::bitset<Filters::FiltersMAX> _f_enabled;
 
+    void _process_frame(::dnstap::Dnstap &d, const void *data, size_t len_data);
     void _read_frame_stream_file();
     void _create_frame_stream_unix_socket();
     void _create_frame_stream_tcp_socket();
 
+    uint64_t _parse_workers() const;
+    void _create_workers(uint64_t workers);
+    void _start_workers();
+    void _drain_pending_clients(Worker &worker);
+    template <typename C>
+    void _serve_client(Worker &worker, std::shared_ptr<C> client, std::unordered_map<uv_os_fd_t, std::unique_ptr<FrameSessionData<C>>> &sessions);
+
     void _parse_host_specs(const std::vector<std::string> &host_list);
-    bool _match_subnet(const std::string &dnstap_ip);
+    bool _match_subnet(std::string_view dnstap_ip);
 
-    inline bool _filtering(const ::dnstap::Dnstap &d)
+    inline bool _filtering(const DnstapFrameView &d)
     {
         if (_f_enabled[Filters::OnlyHosts]) {
-            if (d.message().has_query_address() && d.message().has_response_address()) {
-                if (!_match_subnet(d.message().query_address()) && !_match_subnet(d.message().response_address())) {
+            if (d.has_query_address() && d.has_response_address()) {
+                if (!_match_subnet(d.query_address()) && !_match_subnet(d.response_address())) {
                     // message had both query and response address, and neither matched, so filter
                     return true;
                 }
-            } else if (d.message().has_query_address() && !_match_subnet(d.message().query_address())) {
+            } else if (d.has_query_address() && !_match_subnet(d.query_address())) {
                 // message had only query address and it didn't match, so filter
                 return true;
-            } else if (d.message().has_response_address() && !_match_subnet(d.message().response_address())) {
+            } else if (d.has_response_address() && !_match_subnet(d.response_address())) {
                 // message had only response address and it didn't match, so filter
                 return true;
             } else {
@@ -95,6 +157,11 @@ public:
     void start() override;
     void stop() override;
     void info_json(json &j) const override;
+    uint64_t capture_threads() const override
+    {
+        // dnstap files are read on the calling thread
+        return config_exists("dnstap_file") ? 1 : _parse_workers();
+    }
     size_t consumer_count() const override
     {
         return policy_signal.slot_count() + heartbeat_signal.slot_count() + dnstap_signal.slot_count();
@@ -5,14 +5,123 @@
 #pragma once
 
 #include "DnstapException.h"
+#include <algorithm>
 #include <arpa/inet.h>
 #include <cstring>
 #include <fstrm/fstrm.h>
 #include <functional>
 #include <memory>
+#include <vector>
 
 namespace visor::input::dnstap {
 
+/**
+ * The frame stream data received from a client but not consumed yet. frames are handed out in place, only a frame
+ * which wraps around the end of the ring is copied to be contiguous. the ring grows to hold the largest frame seen,
+ * and is never moved or compacted otherwise
+ */
+class FrameRingBuffer
+{
+public:
+    static constexpr size_t MIN_CAPACITY = 64 * 1024;
+
+private:
+    std::vector<uint8_t> _ring;
+    size_t _mask{0};
+    // read and write positions, masked on access
+    size_t _head{0};
+    size_t _tail{0};
+    std::vector<uint8_t> _wrapped;
+
+    void _reserve(size_t size)
+    {
+        if (size <= _ring.size()) {
+            return;
+        }
+        auto capacity = std::max(_ring.size(), MIN_CAPACITY);
+        while (capacity < size) {
+            capacity <<= 1;
+        }
+        std::vector<uint8_t> ring(capacity);
+        auto used = this->size();
+        copy(0, ring.data(), used);
+        _ring.swap(ring);
+        _mask = capacity - 1;
+        _head = 0;
+        _tail = used;
+    }
+
+public:
+    size_t size() const
+    {
+        return _tail - _head;
+    }
+
+    bool empty() const
+    {
+        return _head == _tail;
+    }
+
+    size_t capacity() const
+    {
+        return _ring.size();
+    }
+
+    void append(const uint8_t *data, size_t len)
+    {
+        if (!len) {
+            return;
+        }
+        _reserve(size() + len);
+        auto pos = _tail & _mask;
+        auto first = std::min(len, _ring.size() - pos);
+        std::memcpy(_ring.data() + pos, data, first);
+        if (first < len) {
+            std::memcpy(_ring.data(), data + first, len - first);
+        }
+        _tail += len;
+    }
+
+    /**
+     * copy len bytes starting offset bytes past the read position. the caller checks that they were received
+     */
+    void copy(size_t offset, void *out, size_t len) const
+    {
+        if (!len) {
+            return;
+        }
+        auto pos = (_head + offset) & _mask;
+        auto first = std::min(len, _ring.size() - pos);
+        std::memcpy(out, _ring.data() + pos, first);
+        if (first < len) {
+            std::memcpy(static_cast<uint8_t *>(out) + first, _ring.data(), len - first);
+        }
+    }
+
+    /**
+     * @return len contiguous bytes starting offset bytes past the read position, valid until the next call
+     */
+    const uint8_t *contiguous(size_t offset, size_t len)
+    {
+        auto pos = (_head + offset) & _mask;
+        if (pos + len <= _ring.size()) {
+            return _ring.data() + pos;
+        }
+        _wrapped.resize(len);
+        copy(offset, _wrapped.data(), len);
+        return _wrapped.data();
+    }
+
+    void consume(size_t len)
+    {
+        _head += len;
+        if (_head == _tail) {
+            // start over at the beginning of the ring, so that the next frames are less likely to wrap
+            _head = _tail = 0;
+        }
+    }
+};
+
 template <typename C>
 class FrameSessionData
 {
@@ -29,8 +138,7 @@ public:
 private:
     std::shared_ptr<C> _client_h;
     std::string _content_type;
-    using binary = std::basic_string<uint8_t>;
-    binary _buffer;
+    FrameRingBuffer _buffer;
     bool _is_bidir;
 
     on_data_frame_cb_t _on_data_frame_cb;
@@ -162,10 +270,11 @@ bool FrameSessionData<C>::_try_yield_frame()
     std::uint32_t frame_len{0};
 
     if (_buffer.size() < sizeof(frame_len)) {
-        throw DnstapException("invalid data: header length");
+        // need more data
+        return false;
     }
 
-    std::memcpy(&frame_len, _buffer.data(), sizeof(frame_len));
+    _buffer.copy(0, &frame_len, sizeof(frame_len));
     frame_len = ntohl(frame_len);
 
     if (frame_len != 0) {
@@ -181,26 +290,25 @@ bool FrameSessionData<C>::_try_yield_frame()
         }
 
         if (_buffer.size() >= sizeof(frame_len) + frame_len) {
-            _on_data_frame_cb(_buffer.data() + sizeof(frame_len), frame_len);
-            _buffer.erase(0, sizeof(frame_len) + frame_len);
+            _on_data_frame_cb(_buffer.contiguous(sizeof(frame_len), frame_len), frame_len);
+            _buffer.consume(sizeof(frame_len) + frame_len);
         } else {
             // need more data
             return false;
         }
     } else {
-        // this is a control frame
+        // this is a control frame, after the escape code
         // note this happens infrequently
 
-        _buffer.erase(0, sizeof(frame_len)); // erase escape code
-
         // get control frame length
         std::uint32_t ctrl_len{0};
 
-        if (_buffer.size() < sizeof(ctrl_len)) {
-            throw DnstapException("invalid data: control frame length");
+        if (_buffer.size() < sizeof(frame_len) + sizeof(ctrl_len)) {
+            // need more data
+            return false;
         }
 
-        std::memcpy(&ctrl_len, _buffer.data(), sizeof(ctrl_len));
+        _buffer.copy(sizeof(frame_len), &ctrl_len, sizeof(ctrl_len));
         ctrl_len = ntohl(ctrl_len);
 
         // ensure we never allocate more than max
@@ -208,18 +316,18 @@ bool FrameSessionData<C>::_try_yield_frame()
             throw DnstapException("control frame too large");
         }
 
-        if (_buffer.size() >= sizeof(ctrl_len) + ctrl_len) {
-            if (!_decode_control_frame(_buffer.data() + sizeof(ctrl_len), ctrl_len)) {
+        if (_buffer.size() >= sizeof(frame_len) + sizeof(ctrl_len) + ctrl_len) {
+            if (!_decode_control_frame(_buffer.contiguous(sizeof(frame_len) + sizeof(ctrl_len), ctrl_len), ctrl_len)) {
                 throw DnstapException("unable to parse control frame");
             }
-            _buffer.erase(0, sizeof(ctrl_len) + ctrl_len);
+            _buffer.consume(sizeof(frame_len) + sizeof(ctrl_len) + ctrl_len);
         } else {
             // need more data
             return false;
         }
     }
     // parsed ok. if we have more data, try to parse another frame.
-    return _buffer.size();
+    return !_buffer.empty();
 }
 
-}
\ No newline at end of file
+}
@@ -91,6 +91,167 @@ TEST_CASE("bi-directional frame stream process", "[dnstap][frmstrm]")
     CHECK(df_count == 4);
 }
 
+TEST_CASE("frame stream split over reads", "[dnstap][frmstrm]")
+{
+    int df_count{0};
+    auto on_data_frame = [&df_count](const void *data, std::size_t len_data) {
+        df_count++;
+        ::dnstap::Dnstap d;
+        CHECK(d.ParseFromArray(data, len_data) == true);
+        CHECK(d.type() == ::dnstap::Dnstap_Type_MESSAGE);
+    };
+
+    auto client = std::make_shared<MockClient>();
+    FrameSessionData<MockClient> session(client, CONTENT_TYPE, on_data_frame);
+    // one byte at a time, so that every length and frame arrives in pieces
+    for (auto byte : bi_frame_1_len42) {
+        CHECK_NOTHROW(session.receive_socket_data(&byte, 1));
+    }
+    CHECK(session.state() == FrameSessionData<MockClient>::FrameState::Ready);
+    for (auto byte : bi_frame_2_len12) {
+        CHECK_NOTHROW(session.receive_socket_data(&byte, 1));
+    }
+    CHECK(session.state() == FrameSessionData<MockClient>::FrameState::Running);
+    for (auto byte : bi_frame_3_len400) {
+        CHECK_NOTHROW(session.receive_socket_data(&byte, 1));
+    }
+    CHECK(df_count == 4);
+}
+
+TEST_CASE("frame ring buffer", "[dnstap][frmstrm]")
+{
+    FrameRingBuffer ring;
+    CHECK(ring.empty());
+
+    std::vector<uint8_t> data(FrameRingBuffer::MIN_CAPACITY);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<uint8_t>(i * 7);
+    }
+
+    SECTION("frames wrapping around the end of the ring are contiguous")
+    {
+        ring.append(data.data(), data.size() - 10);
+        ring.consume(data.size() - 20);
+        CHECK(ring.size() == 10);
+        ring.append(data.data(), 100);
+        CHECK(ring.capacity() == FrameRingBuffer::MIN_CAPACITY);
+        CHECK(ring.size() == 110);
+
+        auto frame = ring.contiguous(0, 110);
+        CHECK(std::memcmp(frame, data.data() + data.size() - 20, 10) == 0);
+        CHECK(std::memcmp(frame + 10, data.data(), 100) == 0);
+
+        uint32_t value;
+        ring.copy(8, &value, sizeof(value));
+        CHECK(std::memcmp(&value, frame + 8, sizeof(value)) == 0);
+
+        ring.consume(110);
+        CHECK(ring.empty());
+    }
+
+    SECTION("grows to hold a large frame, keeping what was received")
+    {
+        ring.append(data.data(), data.size() - 10);
+        ring.consume(data.size() - 20);
+        ring.append(data.data(), data.size());
+        CHECK(ring.capacity() == 2 * FrameRingBuffer::MIN_CAPACITY);
+        CHECK(ring.size() == data.size() + 10);
+        auto frame = ring.contiguous(10, data.size());
+        CHECK(std::memcmp(frame, data.data(), data.size()) == 0);
+    }
+}
+
+TEST_CASE("dnstap frame view", "[dnstap][frame]")
+{
+    SECTION("matches the decoded frames")
+    {
+        int df_count{0};
+        auto on_data_frame = [&df_count](const void *data, std::size_t len_data) {
+            df_count++;
+            ::dnstap::Dnstap d;
+            REQUIRE(d.ParseFromArray(data, len_data) == true);
+            DnstapFrameView view;
+            REQUIRE(view.parse(data, len_data) == true);
+            CHECK(view.has_type() == d.has_type());
+            CHECK(view.type() == static_cast<uint64_t>(d.type()));
+            CHECK(view.has_message() == d.has_message());
+            CHECK(view.has_message_type() == d.message().has_type());
+            CHECK(view.message_type() == static_cast<uint64_t>(d.message().type()));
+            CHECK(view.has_query_address() == d.message().has_query_address());
+            CHECK(view.query_address() == d.message().query_address());
+            CHECK(view.has_response_address() == d.message().has_response_address());
+            CHECK(view.response_address() == d.message().response_address());
+            // addresses are not copied
+            if (view.has_query_address()) {
+                CHECK(view.query_address().data() > static_cast<const char *>(data));
+                CHECK(view.query_address().data() < static_cast<const char *>(data) + len_data);
+            }
+        };
+
+        auto client = std::make_shared<MockClient>();
+        FrameSessionData<MockClient> session(client, CONTENT_TYPE, on_data_frame);
+        session.receive_socket_data(bi_frame_1_len42, 42);
+        session.receive_socket_data(bi_frame_2_len12, 12);
+        session.receive_socket_data(bi_frame_3_len400, 400);
+        CHECK(df_count == 4);
+    }
+
+    SECTION("skips unknown fields and merges repeated messages")
+    {
+        ::dnstap::Dnstap d;
+        d.set_type(::dnstap::Dnstap_Type_MESSAGE);
+        d.set_identity("resolver");
+        d.mutable_message()->set_type(::dnstap::Message_Type_CLIENT_QUERY);
+        d.mutable_message()->set_query_address(std::string("\xc0\xa8\x00\x01", 4));
+        d.mutable_message()->set_query_time_sec(1);
+        d.mutable_message()->set_query_time_nsec(2);
+        auto wire = d.SerializeAsString();
+
+        ::dnstap::Dnstap more;
+        more.mutable_message()->set_type(::dnstap::Message_Type_CLIENT_RESPONSE);
+        more.mutable_message()->set_response_address(std::string(16, '\x01'));
+        wire += more.SerializePartialAsString();
+
+        DnstapFrameView view;
+        REQUIRE(view.parse(wire.data(), wire.size()) == true);
+        CHECK(view.type() == ::dnstap::Dnstap_Type_MESSAGE);
+        CHECK(view.message_type() == ::dnstap::Message_Type_CLIENT_RESPONSE);
+        CHECK(view.query_address() == std::string_view("\xc0\xa8\x00\x01", 4));
+        CHECK(view.has_response_address() == true);
+        CHECK(view.response_address().size() == 16);
+
+        ::dnstap::Dnstap merged;
+        REQUIRE(merged.ParseFromString(wire) == true);
+        CHECK(view.message_type() == static_cast<uint64_t>(merged.message().type()));
+        CHECK(view.response_address() == merged.message().response_address());
+    }
+
+    SECTION("rejects malformed frames")
+    {
+        ::dnstap::Dnstap d;
+        d.set_type(::dnstap::Dnstap_Type_MESSAGE);
+        d.mutable_message()->set_type(::dnstap::Message_Type_CLIENT_QUERY);
+        d.mutable_message()->set_query_message(std::string(64, 'q'));
+        auto wire = d.SerializeAsString();
+
+        DnstapFrameView view;
+        for (size_t len = 1; len < wire.size(); ++len) {
+            ::dnstap::Dnstap truncated;
+            if (!truncated.ParsePartialFromArray(wire.data(), static_cast<int>(len))) {
+                CHECK(view.parse(wire.data(), len) == false);
+            }
+        }
+        CHECK(view.parse(wire.data(), wire.size()) == true);
+
+        const uint8_t group[] = {0x0b, 0x0c};
+        CHECK(view.parse(group, sizeof(group)) == false);
+        const uint8_t field_zero[] = {0x00, 0x01};
+        CHECK(view.parse(field_zero, sizeof(field_zero)) == false);
+        const uint8_t long_varint[] = {0x78, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01};
+        CHECK(view.parse(long_varint, sizeof(long_varint)) == false);
+    }
+}
+
 TEST_CASE("dnstap file", "[dnstap][file]")
 {
     DnstapInputStream stream{"dnstap-test"};
@@ -110,6 +271,25 @@ TEST_CASE("dnstap tcp socket", "[dnstap][tcp]")
     stream.stop();
 }
 
+TEST_CASE("dnstap tcp socket workers", "[dnstap][tcp]")
+{
+    DnstapInputStream stream{"dnstap-test"};
+    stream.config_set("tcp", "127.0.0.1:5354");
+
+    SECTION("listeners share the port")
+    {
+        stream.config_set<uint64_t>("workers", 4);
+        stream.start();
+        stream.stop();
+    }
+
+    SECTION("invalid worker count")
+    {
+        stream.config_set<uint64_t>("workers", 0);
+        REQUIRE_THROWS_WITH(stream.start(), "workers must be between 1 and 64");
+    }
+}
+
 TEST_CASE("dnstap unix socket", "[dnstap][unix]")
 {
     DnstapInputStream stream{"dnstap-test"};
@@ -119,6 +299,16 @@ TEST_CASE("dnstap unix socket", "[dnstap][unix]")
     stream.stop();
 }
 
+TEST_CASE("dnstap unix socket workers", "[dnstap][unix]")
+{
+    DnstapInputStream stream{"dnstap-test"};
+    stream.config_set("socket", "/tmp/dnstap-test-workers.sock");
+    stream.config_set<uint64_t>("workers", 4);
+
+    stream.start();
+    stream.stop();
+}
+
 TEST_CASE("dnstap file filter by valid subnet", "[dnstap][file][filter]")
 {
     DnstapInputStream stream{"dnstap-test"};
@@ -4,8 +4,8 @@
 
 #include "FlowInputStream.h"
 #include "FlowException.h"
+#include "PcapFileReader.h"
 #include <Packet.h>
-#include <PcapFileDevice.h>
 #include <UdpLayer.h>
 
 namespace visor::input::flow {
@@ -55,14 +55,18 @@ void FlowInputStream::start()
 
 void FlowInputStream::_read_from_pcap_file()
 {
-    pcpp::IFileReaderDevice *reader = pcpp::IFileReaderDevice::getReader(config_get<std::string>("pcap_file"));
-    reader->open();
+    std::unique_ptr<input::pcap::PcapFileReader> reader;
+    try {
+        reader = std::make_unique<input::pcap::PcapFileReader>(config_get<std::string>("pcap_file"));
+    } catch (const input::pcap::PcapException &e) {
+        throw FlowException(e.what());
+    }
 
     pcpp::RawPacket rawPacket;
 
     datasketches::frequent_items_sketch<uint16_t> sketch(3);
 
-    while (reader->getNextPacket(rawPacket)) {
+    while (reader->next(rawPacket)) {
         if (_flow_type == Type::SFLOW) {
             pcpp::Packet sflow_pkt(&rawPacket);
             if (sflow_pkt.isPacketOfType(pcpp::UDP)) {
@@ -94,9 +98,6 @@ void FlowInputStream::_read_from_pcap_file()
             }
         }
     }
-
-    reader->close();
-    delete reader;
 }
 
 void FlowInputStream::_create_frame_stream_udp_socket()
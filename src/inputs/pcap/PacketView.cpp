@@ -0,0 +1,308 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "PacketView.h"
+#include <cstring>
+#include <utility>
+
+namespace visor::input::pcap {
+
+static constexpr uint16_t ETHERTYPE_IPV4 = 0x0800;
+static constexpr uint16_t ETHERTYPE_IPV6 = 0x86dd;
+static constexpr uint16_t ETHERTYPE_VLAN = 0x8100;
+static constexpr uint16_t ETHERTYPE_QINQ = 0x88a8;
+static constexpr uint16_t ETHERTYPE_QINQ_OLD = 0x9100;
+static constexpr uint16_t ETHERTYPE_MPLS = 0x8847;
+static constexpr uint16_t ETHERTYPE_MPLS_MULTICAST = 0x8848;
+
+static constexpr size_t ETH_HEADER_LEN = 14;
+static constexpr size_t VLAN_HEADER_LEN = 4;
+static constexpr size_t MPLS_HEADER_LEN = 4;
+static constexpr size_t SLL_HEADER_LEN = 16;
+static constexpr size_t NULL_HEADER_LEN = 4;
+static constexpr size_t IPV4_MIN_HEADER_LEN = 20;
+static constexpr size_t IPV6_HEADER_LEN = 40;
+static constexpr size_t UDP_HEADER_LEN = 8;
+static constexpr size_t TCP_MIN_HEADER_LEN = 20;
+
+static constexpr uint8_t IPPROTO_NUM_HOPOPTS = 0;
+static constexpr uint8_t IPPROTO_NUM_TCP = 6;
+static constexpr uint8_t IPPROTO_NUM_UDP = 17;
+static constexpr uint8_t IPPROTO_NUM_ROUTING = 43;
+static constexpr uint8_t IPPROTO_NUM_FRAGMENT = 44;
+static constexpr uint8_t IPPROTO_NUM_AH = 51;
+static constexpr uint8_t IPPROTO_NUM_DSTOPTS = 60;
+
+// the maximum number of stacked VLAN tags or MPLS labels we walk before giving up
+static constexpr unsigned int MAX_ENCAPSULATIONS = 8;
+
+static inline uint16_t read16(const uint8_t *p)
+{
+    return static_cast<uint16_t>(p[0] << 8 | p[1]);
+}
+
+// the same ports as pcpp::DnsLayer::isDnsPort
+static inline bool is_dns_port(uint16_t port)
+{
+    return port == 53 || port == 5353 || port == 5355;
+}
+
+static inline uint32_t fnv1a(uint32_t hash, const uint8_t *p, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// hash the 5-tuple with the lower port (or address, on equal ports) first, so both directions of a flow match
+static uint32_t flow_hash(const PacketView &view, uint8_t protocol)
+{
+    bool swap = view.dst_port < view.src_port;
+    size_t addr_len{4};
+    const uint8_t *src, *dst;
+    if (view.l3 == pcpp::IPv4) {
+        src = reinterpret_cast<const uint8_t *>(&view.ipv4_src);
+        dst = reinterpret_cast<const uint8_t *>(&view.ipv4_dst);
+    } else {
+        addr_len = 16;
+        src = view.ipv6_src;
+        dst = view.ipv6_dst;
+    }
+    if (view.src_port == view.dst_port) {
+        swap = std::memcmp(dst, src, addr_len) < 0;
+    }
+
+    uint16_t ports[2] = {view.src_port, view.dst_port};
+    if (swap) {
+        std::swap(ports[0], ports[1]);
+        std::swap(src, dst);
+    }
+
+    uint32_t hash = 2166136261u;
+    hash = fnv1a(hash, reinterpret_cast<const uint8_t *>(ports), sizeof(ports));
+    hash = fnv1a(hash, src, addr_len);
+    hash = fnv1a(hash, dst, addr_len);
+    return fnv1a(hash, &protocol, 1);
+}
+
+static void decode_l4(const uint8_t *data, size_t offset, size_t end, uint8_t protocol, PacketView &view)
+{
+    if (view.fragment) {
+        return;
+    }
+
+    if (protocol == IPPROTO_NUM_UDP) {
+        if (end - offset < UDP_HEADER_LEN) {
+            return;
+        }
+        auto udp = data + offset;
+        view.l4 = pcpp::UDP;
+        view.l4_offset = static_cast<uint32_t>(offset);
+        view.src_port = read16(udp);
+        view.dst_port = read16(udp + 2);
+        size_t udp_len = read16(udp + 4);
+        if (udp_len >= UDP_HEADER_LEN && offset + udp_len < end) {
+            end = offset + udp_len;
+        }
+        offset += UDP_HEADER_LEN;
+    } else if (protocol == IPPROTO_NUM_TCP) {
+        if (end - offset < TCP_MIN_HEADER_LEN) {
+            return;
+        }
+        auto tcp = data + offset;
+        size_t header_len = (tcp[12] >> 4) * 4;
+        if (header_len < TCP_MIN_HEADER_LEN || end - offset < header_len) {
+            return;
+        }
+        view.l4 = pcpp::TCP;
+        view.l4_offset = static_cast<uint32_t>(offset);
+        view.src_port = read16(tcp);
+        view.dst_port = read16(tcp + 2);
+        view.tcp_flags = tcp[13];
+        offset += header_len;
+    } else {
+        return;
+    }
+
+    view.payload_offset = static_cast<uint32_t>(offset);
+    view.payload_len = static_cast<uint32_t>(end - offset);
+    view.flow_key = flow_hash(view, protocol);
+    view.sample_key = view.flow_key;
+    if (view.l4 == pcpp::TCP) {
+        view.sample_key = tcp_sample_key(view.flow_key);
+    } else if (view.payload_len >= 2 && (is_dns_port(view.src_port) || is_dns_port(view.dst_port))) {
+        view.sample_key = dns_sample_key(view.flow_key, read16(view.payload()));
+    }
+}
+
+static bool decode_ipv4(const uint8_t *data, size_t offset, size_t len, PacketView &view)
+{
+    if (len - offset < IPV4_MIN_HEADER_LEN) {
+        return false;
+    }
+    auto ip = data + offset;
+    size_t header_len = (ip[0] & 0x0f) * 4;
+    if ((ip[0] >> 4) != 4 || header_len < IPV4_MIN_HEADER_LEN || len - offset < header_len) {
+        return false;
+    }
+
+    view.l3 = pcpp::IPv4;
+    view.l3_offset = static_cast<uint32_t>(offset);
+    std::memcpy(&view.ipv4_src, ip + 12, sizeof(view.ipv4_src));
+    std::memcpy(&view.ipv4_dst, ip + 16, sizeof(view.ipv4_dst));
+    // more fragments flag or a fragment offset
+    view.fragment = (read16(ip + 6) & 0x3fff) != 0;
+
+    // the total length excludes any ethernet padding
+    size_t end = len;
+    size_t total_len = read16(ip + 2);
+    if (total_len >= header_len && offset + total_len < end) {
+        end = offset + total_len;
+    }
+
+    decode_l4(data, offset + header_len, end, ip[9], view);
+    return true;
+}
+
+static bool decode_ipv6(const uint8_t *data, size_t offset, size_t len, PacketView &view)
+{
+    if (len - offset < IPV6_HEADER_LEN) {
+        return false;
+    }
+    auto ip = data + offset;
+    if ((ip[0] >> 4) != 6) {
+        return false;
+    }
+
+    view.l3 = pcpp::IPv6;
+    view.l3_offset = static_cast<uint32_t>(offset);
+    view.ipv6_src = ip + 8;
+    view.ipv6_dst = ip + 24;
+
+    size_t end = len;
+    size_t payload_len = read16(ip + 4);
+    if (offset + IPV6_HEADER_LEN + payload_len < end) {
+        end = offset + IPV6_HEADER_LEN + payload_len;
+    }
+
+    uint8_t next = ip[6];
+    offset += IPV6_HEADER_LEN;
+    for (unsigned int i = 0; i < MAX_ENCAPSULATIONS; ++i) {
+        if (next != IPPROTO_NUM_HOPOPTS && next != IPPROTO_NUM_ROUTING && next != IPPROTO_NUM_DSTOPTS && next != IPPROTO_NUM_AH && next != IPPROTO_NUM_FRAGMENT) {
+            break;
+        }
+        if (end - offset < 8) {
+            return true;
+        }
+        auto ext = data + offset;
+        size_t ext_len = (next == IPPROTO_NUM_AH) ? (ext[1] + 2) * 4 : (ext[1] + 1) * 8;
+        if (next == IPPROTO_NUM_FRAGMENT) {
+            // fragment offset or more fragments flag. atomic fragments carry a complete datagram
+            if ((read16(ext + 2) & 0xfff9) != 0) {
+                view.fragment = true;
+                return true;
+            }
+            ext_len = 8;
+        }
+        if (end - offset < ext_len) {
+            return true;
+        }
+        next = ext[0];
+        offset += ext_len;
+    }
+
+    decode_l4(data, offset, end, next, view);
+    return true;
+}
+
+static bool decode_ip(const uint8_t *data, size_t offset, size_t len, PacketView &view)
+{
+    if (offset >= len) {
+        return false;
+    }
+    switch (data[offset] >> 4) {
+    case 4:
+        return decode_ipv4(data, offset, len, view);
+    case 6:
+        return decode_ipv6(data, offset, len, view);
+    default:
+        return false;
+    }
+}
+
+static bool decode_ethertype(const uint8_t *data, size_t offset, size_t len, uint16_t ether_type, PacketView &view)
+{
+    for (unsigned int i = 0; i < MAX_ENCAPSULATIONS; ++i) {
+        switch (ether_type) {
+        case ETHERTYPE_IPV4:
+            return decode_ipv4(data, offset, len, view);
+        case ETHERTYPE_IPV6:
+            return decode_ipv6(data, offset, len, view);
+        case ETHERTYPE_VLAN:
+        case ETHERTYPE_QINQ:
+        case ETHERTYPE_QINQ_OLD:
+            if (len - offset < VLAN_HEADER_LEN) {
+                return false;
+            }
+            ether_type = read16(data + offset + 2);
+            offset += VLAN_HEADER_LEN;
+            break;
+        case ETHERTYPE_MPLS:
+        case ETHERTYPE_MPLS_MULTICAST:
+            // pop labels until the bottom of the stack, then guess the payload from the ip version
+            for (unsigned int j = 0; j < MAX_ENCAPSULATIONS; ++j) {
+                if (len - offset < MPLS_HEADER_LEN) {
+                    return false;
+                }
+                bool bottom = data[offset + 2] & 0x01;
+                offset += MPLS_HEADER_LEN;
+                if (bottom) {
+                    return decode_ip(data, offset, len, view);
+                }
+            }
+            return false;
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+bool decode_packet(const uint8_t *data, size_t len, pcpp::LinkLayerType link_type, PacketView &view)
+{
+    view = PacketView();
+    view.data = data;
+    view.len = len;
+
+    switch (link_type) {
+    case pcpp::LINKTYPE_ETHERNET:
+        if (len < ETH_HEADER_LEN) {
+            return false;
+        }
+        return decode_ethertype(data, ETH_HEADER_LEN, len, read16(data + 12), view);
+    case pcpp::LINKTYPE_LINUX_SLL:
+        if (len < SLL_HEADER_LEN) {
+            return false;
+        }
+        return decode_ethertype(data, SLL_HEADER_LEN, len, read16(data + 14), view);
+    case pcpp::LINKTYPE_NULL:
+    case pcpp::LINKTYPE_LOOP:
+        // the address family is in the byte order of the capturing host, the ip version tells us all we need
+        return decode_ip(data, NULL_HEADER_LEN, len, view);
+    case pcpp::LINKTYPE_RAW:
+    case pcpp::LINKTYPE_DLT_RAW1:
+    case pcpp::LINKTYPE_DLT_RAW2:
+        return decode_ip(data, 0, len, view);
+    case pcpp::LINKTYPE_IPV4:
+        return decode_ipv4(data, 0, len, view);
+    case pcpp::LINKTYPE_IPV6:
+        return decode_ipv6(data, 0, len, view);
+    default:
+        return false;
+    }
+}
+
+}
@@ -0,0 +1,88 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#include <ProtocolType.h>
+#include <RawPacket.h>
+#pragma GCC diagnostic pop
+#include <cstddef>
+#include <cstdint>
+
+namespace visor::input::pcap {
+
+/**
+ * A decoded view of the L2-L4 headers of a single frame. it points into the captured frame and owns nothing, so it is
+ * only valid for as long as the frame data it was decoded from (i.e. for the duration of the packet signal)
+ */
+struct PacketView {
+    static constexpr uint8_t TCP_FIN = 0x01;
+    static constexpr uint8_t TCP_SYN = 0x02;
+    static constexpr uint8_t TCP_RST = 0x04;
+    static constexpr uint8_t TCP_ACK = 0x10;
+
+    const uint8_t *data{nullptr};
+    size_t len{0};
+
+    pcpp::ProtocolType l3{pcpp::UnknownProtocol};
+    pcpp::ProtocolType l4{pcpp::UnknownProtocol};
+
+    // offsets from data. 0 means the layer was not found
+    uint32_t l3_offset{0};
+    uint32_t l4_offset{0};
+    uint32_t payload_offset{0};
+    // l4 payload length, bounded by both the captured length and the ip/udp length fields
+    uint32_t payload_len{0};
+
+    // addresses are kept in network byte order, as they appear on the wire
+    uint32_t ipv4_src{0};
+    uint32_t ipv4_dst{0};
+    const uint8_t *ipv6_src{nullptr};
+    const uint8_t *ipv6_dst{nullptr};
+
+    // ports are in host byte order
+    uint16_t src_port{0};
+    uint16_t dst_port{0};
+    uint8_t tcp_flags{0};
+    bool fragment{false};
+
+    // direction independent 5-tuple hash, the same for both sides of a conversation
+    uint32_t flow_key{0};
+    // flow_key, and for DNS over UDP the message id as well: see dns_sample_key() and tcp_sample_key()
+    uint64_t sample_key{0};
+
+    const uint8_t *payload() const
+    {
+        return data + payload_offset;
+    }
+};
+
+/**
+ * the key deciding whether a DNS message is deep sampled in flow sampling mode: its flow and its id, so that a query and
+ * its response are sampled alike by every handler
+ */
+inline uint64_t dns_sample_key(uint32_t flow_key, uint16_t id)
+{
+    return static_cast<uint64_t>(flow_key) << 16 | id;
+}
+
+/**
+ * the key deciding whether a TCP packet, or a DNS message reassembled from its connection, is sampled: its flow alone,
+ * since segments do not line up with messages. every handler samples the same connections
+ */
+inline uint64_t tcp_sample_key(uint32_t flow_key)
+{
+    return flow_key;
+}
+
+/**
+ * decode the Ethernet (with VLAN/QinQ and MPLS), Linux cooked, null/loopback or raw IP headers of a captured frame in
+ * place, filling view without allocating. IP fragments are reported with an unknown l4, as they are by pcpp::Packet
+ * @return false if no IP layer could be found, in which case only data and len are set
+ */
+bool decode_packet(const uint8_t *data, size_t len, pcpp::LinkLayerType link_type, PacketView &view);
+
+}
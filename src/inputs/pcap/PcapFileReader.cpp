@@ -0,0 +1,382 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "PcapFileReader.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace visor::input::pcap {
+
+static constexpr uint32_t PCAP_MAGIC_USEC = 0xa1b2c3d4;
+static constexpr uint32_t PCAP_MAGIC_NSEC = 0xa1b23c4d;
+static constexpr size_t PCAP_FILE_HEADER_LEN = 24;
+static constexpr size_t PCAP_RECORD_HEADER_LEN = 16;
+
+// see https://www.ietf.org/archive/id/draft-tuexen-opsawg-pcapng-04.html
+static constexpr uint32_t PCAPNG_SECTION_HEADER = 0x0a0d0d0a;
+static constexpr uint32_t PCAPNG_BYTE_ORDER_MAGIC = 0x1a2b3c4d;
+static constexpr uint32_t PCAPNG_INTERFACE_DESCRIPTION = 1;
+static constexpr uint32_t PCAPNG_OBSOLETE_PACKET = 2;
+static constexpr uint32_t PCAPNG_SIMPLE_PACKET = 3;
+static constexpr uint32_t PCAPNG_ENHANCED_PACKET = 6;
+static constexpr uint16_t PCAPNG_OPT_END = 0;
+static constexpr uint16_t PCAPNG_IF_TSRESOL = 9;
+static constexpr uint16_t PCAPNG_IF_TSOFFSET = 14;
+// block type and total length before the body, total length again after it
+static constexpr size_t PCAPNG_BLOCK_OVERHEAD = 12;
+// overhead plus interface id, timestamp, captured and original length
+static constexpr size_t PCAPNG_PACKET_BLOCK_MIN_LEN = PCAPNG_BLOCK_OVERHEAD + 20;
+
+static constexpr uint64_t USEC_UNITS = 1000000;
+static constexpr uint64_t NSEC_UNITS = 1000000000;
+
+// pages further behind the read position than this are given back to the kernel
+static constexpr size_t RELEASE_DISTANCE = 64 << 20;
+
+static timespec ticks_to_timespec(uint64_t ticks, uint64_t units, int64_t offset)
+{
+    timespec stamp;
+    stamp.tv_sec = static_cast<time_t>(ticks / units + offset);
+    stamp.tv_nsec = static_cast<long>(static_cast<unsigned __int128>(ticks % units) * NSEC_UNITS / units);
+    return stamp;
+}
+
+PcapFileReader::PcapFileReader(const std::string &file_name)
+    : _file_name(file_name)
+{
+    _fd = ::open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (_fd < 0) {
+        throw PcapException(fmt::format("Cannot open pcap/pcapng file {}: {}", file_name, std::strerror(errno)));
+    }
+    struct stat st;
+    if (fstat(_fd, &st) != 0 || st.st_size < 4) {
+        _close();
+        throw PcapException(fmt::format("Cannot open pcap/pcapng file {}: not a pcap or pcapng file", file_name));
+    }
+    _size = static_cast<size_t>(st.st_size);
+    auto map = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+    if (map == MAP_FAILED) {
+        _close();
+        throw PcapException(fmt::format("Cannot map pcap/pcapng file {}: {}", file_name, std::strerror(errno)));
+    }
+    _map = static_cast<const uint8_t *>(map);
+    madvise(map, _size, MADV_SEQUENTIAL);
+
+    uint32_t magic;
+    std::memcpy(&magic, _map, sizeof(magic));
+    if (magic == PCAPNG_SECTION_HEADER) {
+        // blocks, including the section header, are read as they come
+        _pcapng = true;
+        return;
+    }
+    try {
+        _open_pcap();
+    } catch (const PcapException &) {
+        _close();
+        throw;
+    }
+}
+
+PcapFileReader::~PcapFileReader()
+{
+    _close();
+}
+
+void PcapFileReader::_close()
+{
+    for (auto &filter : _filters) {
+        pcap_freecode(&filter.program);
+    }
+    _filters.clear();
+    if (_map) {
+        munmap(const_cast<uint8_t *>(_map), _size);
+        _map = nullptr;
+    }
+    if (_fd >= 0) {
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+uint16_t PcapFileReader::_read16(const uint8_t *p) const
+{
+    uint16_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return _swapped ? __builtin_bswap16(value) : value;
+}
+
+uint32_t PcapFileReader::_read32(const uint8_t *p) const
+{
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return _swapped ? __builtin_bswap32(value) : value;
+}
+
+uint64_t PcapFileReader::_read64(const uint8_t *p) const
+{
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return _swapped ? __builtin_bswap64(value) : value;
+}
+
+void PcapFileReader::_open_pcap()
+{
+    if (_size < PCAP_FILE_HEADER_LEN) {
+        throw PcapException(fmt::format("Cannot open pcap/pcapng file {}: not a pcap or pcapng file", _file_name));
+    }
+    uint32_t magic;
+    std::memcpy(&magic, _map, sizeof(magic));
+    if (magic != PCAP_MAGIC_USEC && magic != PCAP_MAGIC_NSEC) {
+        magic = __builtin_bswap32(magic);
+        _swapped = true;
+    }
+    if (magic != PCAP_MAGIC_USEC && magic != PCAP_MAGIC_NSEC) {
+        throw PcapException(fmt::format("Cannot open pcap/pcapng file {}: not a pcap or pcapng file", _file_name));
+    }
+
+    // the link type is in the lower 16 bits, the rest may carry FCS information
+    auto link_type = static_cast<pcpp::LinkLayerType>(_read32(_map + 20) & 0xffff);
+    _interfaces.push_back({link_type, _read32(_map + 16), (magic == PCAP_MAGIC_NSEC) ? NSEC_UNITS : USEC_UNITS, 0});
+    _offset = PCAP_FILE_HEADER_LEN;
+}
+
+bool PcapFileReader::_read_section_header(const uint8_t *block)
+{
+    uint32_t magic;
+    std::memcpy(&magic, block + 8, sizeof(magic));
+    if (magic == PCAPNG_BYTE_ORDER_MAGIC) {
+        _swapped = false;
+    } else if (__builtin_bswap32(magic) == PCAPNG_BYTE_ORDER_MAGIC) {
+        _swapped = true;
+    } else {
+        return false;
+    }
+    // interface ids are per section
+    _interfaces.clear();
+    return true;
+}
+
+void PcapFileReader::_read_interface(const uint8_t *block, uint32_t block_len)
+{
+    Interface iface{pcpp::LINKTYPE_ETHERNET, 0, USEC_UNITS, 0};
+    if (block_len < PCAPNG_BLOCK_OVERHEAD + 8) {
+        // keep the ids of the following interfaces right
+        _interfaces.push_back(iface);
+        return;
+    }
+    iface.link_type = static_cast<pcpp::LinkLayerType>(_read16(block + 8));
+    iface.snaplen = _read32(block + 12);
+
+    auto opt = block + 16;
+    auto end = block + block_len - 4;
+    while (end - opt >= 4) {
+        auto code = _read16(opt);
+        auto len = _read16(opt + 2);
+        auto value = opt + 4;
+        if (code == PCAPNG_OPT_END || len > end - value) {
+            break;
+        }
+        if (code == PCAPNG_IF_TSRESOL && len >= 1) {
+            // a negative power of 10, or of 2 if the high bit is set
+            auto exponent = value[0] & 0x7f;
+            if (value[0] & 0x80) {
+                if (exponent < 64) {
+                    iface.ts_units = uint64_t(1) << exponent;
+                }
+            } else if (exponent <= 19) {
+                iface.ts_units = 1;
+                while (exponent--) {
+                    iface.ts_units *= 10;
+                }
+            }
+        } else if (code == PCAPNG_IF_TSOFFSET && len >= 8) {
+            iface.ts_offset = static_cast<int64_t>(_read64(value));
+        }
+        // values are padded to 32 bits
+        opt = value + ((len + 3) & ~3);
+    }
+    _interfaces.push_back(iface);
+}
+
+bool PcapFileReader::_next_pcap(const uint8_t *&data, uint32_t &cap_len, uint32_t &orig_len, timespec &stamp, const Interface *&iface)
+{
+    if (_size - _offset < PCAP_RECORD_HEADER_LEN) {
+        return false;
+    }
+    auto record = _map + _offset;
+    cap_len = _read32(record + 8);
+    orig_len = _read32(record + 12);
+    if (cap_len > _size - _offset - PCAP_RECORD_HEADER_LEN) {
+        // truncated file
+        return false;
+    }
+    iface = &_interfaces.front();
+    stamp.tv_sec = _read32(record);
+    stamp.tv_nsec = static_cast<long>(_read32(record + 4) * (NSEC_UNITS / iface->ts_units));
+    data = record + PCAP_RECORD_HEADER_LEN;
+    _offset += PCAP_RECORD_HEADER_LEN + cap_len;
+    return true;
+}
+
+bool PcapFileReader::_next_pcapng(const uint8_t *&data, uint32_t &cap_len, uint32_t &orig_len, timespec &stamp, const Interface *&iface)
+{
+    for (;;) {
+        if (_size - _offset < PCAPNG_BLOCK_OVERHEAD) {
+            return false;
+        }
+        auto block = _map + _offset;
+        // the section header type reads the same in both byte orders, and sets the byte order for what follows
+        uint32_t type;
+        std::memcpy(&type, block, sizeof(type));
+        if (type == PCAPNG_SECTION_HEADER) {
+            if (_size - _offset < PCAPNG_BLOCK_OVERHEAD + 4 || !_read_section_header(block)) {
+                return false;
+            }
+        } else {
+            type = _read32(block);
+        }
+        auto block_len = _read32(block + 4);
+        if (block_len < PCAPNG_BLOCK_OVERHEAD || block_len % 4 || block_len > _size - _offset) {
+            return false;
+        }
+        _offset += block_len;
+
+        uint32_t id{0};
+        uint64_t ticks{0};
+        switch (type) {
+        case PCAPNG_INTERFACE_DESCRIPTION:
+            _read_interface(block, block_len);
+            continue;
+        case PCAPNG_ENHANCED_PACKET:
+        case PCAPNG_OBSOLETE_PACKET:
+            if (block_len < PCAPNG_PACKET_BLOCK_MIN_LEN) {
+                return false;
+            }
+            id = (type == PCAPNG_ENHANCED_PACKET) ? _read32(block + 8) : _read16(block + 8);
+            ticks = static_cast<uint64_t>(_read32(block + 12)) << 32 | _read32(block + 16);
+            cap_len = _read32(block + 20);
+            orig_len = _read32(block + 24);
+            data = block + 28;
+            if (cap_len > block_len - PCAPNG_PACKET_BLOCK_MIN_LEN) {
+                return false;
+            }
+            break;
+        case PCAPNG_SIMPLE_PACKET:
+            if (block_len < PCAPNG_BLOCK_OVERHEAD + 4) {
+                return false;
+            }
+            // no timestamp and no captured length, which is bounded by the block and the snap length
+            orig_len = _read32(block + 8);
+            cap_len = std::min<uint32_t>(orig_len, block_len - PCAPNG_BLOCK_OVERHEAD - 4);
+            if (!_interfaces.empty() && _interfaces.front().snaplen) {
+                cap_len = std::min(cap_len, _interfaces.front().snaplen);
+            }
+            data = block + 12;
+            break;
+        default:
+            // statistics, name resolution, custom blocks etc.
+            continue;
+        }
+
+        if (id >= _interfaces.size()) {
+            // packet for an interface which was never described
+            continue;
+        }
+        iface = &_interfaces[id];
+        stamp = ticks_to_timespec(ticks, iface->ts_units, iface->ts_offset);
+        return true;
+    }
+}
+
+const bpf_program &PcapFileReader::_filter_program(pcpp::LinkLayerType link_type)
+{
+    for (const auto &filter : _filters) {
+        if (filter.link_type == link_type) {
+            return filter.program;
+        }
+    }
+
+    auto handle = pcap_open_dead(static_cast<int>(link_type), 262144);
+    if (!handle) {
+        throw PcapException("Cannot set BPF filter to pcap file");
+    }
+    Filter filter{link_type, {}};
+    if (pcap_compile(handle, &filter.program, _bpf.c_str(), 1, PCAP_NETMASK_UNKNOWN) != 0) {
+        auto error = fmt::format("Cannot set BPF filter to pcap file: {}", pcap_geterr(handle));
+        pcap_close(handle);
+        throw PcapException(error);
+    }
+    // the compiled program does not depend on the handle
+    pcap_close(handle);
+    _filters.push_back(filter);
+    return _filters.back().program;
+}
+
+void PcapFileReader::set_filter(const std::string &bpf)
+{
+    for (auto &filter : _filters) {
+        pcap_freecode(&filter.program);
+    }
+    _filters.clear();
+    _bpf = bpf;
+    if (_bpf.empty()) {
+        return;
+    }
+    // compile now to report errors up front. pcapng interfaces are only known as they are read
+    for (const auto &iface : _interfaces) {
+        _filter_program(iface.link_type);
+    }
+    if (_interfaces.empty()) {
+        _filter_program(pcpp::LINKTYPE_ETHERNET);
+    }
+}
+
+void PcapFileReader::_release_pages()
+{
+    if (_offset - _released < 2 * RELEASE_DISTANCE) {
+        return;
+    }
+    // the pages are clean, if anything still points into them they are simply read back in
+    static const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    auto release_to = (_offset - RELEASE_DISTANCE) / page_size * page_size;
+    madvise(const_cast<uint8_t *>(_map) + _released, release_to - _released, MADV_DONTNEED);
+    _released = release_to;
+}
+
+bool PcapFileReader::next(pcpp::RawPacket &packet)
+{
+    const uint8_t *data{nullptr};
+    uint32_t cap_len{0}, orig_len{0};
+    timespec stamp{0, 0};
+    const Interface *iface{nullptr};
+
+    for (;;) {
+        if (!(_pcapng ? _next_pcapng(data, cap_len, orig_len, stamp, iface) : _next_pcap(data, cap_len, orig_len, stamp, iface))) {
+            return false;
+        }
+        _release_pages();
+        if (_bpf.empty()) {
+            break;
+        }
+        pcap_pkthdr header;
+        header.ts.tv_sec = stamp.tv_sec;
+        header.ts.tv_usec = static_cast<suseconds_t>(stamp.tv_nsec / 1000);
+        header.caplen = cap_len;
+        header.len = orig_len;
+        if (pcap_offline_filter(&_filter_program(iface->link_type), &header, data)) {
+            break;
+        }
+    }
+
+    packet.initWithRawData(data, static_cast<int>(cap_len), stamp, iface->link_type);
+    return true;
+}
+
+}
@@ -0,0 +1,96 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#include <RawPacket.h>
+#pragma GCC diagnostic pop
+#include "utils.h"
+#include <cstdint>
+#include <pcap.h>
+#include <string>
+#include <vector>
+
+namespace visor::input::pcap {
+
+/**
+ * Reader for classic pcap (microsecond and nanosecond) and pcapng files which maps the whole file into memory and
+ * hands out packets pointing directly into the mapping, without copying them or going through libpcap's stdio reads.
+ * libpcap is only used to compile and run the optional BPF filter.
+ *
+ * packet data stays valid until the reader is destroyed. pages already read are released back to the kernel as the
+ * reader moves through the file, so files larger than memory can be read as well.
+ */
+class PcapFileReader final
+{
+    struct Interface {
+        pcpp::LinkLayerType link_type;
+        uint32_t snaplen;
+        // timestamp units per second, and the offset in seconds added to every timestamp (pcapng only)
+        uint64_t ts_units;
+        int64_t ts_offset;
+    };
+
+    struct Filter {
+        pcpp::LinkLayerType link_type;
+        bpf_program program;
+    };
+
+    std::string _file_name;
+    int _fd{-1};
+    const uint8_t *_map{nullptr};
+    size_t _size{0};
+    size_t _offset{0};
+    size_t _released{0};
+
+    bool _pcapng{false};
+    bool _swapped{false};
+    // classic pcap has a single interface, pcapng lists them per section
+    std::vector<Interface> _interfaces;
+
+    std::string _bpf;
+    // compiled once per link type
+    std::vector<Filter> _filters;
+
+    uint16_t _read16(const uint8_t *p) const;
+    uint32_t _read32(const uint8_t *p) const;
+    uint64_t _read64(const uint8_t *p) const;
+
+    void _close();
+    void _open_pcap();
+    bool _read_section_header(const uint8_t *block);
+    void _read_interface(const uint8_t *block, uint32_t block_len);
+    bool _next_pcap(const uint8_t *&data, uint32_t &cap_len, uint32_t &orig_len, timespec &stamp, const Interface *&iface);
+    bool _next_pcapng(const uint8_t *&data, uint32_t &cap_len, uint32_t &orig_len, timespec &stamp, const Interface *&iface);
+    const bpf_program &_filter_program(pcpp::LinkLayerType link_type);
+    void _release_pages();
+
+public:
+    /**
+     * map the file and read its header
+     * @throw PcapException if the file can not be opened or is not a pcap or pcapng file
+     */
+    explicit PcapFileReader(const std::string &file_name);
+    ~PcapFileReader();
+
+    PcapFileReader(const PcapFileReader &) = delete;
+    PcapFileReader &operator=(const PcapFileReader &) = delete;
+
+    /**
+     * only return packets matching a BPF filter expression
+     * @throw PcapException if the filter does not compile
+     */
+    void set_filter(const std::string &bpf);
+
+    /**
+     * point packet at the next packet in the file. packet must not own any data, it is (re)initialized without
+     * freeing what it pointed to before
+     * @return false at the end of the file, or at a truncated or malformed record
+     */
+    bool next(pcpp::RawPacket &packet);
+};
+
+}
@@ -3,6 +3,7 @@
  * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
 
 #include "PcapInputStream.h"
+#include "PcapFileReader.h"
 #include <pcap.h>
 #include <timer.hpp>
 #pragma GCC diagnostic push
@@ -16,16 +17,21 @@
 #include <IPv6Layer.h>
 #include <Logger.h>
 #include <PacketUtils.h>
-#include <PcapFileDevice.h>
 #include <SystemUtils.h>
 #pragma GCC diagnostic pop
 #include <IpUtils.h>
+#include <algorithm>
 #include <arpa/inet.h>
 #include <assert.h>
+#include <condition_variable>
 #include <cstdint>
 #include <cstring>
+#include <deque>
+#include <limits>
+#include <mutex>
 #include <netinet/in.h>
 #include <sstream>
+#include <unistd.h>
 
 using namespace std::chrono;
 
@@ -34,26 +40,28 @@ namespace visor::input::pcap {
 // static callbacks for PcapPlusPlus
 static void _tcp_message_ready_cb(int8_t side, const pcpp::TcpStreamData &tcpData, void *cookie)
 {
-    auto stream = static_cast<PcapInputStream *>(cookie);
-    stream->tcp_message_ready(side, tcpData);
+    auto shard = static_cast<CaptureShard *>(cookie);
+    shard->stream->tcp_message_ready(*shard, side, tcpData);
 }
 
 static void _tcp_connection_start_cb(const pcpp::ConnectionData &connectionData, void *cookie)
 {
-    auto stream = static_cast<PcapInputStream *>(cookie);
-    stream->tcp_connection_start(connectionData);
+    auto shard = static_cast<CaptureShard *>(cookie);
+    shard->stream->tcp_connection_start(*shard, connectionData);
 }
 
 static void _tcp_connection_end_cb(const pcpp::ConnectionData &connectionData, pcpp::TcpReassembly::ConnectionEndReason reason, void *cookie)
 {
-    auto stream = static_cast<PcapInputStream *>(cookie);
-    stream->tcp_connection_end(connectionData, reason);
+    auto shard = static_cast<CaptureShard *>(cookie);
+    shard->stream->tcp_connection_end(*shard, connectionData, reason);
 }
 
 static void _packet_arrives_cb(pcpp::RawPacket *rawPacket, [[maybe_unused]] pcpp::PcapLiveDevice *dev, void *cookie)
 {
     auto stream = static_cast<PcapInputStream *>(cookie);
     stream->process_raw_packet(rawPacket);
+    // libpcap reuses its buffer for the next packet, so every packet is its own batch
+    stream->flush_packet_batch();
 }
 
 static void _pcap_stats_update(pcpp::IPcapDevice::PcapStats &stats, void *cookie)
@@ -64,16 +72,32 @@ static void _pcap_stats_update(pcpp::IPcapDevice::PcapStats &stats, void *cookie
     stream->process_pcap_stats(stats);
 }
 
-PcapInputStream::PcapInputStream(const std::string &name)
-    : visor::InputStream(name)
-    , _pcapDevice(nullptr)
-    , _tcp_reassembly(_tcp_message_ready_cb,
+CaptureShard::CaptureShard(PcapInputStream *stream, uint64_t tcp_idle_timeout, size_t tcp_max_connections)
+    : stream(stream)
+    , connections([this](const uint32_t &flow_key, bool evicted) { close_connection(flow_key, evicted); }, tcp_idle_timeout, tcp_max_connections)
+    , reassembly(_tcp_message_ready_cb,
           this,
           _tcp_connection_start_cb,
           _tcp_connection_end_cb,
           {true, 1, 1000, 50})
+{
+}
+
+void CaptureShard::close_connection(uint32_t flow_key, bool evicted)
+{
+    // ends the connection for all handlers through tcp_connection_end
+    reassembly.closeConnection(flow_key);
+    if (evicted) {
+        stream->tcp_connection_evicted_signal();
+    }
+}
+
+PcapInputStream::PcapInputStream(const std::string &name)
+    : visor::InputStream(name)
+    , _pcapDevice(nullptr)
 {
     pcpp::Logger::getInstance().suppressLogs();
+    _capture_shards.emplace_back(std::make_unique<CaptureShard>(this, _tcp_idle_timeout, _tcp_max_connections));
 }
 
 PcapInputStream::~PcapInputStream()
@@ -87,6 +111,8 @@ void PcapInputStream::start()
         return;
     }
 
+    _parse_tcp_limits();
+
     if (config_exists("pcap_file")) {
         // read from pcap file. this is a special case from a command line utility
         assert(config_exists("bpf"));
@@ -211,13 +237,19 @@ void PcapInputStream::stop()
     }
 
 #ifdef __linux__
-    if (_af_device) {
-        _af_device->stop_capture();
+    if (_af_stats_timer) {
+        _af_stats_handle->cancel();
+        _af_stats_timer.reset();
     }
+    // joins the capture workers, so reassembly state below is no longer in use
+    for (auto &dev : _af_devices) {
+        dev->stop_capture();
+    }
+    _af_devices.clear();
 #endif
 
     // close all connections which are still opened
-    _tcp_reassembly.closeAllConnections();
+    _close_all_connections();
 
     _running = false;
 
@@ -227,22 +259,31 @@ void PcapInputStream::stop()
     }
 }
 
-void PcapInputStream::tcp_message_ready(int8_t side, const pcpp::TcpStreamData &tcpData)
+void PcapInputStream::tcp_message_ready(CaptureShard &shard, int8_t side, const pcpp::TcpStreamData &tcpData)
 {
-    tcp_message_ready_signal(side, tcpData);
-    _lru_list.put(tcpData.getConnectionData().flowKey, tcpData.getConnectionData().endTime);
+    // events must reach handlers in packet order, so the batch up to the packet carrying this message goes first.
+    // tcp packets without data, or without consumers for their data, leave the batch whole
+    if (tcp_message_ready_signal.slot_count()) {
+        _flush_batch(shard);
+    }
+    // pcpp starts every connection, with the packet it was created for, before its first message
+    auto flow_key = shard.flow_keys.find(tcpData.getConnectionData().flowKey);
+    tcp_message_ready_signal(side, tcpData, flow_key != shard.flow_keys.end() ? flow_key->second : 0);
+    shard.connections.touch(tcpData.getConnectionData().flowKey, tcpData.getConnectionData().endTime.tv_sec);
 }
 
-void PcapInputStream::tcp_connection_start(const pcpp::ConnectionData &connectionData)
+void PcapInputStream::tcp_connection_start(CaptureShard &shard, const pcpp::ConnectionData &connectionData)
 {
+    shard.flow_keys[connectionData.flowKey] = shard.packet_flow_key;
     tcp_connection_start_signal(connectionData);
-    _lru_list.put(connectionData.flowKey, connectionData.startTime);
+    shard.connections.touch(connectionData.flowKey, connectionData.startTime.tv_sec);
 }
 
-void PcapInputStream::tcp_connection_end(const pcpp::ConnectionData &connectionData, pcpp::TcpReassembly::ConnectionEndReason reason)
+void PcapInputStream::tcp_connection_end(CaptureShard &shard, const pcpp::ConnectionData &connectionData, pcpp::TcpReassembly::ConnectionEndReason reason)
 {
     tcp_connection_end_signal(connectionData, reason);
-    _lru_list.eraseElement(connectionData.flowKey);
+    shard.connections.erase(connectionData.flowKey);
+    shard.flow_keys.erase(connectionData.flowKey);
 }
 
 void PcapInputStream::process_pcap_stats(const pcpp::IPcapDevice::PcapStats &stats)
@@ -323,67 +364,112 @@ void PcapInputStream::_generate_mock_traffic()
     newPacket.computeCalculateFields();
 
     pcpp::Packet packet(newPacket.getRawPacket());
-    pcpp::ProtocolType l3 = pcpp::IPv4;
-    pcpp::ProtocolType l4 = pcpp::UDP;
-    timespec ts;
-    timespec_get(&ts, TIME_UTC);
-    packet_signal(packet, dir, l3, l4, ts);
-    udp_signal(packet, dir, l3, pcpp::hash5Tuple(&packet), ts);
+    auto &batch = _capture_shards[0]->batch;
+    batch.clear();
+    batch.emplace_back();
+    auto &decoded = batch.back();
+    decode_packet(packet.getRawPacket()->getRawData(), packet.getRawPacket()->getRawDataLen(), pcpp::LINKTYPE_ETHERNET, decoded.view);
+    decoded.dir = dir;
+    timespec_get(&decoded.stamp, TIME_UTC);
+    packet_batch_signal(batch);
+    packet_signal(packet, dir, decoded.view.l3, decoded.view.l4, decoded.stamp);
+    udp_signal(packet, dir, decoded.view.l3, decoded.view.flow_key, decoded.stamp);
+    batch.clear();
 }
 
-void PcapInputStream::process_raw_packet(pcpp::RawPacket *rawPacket)
+void PcapInputStream::_build_host_table()
 {
-    pcpp::ProtocolType l3(pcpp::UnknownProtocol), l4(pcpp::UnknownProtocol);
-    pcpp::Packet packet(rawPacket, pcpp::TCP | pcpp::UDP);
-    if (packet.isPacketOfType(pcpp::IPv4)) {
-        l3 = pcpp::IPv4;
-    } else if (packet.isPacketOfType(pcpp::IPv6)) {
-        l3 = pcpp::IPv6;
+    _host_table.clear();
+    for (auto &i : _hostIPv4) {
+        in_addr network;
+        network.s_addr = i.address.toInt();
+        _host_table.add(network, static_cast<uint8_t>(__builtin_popcount(i.mask.toInt())));
     }
-    if (packet.isPacketOfType(pcpp::UDP)) {
-        l4 = pcpp::UDP;
-    } else if (packet.isPacketOfType(pcpp::TCP)) {
-        l4 = pcpp::TCP;
+    for (auto &i : _hostIPv6) {
+        in6_addr network;
+        std::memcpy(network.s6_addr, i.address.toBytes(), sizeof(network.s6_addr));
+        _host_table.add(network, i.mask);
     }
-    // determine packet direction by matching source/dest ips
-    // note the direction may be indeterminate!
-    PacketDirection dir = PacketDirection::unknown;
-    auto IP4layer = packet.getLayerOfType<pcpp::IPv4Layer>();
-    auto IP6layer = packet.getLayerOfType<pcpp::IPv6Layer>();
-    if (IP4layer) {
-        for (auto &i : _hostIPv4) {
-            if (IP4layer->getDstIPv4Address().matchSubnet(i.address, i.mask)) {
-                dir = PacketDirection::toHost;
-                break;
-            } else if (IP4layer->getSrcIPv4Address().matchSubnet(i.address, i.mask)) {
-                dir = PacketDirection::fromHost;
-                break;
-            }
+}
+
+PacketDirection PcapInputStream::_packet_direction(const PacketView &view) const
+{
+    if (view.l3 == pcpp::IPv4) {
+        if (_host_table.match(view.ipv4_dst)) {
+            return PacketDirection::toHost;
+        } else if (_host_table.match(view.ipv4_src)) {
+            return PacketDirection::fromHost;
         }
-    } else if (IP6layer) {
-        for (auto &i : _hostIPv6) {
-            if (IP6layer->getDstIPv6Address().matchSubnet(i.address, i.mask)) {
-                dir = PacketDirection::toHost;
-                break;
-            } else if (IP6layer->getSrcIPv6Address().matchSubnet(i.address, i.mask)) {
-                dir = PacketDirection::fromHost;
-                break;
-            }
+    } else if (view.l3 == pcpp::IPv6) {
+        if (_host_table.match(view.ipv6_dst)) {
+            return PacketDirection::toHost;
+        } else if (_host_table.match(view.ipv6_src)) {
+            return PacketDirection::fromHost;
         }
     }
+    return PacketDirection::unknown;
+}
 
-    auto timestamp = rawPacket->getPacketTimeStamp();
-    // interface to handlers
-    packet_signal(packet, dir, l3, l4, timestamp);
+void PcapInputStream::flush_packet_batch()
+{
+    // NOT bounds checked, workers are numbered [0, _capture_shards.size())
+    _flush_batch(*_capture_shards[worker_shard_id]);
+}
+
+void PcapInputStream::_flush_batch(CaptureShard &shard)
+{
+    if (shard.batch.empty()) {
+        return;
+    }
+    packet_batch_signal(shard.batch);
+    shard.batch.clear();
+}
+
+void PcapInputStream::process_raw_packet(pcpp::RawPacket *rawPacket)
+{
+    // NOT bounds checked, workers are numbered [0, _capture_shards.size())
+    auto &shard = *_capture_shards[worker_shard_id];
+    shard.batch.emplace_back();
+    decode_packet(rawPacket->getRawData(), rawPacket->getRawDataLen(), rawPacket->getLinkLayerType(), shard.batch.back().view);
+    _process_decoded(shard, rawPacket);
+}
+
+void PcapInputStream::_process_decoded(CaptureShard &shard, pcpp::RawPacket *rawPacket)
+{
+    // the view of rawPacket was decoded into the last entry of the batch. the batch may be flushed below, after
+    // which only the copies taken here are valid
+    auto &decoded = shard.batch.back();
+    auto &view = decoded.view;
+    auto l3 = view.l3;
+    auto l4 = view.l4;
+    auto flow_key = view.flow_key;
+    // determine packet direction by matching source/dest ips
+    // note the direction may be indeterminate!
+    auto dir = decoded.dir = _packet_direction(view);
+    auto timestamp = decoded.stamp = rawPacket->getPacketTimeStamp();
+
+    // a full pcpp::Packet parse is only needed for tcp reassembly, and for handlers still consuming it
+    bool legacy_consumers = packet_signal.slot_count() || (l4 == pcpp::UDP && udp_signal.slot_count());
+    if (l4 != pcpp::TCP && !legacy_consumers) {
+        return;
+    }
+    pcpp::Packet packet(rawPacket, pcpp::TCP | pcpp::UDP);
+    if (legacy_consumers) {
+        // events must reach handlers in packet order, so the batch up to this packet goes first
+        _flush_batch(shard);
+        packet_signal(packet, dir, l3, l4, timestamp);
+    }
 
     if (l4 == pcpp::UDP) {
-        udp_signal(packet, dir, l3, pcpp::hash5Tuple(&packet), timestamp);
+        udp_signal(packet, dir, l3, flow_key, timestamp);
     } else if (l4 == pcpp::TCP) {
-        auto result = _tcp_reassembly.reassemblePacket(packet);
+        shard.packet_flow_key = flow_key;
+        auto result = shard.reassembly.reassemblePacket(packet);
         switch (result) {
         case pcpp::TcpReassembly::Error_PacketDoesNotMatchFlow:
         case pcpp::TcpReassembly::NonTcpPacket:
         case pcpp::TcpReassembly::NonIpPacket:
+            _flush_batch(shard);
             tcp_reassembly_error_signal(packet, dir, l3, timestamp);
         case pcpp::TcpReassembly::TcpMessageHandled:
         case pcpp::TcpReassembly::OutOfOrderTcpMessageBuffered:
@@ -394,17 +480,8 @@ void PcapInputStream::process_raw_packet(pcpp::RawPacket *rawPacket)
             break;
         }
 
-        for (uint8_t counter = 0; counter < MAX_TCP_CLEANUPS; counter++) {
-            if (_lru_list.getSize() == 0) {
-                break;
-            }
-            auto connection = _lru_list.getLRUElement();
-            if (timestamp.tv_sec < connection.second.tv_sec + TCP_TIMEOUT) {
-                break;
-            }
-            _tcp_reassembly.closeConnection(connection.first);
-            _lru_list.eraseElement(connection.first);
-        }
+        // outside of reassemblePacket, since expiring closes connections in reassembly
+        shard.connections.expire(timestamp.tv_sec);
     } else {
         // unsupported layer3 protocol
     }
@@ -415,59 +492,301 @@ void PcapInputStream::_open_pcap(const std::string &fileName, const std::string
     assert(_pcapFile);
 
     // open input file (pcap or pcapng file)
-    // NOTE, we are the owner and must free this
-    auto reader = pcpp::IFileReaderDevice::getReader(fileName.c_str());
-
-    // try to open the file device
-    if (!reader->open()) {
-        throw PcapException("Cannot open pcap/pcapng file");
-    }
+    PcapFileReader reader(fileName);
 
     // set BPF filter if set by the user
     if (bpfFilter != "") {
-        if (!reader->setFilter(bpfFilter))
-            throw PcapException("Cannot set BPF filter to pcap file");
+        reader.set_filter(bpfFilter);
+    }
+
+    std::atomic<uint64_t> packet_count{0};
+    uint64_t last_count{0};
+    timer t(100ms);
+    auto t0 = t.set_interval(1s, [&packet_count, &last_count]() {
+        auto count = packet_count.load(std::memory_order_relaxed);
+        std::cerr << "processed " << count << " packets (" << count - last_count << "/s)\n";
+        last_count = count;
+    });
+    auto workers = _parse_workers();
+    if (workers > 1) {
+        _read_pcap_workers(reader, workers, packet_count);
+    } else {
+        _read_pcap(reader, packet_count);
     }
+    t0->cancel();
+    std::cerr << "processed " << packet_count << " packets\n";
+
+    // after all packets have been read - close the connections which are still opened
+    _close_all_connections();
+}
+
+void PcapInputStream::_close_all_connections()
+{
+    // the capture workers have stopped. their connections are closed as if on the worker, since handlers keep tcp
+    // state per worker_shard_id
+    auto id = worker_shard_id;
+    for (unsigned int i = 0; i < _capture_shards.size(); ++i) {
+        worker_shard_id = i;
+        _capture_shards[i]->reassembly.closeAllConnections();
+    }
+    worker_shard_id = id;
+}
 
+void PcapInputStream::_read_pcap(PcapFileReader &reader, std::atomic<uint64_t> &packet_count)
+{
+    // the packet data points into the file mapping and outlives the batch, so a single RawPacket is enough
     pcpp::RawPacket rawPacket;
-    timespec end_tstamp;
+    size_t batched{0};
+    uint64_t count{0};
+    timespec end_tstamp{};
+    int64_t next_period{0};
 
-    // setup initial timestamp from first packet to initiate bucketing
-    if (reader->getNextPacket(rawPacket)) {
-        start_tstamp_signal(rawPacket.getPacketTimeStamp());
+    while (_running && reader.next(rawPacket)) {
+        end_tstamp = rawPacket.getPacketTimeStamp();
+        if (!count) {
+            // setup initial timestamp from first packet to initiate bucketing
+            start_tstamp_signal(end_tstamp);
+            next_period = end_tstamp.tv_sec + METRICS_PERIOD_SEC;
+        } else if (end_tstamp.tv_sec >= next_period) {
+            // all handlers shift at the first packet past the end of the period, whether or not it is one of their events
+            flush_packet_batch();
+            batched = 0;
+            heartbeat_signal(end_tstamp);
+            next_period = end_tstamp.tv_sec + METRICS_PERIOD_SEC;
+        }
         process_raw_packet(&rawPacket);
+        packet_count.store(++count, std::memory_order_relaxed);
+        if (++batched == PCAP_FILE_BATCH_SIZE) {
+            flush_packet_batch();
+            batched = 0;
+        }
     }
+    flush_packet_batch();
+    end_tstamp_signal(end_tstamp);
+}
 
-    int packetCount = 1, lastCount = 0;
-    timer t(100ms);
-    auto t0 = t.set_interval(1s, [&packetCount, &lastCount]() {
-        std::cerr << "processed " << packetCount << " packets (" << lastCount << "/s)\n";
-        lastCount = 0;
-    });
-    while (_running && reader->getNextPacket(rawPacket)) {
-        process_raw_packet(&rawPacket);
-        packetCount++;
-        lastCount++;
-        end_tstamp = rawPacket.getPacketTimeStamp();
+void PcapInputStream::_read_pcap_workers(PcapFileReader &reader, uint64_t workers, std::atomic<uint64_t> &packet_count)
+{
+    // frames are read and decoded on this thread, then handed in batches to the worker owning their flow. flow keys
+    // are direction independent, so both sides of a conversation (and its tcp reassembly) stay on the same worker.
+    // frame data points into the file mapping, only the view and the record metadata are queued
+    struct Frame {
+        PacketView view;
+        timespec stamp;
+        pcpp::LinkLayerType link_type;
+    };
+    typedef std::vector<Frame> FrameBatch;
+    struct Worker {
+        std::thread thread;
+        std::condition_variable work_cv;
+        std::deque<FrameBatch> queue;
+        bool busy{false};
+    };
+
+    while (_capture_shards.size() < workers) {
+        _capture_shards.emplace_back(std::make_unique<CaptureShard>(this, _tcp_idle_timeout, _tcp_max_connections));
+    }
+
+    std::mutex mutex;
+    std::condition_variable idle_cv;
+    bool done{false};
+    std::vector<Worker> pool(workers);
+    for (uint64_t i = 0; i < workers; ++i) {
+        pool[i].thread = std::thread([this, i, &pool, &mutex, &idle_cv, &done] {
+            worker_shard_id = static_cast<unsigned int>(i);
+            auto &shard = *_capture_shards[i];
+            auto &worker = pool[i];
+            pcpp::RawPacket raw;
+            for (;;) {
+                std::unique_lock lock(mutex);
+                worker.work_cv.wait(lock, [&worker, &done] { return done || !worker.queue.empty(); });
+                if (worker.queue.empty()) {
+                    return;
+                }
+                auto frames = std::move(worker.queue.front());
+                worker.queue.pop_front();
+                worker.busy = true;
+                lock.unlock();
+                idle_cv.notify_all();
+
+                for (auto &frame : frames) {
+                    shard.batch.emplace_back();
+                    shard.batch.back().view = frame.view;
+                    raw.initWithRawData(frame.view.data, static_cast<int>(frame.view.len), frame.stamp, frame.link_type);
+                    _process_decoded(shard, &raw);
+                }
+                flush_packet_batch();
+                frames.clear();
+
+                lock.lock();
+                worker.busy = false;
+                lock.unlock();
+                idle_cv.notify_all();
+            }
+        });
+    }
+
+    std::vector<FrameBatch> pending(workers);
+    auto submit = [&](uint64_t i) {
+        std::unique_lock lock(mutex);
+        idle_cv.wait(lock, [&] { return pool[i].queue.size() < PCAP_FILE_MAX_QUEUED_BATCHES; });
+        pool[i].queue.push_back(std::move(pending[i]));
+        lock.unlock();
+        pool[i].work_cv.notify_one();
+        pending[i] = FrameBatch();
+        pending[i].reserve(PCAP_FILE_BATCH_SIZE);
+    };
+    // wait until the workers have processed everything read so far
+    auto drain = [&] {
+        for (uint64_t i = 0; i < workers; ++i) {
+            if (!pending[i].empty()) {
+                submit(i);
+            }
+        }
+        std::unique_lock lock(mutex);
+        idle_cv.wait(lock, [&] {
+            return std::all_of(pool.begin(), pool.end(), [](const Worker &w) { return w.queue.empty() && !w.busy; });
+        });
+    };
+
+    uint64_t count{0};
+    timespec end_tstamp{};
+    int64_t next_period{0};
+    pcpp::RawPacket raw;
+    while (_running && reader.next(raw)) {
+        end_tstamp = raw.getPacketTimeStamp();
+        if (!count) {
+            // setup initial timestamp from first packet to initiate bucketing
+            start_tstamp_signal(end_tstamp);
+            next_period = end_tstamp.tv_sec + METRICS_PERIOD_SEC;
+        } else if (end_tstamp.tv_sec >= next_period) {
+            // let the workers finish the current period, then shift the handlers from here with the stamp of the first
+            // frame past its end, as _read_pcap does. otherwise the workers would race each other to the shift with
+            // the stamps of their own frames
+            drain();
+            heartbeat_signal(end_tstamp);
+            next_period = end_tstamp.tv_sec + METRICS_PERIOD_SEC;
+        }
+
+        Frame frame{PacketView(), end_tstamp, raw.getLinkLayerType()};
+        decode_packet(raw.getRawData(), raw.getRawDataLen(), raw.getLinkLayerType(), frame.view);
+        auto i = frame.view.flow_key % workers;
+        pending[i].push_back(frame);
+        if (pending[i].size() == PCAP_FILE_BATCH_SIZE) {
+            submit(i);
+        }
+        packet_count.store(++count, std::memory_order_relaxed);
+    }
+
+    drain();
+    {
+        std::unique_lock lock(mutex);
+        done = true;
+    }
+    for (auto &worker : pool) {
+        worker.work_cv.notify_one();
+    }
+    for (auto &worker : pool) {
+        worker.thread.join();
     }
     end_tstamp_signal(end_tstamp);
-    t0->cancel();
-    std::cerr << "processed " << packetCount << " packets\n";
+}
 
-    // after all packets have been read - close the connections which are still opened
-    _tcp_reassembly.closeAllConnections();
+uint64_t PcapInputStream::_parse_workers() const
+{
+    uint64_t workers{1};
+    if (config_exists("workers")) {
+        workers = config_get<uint64_t>("workers");
+        if (workers < 1 || workers > MAX_CAPTURE_WORKERS) {
+            throw PcapException(fmt::format("workers must be between 1 and {}", MAX_CAPTURE_WORKERS));
+        }
+    }
+    return workers;
+}
 
-    // close the reader and free its memory
-    reader->close();
-    delete reader;
+uint64_t PcapInputStream::capture_threads() const
+{
+    // only pcap files and af_packet spread the capture over workers
+    if (config_exists("pcap_file") || (config_exists("pcap_source") && config_get<std::string>("pcap_source") == "af_packet")) {
+        return _parse_workers();
+    }
+    return 1;
 }
 
 #ifdef __linux__
 void PcapInputStream::_open_af_packet_iface(const std::string &iface, const std::string &bpfFilter)
 {
+    auto workers = _parse_workers();
+
+    // ring geometry, per worker
+    auto geometry = [this](const std::string &key, uint64_t default_value) {
+        if (!config_exists(key)) {
+            return static_cast<unsigned int>(default_value);
+        }
+        auto value = config_get<uint64_t>(key);
+        if (value == 0 || value > std::numeric_limits<unsigned int>::max()) {
+            throw PcapException(fmt::format("invalid value for {}: {}", key, value));
+        }
+        return static_cast<unsigned int>(value);
+    };
+    auto block_size = geometry("block_size", DEFAULT_BLOCK_SIZE);
+    auto frame_size = geometry("frame_size", DEFAULT_FRAME_SIZE);
+    auto num_blocks = geometry("num_blocks", DEFAULT_NUM_BLOCKS);
+    auto block_timeout = geometry("block_timeout", DEFAULT_BLOCK_TIMEOUT_MS);
+
+    bool software_timestamps{false};
+    if (config_exists("timestamping")) {
+        auto ts_mode = config_get<std::string>("timestamping");
+        if (ts_mode == "software") {
+            software_timestamps = true;
+        } else if (ts_mode != "default") {
+            throw PcapException("unknown timestamping mode, valid modes are: default, software");
+        }
+    }
+
+    // with more than one worker, every worker gets its own ring and joins the same fanout group, which hashes flows
+    // across them. group ids are per network namespace, so keep them distinct between streams in this process
+    int fanout_group_id{-1};
+    if (workers > 1) {
+        static std::atomic<uint16_t> next_fanout_group{0};
+        fanout_group_id = (getpid() + next_fanout_group++) & 0xffff;
+    }
+
+    // reassembly state must exist for all workers before any of them start
+    while (_capture_shards.size() < workers) {
+        _capture_shards.emplace_back(std::make_unique<CaptureShard>(this, _tcp_idle_timeout, _tcp_max_connections));
+    }
+    for (auto i = 0U; i < workers; ++i) {
+        _af_devices.emplace_back(std::make_unique<AFPacket>(this, bpfFilter, iface, fanout_group_id, i,
+            block_size, frame_size, num_blocks, block_timeout, software_timestamps));
+    }
+    for (auto &dev : _af_devices) {
+        dev->start_capture();
+    }
+
+    // the kernel keeps the statistics, poll them the same way libpcap does
+    _af_stats_timer = std::make_unique<timer>(100ms);
+    _af_stats_handle = _af_stats_timer->set_interval(1s, [this] {
+        _process_af_packet_stats();
+    });
+}
+
+void PcapInputStream::_process_af_packet_stats()
+{
+    AFPacketStats af_stats;
+    for (auto &dev : _af_devices) {
+        dev->read_stats(af_stats);
+    }
+    if (af_stats.num_blocks) {
+        _af_ring_backlog.store(static_cast<uint32_t>(af_stats.blocks_in_use * 100 / af_stats.num_blocks), std::memory_order_relaxed);
+    }
+    af_packet_stats_signal(af_stats);
 
-    _af_device = std::make_unique<AFPacket>(this, _packet_arrives_cb, bpfFilter, iface);
-    _af_device->start_capture();
+    pcpp::IPcapDevice::PcapStats stats{};
+    stats.packetsRecv = af_stats.packets;
+    stats.packetsDrop = af_stats.drops;
+    stats.packetsDropByInterface = 0;
+    process_pcap_stats(stats);
 }
 #endif
 
@@ -544,6 +863,7 @@ void PcapInputStream::_get_hosts_from_libpcap_iface()
             _hostIPv6.emplace_back(IPv6subnet(pcpp::IPv6Address(buf1), len));
         }
     }
+    _build_host_table();
 }
 
 void PcapInputStream::info_json(json &j) const
@@ -585,10 +905,28 @@ void PcapInputStream::info_json(json &j) const
     j[schema_key()] = info;
 }
 
+void PcapInputStream::_parse_tcp_limits()
+{
+    if (config_exists("tcp_idle_timeout")) {
+        _tcp_idle_timeout = config_get<uint64_t>("tcp_idle_timeout");
+        if (_tcp_idle_timeout == 0) {
+            throw PcapException("tcp_idle_timeout must be at least 1 second");
+        }
+    }
+    if (config_exists("tcp_max_connections")) {
+        // 0 means no limit
+        _tcp_max_connections = config_get<uint64_t>("tcp_max_connections");
+    }
+    for (auto &shard : _capture_shards) {
+        shard->connections.configure(_tcp_idle_timeout, _tcp_max_connections);
+    }
+}
+
 void PcapInputStream::parse_host_spec()
 {
     if (config_exists("host_spec")) {
         parseHostSpec(config_get<std::string>("host_spec"), _hostIPv4, _hostIPv6);
     }
+    _build_host_table();
 }
 }
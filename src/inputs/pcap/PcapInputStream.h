@@ -12,10 +12,14 @@
 #include <TcpReassembly.h>
 #include <UdpLayer.h>
 #pragma GCC diagnostic pop
-#include "LRUList.h"
+#include "PacketView.h"
+#include "SubnetTable.h"
+#include "TimingWheel.h"
 #include "utils.h"
+#include <atomic>
 #include <functional>
 #include <memory>
+#include <timer.hpp>
 #include <unordered_map>
 #include <vector>
 #ifdef __linux__
@@ -24,6 +28,8 @@
 
 namespace visor::input::pcap {
 
+class PcapFileReader;
+
 enum class PcapSource {
     unknown,
     libpcap,
@@ -37,20 +43,68 @@ enum class PacketDirection {
     unknown
 };
 
+// a decoded packet, as delivered to handlers in a PacketBatch
+struct DecodedPacket {
+    PacketView view;
+    PacketDirection dir;
+    timespec stamp;
+};
+
+/**
+ * packets are delivered to handlers in batches, one af_packet block or a run of pcap file records at a time. the views
+ * point into capture buffers which are only valid for the duration of the batch signal
+ */
+typedef std::vector<DecodedPacket> PacketBatch;
+
+class PcapInputStream;
+
+/**
+ * state for a single capture worker. with af_packet fanout, both directions of a flow always arrive on the same
+ * worker, so each worker reassembles its own flows without sharing this state
+ */
+struct CaptureShard {
+    PcapInputStream *stream;
+    // last activity of every connection in reassembly, idle or excess connections are closed from here
+    TimingWheel<uint32_t> connections;
+    pcpp::TcpReassembly reassembly;
+    // the PacketView::flow_key of every connection in reassembly, by pcpp flow key. pcpp hashes flows its own way, so
+    // it is taken from the packet which starts the connection
+    std::unordered_map<uint32_t, uint32_t> flow_keys;
+    // the flow_key of the packet being reassembled
+    uint32_t packet_flow_key{0};
+    // reused between batches, so it only allocates until it reaches the largest batch size
+    PacketBatch batch;
+
+    CaptureShard(PcapInputStream *stream, uint64_t tcp_idle_timeout, size_t tcp_max_connections);
+
+    void close_connection(uint32_t flow_key, bool evicted);
+};
+
 class PcapInputStream : public visor::InputStream
 {
 
 private:
-    static constexpr uint8_t TCP_TIMEOUT = 30;
-    static constexpr uint8_t MAX_TCP_CLEANUPS = 100;
+    static constexpr uint64_t DEFAULT_TCP_IDLE_TIMEOUT = 30;
+    static constexpr uint64_t DEFAULT_TCP_MAX_CONNECTIONS = 100000;
+    static constexpr uint64_t MAX_CAPTURE_WORKERS = 64;
+    static constexpr size_t PCAP_FILE_BATCH_SIZE = 256;
+    // frames read ahead per pcap file worker, in batches
+    static constexpr size_t PCAP_FILE_MAX_QUEUED_BATCHES = 16;
+    // the length of a metrics period, see AbstractMetricsManager::PERIOD_SEC
+    static constexpr int64_t METRICS_PERIOD_SEC = 60;
 
     static const PcapSource DefaultPcapSource = PcapSource::libpcap;
-    pcpp::LRUList<uint32_t, timeval> _lru_list;
     IPv4subnetList _hostIPv4;
     IPv6subnetList _hostIPv6;
+    // compiled from the lists above, used for the per packet direction lookup
+    SubnetTable _host_table;
 
     PcapSource _cur_pcap_source{PcapSource::unknown};
 
+    // tcp connection tracking limits, per capture worker
+    uint64_t _tcp_idle_timeout{DEFAULT_TCP_IDLE_TIMEOUT};
+    uint64_t _tcp_max_connections{DEFAULT_TCP_MAX_CONNECTIONS};
+
     // libpcap source
     std::unique_ptr<pcpp::PcapLiveDevice> _pcapDevice;
     bool _pcapFile = false;
@@ -60,22 +114,37 @@ private:
     // mock source
     std::unique_ptr<std::thread> _mock_generator_thread;
 
+    // indexed by worker shard id. declared before the capture devices so that it outlives their threads
+    std::vector<std::unique_ptr<CaptureShard>> _capture_shards;
+
 #ifdef __linux__
-    // af_packet source
-    std::unique_ptr<AFPacket> _af_device;
+    // af_packet source, one device per capture worker
+    std::vector<std::unique_ptr<AFPacket>> _af_devices;
+    std::unique_ptr<timer> _af_stats_timer;
+    std::shared_ptr<timer::interval_handle> _af_stats_handle;
+    // ring occupancy in percent as of the last stats poll, summed over workers
+    std::atomic<uint32_t> _af_ring_backlog{0};
 #endif
 
-    pcpp::TcpReassembly _tcp_reassembly;
-
 protected:
     void _open_pcap(const std::string &fileName, const std::string &bpfFilter);
+    void _read_pcap(PcapFileReader &reader, std::atomic<uint64_t> &packet_count);
+    void _read_pcap_workers(PcapFileReader &reader, uint64_t workers, std::atomic<uint64_t> &packet_count);
+    uint64_t _parse_workers() const;
     void _open_libpcap_iface(const std::string &bpfFilter = "");
     void _get_hosts_from_libpcap_iface();
     void _generate_mock_traffic();
     std::string _get_interface_list() const;
+    void _build_host_table();
+    void _parse_tcp_limits();
+    PacketDirection _packet_direction(const PacketView &view) const;
+    void _process_decoded(CaptureShard &shard, pcpp::RawPacket *rawPacket);
+    void _close_all_connections();
+    void _flush_batch(CaptureShard &shard);
 
 #ifdef __linux__
     void _open_af_packet_iface(const std::string &iface, const std::string &bpfFilter);
+    void _process_af_packet_stats();
 #endif
 
 public:
@@ -90,9 +159,18 @@ public:
     void start() override;
     void stop() override;
     void info_json(json &j) const override;
+    uint32_t backlog() const override
+    {
+#ifdef __linux__
+        return _af_ring_backlog.load(std::memory_order_relaxed);
+#else
+        return 0;
+#endif
+    }
+    uint64_t capture_threads() const override;
     size_t consumer_count() const override
     {
-        return policy_signal.slot_count() + heartbeat_signal.slot_count() + packet_signal.slot_count() + udp_signal.slot_count() + start_tstamp_signal.slot_count() + tcp_message_ready_signal.slot_count() + tcp_connection_start_signal.slot_count() + tcp_connection_end_signal.slot_count() + tcp_reassembly_error_signal.slot_count() + pcap_stats_signal.slot_count();
+        return policy_signal.slot_count() + heartbeat_signal.slot_count() + packet_signal.slot_count() + udp_signal.slot_count() + packet_batch_signal.slot_count() + start_tstamp_signal.slot_count() + tcp_message_ready_signal.slot_count() + tcp_connection_start_signal.slot_count() + tcp_connection_end_signal.slot_count() + tcp_reassembly_error_signal.slot_count() + tcp_connection_evicted_signal.slot_count() + pcap_stats_signal.slot_count() + af_packet_stats_signal.slot_count();
     }
 
     // utilities
@@ -100,23 +178,34 @@ public:
 
     // public methods that can be called from a static callback method via cookie, required by PcapPlusPlus
     void process_raw_packet(pcpp::RawPacket *rawPacket);
+    /**
+     * deliver the packets collected by process_raw_packet on the calling worker to handlers. must be called before
+     * the raw packet data they point to is released or reused
+     */
+    void flush_packet_batch();
     void process_pcap_stats(const pcpp::IPcapDevice::PcapStats &stats);
-    void tcp_message_ready(int8_t side, const pcpp::TcpStreamData &tcpData);
-    void tcp_connection_start(const pcpp::ConnectionData &connectionData);
-    void tcp_connection_end(const pcpp::ConnectionData &connectionData, pcpp::TcpReassembly::ConnectionEndReason reason);
+    void tcp_message_ready(CaptureShard &shard, int8_t side, const pcpp::TcpStreamData &tcpData);
+    void tcp_connection_start(CaptureShard &shard, const pcpp::ConnectionData &connectionData);
+    void tcp_connection_end(CaptureShard &shard, const pcpp::ConnectionData &connectionData, pcpp::TcpReassembly::ConnectionEndReason reason);
 
     // handler functionality
     // IF THIS changes, see consumer_count()
     // note: these are mutable because consumer_count() calls slot_count() which is not const (unclear if it could/should be)
     mutable sigslot::signal<pcpp::Packet &, PacketDirection, pcpp::ProtocolType, pcpp::ProtocolType, timespec> packet_signal;
     mutable sigslot::signal<pcpp::Packet &, PacketDirection, pcpp::ProtocolType, uint32_t, timespec> udp_signal;
+    // decoded header views, which do not require a full pcpp::Packet parse. prefer this over packet_signal and udp_signal
+    mutable sigslot::signal<const PacketBatch &> packet_batch_signal;
     mutable sigslot::signal<timespec> start_tstamp_signal;
     mutable sigslot::signal<timespec> end_tstamp_signal;
-    mutable sigslot::signal<int8_t, const pcpp::TcpStreamData &> tcp_message_ready_signal;
+    // with the PacketView::flow_key of the connection, the same as that of its packets in packet_batch_signal
+    mutable sigslot::signal<int8_t, const pcpp::TcpStreamData &, uint32_t> tcp_message_ready_signal;
     mutable sigslot::signal<const pcpp::ConnectionData &> tcp_connection_start_signal;
     mutable sigslot::signal<const pcpp::ConnectionData &, pcpp::TcpReassembly::ConnectionEndReason> tcp_connection_end_signal;
     mutable sigslot::signal<pcpp::Packet &, PacketDirection, pcpp::ProtocolType, timespec> tcp_reassembly_error_signal;
+    // a connection was closed before it went idle because tcp_max_connections was reached
+    mutable sigslot::signal<> tcp_connection_evicted_signal;
     mutable sigslot::signal<const pcpp::IPcapDevice::PcapStats &> pcap_stats_signal;
+    mutable sigslot::signal<const AFPacketStats &> af_packet_stats_signal;
 };
 
 }
@@ -0,0 +1,224 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+namespace visor::input::pcap {
+
+/**
+ * A hashed timing wheel which tracks the last activity of a set of keys (e.g. TCP connections). keys idle for longer
+ * than the timeout are expired, and while there are more keys than the configured maximum, the ones closest to
+ * expiring are evicted. touching, erasing and expiring a key are all O(1).
+ *
+ * time is in whole seconds and is expected to move forward. it may stall or jump, but going backwards is ignored.
+ * not thread safe, each capture worker owns its own wheel.
+ */
+template <typename K, typename Hash = std::hash<K>>
+class TimingWheel
+{
+public:
+    // evicted is false if the key expired because it was idle, true if it was removed to stay under the maximum size
+    typedef std::function<void(const K &key, bool evicted)> RemoveCallback;
+
+private:
+    struct Entry {
+        const K *key{nullptr};
+        uint64_t deadline{0};
+        Entry *prev{nullptr};
+        Entry *next{nullptr};
+    };
+
+    // entries are linked into the slot of their deadline. unordered_map never moves its values, so the links stay valid
+    std::unordered_map<K, Entry, Hash> _entries;
+    std::vector<Entry *> _slots;
+    uint64_t _mask{0};
+    uint64_t _timeout{0};
+    size_t _max_size{0};
+    uint64_t _now{0};
+    bool _started{false};
+    bool _expiring{false};
+    uint64_t _evictions{0};
+    std::vector<K> _due;
+    RemoveCallback _on_remove;
+
+    void _link(Entry &e)
+    {
+        auto &head = _slots[e.deadline & _mask];
+        e.prev = nullptr;
+        e.next = head;
+        if (head) {
+            head->prev = &e;
+        }
+        head = &e;
+    }
+
+    void _unlink(Entry &e)
+    {
+        if (e.prev) {
+            e.prev->next = e.next;
+        } else {
+            _slots[e.deadline & _mask] = e.next;
+        }
+        if (e.next) {
+            e.next->prev = e.prev;
+        }
+    }
+
+    // the entry with the nearest deadline, found by walking forward from the current slot
+    const K *_soonest() const
+    {
+        for (uint64_t i = 1; i <= _slots.size(); ++i) {
+            if (auto e = _slots[(_now + i) & _mask]) {
+                return e->key;
+            }
+        }
+        return nullptr;
+    }
+
+public:
+    /**
+     * @param on_remove called for every key which expires or is evicted, after it has been removed from the wheel
+     * @param timeout idle time in seconds after which a key expires
+     * @param max_size the maximum number of keys to track, 0 for no limit
+     */
+    TimingWheel(RemoveCallback on_remove, uint64_t timeout, size_t max_size = 0)
+        : _on_remove(std::move(on_remove))
+    {
+        configure(timeout, max_size);
+    }
+
+    /**
+     * change the timeout and maximum size. existing keys keep their current deadline
+     */
+    void configure(uint64_t timeout, size_t max_size)
+    {
+        _timeout = std::max<uint64_t>(timeout, 1);
+        _max_size = max_size;
+
+        // one slot per second of the timeout, so that every slot holds a single deadline in normal operation
+        size_t slots{1};
+        while (slots <= _timeout) {
+            slots <<= 1;
+        }
+        _slots.assign(slots, nullptr);
+        _mask = slots - 1;
+        for (auto &i : _entries) {
+            _link(i.second);
+        }
+    }
+
+    /**
+     * record activity on key at time now, adding it if it is not tracked yet. this never removes keys, so it is safe
+     * to call from inside callbacks of the code owning the keys: limits are enforced by the next call to expire()
+     */
+    void touch(const K &key, uint64_t now)
+    {
+        auto [iter, inserted] = _entries.try_emplace(key);
+        auto &e = iter->second;
+        if (inserted) {
+            e.key = &iter->first;
+        } else {
+            _unlink(e);
+        }
+        e.deadline = std::max(now, _now) + _timeout;
+        _link(e);
+    }
+
+    /**
+     * stop tracking key, without calling the remove callback. does nothing if key is not tracked
+     */
+    void erase(const K &key)
+    {
+        auto iter = _entries.find(key);
+        if (iter == _entries.end()) {
+            return;
+        }
+        _unlink(iter->second);
+        _entries.erase(iter);
+    }
+
+    /**
+     * advance the wheel to time now, expiring all keys idle for longer than the timeout, then evict the keys closest
+     * to expiring until no more than the maximum number of keys remain
+     */
+    void expire(uint64_t now)
+    {
+        if (_expiring) {
+            // called again from a remove callback
+            return;
+        }
+        if (!_started) {
+            _now = now;
+            _started = true;
+        }
+        _expiring = true;
+
+        if (now > _now) {
+            // after a jump of a full turn or more every slot is due once, keys with a later deadline are skipped
+            auto ticks = std::min<uint64_t>(now - _now, _slots.size());
+            for (uint64_t i = 1; i <= ticks; ++i) {
+                for (auto e = _slots[(_now + i) & _mask]; e; e = e->next) {
+                    if (e->deadline <= now) {
+                        _due.push_back(*e->key);
+                    }
+                }
+            }
+            _now = now;
+        }
+
+        // the callbacks may touch or erase keys, so only remove those which are still due
+        for (const auto &key : _due) {
+            auto iter = _entries.find(key);
+            if (iter == _entries.end() || iter->second.deadline > now) {
+                continue;
+            }
+            _unlink(iter->second);
+            _entries.erase(iter);
+            _on_remove(key, false);
+        }
+        _due.clear();
+
+        while (_max_size && _entries.size() > _max_size) {
+            auto key = _soonest();
+            if (!key) {
+                break;
+            }
+            K evicted = *key;
+            erase(evicted);
+            ++_evictions;
+            _on_remove(evicted, true);
+        }
+
+        _expiring = false;
+    }
+
+    size_t size() const
+    {
+        return _entries.size();
+    }
+
+    uint64_t timeout() const
+    {
+        return _timeout;
+    }
+
+    size_t max_size() const
+    {
+        return _max_size;
+    }
+
+    // total number of keys evicted because of the maximum size
+    uint64_t evictions() const
+    {
+        return _evictions;
+    }
+};
+
+}
@@ -5,11 +5,14 @@
 #ifdef __linux__
 #include "afpacket.h"
 
+#include "AbstractMetricsManager.h"
+#include "PcapInputStream.h"
 #include "utils.h"
 #include <Packet.h>
 #include <arpa/inet.h>
 #include <cerrno>
 #include <cstring>
+#include <linux/net_tstamp.h>
 #include <net/ethernet.h>
 #include <net/if.h>
 #include <pcap/pcap.h>
@@ -21,41 +24,36 @@
 
 namespace visor::input::pcap {
 
-AFPacket::AFPacket(PcapInputStream *stream, pcpp::OnPacketArrivesCallback cb, std::string filter,
+AFPacket::AFPacket(PcapInputStream *stream, std::string filter,
     std::string interface_name,
     int fanout_group_id,
+    unsigned int worker_id,
     unsigned int block_size,
     unsigned int frame_size,
-    unsigned int num_blocks)
+    unsigned int num_blocks,
+    unsigned int block_timeout,
+    bool software_timestamps)
     : fd(-1)
     , block_size(block_size)
     , frame_size(frame_size)
     , num_blocks(num_blocks)
+    , block_timeout(block_timeout)
+    , software_timestamps(software_timestamps)
     , interface(-1)
     , interface_type(-1)
     , interface_name(std::move(interface_name))
     , bpf()
     , filter(std::move(filter))
     , fanout_group_id(fanout_group_id)
+    , worker_id(worker_id)
     , map(nullptr)
-    , cb(std::move(cb))
     , inputStream(stream)
 {
-    fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
-
-    if (fd == -1) {
-        throw PcapException("Failed to create AF_PACKET socket: " + std::string(strerror(errno)));
-    }
 }
 
 AFPacket::~AFPacket()
 {
-    if (running) {
-        stop_capture();
-    }
-    if (cap_thread) {
-        cap_thread->join();
-    }
+    stop_capture();
     if (fd != -1) {
         close(fd);
         fd = -1;
@@ -67,7 +65,8 @@ AFPacket::~AFPacket()
 
 void AFPacket::flush_block(struct block_desc *pbd)
 {
-    pbd->h1.block_status = TP_STATUS_KERNEL;
+    // release the block back to the kernel, ordered after our reads of it
+    __atomic_store_n(&pbd->h1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
 }
 
 void AFPacket::walk_block(struct block_desc *pbd)
@@ -81,12 +80,16 @@ void AFPacket::walk_block(struct block_desc *pbd)
         bytes += ppd->tp_snaplen;
 
         auto data_pointer = (uint8_t *)ppd + ppd->tp_mac;
-        pcpp::RawPacket packet(data_pointer, ppd->tp_snaplen, timespec{pbd->h1.ts_last_pkt.ts_sec, pbd->h1.ts_last_pkt.ts_nsec},
+        // each packet carries its own receive time, the block only knows its first and last
+        pcpp::RawPacket packet(data_pointer, ppd->tp_snaplen, timespec{ppd->tp_sec, ppd->tp_nsec},
             false, pcpp::LINKTYPE_ETHERNET);
-        cb(&packet, nullptr, inputStream);
+        // collected into the batch of this worker, only delivered early ahead of the unbatched signals of a packet
+        inputStream->process_raw_packet(&packet);
 
         ppd = (struct tpacket3_hdr *)((uint8_t *)ppd + ppd->tp_next_offset);
     }
+    // the whole block is handed to handlers at once, it stays ours until flush_block
+    inputStream->flush_packet_batch();
 }
 
 void AFPacket::set_interface()
@@ -157,6 +160,30 @@ void AFPacket::set_socket_opts()
         }
     }
 
+    if (software_timestamps) {
+        // stamp packets in the receive path as soon as they reach the stack, instead of when they are copied into
+        // the ring, and have the ring report those stamps
+        int ts_flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+        if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &ts_flags, sizeof(ts_flags)) == -1) {
+            throw PcapException("Failed to enable software timestamping on AF_PACKET socket: " + std::string(strerror(errno)));
+        }
+        int req_ts = SOF_TIMESTAMPING_SOFTWARE;
+        if (setsockopt(fd, SOL_PACKET, PACKET_TIMESTAMP, &req_ts, sizeof(req_ts)) == -1) {
+            throw PcapException("Failed to select software timestamps for AF_PACKET ring: " + std::string(strerror(errno)));
+        }
+    }
+
+    // Validate ring geometry up front, the kernel only reports EINVAL
+    if (frame_size < TPACKET3_HDRLEN || frame_size % TPACKET_ALIGNMENT != 0) {
+        throw PcapException("Invalid AF_PACKET frame size " + std::to_string(frame_size) + ": must be a multiple of " + std::to_string(TPACKET_ALIGNMENT) + " and at least " + std::to_string(TPACKET3_HDRLEN));
+    }
+    if (block_size % static_cast<unsigned int>(getpagesize()) != 0 || block_size % frame_size != 0) {
+        throw PcapException("Invalid AF_PACKET block size " + std::to_string(block_size) + ": must be a multiple of the page size and the frame size");
+    }
+    if (num_blocks == 0) {
+        throw PcapException("Invalid AF_PACKET number of blocks: must be at least 1");
+    }
+
     // Enable PACKET_RX_RING for the socket
     struct tpacket_req3 req {
     };
@@ -167,7 +194,7 @@ void AFPacket::set_socket_opts()
     req.tp_block_nr = num_blocks;
     req.tp_frame_nr = (block_size * num_blocks) / frame_size;
 
-    req.tp_retire_blk_tov = 60; // Timeout in msec
+    req.tp_retire_blk_tov = block_timeout; // Timeout in msec
     req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
 
     if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, reinterpret_cast<void *>(&req), sizeof(req)) == -1) {
@@ -177,6 +204,12 @@ void AFPacket::set_socket_opts()
 
 void AFPacket::setup()
 {
+    fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+
+    if (fd == -1) {
+        throw PcapException("Failed to create AF_PACKET socket: " + std::string(strerror(errno)));
+    }
+
     set_interface();
     set_socket_opts();
 
@@ -217,9 +250,9 @@ void AFPacket::setup()
 
     // Setup fanout if enabled.
     if (fanout_group_id != -1) {
-        // PACKET_FANOUT_LB - round robin
-        // PACKET_FANOUT_CPU - send packets to CPU where packet arrived
-        int fanout_type = PACKET_FANOUT_LB;
+        // PACKET_FANOUT_HASH - flow hash, both directions of a flow land on the same socket
+        // PACKET_FANOUT_FLAG_DEFRAG - defragment before hashing, so fragments follow their flow
+        int fanout_type = PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG;
 
         int fanout_arg = (fanout_group_id | (fanout_type << 16));
 
@@ -239,6 +272,9 @@ void AFPacket::start_capture()
     running = true;
 
     cap_thread = std::make_unique<std::thread>([this] {
+        // each worker feeds its own shard of the handler metrics
+        worker_shard_id = worker_id;
+
         unsigned int current_block_num = 0;
 
         struct pollfd pfd {
@@ -253,7 +289,8 @@ void AFPacket::start_capture()
             auto pbd = reinterpret_cast<struct block_desc *>(rd[current_block_num].iov_base);
 
             if ((pbd->h1.block_status & TP_STATUS_USER) == 0) {
-                poll(&pfd, 1, -1);
+                // wake up periodically so that stop_capture() does not wait on a quiet interface
+                poll(&pfd, 1, POLL_TIMEOUT_MS);
                 continue;
             }
 
@@ -264,6 +301,44 @@ void AFPacket::start_capture()
     });
 }
 
+void AFPacket::stop_capture()
+{
+    running = false;
+    if (cap_thread) {
+        cap_thread->join();
+        cap_thread.reset();
+    }
+}
+
+void AFPacket::read_stats(AFPacketStats &stats)
+{
+    if (map == nullptr) {
+        return;
+    }
+
+    struct tpacket_stats_v3 tp_stats {
+    };
+    socklen_t len = sizeof(tp_stats);
+    if (getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &tp_stats, &len) == 0) {
+        total_packets += tp_stats.tp_packets;
+        total_drops += tp_stats.tp_drops;
+        total_freeze_q_cnt += tp_stats.tp_freeze_q_cnt;
+    }
+
+    stats.packets += total_packets;
+    stats.drops += total_drops;
+    stats.freeze_q_cnt += total_freeze_q_cnt;
+
+    // blocks handed to user space and not yet walked by the capture thread
+    for (const auto &block : rd) {
+        auto pbd = reinterpret_cast<const struct block_desc *>(block.iov_base);
+        if (__atomic_load_n(&pbd->h1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) {
+            ++stats.blocks_in_use;
+        }
+    }
+    stats.num_blocks += num_blocks;
+}
+
 void filter_try_compile(const std::string &filter, struct sock_fprog *bpf, int link_type)
 {
     int i, ret;
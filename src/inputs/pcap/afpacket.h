@@ -8,6 +8,7 @@
 #pragma GCC diagnostic ignored "-Wold-style-cast"
 #include <PcapLiveDevice.h>
 #pragma GCC diagnostic pop
+#include "utils.h"
 #include <atomic>
 #include <cstdint>
 #include <functional>
@@ -23,6 +24,15 @@ const int physical_offset = TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
 
 static const int VERSION = TPACKET_V3;
 
+// how long a capture thread waits for a block before checking whether it should stop
+static const int POLL_TIMEOUT_MS = 100;
+
+// default ring geometry, see https://www.kernel.org/doc/Documentation/networking/packet_mmap.txt
+static const unsigned int DEFAULT_BLOCK_SIZE = 1 << 22;
+static const unsigned int DEFAULT_FRAME_SIZE = 1 << 11;
+static const unsigned int DEFAULT_NUM_BLOCKS = 64;
+static const unsigned int DEFAULT_BLOCK_TIMEOUT_MS = 60;
+
 struct block_desc {
     uint32_t version;
     uint32_t offset_to_priv;
@@ -38,6 +48,8 @@ class AFPacket final
     unsigned int block_size;
     unsigned int frame_size;
     unsigned int num_blocks;
+    unsigned int block_timeout;
+    bool software_timestamps;
 
     int interface;
     int interface_type;
@@ -47,37 +59,53 @@ class AFPacket final
     std::string filter;
 
     int fanout_group_id;
+    unsigned int worker_id;
 
     std::vector<struct iovec> rd;
     uint8_t *map;
 
-    pcpp::OnPacketArrivesCallback cb;
     PcapInputStream *inputStream;
 
     void flush_block(struct block_desc *pbd);
-    void walk_block(struct block_desc *pbd);
 
     void set_interface();
     void set_socket_opts();
     void setup();
 
-    std::atomic<bool> running;
+    std::atomic<bool> running{false};
     std::unique_ptr<std::thread> cap_thread;
 
+    // PACKET_STATISTICS counters reset on every read, these accumulate them
+    uint64_t total_packets{0};
+    uint64_t total_drops{0};
+    uint64_t total_freeze_q_cnt{0};
+
 public:
-    AFPacket(PcapInputStream *stream, pcpp::OnPacketArrivesCallback cb, std::string filter,
+    AFPacket(PcapInputStream *stream, std::string filter,
         std::string interface_name,
         int fanout_group_id = -1,
-        unsigned int block_size = 1 << 22,
-        unsigned int frame_size = 1 << 11,
-        unsigned int num_blocks = 64);
+        unsigned int worker_id = 0,
+        unsigned int block_size = DEFAULT_BLOCK_SIZE,
+        unsigned int frame_size = DEFAULT_FRAME_SIZE,
+        unsigned int num_blocks = DEFAULT_NUM_BLOCKS,
+        unsigned int block_timeout = DEFAULT_BLOCK_TIMEOUT_MS,
+        bool software_timestamps = false);
     ~AFPacket();
 
     void start_capture();
-    void stop_capture()
-    {
-        running = false;
-    }
+    void stop_capture();
+
+    /**
+     * hand all packets of a ring block to the input stream as a single batch, which is only split ahead of the tcp
+     * messages and legacy signals found in it. called by the capture thread
+     */
+    void walk_block(struct block_desc *pbd);
+
+    /**
+     * read the socket statistics and sample ring occupancy, adding them to stats so that workers can be summed.
+     * may be called from a thread other than the capture thread, but not from more than one thread at a time
+     */
+    void read_stats(AFPacketStats &stats);
 };
 
 void filter_try_compile(const std::string &, struct sock_fprog *, int);
@@ -0,0 +1,89 @@
+#ifdef __linux__
+#include "PcapFileReader.h"
+#include "PcapInputStream.h"
+#include "afpacket.h"
+#include <algorithm>
+#include <catch2/catch.hpp>
+#include <cstring>
+
+using namespace visor::input::pcap;
+
+// lay the packets of a capture file out in a TPACKET_V3 ring block, the way the kernel fills it
+static std::vector<uint8_t> make_block(const char *file, size_t block_size)
+{
+    std::vector<uint8_t> block(block_size);
+    auto pbd = reinterpret_cast<struct block_desc *>(block.data());
+    size_t offset = TPACKET_ALIGN(sizeof(struct block_desc));
+    pbd->h1.offset_to_first_pkt = offset;
+
+    PcapFileReader reader(file);
+    pcpp::RawPacket packet;
+    const size_t header_len = TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+    while (reader.next(packet)) {
+        auto len = static_cast<size_t>(packet.getRawDataLen());
+        auto frame_len = TPACKET_ALIGN(header_len + len);
+        if (offset + frame_len > block.size()) {
+            break;
+        }
+        auto ppd = reinterpret_cast<struct tpacket3_hdr *>(block.data() + offset);
+        ppd->tp_snaplen = ppd->tp_len = len;
+        ppd->tp_mac = header_len;
+        ppd->tp_next_offset = frame_len;
+        ppd->tp_sec = packet.getPacketTimeStamp().tv_sec;
+        ppd->tp_nsec = packet.getPacketTimeStamp().tv_nsec;
+        std::memcpy(block.data() + offset + header_len, packet.getRawData(), len);
+        offset += frame_len;
+        ++pbd->h1.num_pkts;
+    }
+    return block;
+}
+
+TEST_CASE("AF_PACKET ring blocks", "[pcap][afpacket]")
+{
+    PcapInputStream stream{"pcap-test"};
+    std::vector<size_t> batches;
+    stream.packet_batch_signal.connect([&batches](const PacketBatch &batch) {
+        batches.push_back(batch.size());
+    });
+
+    auto block = make_block("tests/fixtures/dns_ipv4_udp.pcap", 1 << 16);
+    auto pbd = reinterpret_cast<struct block_desc *>(block.data());
+    REQUIRE(pbd->h1.num_pkts > 1);
+
+    // the socket is only opened by start_capture, walking a block needs no privileges
+    AFPacket device(&stream, "", "lo");
+    device.walk_block(pbd);
+    CHECK(batches == std::vector<size_t>{pbd->h1.num_pkts});
+}
+
+TEST_CASE("AF_PACKET ring blocks keep tcp messages in packet order", "[pcap][afpacket]")
+{
+    PcapInputStream stream{"pcap-test"};
+    // the stamp of every event, in the order handlers see them
+    std::vector<timespec> stamps;
+    size_t messages{0};
+    stream.packet_batch_signal.connect([&stamps](const PacketBatch &batch) {
+        for (const auto &packet : batch) {
+            stamps.push_back(packet.stamp);
+        }
+    });
+    stream.tcp_message_ready_signal.connect([&stamps, &messages](int8_t, const pcpp::TcpStreamData &data, uint32_t) {
+        timespec stamp;
+        TIMEVAL_TO_TIMESPEC(&data.getConnectionData().endTime, &stamp);
+        stamps.push_back(stamp);
+        ++messages;
+    });
+
+    // udp and tcp dns, with increasing time stamps
+    auto block = make_block("tests/fixtures/dns_udp_tcp_random.pcap", 1 << 20);
+    auto pbd = reinterpret_cast<struct block_desc *>(block.data());
+
+    AFPacket device(&stream, "", "lo");
+    device.walk_block(pbd);
+    REQUIRE(messages > 0);
+    CHECK(stamps.size() == pbd->h1.num_pkts + messages);
+    CHECK(std::is_sorted(stamps.begin(), stamps.end(), [](const timespec &a, const timespec &b) {
+        return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+    }));
+}
+#endif
@@ -0,0 +1,210 @@
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#pragma clang diagnostic ignored "-Wc99-extensions"
+#include <IPv4Layer.h>
+#include <IPv6Layer.h>
+#include <Packet.h>
+#include <PcapFileDevice.h>
+#include <TcpLayer.h>
+#include <UdpLayer.h>
+#pragma GCC diagnostic pop
+#include "PacketView.h"
+#include <arpa/inet.h>
+#include <catch2/catch.hpp>
+#include <vector>
+
+using namespace visor::input::pcap;
+
+static std::vector<uint8_t> eth_header(uint16_t ether_type)
+{
+    std::vector<uint8_t> frame{0x00, 0x50, 0x43, 0x11, 0x22, 0x33, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
+    frame.push_back(ether_type >> 8);
+    frame.push_back(ether_type & 0xff);
+    return frame;
+}
+
+static void ipv4_udp(std::vector<uint8_t> &frame, uint16_t sport, uint16_t dport, size_t payload_len, uint16_t frag = 0)
+{
+    uint16_t total = static_cast<uint16_t>(20 + 8 + payload_len);
+    std::vector<uint8_t> ip{0x45, 0x00, static_cast<uint8_t>(total >> 8), static_cast<uint8_t>(total & 0xff), 0x12, 0x34,
+        static_cast<uint8_t>(frag >> 8), static_cast<uint8_t>(frag & 0xff), 64, 17, 0x00, 0x00, 10, 0, 0, 1, 192, 168, 0, 1};
+    frame.insert(frame.end(), ip.begin(), ip.end());
+    uint16_t udp_len = static_cast<uint16_t>(8 + payload_len);
+    std::vector<uint8_t> udp{static_cast<uint8_t>(sport >> 8), static_cast<uint8_t>(sport & 0xff), static_cast<uint8_t>(dport >> 8),
+        static_cast<uint8_t>(dport & 0xff), static_cast<uint8_t>(udp_len >> 8), static_cast<uint8_t>(udp_len & 0xff), 0x00, 0x00};
+    frame.insert(frame.end(), udp.begin(), udp.end());
+    frame.insert(frame.end(), payload_len, 0xab);
+}
+
+TEST_CASE("PacketView Ethernet IPv4 UDP", "[pcap][view]")
+{
+    auto frame = eth_header(0x0800);
+    ipv4_udp(frame, 53000, 53, 12);
+    // ethernet padding must not count as payload
+    frame.insert(frame.end(), 6, 0x00);
+
+    PacketView view;
+    CHECK(decode_packet(frame.data(), frame.size(), pcpp::LINKTYPE_ETHERNET, view));
+    CHECK(view.l3 == pcpp::IPv4);
+    CHECK(view.l4 == pcpp::UDP);
+    CHECK(view.l3_offset == 14);
+    CHECK(view.l4_offset == 34);
+    CHECK(view.payload_offset == 42);
+    CHECK(view.payload_len == 12);
+    CHECK(view.len == frame.size());
+    CHECK(view.src_port == 53000);
+    CHECK(view.dst_port == 53);
+    CHECK(view.ipv4_src == inet_addr("10.0.0.1"));
+    CHECK(view.ipv4_dst == inet_addr("192.168.0.1"));
+    CHECK(view.payload()[0] == 0xab);
+    CHECK(!view.fragment);
+    // dns: the message id is part of the sampling key
+    CHECK(view.sample_key == dns_sample_key(view.flow_key, 0xabab));
+}
+
+TEST_CASE("PacketView VLAN and QinQ", "[pcap][view]")
+{
+    auto frame = eth_header(0x88a8);
+    std::vector<uint8_t> tags{0x00, 0x64, 0x81, 0x00, 0x00, 0xc8, 0x08, 0x00};
+    frame.insert(frame.end(), tags.begin(), tags.end());
+    ipv4_udp(frame, 53, 40000, 20);
+
+    PacketView view;
+    CHECK(decode_packet(frame.data(), frame.size(), pcpp::LINKTYPE_ETHERNET, view));
+    CHECK(view.l3 == pcpp::IPv4);
+    CHECK(view.l4 == pcpp::UDP);
+    CHECK(view.l3_offset == 22);
+    CHECK(view.src_port == 53);
+    CHECK(view.payload_len == 20);
+}
+
+TEST_CASE("PacketView IPv4 fragments", "[pcap][view]")
+{
+    auto frame = eth_header(0x0800);
+    // more fragments flag
+    ipv4_udp(frame, 53000, 53, 12, 0x2000);
+
+    PacketView view;
+    CHECK(decode_packet(frame.data(), frame.size(), pcpp::LINKTYPE_ETHERNET, view));
+    CHECK(view.l3 == pcpp::IPv4);
+    CHECK(view.l4 == pcpp::UnknownProtocol);
+    CHECK(view.fragment);
+}
+
+TEST_CASE("PacketView IPv6 TCP", "[pcap][view]")
+{
+    auto frame = eth_header(0x86dd);
+    std::vector<uint8_t> ip{0x60, 0x00, 0x00, 0x00, 0x00, 28, 0 /* hop by hop */, 64};
+    for (uint8_t i = 0; i < 32; ++i) {
+        ip.push_back(i);
+    }
+    // hop by hop options, next header tcp
+    std::vector<uint8_t> hbh{6, 0, 1, 4, 0, 0, 0, 0};
+    std::vector<uint8_t> tcp{0xc3, 0x50, 0x00, 0x35, 0, 0, 0, 1, 0, 0, 0, 0, 0x50, 0x02, 0xff, 0xff, 0, 0, 0, 0};
+    frame.insert(frame.end(), ip.begin(), ip.end());
+    frame.insert(frame.end(), hbh.begin(), hbh.end());
+    frame.insert(frame.end(), tcp.begin(), tcp.end());
+
+    PacketView view;
+    CHECK(decode_packet(frame.data(), frame.size(), pcpp::LINKTYPE_ETHERNET, view));
+    CHECK(view.l3 == pcpp::IPv6);
+    CHECK(view.l4 == pcpp::TCP);
+    CHECK(view.l4_offset == 14 + 40 + 8);
+    CHECK(view.payload_len == 0);
+    CHECK(view.src_port == 50000);
+    CHECK(view.dst_port == 53);
+    CHECK(view.tcp_flags & PacketView::TCP_SYN);
+    CHECK(view.ipv6_src[0] == 0);
+    CHECK(view.ipv6_dst[15] == 31);
+    // dns over tcp: sampled by the connection, like the messages reassembled from it
+    CHECK(view.sample_key == tcp_sample_key(view.flow_key));
+}
+
+TEST_CASE("PacketView truncated and non ip frames", "[pcap][view]")
+{
+    auto frame = eth_header(0x0800);
+    ipv4_udp(frame, 53000, 53, 12);
+
+    PacketView view;
+    CHECK(!decode_packet(frame.data(), 20, pcpp::LINKTYPE_ETHERNET, view));
+    CHECK(view.l3 == pcpp::UnknownProtocol);
+    CHECK(view.l4 == pcpp::UnknownProtocol);
+
+    // ip header present, udp header cut short
+    CHECK(decode_packet(frame.data(), 38, pcpp::LINKTYPE_ETHERNET, view));
+    CHECK(view.l3 == pcpp::IPv4);
+    CHECK(view.l4 == pcpp::UnknownProtocol);
+
+    auto arp = eth_header(0x0806);
+    arp.insert(arp.end(), 28, 0);
+    CHECK(!decode_packet(arp.data(), arp.size(), pcpp::LINKTYPE_ETHERNET, view));
+}
+
+TEST_CASE("PacketView raw IP link type", "[pcap][view]")
+{
+    std::vector<uint8_t> frame;
+    ipv4_udp(frame, 53000, 53, 12);
+
+    PacketView view;
+    CHECK(decode_packet(frame.data(), frame.size(), pcpp::LINKTYPE_RAW, view));
+    CHECK(view.l3_offset == 0);
+    CHECK(view.l4 == pcpp::UDP);
+    CHECK(view.payload_offset == 28);
+}
+
+TEST_CASE("PacketView flow key is direction independent", "[pcap][view]")
+{
+    auto query = eth_header(0x0800);
+    ipv4_udp(query, 53000, 53, 12);
+    auto response = query;
+    // swap addresses and ports
+    std::swap_ranges(response.begin() + 26, response.begin() + 30, response.begin() + 30);
+    std::swap_ranges(response.begin() + 34, response.begin() + 36, response.begin() + 36);
+    auto other = eth_header(0x0800);
+    ipv4_udp(other, 53001, 53, 12);
+
+    PacketView q, r, o;
+    decode_packet(query.data(), query.size(), pcpp::LINKTYPE_ETHERNET, q);
+    decode_packet(response.data(), response.size(), pcpp::LINKTYPE_ETHERNET, r);
+    decode_packet(other.data(), other.size(), pcpp::LINKTYPE_ETHERNET, o);
+    CHECK(r.src_port == 53);
+    CHECK(q.flow_key == r.flow_key);
+    CHECK(q.flow_key != o.flow_key);
+}
+
+TEST_CASE("PacketView matches pcpp::Packet", "[pcap][view]")
+{
+    for (auto file : {"tests/fixtures/dns_ipv4_udp.pcap", "tests/fixtures/dns_ipv6_udp.pcap", "tests/fixtures/dns_ipv4_tcp.pcap", "tests/fixtures/dns_ipv6_tcp.pcap"}) {
+        auto reader = pcpp::IFileReaderDevice::getReader(file);
+        CHECK(reader->open());
+
+        pcpp::RawPacket rawPacket;
+        while (reader->getNextPacket(rawPacket)) {
+            pcpp::Packet packet(&rawPacket);
+            PacketView view;
+            decode_packet(rawPacket.getRawData(), rawPacket.getRawDataLen(), rawPacket.getLinkLayerType(), view);
+
+            if (auto udp = packet.getLayerOfType<pcpp::UdpLayer>()) {
+                CHECK(view.l4 == pcpp::UDP);
+                CHECK(view.src_port == ntohs(udp->getUdpHeader()->portSrc));
+                CHECK(view.dst_port == ntohs(udp->getUdpHeader()->portDst));
+                CHECK(view.payload_len == udp->getLayerPayloadSize());
+            } else if (auto tcp = packet.getLayerOfType<pcpp::TcpLayer>()) {
+                CHECK(view.l4 == pcpp::TCP);
+                CHECK(view.src_port == ntohs(tcp->getTcpHeader()->portSrc));
+                CHECK(view.payload_len == tcp->getLayerPayloadSize());
+            }
+            if (auto ip4 = packet.getLayerOfType<pcpp::IPv4Layer>()) {
+                CHECK(view.l3 == pcpp::IPv4);
+                CHECK(view.ipv4_src == ip4->getSrcIPv4Address().toInt());
+            } else if (auto ip6 = packet.getLayerOfType<pcpp::IPv6Layer>()) {
+                CHECK(view.l3 == pcpp::IPv6);
+                CHECK(pcpp::IPv6Address(view.ipv6_dst) == ip6->getDstIPv6Address());
+            }
+        }
+
+        reader->close();
+        delete reader;
+    }
+}
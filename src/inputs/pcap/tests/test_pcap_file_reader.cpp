@@ -0,0 +1,86 @@
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#include <PcapFileDevice.h>
+#pragma GCC diagnostic pop
+#include "PcapFileReader.h"
+#include <catch2/catch.hpp>
+#include <cstring>
+
+using namespace visor::input::pcap;
+
+static void check_same_packets(const char *file, const char *expected_file = nullptr)
+{
+    auto expected = pcpp::IFileReaderDevice::getReader(expected_file ? expected_file : file);
+    REQUIRE(expected->open());
+    PcapFileReader reader(file);
+
+    pcpp::RawPacket a, b;
+    uint64_t count{0};
+    while (expected->getNextPacket(a)) {
+        REQUIRE(reader.next(b));
+        CHECK(b.getRawDataLen() == a.getRawDataLen());
+        CHECK(std::memcmp(b.getRawData(), a.getRawData(), a.getRawDataLen()) == 0);
+        CHECK(b.getLinkLayerType() == a.getLinkLayerType());
+        CHECK(b.getPacketTimeStamp().tv_sec == a.getPacketTimeStamp().tv_sec);
+        CHECK(b.getPacketTimeStamp().tv_nsec == a.getPacketTimeStamp().tv_nsec);
+        ++count;
+    }
+    CHECK(count > 0);
+    CHECK(!reader.next(b));
+
+    expected->close();
+    delete expected;
+}
+
+TEST_CASE("PcapFileReader matches libpcap", "[pcap][reader]")
+{
+    for (auto file : {"tests/fixtures/dns_ipv4_udp.pcap", "tests/fixtures/dns_ipv6_tcp.pcap", "tests/fixtures/dhcp-flow.pcap"}) {
+        check_same_packets(file);
+    }
+}
+
+TEST_CASE("PcapFileReader nanosecond pcap", "[pcap][reader]")
+{
+    check_same_packets("tests/fixtures/nf9.pcap");
+
+    PcapFileReader reader("tests/fixtures/nf9.pcap");
+    pcpp::RawPacket packet;
+    REQUIRE(reader.next(packet));
+    CHECK(packet.getPacketTimeStamp().tv_sec == 1508409869);
+    CHECK(packet.getPacketTimeStamp().tv_nsec == 575718995);
+}
+
+TEST_CASE("PcapFileReader pcapng", "[pcap][reader]")
+{
+    // the same packets as dns_ipv4_udp.pcap, with nanosecond timestamps and a block the reader skips
+    check_same_packets("tests/fixtures/dns_ipv4_udp.pcapng", "tests/fixtures/dns_ipv4_udp.pcap");
+}
+
+TEST_CASE("PcapFileReader BPF filter", "[pcap][reader]")
+{
+    for (auto file : {"tests/fixtures/dns_ipv4_udp.pcap", "tests/fixtures/dns_ipv4_udp.pcapng"}) {
+        PcapFileReader reader(file);
+        pcpp::RawPacket packet;
+
+        reader.set_filter("udp port 53000");
+        uint64_t count{0};
+        while (reader.next(packet)) {
+            ++count;
+        }
+        CHECK(count == 140);
+
+        CHECK_THROWS_AS(reader.set_filter("not a filter"), PcapException);
+    }
+
+    PcapFileReader reader("tests/fixtures/dns_ipv4_udp.pcap");
+    reader.set_filter("tcp");
+    pcpp::RawPacket packet;
+    CHECK(!reader.next(packet));
+}
+
+TEST_CASE("PcapFileReader errors", "[pcap][reader]")
+{
+    CHECK_THROWS_AS(PcapFileReader("tests/fixtures/nonexistent.pcap"), PcapException);
+    CHECK_THROWS_AS(PcapFileReader("tests/fixtures/GeoIP2-City-Test.mmdb"), PcapException);
+}
@@ -0,0 +1,102 @@
+#include "TimingWheel.h"
+#include <catch2/catch.hpp>
+#include <vector>
+
+using namespace visor::input::pcap;
+
+TEST_CASE("TimingWheel idle expiry", "[pcap][wheel]")
+{
+    std::vector<uint32_t> expired;
+    TimingWheel<uint32_t> wheel([&expired](const uint32_t &key, bool evicted) {
+        CHECK(!evicted);
+        expired.push_back(key);
+    },
+        30);
+
+    wheel.expire(1000);
+    wheel.touch(1, 1000);
+    wheel.touch(2, 1005);
+    CHECK(wheel.size() == 2);
+
+    wheel.expire(1029);
+    CHECK(expired.empty());
+
+    // activity pushes the deadline out
+    wheel.touch(1, 1029);
+    wheel.expire(1035);
+    CHECK(expired == std::vector<uint32_t>{2});
+
+    wheel.erase(1);
+    wheel.expire(1100);
+    CHECK(expired == std::vector<uint32_t>{2});
+    CHECK(wheel.size() == 0);
+}
+
+TEST_CASE("TimingWheel time jumps", "[pcap][wheel]")
+{
+    std::vector<uint32_t> expired;
+    TimingWheel<uint32_t> wheel([&expired](const uint32_t &key, bool) { expired.push_back(key); }, 5);
+
+    wheel.expire(10);
+    for (uint32_t i = 0; i < 10; ++i) {
+        wheel.touch(i, 10 + i);
+    }
+    // further than a full turn of the wheel, keys touched ahead of the wheel keep their deadline
+    wheel.expire(20);
+    CHECK(expired.size() == 6);
+    CHECK(wheel.size() == 4);
+
+    // time going backwards is ignored
+    wheel.expire(15);
+    CHECK(wheel.size() == 4);
+
+    wheel.expire(1000);
+    CHECK(expired.size() == 10);
+    CHECK(wheel.size() == 0);
+}
+
+TEST_CASE("TimingWheel maximum size", "[pcap][wheel]")
+{
+    std::vector<uint32_t> evicted_keys;
+    TimingWheel<uint32_t> wheel([&evicted_keys](const uint32_t &key, bool evicted) {
+        CHECK(evicted);
+        evicted_keys.push_back(key);
+    },
+        30, 3);
+
+    wheel.expire(100);
+    wheel.touch(1, 100);
+    wheel.touch(2, 101);
+    wheel.touch(3, 102);
+    wheel.touch(4, 103);
+    // touching never removes, the limit is applied on the next expire
+    CHECK(wheel.size() == 4);
+
+    wheel.expire(103);
+    CHECK(wheel.size() == 3);
+    CHECK(evicted_keys == std::vector<uint32_t>{1});
+    CHECK(wheel.evictions() == 1);
+}
+
+TEST_CASE("TimingWheel callbacks may modify the wheel", "[pcap][wheel]")
+{
+    TimingWheel<uint32_t> *self{nullptr};
+    std::vector<uint32_t> expired;
+    TimingWheel<uint32_t> wheel([&](const uint32_t &key, bool) {
+        expired.push_back(key);
+        // closing a connection may flush data, which touches and then erases it again
+        self->touch(key, 50);
+        self->erase(key);
+        self->erase(key == 1 ? 2 : 1);
+        self->expire(60);
+    },
+        10);
+    self = &wheel;
+
+    wheel.expire(40);
+    wheel.touch(1, 40);
+    wheel.touch(2, 40);
+    wheel.expire(50);
+    CHECK(expired.size() == 1);
+    CHECK(wheel.size() == 0);
+}
@@ -26,6 +26,15 @@ public:
     }
 };
 
+// af_packet capture statistics. counters are monotonic, ring blocks are sampled at the time of reading
+struct AFPacketStats {
+    uint64_t packets{0};
+    uint64_t drops{0};
+    uint64_t freeze_q_cnt{0};
+    uint64_t blocks_in_use{0};
+    uint64_t num_blocks{0};
+};
+
 // list of subnets we count as "host" to determine direction of packets
 struct IPv4subnet {
     pcpp::IPv4Address address;
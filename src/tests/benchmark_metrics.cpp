@@ -0,0 +1,129 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "AbstractMetricsManager.h"
+#include <benchmark/benchmark.h>
+
+using namespace visor;
+
+// shaped like the handler buckets: a mutex for the specialized metrics, a few counters and a sketch
+class BenchMetricsBucket final : public AbstractMetricsBucket
+{
+    mutable std::shared_mutex _mutex;
+    Counter _queries;
+    Counter _replies;
+    Quantile<uint64_t> _size;
+
+public:
+    BenchMetricsBucket()
+        : _queries("bench", {"queries"}, "Count of queries")
+        , _replies("bench", {"replies"}, "Count of replies")
+        , _size("bench", {"size"}, "Quantiles of sizes")
+    {
+    }
+
+    void specialized_merge(const AbstractMetricsBucket &o) override
+    {
+        const auto &other = static_cast<const BenchMetricsBucket &>(o);
+        std::shared_lock r_lock(other._mutex);
+        std::unique_lock w_lock(_mutex);
+        _queries += other._queries;
+        _replies += other._replies;
+        _size.merge(other._size);
+    }
+
+    void to_json(json &j) const override
+    {
+        std::shared_lock r_lock(_mutex);
+        _queries.to_json(j);
+        _replies.to_json(j);
+        _size.to_json(j);
+    }
+
+    void to_prometheus(std::stringstream &out, Metric::LabelMap add_labels = {}) const override
+    {
+        std::shared_lock r_lock(_mutex);
+        _queries.to_prometheus(out, add_labels);
+        _replies.to_prometheus(out, add_labels);
+        _size.to_prometheus(out, add_labels);
+    }
+
+    void process(bool deep, uint64_t n)
+    {
+        auto lock = write_lock(_mutex);
+        if (n & 1) {
+            ++_replies;
+        } else {
+            ++_queries;
+        }
+        if (deep) {
+            _size.update(n & 0x3ff);
+        }
+    }
+};
+
+class BenchMetricsManager final : public AbstractMetricsManager<BenchMetricsBucket>
+{
+public:
+    BenchMetricsManager(const Configurable *window_config)
+        : AbstractMetricsManager(window_config)
+    {
+        enable_single_writer(window_config);
+    }
+
+    void process(timespec stamp, uint64_t n)
+    {
+        auto scope = write_scope();
+        auto deep = new_event(stamp);
+        live_bucket()->process(deep, n);
+    }
+};
+
+// per event cost of the manager and bucket update path, with the default locks and with a single writer
+static void BM_metricsEvent(benchmark::State &state)
+{
+    Config c;
+    c.config_set<uint64_t>("num_periods", 5);
+    c.config_set<uint64_t>("deep_sample_rate", 10);
+    c.config_set<bool>("single_writer", state.range(0));
+    BenchMetricsManager manager(&c);
+    timespec stamp;
+    std::timespec_get(&stamp, TIME_UTC);
+    uint64_t n{0};
+    for (auto _ : state) {
+        manager.process(stamp, n++);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_metricsEvent)->ArgName("single_writer")->Arg(0)->Arg(1);
+
+// the same with a reader taking the live window every millisecond, as an http client polling it would
+static void BM_metricsEventWithReader(benchmark::State &state)
+{
+    Config c;
+    c.config_set<uint64_t>("num_periods", 5);
+    c.config_set<uint64_t>("deep_sample_rate", 10);
+    c.config_set<bool>("single_writer", state.range(0));
+    BenchMetricsManager manager(&c);
+    timespec stamp;
+    std::timespec_get(&stamp, TIME_UTC);
+    std::atomic<bool> done{false};
+    std::thread reader([&manager, &done] {
+        while (!done) {
+            json j;
+            manager.window_single_json(j, "live", 0);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+    uint64_t n{0};
+    for (auto _ : state) {
+        manager.process(stamp, n++);
+    }
+    done = true;
+    reader.join();
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_metricsEventWithReader)->ArgName("single_writer")->Arg(0)->Arg(1)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,246 @@
+#include "AbstractMetricsManager.h"
+#include "LoadShedder.h"
+#include <catch2/catch.hpp>
+
+using namespace visor;
+
+namespace {
+
+class ShedTestMetricsBucket : public AbstractMetricsBucket
+{
+public:
+    void specialized_merge([[maybe_unused]] const AbstractMetricsBucket &other) override
+    {
+    }
+    void to_json([[maybe_unused]] json &j) const override
+    {
+    }
+    void to_prometheus([[maybe_unused]] std::stringstream &out, [[maybe_unused]] Metric::LabelMap add_labels = {}) const override
+    {
+    }
+};
+
+class ShedTestMetricsManager : public AbstractMetricsManager<ShedTestMetricsBucket>
+{
+public:
+    ShedTestMetricsManager(const Configurable *window_config)
+        : AbstractMetricsManager(window_config)
+    {
+    }
+
+    bool process(timespec stamp, uint64_t weight)
+    {
+        return new_event(stamp, true, weight);
+    }
+};
+
+constexpr int64_t SECOND = LoadShedder::CONTROL_INTERVAL_NS;
+
+}
+
+TEST_CASE("Load shedder keep", "[load_shedder]")
+{
+    uint64_t kept[4]{0, 0, 0, 0};
+    for (uint64_t key = 0; key < 100000; ++key) {
+        CHECK(LoadShedder::keep(key, 0));
+        for (uint32_t shift = 1; shift < 4; ++shift) {
+            if (LoadShedder::keep(key, shift)) {
+                ++kept[shift];
+                // nested: kept at a lower shift too
+                CHECK(LoadShedder::keep(key, shift - 1));
+            }
+        }
+    }
+    CHECK(kept[1] > 48000);
+    CHECK(kept[1] < 52000);
+    CHECK(kept[2] > 23500);
+    CHECK(kept[2] < 26500);
+    CHECK(kept[3] > 11000);
+    CHECK(kept[3] < 14000);
+}
+
+TEST_CASE("Load shedder control", "[load_shedder]")
+{
+    Config c;
+    c.config_set<uint64_t>("cpu_budget", 50);
+    c.config_set<uint64_t>("deep_sample_rate", 100);
+    uint32_t backlog{0};
+    LoadShedder shedder(&c, [&backlog] { return backlog; });
+    auto probe = shedder.add_probe("handler");
+    CHECK(shedder.cpu_budget() == 50);
+    CHECK(shedder.deep_sample_rate() == 100);
+    CHECK(shedder.shed_shift() == 0);
+    CHECK(shedder.admit(42) == 1);
+
+    int64_t now{SECOND};
+    // baseline
+    shedder.control(now);
+
+    SECTION("over budget lowers the deep sample rate first, then sheds")
+    {
+        std::vector<uint32_t> deep_rates;
+        for (int i = 0; i < 6; ++i) {
+            probe->add(now, now + SECOND * 8 / 10);
+            now += SECOND;
+            shedder.control(now);
+            deep_rates.push_back(shedder.deep_sample_rate());
+            CHECK(shedder.shed_shift() == 0);
+        }
+        CHECK(deep_rates == std::vector<uint32_t>{50, 25, 12, 6, 3, 1});
+        CHECK(shedder.cpu_usage() == Approx(80));
+        CHECK(probe->cpu_usage() == Approx(80));
+
+        for (uint32_t shift = 1; shift <= LoadShedder::MAX_SHED_SHIFT + 2; ++shift) {
+            probe->add(now, now + SECOND * 8 / 10);
+            now += SECOND;
+            shedder.control(now);
+            CHECK(shedder.shed_shift() == std::min(shift, LoadShedder::MAX_SHED_SHIFT));
+        }
+        CHECK(shedder.sample_ratio() == Approx(1.0 / 1024));
+
+        // nearly idle: steps are undone in reverse order, one per interval
+        for (uint32_t shift = LoadShedder::MAX_SHED_SHIFT; shift > 0; --shift) {
+            now += SECOND;
+            shedder.control(now);
+            CHECK(shedder.shed_shift() == shift - 1);
+            CHECK(shedder.deep_sample_rate() == 1);
+        }
+        std::vector<uint32_t> recovered;
+        for (int i = 0; i < 8; ++i) {
+            now += SECOND;
+            shedder.control(now);
+            recovered.push_back(shedder.deep_sample_rate());
+        }
+        CHECK(recovered == std::vector<uint32_t>{2, 4, 8, 16, 32, 64, 100, 100});
+    }
+
+    SECTION("within budget holds")
+    {
+        // doubling would not fit, so nothing is undone either
+        probe->add(now, now + SECOND * 3 / 10);
+        now += SECOND;
+        shedder.control(now);
+        CHECK(shedder.deep_sample_rate() == 100);
+        CHECK(shedder.shed_shift() == 0);
+    }
+
+    SECTION("a full input ring counts as over budget")
+    {
+        backlog = LoadShedder::BACKLOG_HIGH;
+        now += SECOND;
+        shedder.control(now);
+        CHECK(shedder.input_backlog() == LoadShedder::BACKLOG_HIGH);
+        CHECK(shedder.deep_sample_rate() == 50);
+
+        // between the water marks nothing changes
+        backlog = LoadShedder::BACKLOG_LOW;
+        now += SECOND;
+        shedder.control(now);
+        CHECK(shedder.deep_sample_rate() == 50);
+
+        backlog = 0;
+        now += SECOND;
+        shedder.control(now);
+        CHECK(shedder.deep_sample_rate() == 100);
+    }
+
+    SECTION("control from the event path")
+    {
+        probe->add(now, now + SECOND / 2);
+        // not due yet
+        probe->add(now + SECOND / 2, now + SECOND / 2 + SECOND / 10);
+        CHECK(shedder.deep_sample_rate() == 100);
+        // the interval is over when this one ends
+        probe->add(now + SECOND - 1, now + SECOND);
+        CHECK(shedder.deep_sample_rate() == 50);
+    }
+
+    SECTION("admit weights the kept events")
+    {
+        for (int i = 0; i < 8; ++i) {
+            probe->add(now, now + SECOND);
+            now += SECOND;
+            shedder.control(now);
+        }
+        REQUIRE(shedder.shed_shift() == 2);
+        uint64_t events{0};
+        for (uint64_t key = 0; key < 100000; ++key) {
+            auto weight = shedder.admit(key);
+            CHECK((weight == 0 || weight == 4));
+            events += weight;
+        }
+        CHECK(events > 94000);
+        CHECK(events < 106000);
+    }
+}
+
+TEST_CASE("Load shedder config", "[load_shedder]")
+{
+    Metric::add_static_label("instance", "test instance");
+
+    Config c;
+    c.config_set<uint64_t>("cpu_budget", 0);
+    CHECK_THROWS_WITH(LoadShedder(&c), "invalid cpu_budget: 0, expecting a percentage of one cpu above 0");
+
+    c.config_set<std::string>("cpu_budget", "half");
+    CHECK_THROWS_WITH(LoadShedder(&c), "wrong type for key: cpu_budget");
+
+    c.config_set<uint64_t>("cpu_budget", 200);
+    c.config_set<uint64_t>("deep_sample_rate", 40);
+    LoadShedder shedder(&c);
+    CHECK(shedder.cpu_budget() == 200);
+    CHECK(shedder.deep_sample_rate() == 40);
+    CHECK(shedder.input_backlog() == 0);
+
+    json j;
+    shedder.add_probe("handler");
+    shedder.to_json(j);
+    CHECK(j["cpu_budget"] == 200);
+    CHECK(j["sample_ratio"] == 1.0);
+    CHECK(j["deep_sample_rate"] == 40);
+    CHECK(j["handlers"]["handler"]["cpu_usage"] == 0.0);
+
+    std::stringstream out;
+    shedder.to_prometheus(out, "dns", {{"policy", "default"}});
+    std::string line;
+    std::getline(out, line);
+    CHECK(line == "# HELP dns_load_shed_sample_ratio Share of events processed by the policy, the rest are shed to stay within its cpu budget");
+    std::getline(out, line);
+    CHECK(line == "# TYPE dns_load_shed_sample_ratio gauge");
+    std::getline(out, line);
+    CHECK(line == R"(dns_load_shed_sample_ratio{instance="test instance",policy="default"} 1)");
+}
+
+TEST_CASE("Load shedder metrics manager", "[load_shedder][metrics]")
+{
+    Config c;
+    c.config_set<uint64_t>("num_periods", 1);
+    c.config_set<uint64_t>("deep_sample_rate", 100);
+    c.config_set<uint64_t>("cpu_budget", 10);
+    LoadShedder shedder(&c);
+    auto probe = shedder.add_probe("handler");
+    ShedTestMetricsManager manager(&c);
+    manager.set_load_shedder(&shedder);
+
+    timespec stamp;
+    std::timespec_get(&stamp, TIME_UTC);
+    CHECK(manager.process(stamp, 4));
+    CHECK(manager.bucket(0)->event_data_locked().num_events->value() == 4);
+    CHECK(manager.bucket(0)->event_data_locked().num_samples->value() == 1);
+
+    // the manager follows the lowered rate, but keeps reporting the configured one
+    int64_t now{SECOND};
+    shedder.control(now);
+    for (int i = 0; i < 6; ++i) {
+        probe->add(now, now + SECOND);
+        now += SECOND;
+        shedder.control(now);
+    }
+    CHECK(manager.deep_sample_rate() == 100);
+    CHECK(manager.effective_deep_sample_rate() == 1);
+    uint64_t deep{0};
+    for (int i = 0; i < 10000; ++i) {
+        deep += manager.process(stamp, 1);
+    }
+    CHECK(deep < 300);
+}
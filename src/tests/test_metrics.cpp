@@ -1,5 +1,8 @@
 #include "AbstractMetricsManager.h"
+#include <algorithm>
+#include <atomic>
 #include <catch2/catch.hpp>
+#include <thread>
 
 using namespace visor;
 
@@ -73,6 +76,395 @@ TEST_CASE("Abstract metrics manager", "[metrics][abstract]")
     }
 }
 
+class ShardTestMetricsBucket : public AbstractMetricsBucket
+{
+    Counter _hits;
+
+public:
+    ShardTestMetricsBucket()
+        : _hits("test", {"hits"}, "Test hits")
+    {
+    }
+    void specialized_merge(const AbstractMetricsBucket &o) override
+    {
+        _hits += static_cast<const ShardTestMetricsBucket &>(o)._hits;
+    }
+    void to_json(json &j) const override
+    {
+        _hits.to_json(j);
+    }
+    void to_prometheus(std::stringstream &out, Metric::LabelMap add_labels = {}) const override
+    {
+        _hits.to_prometheus(out, add_labels);
+    }
+    void hit()
+    {
+        ++_hits;
+    }
+};
+
+class ShardTestMetricsManager : public AbstractMetricsManager<ShardTestMetricsBucket>
+{
+public:
+    ShardTestMetricsManager(const Configurable *windowConfig)
+        : AbstractMetricsManager(windowConfig)
+    {
+        enable_single_writer(windowConfig);
+    }
+
+    void process_hit(timespec stamp)
+    {
+        auto scope = write_scope();
+        new_event(stamp);
+        live_bucket()->hit();
+    }
+
+    bool process_flow_hit(timespec stamp, uint64_t flow_key)
+    {
+        auto deep = new_flow_event(stamp, flow_key);
+        live_bucket()->hit();
+        return deep;
+    }
+
+    struct Hit {
+        timespec stamp;
+    };
+
+    void process_hits(const std::vector<Hit> &hits, std::vector<size_t> &runs)
+    {
+        new_event_batch(hits, [&runs](ShardTestMetricsBucket *bucket, auto first, auto last, const std::vector<bool> &deep) {
+            CHECK(deep.size() == static_cast<size_t>(last - first));
+            runs.push_back(deep.size());
+            for (; first != last; ++first) {
+                bucket->hit();
+            }
+        });
+    }
+};
+
+TEST_CASE("Abstract metrics manager worker shards", "[metrics][abstract][shards]")
+{
+    json j;
+    visor::Config c;
+    c.config_set<uint64_t>("num_periods", 2);
+    ShardTestMetricsManager manager(&c);
+    timespec stamp;
+    timespec_get(&stamp, TIME_UTC);
+
+    auto hit_from_workers = [&manager, stamp] {
+        std::vector<std::thread> workers;
+        for (unsigned int i = 0; i < 4; ++i) {
+            workers.emplace_back([&manager, stamp, i] {
+                worker_shard_id = i;
+                for (int n = 0; n < 100; ++n) {
+                    manager.process_hit(stamp);
+                }
+            });
+        }
+        for (auto &w : workers) {
+            w.join();
+        }
+    };
+    hit_from_workers();
+
+    SECTION("Live window merges shards")
+    {
+        manager.window_single_json(j, "metrics", 0);
+        CHECK(j["metrics"]["hits"] == 400);
+        // the bucket for shard 0 alone only saw its own worker
+        manager.bucket(0)->to_json(j["shard"]);
+        CHECK(j["shard"]["hits"] == 100);
+    }
+
+    SECTION("Period shift folds shards into the closed period")
+    {
+        timespec next = stamp;
+        next.tv_sec += ShardTestMetricsManager::PERIOD_SEC;
+        manager.check_period_shift(next);
+        manager.window_single_json(j, "metrics", 1);
+        CHECK(j["metrics"]["hits"] == 400);
+        manager.window_single_json(j, "live", 0);
+        CHECK(j["live"]["hits"] == 0);
+    }
+
+    SECTION("Event rates count the events of all shards")
+    {
+        // the rate engine thread may tick while the workers run, then try again
+        uint64_t live{0};
+        for (int attempt = 0; attempt < 3 && live != 400; ++attempt) {
+            RateEngine::instance().tick();
+            hit_from_workers();
+            RateEngine::instance().tick();
+            auto [num_events, num_samples, event_rate, event_lock] = manager.bucket(0)->event_data_locked();
+            live = event_rate->rate();
+        }
+        CHECK(live == 400);
+    }
+}
+
+TEST_CASE("Abstract metrics manager worker shards across period shifts", "[metrics][abstract][shards]")
+{
+    visor::Config c;
+    c.config_set<uint64_t>("num_periods", 10);
+    ShardTestMetricsManager manager(&c);
+    timespec stamp;
+    timespec_get(&stamp, TIME_UTC);
+    manager.set_start_tstamp(stamp);
+
+    // the window shifts under the workers, no hit may be lost with the shards it retires
+    std::atomic<bool> done{false};
+    std::thread shifter([&manager, &done, stamp] {
+        for (unsigned int i = 1; i < 10; ++i) {
+            auto next = stamp;
+            next.tv_sec += i * ShardTestMetricsManager::PERIOD_SEC;
+            manager.check_period_shift(next);
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        done = true;
+    });
+    std::vector<std::thread> workers;
+    std::vector<uint64_t> sent(4);
+    for (unsigned int i = 0; i < 4; ++i) {
+        workers.emplace_back([&manager, &done, &sent, stamp, i] {
+            worker_shard_id = i;
+            while (!done) {
+                manager.process_hit(stamp);
+                ++sent[i];
+            }
+        });
+    }
+    shifter.join();
+    for (auto &w : workers) {
+        w.join();
+    }
+
+    uint64_t hits{0};
+    for (unsigned int period = 0; period < 10; ++period) {
+        json j;
+        manager.window_single_json(j, "metrics", period);
+        hits += j["metrics"]["hits"].get<uint64_t>();
+    }
+    CHECK(hits == sent[0] + sent[1] + sent[2] + sent[3]);
+}
+
+TEST_CASE("Abstract metrics manager event batches", "[metrics][abstract][batch]")
+{
+    json j;
+    visor::Config c;
+    c.config_set<uint64_t>("num_periods", 2);
+    ShardTestMetricsManager manager(&c);
+    timespec stamp;
+    timespec_get(&stamp, TIME_UTC);
+    timespec next = stamp;
+    next.tv_sec += ShardTestMetricsManager::PERIOD_SEC;
+
+    // a batch straddling a period boundary is split into one run per bucket
+    std::vector<ShardTestMetricsManager::Hit> hits(10, {stamp});
+    hits.insert(hits.end(), 5, {next});
+    std::vector<size_t> runs;
+    manager.process_hits(hits, runs);
+
+    CHECK(runs == std::vector<size_t>{10, 5});
+    manager.window_single_json(j, "closed", 1);
+    CHECK(j["closed"]["hits"] == 10);
+    manager.window_single_json(j, "live", 0);
+    CHECK(j["live"]["hits"] == 5);
+    auto [num_events, num_samples, event_rate, event_lock] = manager.bucket(0)->event_data_locked();
+    CHECK(num_events->value() == 5);
+    CHECK(num_samples->value() == 5);
+}
+
+TEST_CASE("Abstract metrics manager single writer", "[metrics][abstract][single_writer]")
+{
+    json j;
+    visor::Config c;
+    c.config_set<uint64_t>("num_periods", 2);
+    c.config_set<bool>("single_writer", true);
+    ShardTestMetricsManager manager(&c);
+    REQUIRE(manager.single_writer());
+    timespec stamp;
+    timespec_get(&stamp, TIME_UTC);
+    timespec next = stamp;
+    next.tv_sec += ShardTestMetricsManager::PERIOD_SEC;
+
+    constexpr uint64_t HITS = 20000;
+    std::atomic<bool> done{false};
+    std::thread writer([&manager, &done, stamp] {
+        for (uint64_t n = 0; n < HITS; ++n) {
+            manager.process_hit(stamp);
+        }
+        done = true;
+    });
+
+    // readers see consistent copies of the live bucket while it is updated
+    uint64_t last{0};
+    bool shifted{false};
+    while (!done) {
+        manager.window_single_json(j, "live", 0);
+        uint64_t hits = j["live"]["hits"];
+        if (!shifted) {
+            CHECK(hits >= last);
+            last = hits;
+            // merged results are cached until the shift
+            json info;
+            manager.window_merged_json(info, "merged", 2);
+            CHECK(info["merged"]["hits"] <= HITS);
+            if (hits > HITS / 2) {
+                // as an input heartbeat would, from another thread
+                manager.check_period_shift(next);
+                shifted = true;
+            }
+        }
+    }
+    writer.join();
+    if (!shifted) {
+        manager.check_period_shift(next);
+    }
+
+    uint64_t live, closed;
+    manager.window_single_json(j, "live", 0);
+    live = j["live"]["hits"];
+    manager.window_single_json(j, "closed", 1);
+    closed = j["closed"]["hits"];
+    CHECK(live + closed == HITS);
+    manager.window_merged_json(j, "merged", 2);
+    CHECK(j["merged"]["hits"] == HITS);
+    auto snapshot = manager.live_bucket_snapshot();
+    auto [num_events, num_samples, event_rate, event_lock] = snapshot->event_data_locked();
+    CHECK(num_events->value() == live);
+}
+
+TEST_CASE("Abstract metrics manager merged windows", "[metrics][abstract][merged]")
+{
+    json j;
+    visor::Config c;
+    c.config_set<uint64_t>("num_periods", 3);
+    ShardTestMetricsManager manager(&c);
+    timespec stamp;
+    timespec_get(&stamp, TIME_UTC);
+    auto hits = [&manager](timespec at, int n) {
+        while (n--) {
+            manager.process_hit(at);
+        }
+    };
+
+    hits(stamp, 3);
+    stamp.tv_sec += ShardTestMetricsManager::PERIOD_SEC;
+    hits(stamp, 4);
+    // a window longer than the accumulated periods merges what there is
+    manager.window_merged_json(j, "merged", 3);
+    CHECK(j["merged"]["hits"] == 7);
+
+    stamp.tv_sec += ShardTestMetricsManager::PERIOD_SEC;
+    hits(stamp, 5);
+    manager.window_merged_json(j, "merged", 2);
+    CHECK(j["merged"]["hits"] == 9);
+    manager.window_merged_json(j, "merged", 3);
+    CHECK(j["merged"]["hits"] == 12);
+
+    // cached for MERGE_CACHE_TTL_MS, the live period carries on meanwhile
+    hits(stamp, 1);
+    manager.window_merged_json(j, "merged", 3);
+    CHECK(j["merged"]["hits"] == 12);
+    manager.window_single_json(j, "live", 0);
+    CHECK(j["live"]["hits"] == 6);
+
+    // closed periods render the same from the cache
+    manager.window_single_json(j, "closed", 1);
+    CHECK(j["closed"]["hits"] == 4);
+    manager.window_single_json(j, "closed", 1);
+    CHECK(j["closed"]["hits"] == 4);
+    std::stringstream first, second;
+    manager.window_single_prometheus(first, 1);
+    manager.window_single_prometheus(second, 1);
+    CHECK(first.str() == second.str());
+    CHECK(first.str().find(" 4\n") != std::string::npos);
+
+    // a shift drops the cached results, and the oldest period leaves the window
+    stamp.tv_sec += ShardTestMetricsManager::PERIOD_SEC;
+    hits(stamp, 7);
+    manager.window_merged_json(j, "merged", 3);
+    CHECK(j["merged"]["hits"] == 17);
+    manager.window_merged_json(j, "merged", 2);
+    CHECK(j["merged"]["hits"] == 13);
+    manager.window_single_json(j, "closed", 1);
+    CHECK(j["closed"]["hits"] == 6);
+}
+
+TEST_CASE("Abstract metrics manager bucket pool", "[metrics][abstract][pool]")
+{
+    json j;
+    BucketPool<ShardTestMetricsBucket> pool;
+    CHECK_FALSE(pool.ready());
+    pool.prepare();
+    // built on the pool thread
+    for (int i = 0; i < 1000 && !pool.ready(); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(pool.ready());
+    auto bucket = pool.acquire();
+    CHECK_FALSE(pool.ready());
+    bucket->hit();
+    bucket->to_json(j);
+    CHECK(j["hits"] == 1);
+    pool.release(std::move(bucket));
+    // a new one when nothing was prepared
+    CHECK(pool.acquire());
+}
+
+TEST_CASE("Metric descriptors", "[metrics][descriptor]")
+{
+    Counter a("root", {"test", "descriptor"}, "A descriptor test metric");
+    Counter b("root", {"test", "descriptor"}, "A descriptor test metric");
+    Quantile<uint64_t> q("root", {"test", "descriptor"}, "A descriptor test metric");
+    Counter other("root", {"test", "other"}, "A descriptor test metric");
+
+    // the info is shared, whatever the metric type
+    CHECK(&a.info() == &b.info());
+    CHECK(&a.info() == &q.info());
+    CHECK(&a.info() != &other.info());
+    CHECK(a.info().schema_key == "root");
+    CHECK(a.info().names == std::vector<std::string>{"test", "descriptor"});
+    CHECK(a.info().desc == "A descriptor test metric");
+    CHECK(a.base_name_snake() == "root_test_descriptor");
+
+    other.set_info("root", {"test", "descriptor"}, "A descriptor test metric");
+    CHECK(&a.info() == &other.info());
+    CHECK_THROWS_WITH(Counter("root", {"test*"}, "A descriptor test metric"), "invalid metric name: test*");
+}
+
+TEST_CASE("Metric descriptor tables", "[metrics][descriptor]")
+{
+    MetricDescriptor::Table table;
+    auto build = [&table](std::vector<const MetricDescriptor *> &infos) {
+        MetricDescriptor::Table::Scope scope(table);
+        Counter c("root", {"table", "counter"}, "A descriptor table test metric");
+        Rate r("root", {"table", "rate"}, "A descriptor table test rate");
+        infos = {&c.info(), &r.info()};
+    };
+
+    CHECK(table.size() == 0);
+    std::vector<const MetricDescriptor *> first, second;
+    build(first);
+    CHECK(table.size() == 2);
+    build(second);
+    CHECK(first == second);
+    CHECK(second[1]->base_name_snake == "root_table_rate");
+
+    // metrics built outside a scope resolve their own
+    Counter outside("root", {"table", "counter"}, "A descriptor table test metric");
+    CHECK(&outside.info() == first[0]);
+
+    // a first build which throws leaves the table unresolved
+    MetricDescriptor::Table failed;
+    CHECK_THROWS([&failed] {
+        MetricDescriptor::Table::Scope scope(failed);
+        Counter c("root", {"table", "counter"}, "A descriptor table test metric");
+        Counter invalid("root", {"table*"}, "A descriptor table test metric");
+    }());
+    CHECK(failed.size() == 0);
+}
+
 TEST_CASE("Counter metrics", "[metrics][counter]")
 {
     Metric::add_static_label("instance", "test instance");
@@ -234,6 +626,131 @@ TEST_CASE("TopN metrics", "[metrics][topn]")
         std::getline(output, line);
         CHECK(line == R"(root_test_metric{instance="test instance",integer="10",policy="default"} 1)");
     }
+
+    SECTION("TopN for each item")
+    {
+        for (uint16_t i = 0; i < 20; ++i) {
+            top_int.update(i);
+        }
+        std::vector<uint16_t> items;
+        top_int.for_each_item([&items](const uint16_t &val) { items.push_back(val); });
+        std::sort(items.begin(), items.end());
+        CHECK(items.size() == 20);
+        CHECK(items.front() == 0);
+        CHECK(items.back() == 19);
+    }
+}
+
+TEST_CASE("DenseTopN metrics", "[metrics][topn]")
+{
+    Metric::add_static_label("instance", "test instance");
+
+    json j;
+    std::stringstream output;
+    std::string line;
+    DenseTopN<uint16_t> top_port("root", "port", {"test", "metric"}, "A dense topn test metric");
+    DenseTopN<uint8_t, 16> top_code("root", "code", {"test", "metric"}, "A dense topn test metric");
+
+    SECTION("DenseTopN to json")
+    {
+        top_port.update(53);
+        top_port.update(65535, 3);
+        top_port.update(53);
+        top_port.to_json(j);
+        CHECK(j["test"]["metric"][0]["name"] == 65535);
+        CHECK(j["test"]["metric"][0]["estimate"] == 3);
+        CHECK(j["test"]["metric"][1]["name"] == 53);
+        CHECK(j["test"]["metric"][1]["estimate"] == 2);
+    }
+
+    SECTION("DenseTopN to json formatter")
+    {
+        top_code.update(3);
+        top_code.to_json(j["top"], [](const uint8_t &val) { return val == 3 ? "NXDOMAIN" : std::to_string(val); });
+        CHECK(j["top"]["test"]["metric"][0]["estimate"] == 1);
+        CHECK(j["top"]["test"]["metric"][0]["name"] == "NXDOMAIN");
+    }
+
+    SECTION("DenseTopN keeps the top 10, ties by value")
+    {
+        for (uint16_t i = 0; i < 20; ++i) {
+            top_port.update(i, i < 15 ? 1 : 2);
+        }
+        top_port.to_json(j);
+        CHECK(j["test"]["metric"].size() == 10);
+        CHECK(j["test"]["metric"][0]["name"] == 15);
+        CHECK(j["test"]["metric"][4]["name"] == 19);
+        CHECK(j["test"]["metric"][5]["name"] == 0);
+        CHECK(j["test"]["metric"][9]["name"] == 4);
+        CHECK(j["test"]["metric"][9]["estimate"] == 1);
+    }
+
+    SECTION("DenseTopN merge")
+    {
+        DenseTopN<uint16_t> other("root", "port", {"test", "metric"}, "A dense topn test metric");
+        top_port.update(53, 2);
+        other.update(53, 5);
+        other.update(443);
+        top_port.merge(other);
+        CHECK(top_port.count(53) == 7);
+        CHECK(top_port.count(443) == 1);
+        CHECK(top_port.count(80) == 0);
+    }
+
+    SECTION("DenseTopN counts are kept off the bucket until used")
+    {
+        CHECK(sizeof(top_port) < 1024);
+        DenseTopN<uint16_t> other("root", "port", {"test", "metric"}, "A dense topn test metric");
+        top_port.merge(other);
+        CHECK(top_port.count(53) == 0);
+        top_port.to_json(j);
+        CHECK(j["test"]["metric"].empty());
+        other.update(53);
+        top_port.merge(other);
+        CHECK(top_port.count(53) == 1);
+    }
+
+    SECTION("DenseTopN prometheus")
+    {
+        top_port.update(123);
+        top_port.update(10);
+        top_port.update(123);
+        top_port.to_prometheus(output, {{"policy", "default"}});
+        std::getline(output, line);
+        CHECK(line == "# HELP root_test_metric A dense topn test metric");
+        std::getline(output, line);
+        CHECK(line == "# TYPE root_test_metric gauge");
+        std::getline(output, line);
+        CHECK(line == R"(root_test_metric{instance="test instance",policy="default",port="123"} 2)");
+        std::getline(output, line);
+        CHECK(line == R"(root_test_metric{instance="test instance",policy="default",port="10"} 1)");
+    }
+
+    SECTION("DenseTopN prometheus formatter")
+    {
+        top_code.update(0);
+        top_code.update(3, 2);
+        top_code.to_prometheus(output, {{"policy", "default"}},
+            [](const uint8_t &val) { return val == 3 ? "NXDOMAIN" : std::to_string(val); });
+        std::getline(output, line);
+        std::getline(output, line);
+        std::getline(output, line);
+        CHECK(line == R"(root_test_metric{instance="test instance",code="NXDOMAIN",policy="default"} 2)");
+        std::getline(output, line);
+        CHECK(line == R"(root_test_metric{instance="test instance",code="0",policy="default"} 1)");
+    }
+
+    SECTION("DenseTopN for each item")
+    {
+        for (uint16_t i = 0; i < 20; ++i) {
+            top_port.update(i * 1000);
+        }
+        std::vector<uint16_t> items;
+        top_port.for_each_item([&items](const uint16_t &val) { items.push_back(val); });
+        CHECK(items.size() == 20);
+        CHECK(items.front() == 0);
+        CHECK(items.back() == 19000);
+    }
 }
 
 TEST_CASE("Cardinality metrics", "[metrics][cardinality]")
@@ -302,4 +819,121 @@ TEST_CASE("Rate metrics", "[metrics][rate]")
     {
         r.to_prometheus(output, {{"policy", "default"}});
     }
+
+    SECTION("rate deferred start")
+    {
+        std::vector<Rate *> rates;
+        {
+            Rate::DeferStart defer(rates);
+            Rate deferred("root", {"test", "deferred"}, "A deferred rate test metric");
+            CHECK(rates == std::vector<Rate *>{&deferred});
+            CHECK_FALSE(deferred.running());
+            deferred.start();
+            CHECK(deferred.running());
+        }
+        Rate started("root", {"test", "started"}, "A started rate test metric");
+        CHECK(rates.size() == 1);
+    }
+
+    SECTION("rate counted into another")
+    {
+        Rate total("root", {"test", "total"}, "A total rate test metric");
+        Rate part("root", {"test", "part"}, "A partial rate test metric");
+        part.count_into(total);
+        CHECK_FALSE(part.running());
+        // the rate engine thread may tick in between, then try again
+        for (int attempt = 0; attempt < 3 && total.rate() != 4; ++attempt) {
+            RateEngine::instance().tick();
+            part += 3;
+            ++total;
+            RateEngine::instance().tick();
+        }
+        CHECK(total.rate() == 4);
+        CHECK(part.rate() == 0);
+    }
+
+    SECTION("rate engine slots")
+    {
+        CHECK(r.running());
+        r.cancel();
+        CHECK_FALSE(r.running());
+        // a cancelled rate stays read only
+        r.start();
+        CHECK_FALSE(r.running());
+        ++r;
+        RateEngine::instance().tick();
+        CHECK(r.rate() == 0);
+    }
+
+    SECTION("rate engine adds and removes rates during a tick")
+    {
+        std::atomic<bool> done{false};
+        std::thread churn([&done] {
+            while (!done) {
+                Rate transient("root", {"test", "transient"}, "A transient rate test metric");
+                ++transient;
+            }
+        });
+        for (int i = 0; i < 100; ++i) {
+            RateEngine::instance().tick();
+        }
+        done = true;
+        churn.join();
+        CHECK(r.running());
+    }
+}
+
+TEST_CASE("Abstract metrics manager deep sample mode", "[metrics][abstract][sampling]")
+{
+    timespec stamp;
+    timespec_get(&stamp, TIME_UTC);
+
+    SECTION("flow sampling depends only on the key and the rate")
+    {
+        visor::Config c;
+        c.config_set<uint64_t>("deep_sample_rate", 30);
+        c.config_set<std::string>("deep_sample_mode", "flow");
+        ShardTestMetricsManager manager(&c), other(&c);
+        CHECK(manager.deep_sample_mode() == DeepSampleMode::Flow);
+
+        visor::Config more;
+        more.config_set<uint64_t>("deep_sample_rate", 60);
+        more.config_set<std::string>("deep_sample_mode", "flow");
+        ShardTestMetricsManager higher(&more);
+
+        uint64_t sampled{0};
+        for (uint64_t key = 0; key < 10000; ++key) {
+            bool deep = manager.process_flow_hit(stamp, key);
+            // the same key is sampled alike, whichever manager and however often
+            CHECK(other.process_flow_hit(stamp, key) == deep);
+            CHECK(manager.process_flow_hit(stamp, key) == deep);
+            if (deep) {
+                CHECK(higher.process_flow_hit(stamp, key));
+            }
+            sampled += deep;
+        }
+        CHECK(sampled > 2500);
+        CHECK(sampled < 3500);
+    }
+
+    SECTION("random sampling ignores the key")
+    {
+        visor::Config c;
+        c.config_set<uint64_t>("deep_sample_rate", 50);
+        ShardTestMetricsManager manager(&c);
+        CHECK(manager.deep_sample_mode() == DeepSampleMode::Random);
+        uint64_t sampled{0};
+        for (int i = 0; i < 1000; ++i) {
+            sampled += manager.process_flow_hit(stamp, 42);
+        }
+        CHECK(sampled > 0);
+        CHECK(sampled < 1000);
+    }
+
+    SECTION("invalid mode")
+    {
+        visor::Config c;
+        c.config_set<std::string>("deep_sample_mode", "sometimes");
+        CHECK_THROWS_WITH(ShardTestMetricsManager(&c), "invalid deep_sample_mode: sometimes, use random or flow");
+    }
 }
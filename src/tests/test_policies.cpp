@@ -457,6 +457,28 @@ TEST_CASE("Policies", "[policies]")
         CHECK(policy->modules()[1]->running());
     }
 
+    SECTION("Good Config with a cpu budget")
+    {
+        CoreRegistry registry;
+        registry.start(nullptr);
+        YAML::Node config_file = YAML::Load(policies_config_hseq);
+        config_file["visor"]["policies"]["default_view"]["handlers"]["window_config"]["cpu_budget"] = 50;
+        REQUIRE_NOTHROW(registry.tap_manager()->load(config_file["visor"]["taps"], true));
+        REQUIRE_NOTHROW(registry.policy_manager()->load(config_file["visor"]["policies"]));
+
+        auto [policy, lock] = registry.policy_manager()->module_get_locked("default_view");
+        REQUIRE(policy->load_shedder());
+        CHECK(policy->load_shedder()->cpu_budget() == 50);
+        CHECK(policy->load_shedder()->sample_ratio() == 1.0);
+        json j;
+        policy->info_json(j);
+        CHECK(j["load_shedding"]["cpu_budget"] == 50);
+        // the chained net handler is timed as part of the dns handler
+        CHECK(j["load_shedding"]["handlers"].contains("default_view-default_dns"));
+        CHECK(!j["load_shedding"]["handlers"].contains("default_view-default_net"));
+        CHECK(j["modules"]["default_view-default_dns"]["metrics"]["load_shedding"]["sample_ratio"] == 1.0);
+    }
+
     // TODO multiple collection policies in the same yaml
 
     SECTION("Duplicate")
@@ -607,6 +629,41 @@ TEST_CASE("Policies", "[policies]")
         REQUIRE_THROWS_WITH(YAML::Load(policies_config_hseq_bad2), "yaml-cpp: error at line 23, column 11: end of map not found");
     }
 
+    SECTION("Bad Config: invalid cpu budget")
+    {
+        CoreRegistry registry;
+        registry.start(nullptr);
+        YAML::Node config_file = YAML::Load(policies_config_hseq);
+        config_file["visor"]["policies"]["default_view"]["handlers"]["window_config"]["cpu_budget"] = 0;
+        REQUIRE_NOTHROW(registry.tap_manager()->load(config_file["visor"]["taps"], true));
+        REQUIRE_THROWS_WITH(registry.policy_manager()->load(config_file["visor"]["policies"]), "invalid stream handler window config: invalid cpu_budget: 0, expecting a percentage of one cpu above 0");
+    }
+
+    SECTION("Good Config with a single writer")
+    {
+        CoreRegistry registry;
+        registry.start(nullptr);
+        YAML::Node config_file = YAML::Load(policies_config_hseq);
+        config_file["visor"]["policies"]["default_view"]["handlers"]["window_config"]["single_writer"] = true;
+        REQUIRE_NOTHROW(registry.tap_manager()->load(config_file["visor"]["taps"], true));
+        REQUIRE_NOTHROW(registry.policy_manager()->load(config_file["visor"]["policies"]));
+    }
+
+    SECTION("Bad Config: single writer with more than one capture thread")
+    {
+        CoreRegistry registry;
+        registry.start(nullptr);
+        YAML::Node config_file = YAML::Load(policies_config_hseq);
+        config_file["visor"]["taps"]["anycast"]["input_type"] = "pcap";
+        config_file["visor"]["policies"]["default_view"]["input"]["input_type"] = "pcap";
+        config_file["visor"]["policies"]["default_view"]["input"]["config"]["pcap_file"] = "tests/fixtures/dns_udp_tcp_random.pcap";
+        config_file["visor"]["policies"]["default_view"]["input"]["config"]["workers"] = 4;
+        config_file["visor"]["policies"]["default_view"]["handlers"]["window_config"]["single_writer"] = true;
+        REQUIRE_NOTHROW(registry.tap_manager()->load(config_file["visor"]["taps"], true));
+        REQUIRE_THROWS_WITH(registry.policy_manager()->load(config_file["visor"]["policies"]), "single_writer on handler 'default_dns' requires an input with one capture thread, not 4");
+        CHECK(!registry.policy_manager()->module_exists("default_view"));
+    }
+
     SECTION("Roll Back")
     {
         CoreRegistry registry;
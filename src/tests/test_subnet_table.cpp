@@ -0,0 +1,92 @@
+#include "SubnetTable.h"
+#include <arpa/inet.h>
+#include <catch2/catch.hpp>
+
+using namespace visor;
+
+static in_addr v4(const char *addr)
+{
+    in_addr a;
+    inet_pton(AF_INET, addr, &a);
+    return a;
+}
+
+static in6_addr v6(const char *addr)
+{
+    in6_addr a;
+    inet_pton(AF_INET6, addr, &a);
+    return a;
+}
+
+TEST_CASE("Subnet table IPv4", "[subnet]")
+{
+    SubnetTable table;
+    CHECK(table.ipv4_empty());
+    CHECK(!table.match(v4("192.168.0.1").s_addr));
+
+    table.add(v4("192.168.0.0"), 24);
+    table.add(v4("10.1.2.3"), 32);
+    table.add(v4("172.16.5.9"), 12);
+    CHECK(!table.ipv4_empty());
+    CHECK(table.ipv6_empty());
+
+    CHECK(table.match(v4("192.168.0.0").s_addr));
+    CHECK(table.match(v4("192.168.0.255").s_addr));
+    CHECK(!table.match(v4("192.168.1.0").s_addr));
+    CHECK(!table.match(v4("192.167.255.255").s_addr));
+    CHECK(table.match(v4("10.1.2.3").s_addr));
+    CHECK(!table.match(v4("10.1.2.4").s_addr));
+    // host bits in the configured network are ignored
+    CHECK(table.match(v4("172.16.0.0").s_addr));
+    CHECK(table.match(v4("172.31.255.255").s_addr));
+    CHECK(!table.match(v4("172.32.0.0").s_addr));
+
+    SECTION("overlapping and adjacent prefixes")
+    {
+        table.add(v4("192.168.1.0"), 24);
+        table.add(v4("192.168.0.128"), 25);
+        CHECK(table.match(v4("192.168.1.200").s_addr));
+        CHECK(table.match(v4("192.168.0.10").s_addr));
+        CHECK(!table.match(v4("192.168.2.0").s_addr));
+    }
+
+    SECTION("default route")
+    {
+        table.add(v4("0.0.0.0"), 0);
+        CHECK(table.match(v4("8.8.8.8").s_addr));
+        CHECK(table.match(v4("255.255.255.255").s_addr));
+    }
+}
+
+TEST_CASE("Subnet table IPv6", "[subnet]")
+{
+    SubnetTable table;
+    table.add(v6("2001:7f8:1::a506:2597:1"), 48);
+    table.add(v6("2a02:dac0::"), 29);
+    table.add(v6("fe80::1"), 128);
+    CHECK(table.ipv4_empty());
+
+    CHECK(table.match(v6("2001:7f8:1::").s6_addr));
+    CHECK(table.match(v6("2001:7f8:1:ffff:ffff:ffff:ffff:ffff").s6_addr));
+    CHECK(!table.match(v6("2001:7f8:2::").s6_addr));
+    CHECK(table.match(v6("2a02:dac7:ffff::1").s6_addr));
+    CHECK(!table.match(v6("2a02:dac8::").s6_addr));
+    CHECK(table.match(v6("fe80::1").s6_addr));
+    CHECK(!table.match(v6("fe80::2").s6_addr));
+
+    SECTION("prefixes crossing the 64 bit boundary")
+    {
+        table.add(v6("2001:db8::ffff:ffff:ffff:ff00"), 120);
+        table.add(v6("2001:db8:0:1::"), 64);
+        CHECK(table.match(v6("2001:db8::ffff:ffff:ffff:ffff").s6_addr));
+        CHECK(table.match(v6("2001:db8:0:1:ffff::").s6_addr));
+        CHECK(!table.match(v6("2001:db8::ffff:ffff:ffff:feff").s6_addr));
+        CHECK(!table.match(v6("2001:db8:0:2::").s6_addr));
+    }
+
+    SECTION("default route")
+    {
+        table.add(v6("::"), 0);
+        CHECK(table.match(v6("ffff::1").s6_addr));
+    }
+}